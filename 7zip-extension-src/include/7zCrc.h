@@ -0,0 +1,35 @@
+/* 7zCrc.h -- CRC32 calculation */
+
+#ifndef __7Z_CRC_H
+#define __7Z_CRC_H
+
+#include "7zTypes.h"
+
+EXTERN_C_BEGIN
+
+/*
+ * Two CRC-32 flavours over the same polynomial:
+ *   Crc*    -- reflected (zip, gzip, PNG), PCLMULQDQ folding when available.
+ *   Bz2Crc* -- MSB-first, as stored in bzip2 block and stream headers.
+ * Both fall back to slicing-by-16 tables. CrcInit.cpp builds them while
+ * the module loads. The lazy setup in the update functions is not thread
+ * safe, so code that links without CrcInit.cpp must call CrcGenerateTable()
+ * before starting threads.
+ */
+#define CRC_INIT_VAL 0xFFFFFFFF
+#define CRC_GET_DIGEST(crc) ((crc) ^ CRC_INIT_VAL)
+
+void MY_FAST_CALL CrcGenerateTable(void);
+
+UInt32 MY_FAST_CALL CrcUpdate(UInt32 crc, const void *data, size_t size);
+UInt32 MY_FAST_CALL CrcCalc(const void *data, size_t size);
+
+UInt32 MY_FAST_CALL Bz2CrcUpdate(UInt32 crc, const void *data, size_t size);
+UInt32 MY_FAST_CALL Bz2CrcCalc(const void *data, size_t size);
+
+/* Combined stream CRC from the block CRCs, as in the bzip2 stream trailer */
+#define BZ2_CRC_COMBINE(combined, blockCrc) ((((combined) << 1) | ((combined) >> 31)) ^ (blockCrc))
+
+EXTERN_C_END
+
+#endif
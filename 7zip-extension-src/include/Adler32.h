@@ -0,0 +1,25 @@
+/* Adler32.h -- Adler-32 calculation */
+
+#ifndef __ADLER32_H
+#define __ADLER32_H
+
+#include "7zTypes.h"
+
+EXTERN_C_BEGIN
+
+#define ADLER32_INIT_VAL 1
+
+/*
+ * Adler32_Init selects the SSSE3 / AVX2 kernel when the CPU supports it.
+ * AdlerInit.cpp runs it while the module loads. The fallback call on first
+ * use is not thread safe, so code that links without AdlerInit.cpp must call
+ * Adler32_Init() before starting threads.
+ */
+void MY_FAST_CALL Adler32_Init(void);
+
+UInt32 MY_FAST_CALL Adler32_Update(UInt32 adler, const void *data, size_t size);
+UInt32 MY_FAST_CALL Adler32_Calc(const void *data, size_t size);
+
+EXTERN_C_END
+
+#endif
@@ -0,0 +1,57 @@
+/* Aes128.h -- AES-128 encryption and CBC decryption */
+
+#ifndef __AES128_H
+#define __AES128_H
+
+#include "7zTypes.h"
+
+EXTERN_C_BEGIN
+
+/*
+ * AES-128 for the CTR, CMAC and CBC constructions of console packages.
+ * Kernels are picked on first use: AES-NI with eight blocks in flight when
+ * the CPU has it, T-tables otherwise.
+ * AesInit.cpp runs AesGenTables() while the module loads. The lazy setup on
+ * first use is not thread safe, so code that links without AesInit.cpp must
+ * call AesGenTables() before starting threads.
+ */
+#define AES_BLOCK_SIZE 16
+#define AES128_NUM_ROUND_KEYS 11
+
+typedef struct
+{
+  Byte keys[AES_BLOCK_SIZE * AES128_NUM_ROUND_KEYS];
+} CAes128;
+
+void MY_FAST_CALL AesGenTables(void);
+
+void MY_FAST_CALL Aes128_SetKey(CAes128 *p, const Byte *key);
+
+/*
+ * Expands key into the schedule of the equivalent inverse cipher. Such a
+ * CAes128 may only be passed to Aes128_CbcDecrypt.
+ */
+void MY_FAST_CALL Aes128_SetKeyDecrypt(CAes128 *p, const Byte *key);
+
+/* Encrypts numBlocks independent 16-byte blocks in place (ECB). */
+void MY_FAST_CALL Aes128_Encrypt(const CAes128 *p, Byte *data, size_t numBlocks);
+
+/*
+ * CTR mode over a 128-bit big-endian counter: XORs the keystream of the
+ * counters iv + blockIndex, iv + blockIndex + 1, ... into numBlocks blocks of
+ * data. Any block of the stream can be reached without touching the ones
+ * before it.
+ */
+void MY_FAST_CALL Aes128_Ctr(const CAes128 *p, const Byte *iv, UInt64 blockIndex, Byte *data, size_t numBlocks);
+
+/*
+ * CBC decryption of numBlocks blocks in place. On return iv holds the last
+ * ciphertext block, so a stream can be decrypted in consecutive calls.
+ * Each block needs only the ciphertext before it, so independent runs of a
+ * buffer can be decrypted concurrently given their preceding block as iv.
+ */
+void MY_FAST_CALL Aes128_CbcDecrypt(const CAes128 *p, Byte *iv, Byte *data, size_t numBlocks);
+
+EXTERN_C_END
+
+#endif
@@ -329,6 +329,12 @@ BoolInt CPU_Is_InOrder();
 BoolInt CPU_Is_Aes_Supported();
 BoolInt CPU_IsSupported_PageGB();
 
+/* SIMD features; the AVX2 check also requires OS support for YMM state */
+BoolInt CPU_IsSupported_SSSE3();
+BoolInt CPU_IsSupported_SSE41();
+BoolInt CPU_IsSupported_PCLMUL();
+BoolInt CPU_IsSupported_AVX2();
+
 #endif
 
 EXTERN_C_END
@@ -0,0 +1,211 @@
+/* 7zCrc.c -- CRC32 calculation */
+
+#include "7zCrc.h"
+#include "CpuArch.h"
+
+#define kCrcPoly 0xEDB88320
+#define kBz2CrcPoly 0x04C11DB7
+
+#define CRC_NUM_TABLES 16
+
+static UInt32 g_CrcTable[256 * CRC_NUM_TABLES];
+static UInt32 g_Bz2CrcTable[256 * CRC_NUM_TABLES];
+static int g_CrcTablesReady;
+
+typedef UInt32 (MY_FAST_CALL *CRC_FUNC)(UInt32 crc, const Byte *p, size_t size);
+
+#define CRC_UPDATE_BYTE(crc, b) (g_CrcTable[((crc) ^ (b)) & 0xFF] ^ ((crc) >> 8))
+#define BZ2_CRC_UPDATE_BYTE(crc, b) (g_Bz2CrcTable[((crc) >> 24) ^ (b)] ^ ((crc) << 8))
+
+/* Table k maps a byte followed by k zero bytes, so 16 bytes need 16 lookups. */
+#define T(k, b) g_CrcTable[((k) << 8) + (b)]
+#define TB(k, b) g_Bz2CrcTable[((k) << 8) + (b)]
+
+static UInt32 MY_FAST_CALL CrcUpdate_Slice16(UInt32 v, const Byte *p, size_t size)
+{
+  for (; size > 0 && ((size_t)p & 3) != 0; size--, p++)
+    v = CRC_UPDATE_BYTE(v, *p);
+  for (; size >= 16; size -= 16, p += 16)
+  {
+    UInt32 d = v ^ GetUi32(p);
+    v = T(15, d & 0xFF)
+      ^ T(14, (d >> 8) & 0xFF)
+      ^ T(13, (d >> 16) & 0xFF)
+      ^ T(12, d >> 24);
+    d = GetUi32(p + 4);
+    v ^= T(11, d & 0xFF)
+      ^ T(10, (d >> 8) & 0xFF)
+      ^ T(9, (d >> 16) & 0xFF)
+      ^ T(8, d >> 24);
+    d = GetUi32(p + 8);
+    v ^= T(7, d & 0xFF)
+      ^ T(6, (d >> 8) & 0xFF)
+      ^ T(5, (d >> 16) & 0xFF)
+      ^ T(4, d >> 24);
+    d = GetUi32(p + 12);
+    v ^= T(3, d & 0xFF)
+      ^ T(2, (d >> 8) & 0xFF)
+      ^ T(1, (d >> 16) & 0xFF)
+      ^ T(0, d >> 24);
+  }
+  for (; size > 0; size--, p++)
+    v = CRC_UPDATE_BYTE(v, *p);
+  return v;
+}
+
+static UInt32 MY_FAST_CALL Bz2CrcUpdate_Slice16(UInt32 v, const Byte *p, size_t size)
+{
+  for (; size >= 16; size -= 16, p += 16)
+  {
+    UInt32 d = v ^ GetBe32(p);
+    v = TB(15, d >> 24)
+      ^ TB(14, (d >> 16) & 0xFF)
+      ^ TB(13, (d >> 8) & 0xFF)
+      ^ TB(12, d & 0xFF);
+    d = GetBe32(p + 4);
+    v ^= TB(11, d >> 24)
+      ^ TB(10, (d >> 16) & 0xFF)
+      ^ TB(9, (d >> 8) & 0xFF)
+      ^ TB(8, d & 0xFF);
+    d = GetBe32(p + 8);
+    v ^= TB(7, d >> 24)
+      ^ TB(6, (d >> 16) & 0xFF)
+      ^ TB(5, (d >> 8) & 0xFF)
+      ^ TB(4, d & 0xFF);
+    d = GetBe32(p + 12);
+    v ^= TB(3, d >> 24)
+      ^ TB(2, (d >> 16) & 0xFF)
+      ^ TB(1, (d >> 8) & 0xFF)
+      ^ TB(0, d & 0xFF);
+  }
+  for (; size > 0; size--, p++)
+    v = BZ2_CRC_UPDATE_BYTE(v, *p);
+  return v;
+}
+
+#ifdef MY_CPU_X86_OR_AMD64
+
+#include <immintrin.h>
+#include <wmmintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CRC_TARGET_PCLMUL __attribute__((target("sse4.1,pclmul")))
+#else
+#define CRC_TARGET_PCLMUL
+#endif
+
+/*
+ * Carry-less multiplication folding (Intel, "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ"). Four 128-bit lanes are folded forward by
+ * 512 bits per step, then merged into one lane. The remaining 128 bits are
+ * congruent to the input processed so far, so the table code finishes them
+ * together with the tail instead of a Barrett reduction.
+ */
+#define CRC_FOLD(x, k, next) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next)
+
+static CRC_TARGET_PCLMUL UInt32 MY_FAST_CALL CrcUpdate_Pclmul(UInt32 v, const Byte *p, size_t size)
+{
+  const __m128i k512 = _mm_set_epi32(0x00000001, (int)0xc6e41596, 0x00000001, 0x54442bd4);
+  const __m128i k128 = _mm_set_epi32(0x00000000, (int)0xccaa009e, 0x00000001, 0x751997d0);
+  __m128i x0, x1, x2, x3;
+  Byte folded[16];
+
+  if (size < 64)
+    return CrcUpdate_Slice16(v, p, size);
+
+  x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(const void *)p), _mm_cvtsi32_si128((int)v));
+  x1 = _mm_loadu_si128((const __m128i *)(const void *)(p + 16));
+  x2 = _mm_loadu_si128((const __m128i *)(const void *)(p + 32));
+  x3 = _mm_loadu_si128((const __m128i *)(const void *)(p + 48));
+  p += 64;
+  size -= 64;
+
+  for (; size >= 64; size -= 64, p += 64)
+  {
+    x0 = CRC_FOLD(x0, k512, _mm_loadu_si128((const __m128i *)(const void *)p));
+    x1 = CRC_FOLD(x1, k512, _mm_loadu_si128((const __m128i *)(const void *)(p + 16)));
+    x2 = CRC_FOLD(x2, k512, _mm_loadu_si128((const __m128i *)(const void *)(p + 32)));
+    x3 = CRC_FOLD(x3, k512, _mm_loadu_si128((const __m128i *)(const void *)(p + 48)));
+  }
+
+  x0 = CRC_FOLD(x0, k128, x1);
+  x0 = CRC_FOLD(x0, k128, x2);
+  x0 = CRC_FOLD(x0, k128, x3);
+  for (; size >= 16; size -= 16, p += 16)
+    x0 = CRC_FOLD(x0, k128, _mm_loadu_si128((const __m128i *)(const void *)p));
+
+  _mm_storeu_si128((__m128i *)(void *)folded, x0);
+  v = CrcUpdate_Slice16(0, folded, 16);
+  return CrcUpdate_Slice16(v, p, size);
+}
+
+#endif
+
+static CRC_FUNC g_CrcUpdate;
+
+void MY_FAST_CALL CrcGenerateTable(void)
+{
+  UInt32 i;
+  unsigned k;
+  CRC_FUNC f = CrcUpdate_Slice16;
+
+  if (g_CrcTablesReady)
+    return;
+
+  for (i = 0; i < 256; i++)
+  {
+    UInt32 r = i;
+    UInt32 rb = i << 24;
+    unsigned j;
+    for (j = 0; j < 8; j++)
+    {
+      r = (r >> 1) ^ (kCrcPoly & ((UInt32)0 - (r & 1)));
+      rb = (rb << 1) ^ (kBz2CrcPoly & ((UInt32)0 - (rb >> 31)));
+    }
+    g_CrcTable[i] = r;
+    g_Bz2CrcTable[i] = rb;
+  }
+  for (k = 1; k < CRC_NUM_TABLES; k++)
+  {
+    for (i = 0; i < 256; i++)
+    {
+      UInt32 r = g_CrcTable[((k - 1) << 8) + i];
+      UInt32 rb = g_Bz2CrcTable[((k - 1) << 8) + i];
+      g_CrcTable[(k << 8) + i] = g_CrcTable[r & 0xFF] ^ (r >> 8);
+      g_Bz2CrcTable[(k << 8) + i] = g_Bz2CrcTable[rb >> 24] ^ (rb << 8);
+    }
+  }
+
+  #ifdef MY_CPU_X86_OR_AMD64
+  if (CPU_IsSupported_PCLMUL() && CPU_IsSupported_SSE41())
+    f = CrcUpdate_Pclmul;
+  #endif
+
+  g_CrcUpdate = f;
+  g_CrcTablesReady = 1;
+}
+
+UInt32 MY_FAST_CALL CrcUpdate(UInt32 crc, const void *data, size_t size)
+{
+  if (!g_CrcTablesReady)
+    CrcGenerateTable();
+  return g_CrcUpdate(crc, (const Byte *)data, size);
+}
+
+UInt32 MY_FAST_CALL CrcCalc(const void *data, size_t size)
+{
+  return CrcUpdate(CRC_INIT_VAL, data, size) ^ CRC_INIT_VAL;
+}
+
+UInt32 MY_FAST_CALL Bz2CrcUpdate(UInt32 crc, const void *data, size_t size)
+{
+  if (!g_CrcTablesReady)
+    CrcGenerateTable();
+  return Bz2CrcUpdate_Slice16(crc, (const Byte *)data, size);
+}
+
+UInt32 MY_FAST_CALL Bz2CrcCalc(const void *data, size_t size)
+{
+  return Bz2CrcUpdate(CRC_INIT_VAL, data, size) ^ CRC_INIT_VAL;
+}
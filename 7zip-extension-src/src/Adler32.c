@@ -0,0 +1,190 @@
+/* Adler32.c -- Adler-32 calculation */
+
+#include "Adler32.h"
+#include "CpuArch.h"
+
+#define ADLER_MOD 65521
+
+/* Largest n such that 255 * n * (n + 1) / 2 + (n + 1) * (ADLER_MOD - 1)
+   fits in 32 bits, so the modulo is only needed once per ADLER_NMAX bytes. */
+#define ADLER_NMAX 5552
+
+typedef UInt32 (MY_FAST_CALL *ADLER32_UPDATE_FUNC)(UInt32 adler, const Byte *p, size_t size);
+
+static UInt32 MY_FAST_CALL Adler32_Update_Scalar(UInt32 adler, const Byte *p, size_t size)
+{
+  UInt32 a = adler & 0xFFFF;
+  UInt32 b = adler >> 16;
+  while (size != 0)
+  {
+    size_t n = size < ADLER_NMAX ? size : ADLER_NMAX;
+    size -= n;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+      a += p[0]; b += a;
+      a += p[1]; b += a;
+      a += p[2]; b += a;
+      a += p[3]; b += a;
+      a += p[4]; b += a;
+      a += p[5]; b += a;
+      a += p[6]; b += a;
+      a += p[7]; b += a;
+    }
+    for (; n != 0; n--)
+    {
+      a += *p++;
+      b += a;
+    }
+    a %= ADLER_MOD;
+    b %= ADLER_MOD;
+  }
+  return (b << 16) | a;
+}
+
+#ifdef MY_CPU_X86_OR_AMD64
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ADLER_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define ADLER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define ADLER_TARGET_SSSE3
+#define ADLER_TARGET_AVX2
+#endif
+
+/*
+ * Both kernels keep per-lane partial sums and fold them once per ADLER_NMAX
+ * bytes. For a 32-byte chunk, s2 grows by 32 * s1 (kept in v_ps and shifted
+ * in at the end) plus the bytes weighted 32..1, which pmaddubsw computes.
+ */
+static ADLER_TARGET_SSSE3 UInt32 MY_FAST_CALL Adler32_Update_SSSE3(UInt32 adler, const Byte *p, size_t size)
+{
+  UInt32 a = adler & 0xFFFF;
+  UInt32 b = adler >> 16;
+  size_t blocks = size / 32;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  size -= blocks * 32;
+  while (blocks != 0)
+  {
+    size_t n = ADLER_NMAX / 32;
+    __m128i v_ps, v_s1, v_s2;
+    if (n > blocks)
+      n = blocks;
+    blocks -= n;
+
+    v_ps = _mm_cvtsi32_si128((int)(a * (UInt32)n));
+    v_s2 = _mm_cvtsi32_si128((int)b);
+    v_s1 = zero;
+    do
+    {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i *)(const void *)p);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(const void *)(p + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      p += 32;
+    }
+    while (--n);
+
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    a += (UInt32)_mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    b = (UInt32)_mm_cvtsi128_si32(v_s2);
+
+    a %= ADLER_MOD;
+    b %= ADLER_MOD;
+  }
+  return Adler32_Update_Scalar((b << 16) | a, p, size);
+}
+
+static ADLER_TARGET_AVX2 UInt32 MY_FAST_CALL Adler32_Update_AVX2(UInt32 adler, const Byte *p, size_t size)
+{
+  UInt32 a = adler & 0xFFFF;
+  UInt32 b = adler >> 16;
+  size_t blocks = size / 32;
+  const __m256i tap = _mm256_setr_epi8(
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+      16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  size -= blocks * 32;
+  while (blocks != 0)
+  {
+    size_t n = ADLER_NMAX / 32;
+    __m256i v_ps, v_s1, v_s2;
+    __m128i s1, s2;
+    if (n > blocks)
+      n = blocks;
+    blocks -= n;
+
+    v_ps = _mm256_setr_epi32((int)(a * (UInt32)n), 0, 0, 0, 0, 0, 0, 0);
+    v_s2 = _mm256_setr_epi32((int)b, 0, 0, 0, 0, 0, 0, 0);
+    v_s1 = zero;
+    do
+    {
+      const __m256i bytes = _mm256_loadu_si256((const __m256i *)(const void *)p);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      p += 32;
+    }
+    while (--n);
+
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    s1 = _mm_add_epi32(s1, _mm_shuffle_epi32(s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    s1 = _mm_add_epi32(s1, _mm_shuffle_epi32(s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    a += (UInt32)_mm_cvtsi128_si32(s1);
+    s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    b = (UInt32)_mm_cvtsi128_si32(s2);
+
+    a %= ADLER_MOD;
+    b %= ADLER_MOD;
+  }
+  return Adler32_Update_Scalar((b << 16) | a, p, size);
+}
+
+#endif
+
+static ADLER32_UPDATE_FUNC g_Adler32Update;
+
+void MY_FAST_CALL Adler32_Init(void)
+{
+  ADLER32_UPDATE_FUNC f = Adler32_Update_Scalar;
+  if (g_Adler32Update)
+    return;
+  #ifdef MY_CPU_X86_OR_AMD64
+  if (CPU_IsSupported_AVX2())
+    f = Adler32_Update_AVX2;
+  else if (CPU_IsSupported_SSSE3())
+    f = Adler32_Update_SSSE3;
+  #endif
+  g_Adler32Update = f;
+}
+
+UInt32 MY_FAST_CALL Adler32_Update(UInt32 adler, const void *data, size_t size)
+{
+  if (!g_Adler32Update)
+    Adler32_Init();
+  return g_Adler32Update(adler, (const Byte *)data, size);
+}
+
+UInt32 MY_FAST_CALL Adler32_Calc(const void *data, size_t size)
+{
+  return Adler32_Update(ADLER32_INIT_VAL, data, size);
+}
@@ -0,0 +1,7 @@
+// AdlerInit.cpp
+
+#include "Adler32.h"
+
+// Picks the Adler-32 kernel while the module loads, before any thread can
+// call in; see CrcInit.cpp.
+static struct CAdlerInit { CAdlerInit() { Adler32_Init(); } } g_AdlerInit;
@@ -0,0 +1,453 @@
+/* Aes128.c -- AES-128 encryption and CBC decryption */
+
+#include "Aes128.h"
+#include <string.h>
+
+#include "CpuArch.h"
+
+#define AES128_NUM_ROUNDS 10
+
+typedef void (MY_FAST_CALL *AES_ENCRYPT_FUNC)(const CAes128 *p, Byte *data, size_t numBlocks);
+typedef void (MY_FAST_CALL *AES_CTR_FUNC)(const CAes128 *p, const Byte *iv, UInt64 blockIndex, Byte *data, size_t numBlocks);
+typedef void (MY_FAST_CALL *AES_CBC_FUNC)(const CAes128 *p, Byte *iv, Byte *data, size_t numBlocks);
+
+static const Byte Sbox[256] = {
+  0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+  0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+  0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+  0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+  0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+  0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+  0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+  0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+  0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+  0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+  0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+  0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+  0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+  0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+  0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+  0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16 };
+
+/* Table k is SubBytes + MixColumns for row k, as a big-endian column. */
+static UInt32 g_AesT[256 * 4];
+/* Table k is InvSubBytes + InvMixColumns for row k. */
+static UInt32 g_AesD[256 * 4];
+static Byte g_AesInvSbox[256];
+static int g_AesTablesReady;
+
+static AES_ENCRYPT_FUNC g_AesEncrypt;
+static AES_CTR_FUNC g_AesCtr;
+static AES_CBC_FUNC g_AesCbcDecrypt;
+
+#define T(k, b) g_AesT[((k) << 8) + (b)]
+#define D(k, b) g_AesD[((k) << 8) + (b)]
+#define gb(n, x) ((unsigned)((x) >> (24 - 8 * (n))) & 0xFF)
+
+#define AES_ROUND_T(d0, d1, d2, d3, s0, s1, s2, s3, rk) \
+  d0 = T(0, gb(0, s0)) ^ T(1, gb(1, s1)) ^ T(2, gb(2, s2)) ^ T(3, gb(3, s3)) ^ GetBe32(rk); \
+  d1 = T(0, gb(0, s1)) ^ T(1, gb(1, s2)) ^ T(2, gb(2, s3)) ^ T(3, gb(3, s0)) ^ GetBe32(rk + 4); \
+  d2 = T(0, gb(0, s2)) ^ T(1, gb(1, s3)) ^ T(2, gb(2, s0)) ^ T(3, gb(3, s1)) ^ GetBe32(rk + 8); \
+  d3 = T(0, gb(0, s3)) ^ T(1, gb(1, s0)) ^ T(2, gb(2, s1)) ^ T(3, gb(3, s2)) ^ GetBe32(rk + 12);
+
+#define AES_LAST_T(s0, s1, s2, s3) \
+  (((UInt32)Sbox[gb(0, s0)] << 24) | ((UInt32)Sbox[gb(1, s1)] << 16) | \
+   ((UInt32)Sbox[gb(2, s2)] << 8) | Sbox[gb(3, s3)])
+
+static void Aes128_EncryptBlock_Table(const CAes128 *p, const Byte *in, Byte *out)
+{
+  const Byte *rk = p->keys;
+  UInt32 s0 = GetBe32(in) ^ GetBe32(rk);
+  UInt32 s1 = GetBe32(in + 4) ^ GetBe32(rk + 4);
+  UInt32 s2 = GetBe32(in + 8) ^ GetBe32(rk + 8);
+  UInt32 s3 = GetBe32(in + 12) ^ GetBe32(rk + 12);
+  UInt32 t0, t1, t2, t3;
+  unsigned r;
+
+  for (r = 1; r < AES128_NUM_ROUNDS - 1; r += 2)
+  {
+    AES_ROUND_T(t0, t1, t2, t3, s0, s1, s2, s3, rk + r * 16)
+    AES_ROUND_T(s0, s1, s2, s3, t0, t1, t2, t3, rk + (r + 1) * 16)
+  }
+  AES_ROUND_T(t0, t1, t2, t3, s0, s1, s2, s3, rk + r * 16)
+  rk += AES128_NUM_ROUNDS * 16;
+  SetBe32(out, AES_LAST_T(t0, t1, t2, t3) ^ GetBe32(rk));
+  SetBe32(out + 4, AES_LAST_T(t1, t2, t3, t0) ^ GetBe32(rk + 4));
+  SetBe32(out + 8, AES_LAST_T(t2, t3, t0, t1) ^ GetBe32(rk + 8));
+  SetBe32(out + 12, AES_LAST_T(t3, t0, t1, t2) ^ GetBe32(rk + 12));
+}
+
+static void MY_FAST_CALL Aes128_Encrypt_Table(const CAes128 *p, Byte *data, size_t numBlocks)
+{
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+    Aes128_EncryptBlock_Table(p, data, data);
+}
+
+static void MY_FAST_CALL Aes128_Ctr_Table(const CAes128 *p, const Byte *iv, UInt64 blockIndex, Byte *data, size_t numBlocks)
+{
+  UInt64 hi = GetBe64(iv);
+  UInt64 lo = GetBe64(iv + 8) + blockIndex;
+  if (lo < blockIndex)
+    hi++;
+
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+  {
+    Byte ks[AES_BLOCK_SIZE];
+    unsigned i;
+    SetBe32(ks, (UInt32)(hi >> 32));
+    SetBe32(ks + 4, (UInt32)hi);
+    SetBe32(ks + 8, (UInt32)(lo >> 32));
+    SetBe32(ks + 12, (UInt32)lo);
+    Aes128_EncryptBlock_Table(p, ks, ks);
+    for (i = 0; i < AES_BLOCK_SIZE; i++)
+      data[i] ^= ks[i];
+    if (++lo == 0)
+      hi++;
+  }
+}
+
+#define AES_ROUND_D(d0, d1, d2, d3, s0, s1, s2, s3, rk) \
+  d0 = D(0, gb(0, s0)) ^ D(1, gb(1, s3)) ^ D(2, gb(2, s2)) ^ D(3, gb(3, s1)) ^ GetBe32(rk); \
+  d1 = D(0, gb(0, s1)) ^ D(1, gb(1, s0)) ^ D(2, gb(2, s3)) ^ D(3, gb(3, s2)) ^ GetBe32(rk + 4); \
+  d2 = D(0, gb(0, s2)) ^ D(1, gb(1, s1)) ^ D(2, gb(2, s0)) ^ D(3, gb(3, s3)) ^ GetBe32(rk + 8); \
+  d3 = D(0, gb(0, s3)) ^ D(1, gb(1, s2)) ^ D(2, gb(2, s1)) ^ D(3, gb(3, s0)) ^ GetBe32(rk + 12);
+
+#define AES_LAST_D(s0, s1, s2, s3) \
+  (((UInt32)g_AesInvSbox[gb(0, s0)] << 24) | ((UInt32)g_AesInvSbox[gb(1, s1)] << 16) | \
+   ((UInt32)g_AesInvSbox[gb(2, s2)] << 8) | g_AesInvSbox[gb(3, s3)])
+
+static void Aes128_DecryptBlock_Table(const CAes128 *p, const Byte *in, Byte *out)
+{
+  const Byte *rk = p->keys;
+  UInt32 s0 = GetBe32(in) ^ GetBe32(rk);
+  UInt32 s1 = GetBe32(in + 4) ^ GetBe32(rk + 4);
+  UInt32 s2 = GetBe32(in + 8) ^ GetBe32(rk + 8);
+  UInt32 s3 = GetBe32(in + 12) ^ GetBe32(rk + 12);
+  UInt32 t0, t1, t2, t3;
+  unsigned r;
+
+  for (r = 1; r < AES128_NUM_ROUNDS - 1; r += 2)
+  {
+    AES_ROUND_D(t0, t1, t2, t3, s0, s1, s2, s3, rk + r * 16)
+    AES_ROUND_D(s0, s1, s2, s3, t0, t1, t2, t3, rk + (r + 1) * 16)
+  }
+  AES_ROUND_D(t0, t1, t2, t3, s0, s1, s2, s3, rk + r * 16)
+  rk += AES128_NUM_ROUNDS * 16;
+  SetBe32(out, AES_LAST_D(t0, t3, t2, t1) ^ GetBe32(rk));
+  SetBe32(out + 4, AES_LAST_D(t1, t0, t3, t2) ^ GetBe32(rk + 4));
+  SetBe32(out + 8, AES_LAST_D(t2, t1, t0, t3) ^ GetBe32(rk + 8));
+  SetBe32(out + 12, AES_LAST_D(t3, t2, t1, t0) ^ GetBe32(rk + 12));
+}
+
+static void MY_FAST_CALL Aes128_CbcDecrypt_Table(const CAes128 *p, Byte *iv, Byte *data, size_t numBlocks)
+{
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+  {
+    Byte c[AES_BLOCK_SIZE];
+    unsigned i;
+    memcpy(c, data, AES_BLOCK_SIZE);
+    Aes128_DecryptBlock_Table(p, data, data);
+    for (i = 0; i < AES_BLOCK_SIZE; i++)
+      data[i] ^= iv[i];
+    memcpy(iv, c, AES_BLOCK_SIZE);
+  }
+}
+
+#ifdef MY_CPU_X86_OR_AMD64
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AES_TARGET_NI __attribute__((target("aes,ssse3")))
+#else
+#define AES_TARGET_NI
+#endif
+
+/*
+ * aesenc has a latency of several cycles but issues every cycle, so eight
+ * independent blocks per round keep the unit busy. The tail runs one block
+ * at a time.
+ */
+#define AES_NI_8(op) \
+  op(b0) op(b1) op(b2) op(b3) op(b4) op(b5) op(b6) op(b7)
+
+#define AES_NI_XOR_KEY(b) b = _mm_xor_si128(b, k[0]);
+#define AES_NI_ENC(b) b = _mm_aesenc_si128(b, key);
+#define AES_NI_ENC_LAST(b) b = _mm_aesenclast_si128(b, k[AES128_NUM_ROUNDS]);
+
+#define AES_NI_ROUNDS_8 \
+  AES_NI_8(AES_NI_XOR_KEY) \
+  for (r = 1; r < AES128_NUM_ROUNDS; r++) \
+  { \
+    const __m128i key = k[r]; \
+    AES_NI_8(AES_NI_ENC) \
+  } \
+  AES_NI_8(AES_NI_ENC_LAST)
+
+#define AES_NI_LOAD(b, n) b = _mm_loadu_si128((const __m128i *)(const void *)(data + (n) * AES_BLOCK_SIZE));
+#define AES_NI_STORE(b, n) _mm_storeu_si128((__m128i *)(void *)(data + (n) * AES_BLOCK_SIZE), b);
+#define AES_NI_STORE_XOR(b, n) _mm_storeu_si128((__m128i *)(void *)(data + (n) * AES_BLOCK_SIZE), \
+    _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)(const void *)(data + (n) * AES_BLOCK_SIZE))));
+
+static AES_TARGET_NI __m128i Aes128_EncryptOne_Ni(const __m128i *k, __m128i b)
+{
+  unsigned r;
+  b = _mm_xor_si128(b, k[0]);
+  for (r = 1; r < AES128_NUM_ROUNDS; r++)
+    b = _mm_aesenc_si128(b, k[r]);
+  return _mm_aesenclast_si128(b, k[AES128_NUM_ROUNDS]);
+}
+
+static AES_TARGET_NI void MY_FAST_CALL Aes128_Encrypt_Ni(const CAes128 *p, Byte *data, size_t numBlocks)
+{
+  __m128i k[AES128_NUM_ROUND_KEYS];
+  unsigned r;
+  for (r = 0; r < AES128_NUM_ROUND_KEYS; r++)
+    k[r] = _mm_loadu_si128((const __m128i *)(const void *)(p->keys + r * AES_BLOCK_SIZE));
+
+  for (; numBlocks >= 8; numBlocks -= 8, data += 8 * AES_BLOCK_SIZE)
+  {
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    AES_NI_LOAD(b0, 0) AES_NI_LOAD(b1, 1) AES_NI_LOAD(b2, 2) AES_NI_LOAD(b3, 3)
+    AES_NI_LOAD(b4, 4) AES_NI_LOAD(b5, 5) AES_NI_LOAD(b6, 6) AES_NI_LOAD(b7, 7)
+    AES_NI_ROUNDS_8
+    AES_NI_STORE(b0, 0) AES_NI_STORE(b1, 1) AES_NI_STORE(b2, 2) AES_NI_STORE(b3, 3)
+    AES_NI_STORE(b4, 4) AES_NI_STORE(b5, 5) AES_NI_STORE(b6, 6) AES_NI_STORE(b7, 7)
+  }
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+  {
+    __m128i b;
+    AES_NI_LOAD(b, 0)
+    b = Aes128_EncryptOne_Ni(k, b);
+    AES_NI_STORE(b, 0)
+  }
+}
+
+/*
+ * Counters are kept as two native 64-bit halves and turned into the
+ * big-endian block with one byte shuffle.
+ */
+#define AES_NI_COUNTER(b, n) \
+  { \
+    UInt64 l = lo + (n); \
+    b = _mm_shuffle_epi8(_mm_set_epi64x((Int64)(hi + (l < lo)), (Int64)l), bswap); \
+  }
+
+static AES_TARGET_NI void MY_FAST_CALL Aes128_Ctr_Ni(const CAes128 *p, const Byte *iv, UInt64 blockIndex, Byte *data, size_t numBlocks)
+{
+  const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  __m128i k[AES128_NUM_ROUND_KEYS];
+  UInt64 hi = GetBe64(iv);
+  UInt64 lo = GetBe64(iv + 8) + blockIndex;
+  unsigned r;
+  if (lo < blockIndex)
+    hi++;
+  for (r = 0; r < AES128_NUM_ROUND_KEYS; r++)
+    k[r] = _mm_loadu_si128((const __m128i *)(const void *)(p->keys + r * AES_BLOCK_SIZE));
+
+  for (; numBlocks >= 8; numBlocks -= 8, data += 8 * AES_BLOCK_SIZE)
+  {
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    AES_NI_COUNTER(b0, 0) AES_NI_COUNTER(b1, 1) AES_NI_COUNTER(b2, 2) AES_NI_COUNTER(b3, 3)
+    AES_NI_COUNTER(b4, 4) AES_NI_COUNTER(b5, 5) AES_NI_COUNTER(b6, 6) AES_NI_COUNTER(b7, 7)
+    AES_NI_ROUNDS_8
+    AES_NI_STORE_XOR(b0, 0) AES_NI_STORE_XOR(b1, 1) AES_NI_STORE_XOR(b2, 2) AES_NI_STORE_XOR(b3, 3)
+    AES_NI_STORE_XOR(b4, 4) AES_NI_STORE_XOR(b5, 5) AES_NI_STORE_XOR(b6, 6) AES_NI_STORE_XOR(b7, 7)
+    lo += 8;
+    if (lo < 8)
+      hi++;
+  }
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+  {
+    __m128i b;
+    AES_NI_COUNTER(b, 0)
+    b = Aes128_EncryptOne_Ni(k, b);
+    AES_NI_STORE_XOR(b, 0)
+    if (++lo == 0)
+      hi++;
+  }
+}
+
+/*
+ * Unlike CBC encryption, decryption has no chain between the block ciphers:
+ * each output is one block decrypted and XORed with the ciphertext before it,
+ * so it pipelines like ECB.
+ */
+#define AES_NI_DEC(b) b = _mm_aesdec_si128(b, key);
+#define AES_NI_DEC_LAST(b) b = _mm_aesdeclast_si128(b, k[AES128_NUM_ROUNDS]);
+
+static AES_TARGET_NI void MY_FAST_CALL Aes128_CbcDecrypt_Ni(const CAes128 *p, Byte *iv, Byte *data, size_t numBlocks)
+{
+  __m128i k[AES128_NUM_ROUND_KEYS];
+  __m128i prev = _mm_loadu_si128((const __m128i *)(const void *)iv);
+  unsigned r;
+  for (r = 0; r < AES128_NUM_ROUND_KEYS; r++)
+    k[r] = _mm_loadu_si128((const __m128i *)(const void *)(p->keys + r * AES_BLOCK_SIZE));
+
+  for (; numBlocks >= 8; numBlocks -= 8, data += 8 * AES_BLOCK_SIZE)
+  {
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    __m128i c0, c1, c2, c3, c4, c5, c6, c7;
+    AES_NI_LOAD(c0, 0) AES_NI_LOAD(c1, 1) AES_NI_LOAD(c2, 2) AES_NI_LOAD(c3, 3)
+    AES_NI_LOAD(c4, 4) AES_NI_LOAD(c5, 5) AES_NI_LOAD(c6, 6) AES_NI_LOAD(c7, 7)
+    b0 = c0; b1 = c1; b2 = c2; b3 = c3; b4 = c4; b5 = c5; b6 = c6; b7 = c7;
+    AES_NI_8(AES_NI_XOR_KEY)
+    for (r = 1; r < AES128_NUM_ROUNDS; r++)
+    {
+      const __m128i key = k[r];
+      AES_NI_8(AES_NI_DEC)
+    }
+    AES_NI_8(AES_NI_DEC_LAST)
+    b0 = _mm_xor_si128(b0, prev); b1 = _mm_xor_si128(b1, c0);
+    b2 = _mm_xor_si128(b2, c1); b3 = _mm_xor_si128(b3, c2);
+    b4 = _mm_xor_si128(b4, c3); b5 = _mm_xor_si128(b5, c4);
+    b6 = _mm_xor_si128(b6, c5); b7 = _mm_xor_si128(b7, c6);
+    prev = c7;
+    AES_NI_STORE(b0, 0) AES_NI_STORE(b1, 1) AES_NI_STORE(b2, 2) AES_NI_STORE(b3, 3)
+    AES_NI_STORE(b4, 4) AES_NI_STORE(b5, 5) AES_NI_STORE(b6, 6) AES_NI_STORE(b7, 7)
+  }
+  for (; numBlocks != 0; numBlocks--, data += AES_BLOCK_SIZE)
+  {
+    __m128i b, c;
+    AES_NI_LOAD(c, 0)
+    b = _mm_xor_si128(c, k[0]);
+    for (r = 1; r < AES128_NUM_ROUNDS; r++)
+      b = _mm_aesdec_si128(b, k[r]);
+    b = _mm_xor_si128(_mm_aesdeclast_si128(b, k[AES128_NUM_ROUNDS]), prev);
+    prev = c;
+    AES_NI_STORE(b, 0)
+  }
+  _mm_storeu_si128((__m128i *)(void *)iv, prev);
+}
+
+#endif
+
+static Byte AesXtime(Byte b)
+{
+  return (Byte)((b << 1) ^ (0x1B & (0 - (b >> 7))));
+}
+
+void MY_FAST_CALL AesGenTables(void)
+{
+  unsigned i;
+  AES_ENCRYPT_FUNC fEncrypt = Aes128_Encrypt_Table;
+  AES_CTR_FUNC fCtr = Aes128_Ctr_Table;
+  AES_CBC_FUNC fCbcDecrypt = Aes128_CbcDecrypt_Table;
+
+  if (g_AesTablesReady)
+    return;
+
+  for (i = 0; i < 256; i++)
+  {
+    UInt32 s = Sbox[i];
+    UInt32 s2 = AesXtime((Byte)s);
+    UInt32 w = (s2 << 24) | (s << 16) | (s << 8) | (s2 ^ s);
+    T(0, i) = w;
+    T(1, i) = (w >> 8) | (w << 24);
+    T(2, i) = (w >> 16) | (w << 16);
+    T(3, i) = (w >> 24) | (w << 8);
+    g_AesInvSbox[s] = (Byte)i;
+  }
+
+  for (i = 0; i < 256; i++)
+  {
+    UInt32 s = g_AesInvSbox[i];
+    UInt32 s2 = AesXtime((Byte)s);
+    UInt32 s4 = AesXtime((Byte)s2);
+    UInt32 s8 = AesXtime((Byte)s4);
+    UInt32 w = ((s8 ^ s4 ^ s2) << 24) | ((s8 ^ s) << 16) | ((s8 ^ s4 ^ s) << 8) | (s8 ^ s2 ^ s);
+    D(0, i) = w;
+    D(1, i) = (w >> 8) | (w << 24);
+    D(2, i) = (w >> 16) | (w << 16);
+    D(3, i) = (w >> 24) | (w << 8);
+  }
+
+  #ifdef MY_CPU_X86_OR_AMD64
+  if (CPU_Is_Aes_Supported() && CPU_IsSupported_SSSE3())
+  {
+    fEncrypt = Aes128_Encrypt_Ni;
+    fCtr = Aes128_Ctr_Ni;
+    fCbcDecrypt = Aes128_CbcDecrypt_Ni;
+  }
+  #endif
+
+  g_AesEncrypt = fEncrypt;
+  g_AesCtr = fCtr;
+  g_AesCbcDecrypt = fCbcDecrypt;
+  g_AesTablesReady = 1;
+}
+
+void MY_FAST_CALL Aes128_SetKey(CAes128 *p, const Byte *key)
+{
+  Byte *w = p->keys;
+  Byte rcon = 1;
+  unsigned i;
+
+  memcpy(w, key, AES_BLOCK_SIZE);
+  for (i = AES_BLOCK_SIZE; i < sizeof(p->keys); i += 4)
+  {
+    Byte t0 = w[i - 4], t1 = w[i - 3], t2 = w[i - 2], t3 = w[i - 1];
+    if (i % AES_BLOCK_SIZE == 0)
+    {
+      Byte t = t0;
+      t0 = (Byte)(Sbox[t1] ^ rcon);
+      t1 = Sbox[t2];
+      t2 = Sbox[t3];
+      t3 = Sbox[t];
+      rcon = AesXtime(rcon);
+    }
+    w[i] = (Byte)(w[i - 16] ^ t0);
+    w[i + 1] = (Byte)(w[i - 15] ^ t1);
+    w[i + 2] = (Byte)(w[i - 14] ^ t2);
+    w[i + 3] = (Byte)(w[i - 13] ^ t3);
+  }
+}
+
+/*
+ * Round keys are taken in reverse, with InvMixColumns applied to all but the
+ * outer two. D(k, Sbox[b]) cancels the InvSubBytes in the tables and leaves
+ * InvMixColumns of b alone.
+ */
+void MY_FAST_CALL Aes128_SetKeyDecrypt(CAes128 *p, const Byte *key)
+{
+  CAes128 enc;
+  unsigned r, i;
+
+  if (!g_AesTablesReady)
+    AesGenTables();
+  Aes128_SetKey(&enc, key);
+
+  memcpy(p->keys, enc.keys + AES128_NUM_ROUNDS * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+  for (r = 1; r < AES128_NUM_ROUNDS; r++)
+  {
+    const Byte *src = enc.keys + (AES128_NUM_ROUNDS - r) * AES_BLOCK_SIZE;
+    for (i = 0; i < AES_BLOCK_SIZE; i += 4)
+    {
+      UInt32 w = GetBe32(src + i);
+      SetBe32(p->keys + r * AES_BLOCK_SIZE + i,
+          D(0, Sbox[gb(0, w)]) ^ D(1, Sbox[gb(1, w)]) ^ D(2, Sbox[gb(2, w)]) ^ D(3, Sbox[gb(3, w)]));
+    }
+  }
+  memcpy(p->keys + AES128_NUM_ROUNDS * AES_BLOCK_SIZE, enc.keys, AES_BLOCK_SIZE);
+}
+
+void MY_FAST_CALL Aes128_Encrypt(const CAes128 *p, Byte *data, size_t numBlocks)
+{
+  if (!g_AesTablesReady)
+    AesGenTables();
+  g_AesEncrypt(p, data, numBlocks);
+}
+
+void MY_FAST_CALL Aes128_Ctr(const CAes128 *p, const Byte *iv, UInt64 blockIndex, Byte *data, size_t numBlocks)
+{
+  if (!g_AesTablesReady)
+    AesGenTables();
+  g_AesCtr(p, iv, blockIndex, data, numBlocks);
+}
+
+void MY_FAST_CALL Aes128_CbcDecrypt(const CAes128 *p, Byte *iv, Byte *data, size_t numBlocks)
+{
+  if (!g_AesTablesReady)
+    AesGenTables();
+  g_AesCbcDecrypt(p, iv, data, numBlocks);
+}
@@ -0,0 +1,7 @@
+// AesInit.cpp
+
+#include "Aes128.h"
+
+// Builds the AES tables and picks the kernels while the module loads,
+// before any thread can call in; see CrcInit.cpp.
+static struct CAesTablesInit { CAesTablesInit() { AesGenTables(); } } g_AesTablesInit;
@@ -0,0 +1,170 @@
+/* CpuArch.c -- CPU specific code */
+
+#include "CpuArch.h"
+
+#ifdef MY_CPU_X86_OR_AMD64
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+void MyCPUID(UInt32 function, UInt32 *a, UInt32 *b, UInt32 *c, UInt32 *d)
+{
+  #ifdef _MSC_VER
+  int regs[4];
+  __cpuidex(regs, (int)function, 0);
+  *a = (UInt32)regs[0];
+  *b = (UInt32)regs[1];
+  *c = (UInt32)regs[2];
+  *d = (UInt32)regs[3];
+  #else
+  unsigned ra, rb, rc, rd;
+  __cpuid_count(function, 0, ra, rb, rc, rd);
+  *a = ra;
+  *b = rb;
+  *c = rc;
+  *d = rd;
+  #endif
+}
+
+static UInt32 x86_xgetbv0(void)
+{
+  #ifdef _MSC_VER
+  return (UInt32)_xgetbv(0);
+  #else
+  UInt32 lo, hi;
+  __asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+  return lo;
+  #endif
+}
+
+BoolInt x86cpuid_CheckAndRead(Cx86cpuid *p)
+{
+  MyCPUID(0, &p->maxFunc, &p->vendor[0], &p->vendor[2], &p->vendor[1]);
+  MyCPUID(1, &p->ver, &p->b, &p->c, &p->d);
+  return True;
+}
+
+static const UInt32 kVendors[][3] =
+{
+  { 0x756E6547, 0x49656E69, 0x6C65746E},
+  { 0x68747541, 0x69746E65, 0x444D4163},
+  { 0x746E6543, 0x48727561, 0x736C7561}
+};
+
+int x86cpuid_GetFirm(const Cx86cpuid *p)
+{
+  unsigned i;
+  for (i = 0; i < sizeof(kVendors) / sizeof(kVendors[i]); i++)
+  {
+    const UInt32 *v = kVendors[i];
+    if (v[0] == p->vendor[0] &&
+        v[1] == p->vendor[1] &&
+        v[2] == p->vendor[2])
+      return (int)i;
+  }
+  return -1;
+}
+
+BoolInt CPU_Is_InOrder()
+{
+  Cx86cpuid p;
+  int firm;
+  UInt32 family, model;
+  if (!x86cpuid_CheckAndRead(&p))
+    return True;
+
+  family = x86cpuid_GetFamily(p.ver);
+  model = x86cpuid_GetModel(p.ver);
+
+  firm = x86cpuid_GetFirm(&p);
+
+  switch (firm)
+  {
+    case CPU_FIRM_INTEL: return (family < 6 || (family == 6 && (
+        /* In-Order Atom CPU */
+           model == 0x1C  /* 45 nm, N4xx, D4xx, N5xx, D5xx, 230, 330 */
+        || model == 0x26  /* 45 nm, Z6xx */
+        || model == 0x27  /* 32 nm, Z2460 */
+        || model == 0x35  /* 32 nm, Z2760 */
+        || model == 0x36  /* 32 nm, N2xxx, D2xxx */
+        )));
+    case CPU_FIRM_AMD: return (family < 5 || (family == 5 && (model < 6 || model == 0xA)));
+    case CPU_FIRM_VIA: return (family < 6 || (family == 6 && model < 0xF));
+  }
+  return True;
+}
+
+BoolInt CPU_Is_Aes_Supported()
+{
+  Cx86cpuid p;
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  return (p.c >> 25) & 1;
+}
+
+BoolInt CPU_IsSupported_PageGB()
+{
+  Cx86cpuid cpuid;
+  if (!x86cpuid_CheckAndRead(&cpuid))
+    return False;
+  {
+    UInt32 d[4] = { 0 };
+    MyCPUID(0x80000000, &d[0], &d[1], &d[2], &d[3]);
+    if (d[0] < 0x80000001)
+      return False;
+  }
+  {
+    UInt32 d[4] = { 0 };
+    MyCPUID(0x80000001, &d[0], &d[1], &d[2], &d[3]);
+    return (d[3] >> 26) & 1;
+  }
+}
+
+BoolInt CPU_IsSupported_SSSE3()
+{
+  Cx86cpuid p;
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  return (p.c >> 9) & 1;
+}
+
+BoolInt CPU_IsSupported_SSE41()
+{
+  Cx86cpuid p;
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  return (p.c >> 19) & 1;
+}
+
+BoolInt CPU_IsSupported_PCLMUL()
+{
+  Cx86cpuid p;
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  return (p.c >> 1) & 1;
+}
+
+BoolInt CPU_IsSupported_AVX2()
+{
+  Cx86cpuid p;
+  if (!x86cpuid_CheckAndRead(&p))
+    return False;
+  /* OSXSAVE and AVX, then XMM and YMM state enabled by the OS */
+  if (((p.c >> 27) & 1) == 0 || ((p.c >> 28) & 1) == 0)
+    return False;
+  if ((x86_xgetbv0() & 6) != 6)
+    return False;
+  if (p.maxFunc < 7)
+    return False;
+  {
+    UInt32 d[4] = { 0 };
+    MyCPUID(7, &d[0], &d[1], &d[2], &d[3]);
+    return (d[1] >> 5) & 1;
+  }
+}
+
+#endif
@@ -0,0 +1,8 @@
+// CrcInit.cpp
+
+#include "7zCrc.h"
+
+// Builds the CRC tables and picks the kernel while the module loads, before
+// any thread can call in. The ready flag and kernel pointer are plain
+// globals, so setting them up lazily from concurrent first calls would race.
+static struct CCrcTableInit { CCrcTableInit() { CrcGenerateTable(); } } g_CrcTableInit;
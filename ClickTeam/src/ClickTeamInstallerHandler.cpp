@@ -10,6 +10,7 @@
 #include "ProgressUtils.h"
 #include "RegisterArc.h"
 #include "StringConvert.h"
+#include "StreamUtils.h"
 #include "ClickTeamInstallerHandler.h"
 #include <cwchar>
 
@@ -28,7 +29,6 @@ public:
 
 private:
 	ClickTeamInstallerHandler clickHandler;
-	std::vector<ClickTeamInstallerHandler::FileInfo> items;
 	CMyComPtr<IInStream> mainStream;
 	UInt64 totalSize = 0;
 };
@@ -48,13 +48,12 @@ STDMETHODIMP CHandler::Open(IInStream* inStream, const UInt64* maxCheckStartPosi
 		if (memcmp(magic, kSignature, magicSize) != 0)
 			return S_FALSE;
 
-		// Open with ClickTeam handler
+		// Open with ClickTeam handler (FILE_LIST only; payloads are inflated on demand)
 		RINOK(clickHandler.Open(inStream, nullptr, callback));
-
-		items = clickHandler.items;
 		mainStream = inStream;
 
 		// Calculate total size
+		const auto& items = clickHandler.items;
 		UInt64 s = 0;
 		for (size_t i = 0; i < items.size(); i++)
 		{
@@ -74,15 +73,14 @@ STDMETHODIMP CHandler::Open(IInStream* inStream, const UInt64* maxCheckStartPosi
 STDMETHODIMP CHandler::Close() MY_NO_THROW_DECL_ONLY
 {
 	mainStream.Release();
-	items.clear();
-	clickHandler.items.clear();
+	clickHandler.Close();
 	totalSize = 0;
 	return S_OK;
 }
 
 STDMETHODIMP CHandler::GetNumberOfItems(UInt32* numItems) MY_NO_THROW_DECL_ONLY
 {
-	*numItems = static_cast<UInt32>(items.size());
+	*numItems = static_cast<UInt32>(clickHandler.items.size());
 	return S_OK;
 }
 
@@ -123,26 +121,27 @@ STDMETHODIMP CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value) MY_
 STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value) MY_NO_THROW_DECL_ONLY
 {
 	COM_TRY_BEGIN
-		if (index >= items.size())
+		if (index >= clickHandler.items.size())
 			return E_INVALIDARG;
 
-	const auto& item = items[index];
+	const auto& item = clickHandler.items[index];
+	const std::string_view path = clickHandler.GetPath(item);
 	NWindows::NCOM::CPropVariant prop;
 
 	switch (propID)
 	{
 	case kpidPath:
 	{
-		if (item.path.empty())
+		if (path.empty())
 		{
 			prop = L"unnamed.bin";
 		}
 		else
 		{
 			UString widePath;
-			for (size_t i = 0; i < item.path.length(); i++)
+			for (size_t i = 0; i < path.length(); i++)
 			{
-				widePath += (wchar_t)(unsigned char)item.path[i];
+				widePath += (wchar_t)(unsigned char)path[i];
 			}
 			prop = widePath;
 		}
@@ -170,6 +169,7 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 {
 	COM_TRY_BEGIN
 		const bool allFilesMode = numItems == (UInt32)(Int32)-1;
+	const auto& items = clickHandler.items;
 	if (allFilesMode)
 		numItems = static_cast<UInt32>(items.size());
 
@@ -191,6 +191,7 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 
 	const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest : NArchive::NExtract::NAskMode::kExtract;
 	UInt64 currentTotalSize = 0;
+	CByteBuffer buffer;
 
 	for (UInt32 i = 0; i < numItems; i++)
 	{
@@ -219,15 +220,24 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 
 		Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
 
-		// Write decompressed data
-		HRESULT writeResult = realOutStream->Write(
-			item.decompressedData.data(),
-			static_cast<UInt32>(item.decompressedData.size()),
-			nullptr
-		);
+		// Inflate just this item; the buffer is reused across items
+		if (buffer.Size() < item.uncompressedSize)
+			buffer.Alloc(item.uncompressedSize);
 
-		if (writeResult != S_OK)
+		size_t written = 0;
+		HRESULT hr = clickHandler.DecompressItem(mainStream, item, buffer, item.uncompressedSize, &written);
+		if (hr == E_NOTIMPL)
+			opRes = NArchive::NExtract::NOperationResult::kUnsupportedMethod;
+		else if (hr == S_FALSE)
 			opRes = NArchive::NExtract::NOperationResult::kDataError;
+		else
+			RINOK(hr);
+
+		if (realOutStream && written != 0)
+		{
+			if (WriteStream(realOutStream, buffer, written) != S_OK)
+				opRes = NArchive::NExtract::NOperationResult::kDataError;
+		}
 
 		realOutStream.Release();
 		RINOK(extractCallback->SetOperationResult(opRes));
@@ -241,12 +251,12 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream)
 {
 	*stream = nullptr;
 
-	if (index >= items.size())
+	if (index >= clickHandler.items.size())
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 
-	const auto& item = items[index];
+	const auto& item = clickHandler.items[index];
 
-	if (!item.decompressedData.size())
+	if (item.uncompressedSize == 0)
 	{
 		*stream = new CEmptyInStream();
 		(*stream)->AddRef();
@@ -259,12 +269,17 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream)
 	// Set the main stream (even though we won't read from it since everything is cached)
 	limitedStream->SetStream(mainStream, 0);
 
+	// Inflate the item straight into the cache buffer
 	auto& preload = limitedStream->Buffer;
-	preload.Alloc(item.decompressedData.size());
-	memcpy(preload, item.decompressedData.data(), item.decompressedData.size());
+	preload.Alloc(item.uncompressedSize);
+
+	size_t written = 0;
+	HRESULT hr = clickHandler.DecompressItem(mainStream, item, preload, item.uncompressedSize, &written);
+	if (hr != S_OK)
+		return hr == S_FALSE || hr == E_NOTIMPL ? S_FALSE : hr;
 
-	limitedStream->SetCache(item.decompressedData.size(), 0);
-	RINOK(limitedStream->InitAndSeek(0, item.decompressedData.size()));
+	limitedStream->SetCache(written, 0);
+	RINOK(limitedStream->InitAndSeek(0, written));
 
 	*stream = limitedStream.Detach();
 	return S_OK;
@@ -13,6 +13,11 @@
 #include <fstream>
 #include <ctime>
 #include <chrono>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <shlobj.h>
 #include "zlib_decoder.h"
 #include "bzip2_decoder.h"
@@ -48,27 +53,28 @@ enum BLOCK_TYPE {
 class ClickTeamInstallerHandler {
 	UInt64 archiveSize;
 	uint64_t overlayPos;
-	std::vector<char> decompressedData;
+	std::vector<char> decompressedData;   // FILE_LIST arena; item paths point into it
 
 	const int BLOCK_HEADER_SIZE = 16 + 16 + 32;
+	static const size_t kVersionProbeSize = 1 << 16;
 	const std::string DATA_SECTION_SIGNATURE_STR = "\x77\x77\x67\x54\x29\x48";
 
 public:
 	struct FileInfo {
-		std::streampos position;
+		uint64_t position;
 		uint32_t size;
 		uint32_t type;
-		std::string path;
+		uint32_t pathOffset;   // into the buffer the node was parsed from
+		uint32_t pathLength;
 		uint32_t offset;
 		uint32_t compressedSize;
 		uint32_t uncompressedSize;
 		int64_t fileTime1;
 		int64_t fileTime2;
 		int64_t fileTime3;
-		std::vector<uint8_t> decompressedData;
 
 		FileInfo()
-			: position(0), size(0), type(0), offset(0), path(""),
+			: position(0), size(0), type(0), pathOffset(0), pathLength(0), offset(0),
 			compressedSize(0), uncompressedSize(0), fileTime1(0), fileTime2(0), fileTime3(0) {
 		}
 
@@ -85,7 +91,7 @@ public:
 		}
 
 		bool IsValid(long fileStreamLength, long offset, long compressedSize,
-			long uncompressedSize, long index, const std::wstring& path) {
+			long uncompressedSize, long index, std::string_view path) {
 			if (offset > fileStreamLength ||
 				(compressedSize == 0 && uncompressedSize > 3000000000) ||
 				(uncompressedSize > 10 && compressedSize > 10 && compressedSize > uncompressedSize * 5) ||
@@ -96,10 +102,10 @@ public:
 			return true;
 		}
 
-		static bool PathContainsInvalidChars(const std::wstring& path) {
-			for (wchar_t ch : path) {
-				if (ch == L'/' || ch == L'\\' || ch == L':' || ch == L'<' ||
-					ch == L'>' || ch == L'"' || ch == L'|' || ch == L'?') {
+		static bool PathContainsInvalidChars(std::string_view path) {
+			for (char ch : path) {
+				if (ch == '/' || ch == '\\' || ch == ':' || ch == '<' ||
+					ch == '>' || ch == '"' || ch == '|' || ch == '?') {
 					return true;
 				}
 			}
@@ -108,40 +114,61 @@ public:
 	};
 
 	std::vector<FileInfo> items;
+	UInt64 fileDataStart = 0;   // start of the FILE_DATA block; item offsets are relative to it
+	int installerVersion = -1;  // detected per archive in Open
 	CMyComPtr<IArchiveOpenVolumeCallback> volCallback;
 
 	HRESULT Open(IInStream* stream, const UInt64* fileSize, IArchiveOpenCallback* callback);
-	HRESULT ParseArchive(IInStream* stream, const std::vector<char>& decompressedData);
+	void Close() {
+		items.clear();
+		decompressedData.clear();
+		decompressedData.shrink_to_fit();
+		fileDataStart = 0;
+		installerVersion = -1;
+	}
+	HRESULT ParseArchive(IInStream* stream, size_t start);
+	std::string_view GetPath(const FileInfo& item) const {
+		return std::string_view(decompressedData.data() + item.pathOffset, item.pathLength);
+	}
 	HRESULT unpackStream(IInStream* stream, long dataStreamLength, std::vector<char>& decompressedData,
-	std::vector<FileInfo>& filesInfos, int installerVersion);
-	HRESULT ExtractFilesFromBlock(IInStream* stream, UInt64 fileDataStart, int installerVersion);
+	int installerVersion);
+	HRESULT DecompressItem(IInStream* stream, const FileInfo& item, Byte* output, size_t outputSize, size_t* written);
 };
 
 // Utility functions
-static HRESULT readUint32(IInStream* stream, uint32_t* value) {
-	UInt32 bytesRead = 0;
-	return stream->Read(reinterpret_cast<BYTE*>(value), sizeof(uint32_t), &bytesRead);
-}
-
-static HRESULT readUint16(IInStream* stream, uint16_t* value) {
-	UInt32 bytesRead = 0;
-	return stream->Read(reinterpret_cast<BYTE*>(value), sizeof(uint16_t), &bytesRead);
-}
+// Bounds-checked little-endian cursor over an in-memory window of the archive
+struct BinaryReader {
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+
+	BinaryReader(const uint8_t* data, size_t size) : data(data), size(size), pos(0) {}
+
+	template <typename T>
+	HRESULT read(T* value) {
+		if (size - pos < sizeof(T)) return E_FAIL;
+		memcpy(value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return S_OK;
+	}
 
-static HRESULT readInt64(IInStream* stream, int64_t* value) {
-	UInt32 bytesRead = 0;
-	return stream->Read(reinterpret_cast<BYTE*>(value), sizeof(int64_t), &bytesRead);
-}
+	HRESULT skip(size_t count) {
+		if (size - pos < count) return E_FAIL;
+		pos += count;
+		return S_OK;
+	}
 
-static HRESULT readByte(IInStream* stream, char* value) {
-	UInt32 bytesRead = 0;
-	return stream->Read(reinterpret_cast<BYTE*>(value), sizeof(char), &bytesRead);
-}
+	HRESULT seek(size_t offset) {
+		if (offset > size) return E_FAIL;
+		pos = offset;
+		return S_OK;
+	}
+};
 
-static void filterInvalidChars(std::vector<char>& decompressedData) {
-	for (auto& byte : decompressedData) {
-		if (byte < 0 || byte > 255) {
-			byte = 0x20;
+static void filterInvalidChars(char* data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] < 0 || data[i] > 255) {
+			data[i] = 0x20;
 		}
 	}
 }
@@ -205,178 +232,316 @@ static std::string wideToUtf8(const std::wstring& wstr) {
 }
 
 // Version detection
-static HRESULT tryParse(IInStream* stream, ClickTeamInstallerHandler::FileInfo& fileInfo, int version) {
-	try {
-		UInt64 nodeStart = 0;
-		stream->Seek(0, STREAM_SEEK_CUR, &nodeStart);
-		fileInfo.position = nodeStart;
+static HRESULT tryParse(BinaryReader& reader, ClickTeamInstallerHandler::FileInfo& fileInfo, int version) {
+	fileInfo.position = reader.pos;
 
-		// Read node size and type
-		if (version == 20) {
-			uint32_t nodeSize;
-			RINOK(readUint32(stream, &nodeSize));
-			fileInfo.size = nodeSize;
-		}
-		else {
-			uint16_t nodeSize;
-			RINOK(readUint16(stream, &nodeSize));
-			fileInfo.size = nodeSize;
-		}
+	// Read node size and type
+	if (version == 20) {
+		uint32_t nodeSize;
+		RINOK(reader.read(&nodeSize));
+		fileInfo.size = nodeSize;
+	}
+	else {
+		uint16_t nodeSize;
+		RINOK(reader.read(&nodeSize));
+		fileInfo.size = nodeSize;
+	}
 
-		uint16_t fileType;
-		RINOK(readUint16(stream, &fileType));
-		fileInfo.type = fileType;
+	uint16_t fileType;
+	RINOK(reader.read(&fileType));
+	fileInfo.type = fileType;
 
-		if (fileInfo.type != 0) return S_OK;
+	if (fileInfo.type != 0) return S_OK;
 
-		char peekByte = 0;
+	char peekByte = 0;
 
-		// Handle version-specific skips
-		switch (version) {
-		case 20: stream->Seek(14, STREAM_SEEK_CUR, nullptr); break;
-		case 24: case 30: stream->Seek(2, STREAM_SEEK_CUR, nullptr); break;
-		case 35: case 40: stream->Seek(3, STREAM_SEEK_CUR, nullptr); break;
-		}
+	// Handle version-specific skips
+	switch (version) {
+	case 20: RINOK(reader.skip(14)); break;
+	case 24: case 30: RINOK(reader.skip(2)); break;
+	case 35: case 40: RINOK(reader.skip(3)); break;
+	}
 
-		// Handle 0xE2 marker for empty files (versions 35 & 40)
-		if (version == 35 || version == 40) {
-			RINOK(readByte(stream, &peekByte));
-			if (peekByte == (char)0xE2) {
-				stream->Seek(30, STREAM_SEEK_CUR, nullptr);
-			}
-			else {
-				stream->Seek(14, STREAM_SEEK_CUR, nullptr);
-			}
-		}
+	// Handle 0xE2 marker for empty files (versions 35 & 40)
+	if (version == 35 || version == 40) {
+		RINOK(reader.read(&peekByte));
+		RINOK(reader.skip(peekByte == (char)0xE2 ? 30 : 14));
+	}
 
-		// Read file info
-		uint32_t offset = 0, compressedSize = 0, uncompressedSize = 0, unknown = 0;
-		switch (version) {
-		case 20:
-			RINOK(readUint32(stream, &uncompressedSize));
-			RINOK(readUint32(stream, &offset));
-			RINOK(readUint32(stream, &compressedSize));
-			fileInfo.SetFileInfos(offset, compressedSize, uncompressedSize);
-			break;
-		case 24: case 30: case 35:
-			RINOK(readUint32(stream, &offset));
-			RINOK(readUint32(stream, &compressedSize));
-			RINOK(readUint32(stream, &unknown));
-			RINOK(readUint32(stream, &uncompressedSize));
+	// Read file info
+	uint32_t offset = 0, compressedSize = 0, uncompressedSize = 0, unknown = 0;
+	switch (version) {
+	case 20:
+		RINOK(reader.read(&uncompressedSize));
+		RINOK(reader.read(&offset));
+		RINOK(reader.read(&compressedSize));
+		fileInfo.SetFileInfos(offset, compressedSize, uncompressedSize);
+		break;
+	case 24: case 30: case 35:
+		RINOK(reader.read(&offset));
+		RINOK(reader.read(&compressedSize));
+		RINOK(reader.read(&unknown));
+		RINOK(reader.read(&uncompressedSize));
+		fileInfo.SetFileInfos(offset, compressedSize, uncompressedSize);
+		break;
+	case 40:
+		if (peekByte != (char)0xE2) {
+			RINOK(reader.read(&uncompressedSize));
+			RINOK(reader.read(&offset));
+			RINOK(reader.read(&compressedSize));
+			RINOK(reader.skip(4));
 			fileInfo.SetFileInfos(offset, compressedSize, uncompressedSize);
-			break;
-		case 40:
-			if (peekByte != (char)0xE2) {
-				RINOK(readUint32(stream, &uncompressedSize));
-				RINOK(readUint32(stream, &offset));
-				RINOK(readUint32(stream, &compressedSize));
-				stream->Seek(4, STREAM_SEEK_CUR, nullptr);
-				fileInfo.SetFileInfos(offset, compressedSize, uncompressedSize);
-			}
-			break;
 		}
+		break;
+	}
 
-		// Read index for versions 30, 35
-		if (version == 30 || version == 35) {
-			uint32_t index;
-			RINOK(readUint32(stream, &index));
-		}
+	// Read index for versions 30, 35
+	if (version == 30 || version == 35) {
+		uint32_t index;
+		RINOK(reader.read(&index));
+	}
+
+	// Read file times
+	if (!(version == 40 && peekByte == (char)0xE2)) {
+		int64_t created, accessed, modified;
+		RINOK(reader.read(&created));
+		RINOK(reader.read(&accessed));
+		RINOK(reader.read(&modified));
+		fileInfo.SetFileTimes(created, accessed, modified);
+	}
+
+	// Read file path (a path cut off by the end of the window is kept as is)
+	const void* end = memchr(reader.data + reader.pos, '\0', reader.size - reader.pos);
+	size_t length = end ? static_cast<const uint8_t*>(end) - (reader.data + reader.pos) : reader.size - reader.pos;
+	fileInfo.pathOffset = static_cast<uint32_t>(reader.pos);
+	fileInfo.pathLength = static_cast<uint32_t>(length);
+	reader.pos += end ? length + 1 : length;
 
-		// Read file times
-		if (!(version == 40 && peekByte == (char)0xE2)) {
-			int64_t created, accessed, modified;
-			RINOK(readInt64(stream, &created));
-			RINOK(readInt64(stream, &accessed));
-			RINOK(readInt64(stream, &modified));
-			fileInfo.SetFileTimes(created, accessed, modified);
+	return S_OK;
+}
+
+static bool TestInstallerVersion(int version, BinaryReader reader, uint16_t fileNumber, long dataStreamLength) {
+	for (int i = 0; i < fileNumber; ++i) {
+		ClickTeamInstallerHandler::FileInfo fileInfo;
+		if (FAILED(tryParse(reader, fileInfo, version))) {
+			return false;
 		}
 
-		// Read file path
-		std::string fileName;
-		char ch;
-		while (readByte(stream, &ch) == S_OK && ch != '\0') {
-			fileName += ch;
+		if (!fileInfo.IsValid(dataStreamLength, fileInfo.offset,
+			fileInfo.compressedSize, fileInfo.uncompressedSize,
+			i, std::string_view(reinterpret_cast<const char*>(reader.data) + fileInfo.pathOffset, fileInfo.pathLength))) {
+			return false;
 		}
-		fileInfo.path = fileName;
 
-		return S_OK;
+		if (fileInfo.type != 0) {
+			if (FAILED(reader.seek(static_cast<size_t>(fileInfo.position) + fileInfo.size))) {
+				return false;
+			}
+		}
 	}
-	catch (const std::exception& e) {
-		std::cerr << "Error in tryParse (version " << version << "): " << e.what() << std::endl;
-		return E_FAIL;
+
+	return true;
+}
+
+// Probes each known layout against a window read from the start of the archive
+static int GetInstallerVersion(const uint8_t* data, size_t size, uint16_t fileNumber, long dataStreamLength) {
+	static const int versionsToTry[] = { 40, 35, 30, 24, 20 };
+
+	for (int version : versionsToTry) {
+		BinaryReader reader(data, size);
+		ClickTeamInstallerHandler::FileInfo fileInfo;
+
+		if (SUCCEEDED(tryParse(reader, fileInfo, version)) &&
+			TestInstallerVersion(version, BinaryReader(data, size), fileNumber, dataStreamLength)) {
+			return version;
+		}
 	}
+
+	std::cerr << "Failed to determine installer version. Please send a bug report." << std::endl;
+	return -1;
 }
 
-static bool TestInstallerVersion(int version, IInStream* stream, uint16_t fileNumber, long dataStreamLength) {
-	const size_t bufferSize = 4096;
-	std::vector<BYTE> buffer(bufferSize);
-	UInt32 bytesRead = 0;
-	HRESULT hr;
+// Multi-stream DEFLATE
+// A block may hold several zlib streams back to back, but where one ends is
+// only known once it has been inflated. Every plausible zlib header is
+// therefore inflated speculatively on a worker pool while the calling thread
+// walks the chain in order, the same way the serial loop used to, and picks up
+// the finished result at each boundary. Headers that fall inside a stream the
+// walk has already accepted are dropped before a worker spends time on them,
+// and the output of any candidate that failed or was overlapped is freed as
+// soon as that is known, so only accepted streams hold memory.
+struct DeflateCandidate {
+	size_t offset;
+	size_t consumed;
+	int result;
+	ByteVector* output;
+	bool done;
+	bool accepted;
+};
 
-	for (int i = 0; i < fileNumber; ++i) {
-		try {
-			ClickTeamInstallerHandler::FileInfo fileInfo;
+struct DeflateStream {
+	size_t offset;
+	size_t compressedSize;
+	size_t decompressedSize;
+	const uint8_t* data;
+};
 
-			hr = stream->Read(buffer.data(), static_cast<UInt32>(bufferSize), &bytesRead);
-			if (FAILED(hr) || bytesRead == 0) {
-				return false;
-			}
+struct DeflateStreamSet {
+	std::vector<DeflateCandidate> candidates;
+	std::vector<DeflateStream> streams;   // points into candidate outputs
 
-			stream->Seek(0, STREAM_SEEK_SET, nullptr);
+	~DeflateStreamSet() {
+		for (auto& c : candidates) bytevector_free(c.output);
+	}
+};
 
-			hr = tryParse(stream, fileInfo, version);
-			if (FAILED(hr)) {
-				return false;
-			}
+static bool isZlibHeader(const uint8_t* p) {
+	return p[0] == 0x78 && ((p[0] << 8) + p[1]) % 31 == 0 && !(p[1] & 0x20);
+}
 
-			if (!fileInfo.IsValid(dataStreamLength, fileInfo.offset,
-				fileInfo.compressedSize, fileInfo.uncompressedSize,
-				i, std::wstring(fileInfo.path.begin(), fileInfo.path.end()))) {
-				return false;
-			}
+// Outputs start small and grow with the stream, so a false header costs
+// little even when the next candidate is far away
+static const size_t kDeflateCandidateInitialOutput = 64 * 1024;
+
+static void inflateStreams(const std::vector<uint8_t>& compressedData, DeflateStreamSet& set) {
+	const uint8_t* data = compressedData.data();
+	const size_t size = compressedData.size();
+	std::vector<DeflateCandidate>& candidates = set.candidates;
 
-			if (fileInfo.type != 0) {
-				UInt64 newPos = static_cast<UInt64>(fileInfo.position) + fileInfo.size;
-				stream->Seek(newPos, STREAM_SEEK_SET, nullptr);
+	// Pre-scan: zlib_decompress_no_checksum rejects anything else up front
+	for (size_t i = 0; i + 2 <= size; i++) {
+		const uint8_t* p = static_cast<const uint8_t*>(memchr(data + i, 0x78, size - 1 - i));
+		if (!p) break;
+		i = p - data;
+		if (isZlibHeader(p)) {
+			candidates.push_back({ i, 0, -1, nullptr, false, false });
+		}
+	}
+	if (candidates.empty()) return;
+
+	std::atomic<size_t> nextCandidate(0);
+	std::atomic<size_t> frontier(0);   // written under mutex
+	std::mutex mutex;
+	std::condition_variable ready;
+
+	auto decode = [&](size_t i) {
+		DeflateCandidate& c = candidates[i];
+		ByteVector* output = nullptr;
+		int result = -1;
+		size_t consumed = 0;
+		if (c.offset >= frontier.load()) {
+			size_t next = i + 1 < candidates.size() ? candidates[i + 1].offset : size;
+			output = bytevector_create(std::min(std::max<size_t>(next - c.offset, 4096), kDeflateCandidateInitialOutput));
+			if (output) {
+				result = zlib_decompress_no_checksum(data + c.offset, size - c.offset, output, &consumed);
 			}
 		}
-		catch (const std::exception&) {
-			return false;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (result < 0 || c.offset < frontier.load()) {
+			bytevector_free(output);
+			output = nullptr;
+			result = -1;
 		}
-	}
+		c.output = output;
+		c.result = result;
+		c.consumed = consumed;
+		c.done = true;
+	};
 
-	return true;
-}
+	auto worker = [&]() {
+		for (;;) {
+			size_t i = nextCandidate.fetch_add(1);
+			if (i >= candidates.size()) return;
+			decode(i);
+			ready.notify_all();
+		}
+	};
 
-static int GetInstallerVersion(IInStream* stream, uint16_t fileNumber, long dataStreamLength) {
-	static int installerVersion = -1;
+	unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+	threadCount = static_cast<unsigned>(std::min<size_t>(threadCount, candidates.size()));
+	std::vector<std::thread> threads;
+	try {
+		for (unsigned t = 0; t < threadCount; t++) {
+			threads.emplace_back(worker);
+		}
+	}
+	catch (...) {
+		// Could not start more threads; with none at all the walk below
+		// inflates each stream itself when it reaches it
+	}
 
-	if (installerVersion > -1)
-		return installerVersion;
+	size_t offset = 0;
+	while (offset < size) {
+		if (size - offset >= 2 && data[offset] == 0x78) {
+			auto it = std::lower_bound(candidates.begin(), candidates.end(), offset,
+				[](const DeflateCandidate& c, size_t o) { return c.offset < o; });
+			if (it == candidates.end() || it->offset != offset) break;
 
-	std::vector<int> versionsToTry = { 40, 35, 30, 24, 20 };
+			if (threads.empty()) {
+				decode(it - candidates.begin());
+			}
+			else {
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [&]() { return it->done; });
+			}
+			if (it->result < 0) break;
 
-	for (int version : versionsToTry) {
-		ClickTeamInstallerHandler::FileInfo fileInfo;
-		stream->Seek(0, STREAM_SEEK_SET, nullptr);
+			it->accepted = true;
+			set.streams.push_back({ offset, it->consumed, it->output->length, it->output->data });
+			offset += it->consumed;
 
-		HRESULT hr = tryParse(stream, fileInfo, version);
+			// Skip Adler-32 checksum (4 bytes)
+			if (offset + 4 <= size) {
+				offset += 4;
+			}
 
-		if (SUCCEEDED(hr)) {
-			if (TestInstallerVersion(version, stream, fileNumber, dataStreamLength)) {
-				installerVersion = version;
-				return installerVersion;
+			// Candidates inside the accepted stream are dead. Finished ones are
+			// freed here; the rest see the new frontier when they finish.
+			std::lock_guard<std::mutex> lock(mutex);
+			frontier.store(offset);
+			for (auto skipped = it + 1; skipped != candidates.end() && skipped->offset < offset; ++skipped) {
+				if (skipped->done) {
+					bytevector_free(skipped->output);
+					skipped->output = nullptr;
+				}
+			}
+		}
+		else {
+			// Look for next stream
+			bool foundNext = false;
+			for (size_t lookahead = 1; lookahead <= 10 && offset + lookahead < size; lookahead++) {
+				if (data[offset + lookahead] == 0x78) {
+					offset += lookahead;
+					foundNext = true;
+					break;
+				}
 			}
+
+			if (!foundNext) break;
 		}
 	}
 
-	std::cerr << "Failed to determine installer version. Please send a bug report." << std::endl;
-	return -1;
+	// Nothing past this point is needed; let the workers drain the queue
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		frontier.store(SIZE_MAX);
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	for (auto& c : candidates) {
+		if (!c.accepted) {
+			bytevector_free(c.output);
+			c.output = nullptr;
+		}
+	}
 }
 
 // Decompression
 HRESULT ClickTeamInstallerHandler::unpackStream(IInStream* stream, long dataStreamLength,
-	std::vector<char>& decompressedData, std::vector<FileInfo>& filesInfos, int installerVersion) {
+	std::vector<char>& decompressedData, int installerVersion) {
 
 	ULONGLONG initialPosition = 0;
 	HRESULT hr = stream->Seek(0, STREAM_SEEK_CUR, &initialPosition);
@@ -435,66 +600,11 @@ HRESULT ClickTeamInstallerHandler::unpackStream(IInStream* stream, long dataStre
 				return E_FAIL;
 			}
 
-			struct DeflateStream {
-				size_t offset;
-				size_t compressedSize;
-				size_t decompressedSize;
-				std::vector<uint8_t> data;
-			};
-
-			std::vector<DeflateStream> streams;
-			size_t offset = 0;
-			int streamCount = 0;
-
-			// Decompress all streams individually
-			while (offset < compressedData.size()) {
-				if (compressedData.size() - offset >= 2 && compressedData[offset] == 0x78) {
-					streamCount++;
-
-					ByteVector* output = bytevector_create(compressedDataSize * 2);
-					if (!output) {
-						logDebug("[DECOMPRESSION] Failed to allocate output buffer.");
-						return E_FAIL;
-					}
-
-					size_t bytes_consumed = 0;
-					int result = zlib_decompress_no_checksum(compressedData.data() + offset,
-						compressedData.size() - offset, output, &bytes_consumed);
-
-					if (result < 0) {
-						bytevector_free(output);
-						break;
-					}
-
-					DeflateStream stream;
-					stream.offset = offset;
-					stream.compressedSize = bytes_consumed;
-					stream.decompressedSize = output->length;
-					stream.data.assign(output->data, output->data + output->length);
-					streams.push_back(stream);
-
-					bytevector_free(output);
-					offset += bytes_consumed;
-
-					// Skip Adler-32 checksum (4 bytes)
-					if (offset + 4 <= compressedData.size()) {
-						offset += 4;
-					}
-				}
-				else {
-					// Look for next stream
-					bool foundNext = false;
-					for (size_t lookahead = 1; lookahead <= 10 && offset + lookahead < compressedData.size(); lookahead++) {
-						if (compressedData[offset + lookahead] == 0x78) {
-							offset += lookahead;
-							foundNext = true;
-							break;
-						}
-					}
-
-					if (!foundNext) break;
-				}
-			}
+			DeflateStreamSet set;
+			inflateStreams(compressedData, set);
+			std::vector<DeflateStream>& streams = set.streams;
+			logDebug("[DECOMPRESSION] " + std::to_string(streams.size()) + " stream(s) from "
+				+ std::to_string(set.candidates.size()) + " candidate header(s).");
 
 			if (streams.empty()) {
 				logDebug("[DECOMPRESSION] No streams decompressed!");
@@ -502,27 +612,31 @@ HRESULT ClickTeamInstallerHandler::unpackStream(IInStream* stream, long dataStre
 			}
 
 			// Decide which streams to use
-			if (streams.size() == 1) {
-				decompressedData.assign(streams[0].data.begin(), streams[0].data.end());
-			}
-			else if (streams.size() >= 2) {
+			size_t first = 0, count = streams.size();
+			if (streams.size() >= 2) {
 				// Heuristic: If first stream is small (<5% of second stream), use only second stream
 				if (streams[0].decompressedSize < streams[1].decompressedSize / 20) {
-					decompressedData.assign(streams[1].data.begin(), streams[1].data.end());
+					first = 1; count = 1;
 				}
 				else if (streams[0].decompressedSize == blockSizeOrDecompressedSize) {
-					decompressedData.assign(streams[0].data.begin(), streams[0].data.end());
+					count = 1;
 				}
 				else if (streams[1].decompressedSize == blockSizeOrDecompressedSize) {
-					decompressedData.assign(streams[1].data.begin(), streams[1].data.end());
-				}
-				else {
-					// Concatenate all streams
-					for (const auto& s : streams) {
-						decompressedData.insert(decompressedData.end(), s.data.begin(), s.data.end());
-					}
+					first = 1; count = 1;
 				}
 			}
+
+			// Size the output once, then copy the chosen streams in order
+			size_t total = 0;
+			for (size_t i = first; i < first + count; i++) {
+				total += streams[i].decompressedSize;
+			}
+			decompressedData.resize(total);
+			char* dst = decompressedData.data();
+			for (size_t i = first; i < first + count; i++) {
+				memcpy(dst, streams[i].data, streams[i].decompressedSize);
+				dst += streams[i].decompressedSize;
+			}
 		}
 		break;
 
@@ -537,16 +651,12 @@ HRESULT ClickTeamInstallerHandler::unpackStream(IInStream* stream, long dataStre
 				return E_FAIL;
 			}
 
-			BZ2ByteVector output = { 0 };
-			int result = bzip2_decompress(compressedData.data(), compressedData.size(), &output);
+			// Decoded straight into the caller's buffer
+			int result = bzip2_decompress_into(compressedData.data(), compressedData.size(), decompressedData);
 			if (result < 0) {
 				logDebug("[DECOMPRESSION] Failed to decompress BZ2 data.");
-				if (output.data) free(output.data);
 				return E_FAIL;
 			}
-
-			decompressedData.assign(output.data, output.data + output.length);
-			if (output.data) free(output.data);
 		}
 		break;
 
@@ -560,94 +670,85 @@ HRESULT ClickTeamInstallerHandler::unpackStream(IInStream* stream, long dataStre
 		return E_FAIL;
 	}
 
-	filterInvalidChars(decompressedData);
 	logDebug("[DECOMPRESSION] Decompressed data stored successfully.");
 	return S_OK;
 }
 
-HRESULT ClickTeamInstallerHandler::ParseArchive(IInStream* stream, const std::vector<char>& decompressedData) {
-	logDebug(L"Start parsing decompressed data. Data size: " + std::to_wstring(decompressedData.size()));
+// Walks the FILE_LIST in place from `start` in the arena. Items keep offsets
+// to their paths rather than copies, so the arena must outlive them.
+HRESULT ClickTeamInstallerHandler::ParseArchive(IInStream* stream, size_t start) {
+	logDebug(L"Start parsing decompressed data. Data size: " + std::to_wstring(decompressedData.size() - start));
+
+	if (decompressedData.size() > UINT32_MAX) {
+		logDebug(L"FILE_LIST too large");
+		return E_FAIL;
+	}
 
-	this->decompressedData = decompressedData;
-	size_t pos = 0;
+	BinaryReader reader(reinterpret_cast<const uint8_t*>(decompressedData.data()), decompressedData.size());
+	RINOK(reader.seek(start));
 
 	// Read file count (2 bytes)
-	if (pos + 2 > decompressedData.size()) {
+	uint16_t fileCount;
+	if (reader.read(&fileCount) != S_OK || reader.skip(2) != S_OK) { // Skip unknown bytes
 		logDebug(L"Not enough data to read file count");
 		return E_FAIL;
 	}
 
-	uint16_t fileCount = *reinterpret_cast<const uint16_t*>(&decompressedData[pos]);
-	pos += 2;
-	pos += 2; // Skip unknown bytes
-
 	logDebug(L"FILE_LIST contains " + std::to_wstring(fileCount) + L" files");
+	items.reserve(items.size() + fileCount);
 
 	for (uint16_t i = 0; i < fileCount; i++) {
 		FileInfo fileInfo;
-		size_t nodeStart = pos;
-
-		if (pos + 2 > decompressedData.size()) break;
+		size_t nodeStart = reader.pos;
 
-		uint16_t nodeSize = *reinterpret_cast<const uint16_t*>(&decompressedData[pos]);
-		pos += 2;
-
-		if (pos + 2 > decompressedData.size()) break;
-		uint16_t fileType = *reinterpret_cast<const uint16_t*>(&decompressedData[pos]);
-		pos += 2;
+		uint16_t nodeSize, fileType;
+		if (reader.read(&nodeSize) != S_OK || reader.read(&fileType) != S_OK) break;
 
 		fileInfo.size = nodeSize;
 		fileInfo.type = fileType;
 		fileInfo.position = nodeStart;
 
-		size_t nodeEnd = nodeStart + nodeSize;
+		size_t nodeEnd = std::min(nodeStart + nodeSize, reader.size);
 
 		if (fileType != 0) {
-			pos = nodeEnd;
+			reader.pos = std::max(nodeEnd, reader.pos);
 			continue;
 		}
 
-		pos += 2; // Skip unknown
-
-		if (pos + 16 > decompressedData.size()) break;
-		uint32_t offset = *reinterpret_cast<const uint32_t*>(&decompressedData[pos]); pos += 4;
-		uint32_t compressedSize = *reinterpret_cast<const uint32_t*>(&decompressedData[pos]); pos += 4;
-		uint32_t unknown32 = *reinterpret_cast<const uint32_t*>(&decompressedData[pos]); pos += 4;
-		uint32_t uncompressedSize = *reinterpret_cast<const uint32_t*>(&decompressedData[pos]); pos += 4;
-
-		fileInfo.offset = offset;
-		fileInfo.compressedSize = compressedSize;
-		fileInfo.uncompressedSize = uncompressedSize;
-
-		pos += 18; // Skip unknown
-
-		if (pos + 4 > decompressedData.size()) break;
-		uint32_t index = *reinterpret_cast<const uint32_t*>(&decompressedData[pos]); pos += 4;
-
-		if (pos + 24 > decompressedData.size()) break;
-		int64_t created = *reinterpret_cast<const int64_t*>(&decompressedData[pos]); pos += 8;
-		int64_t accessed = *reinterpret_cast<const int64_t*>(&decompressedData[pos]); pos += 8;
-		int64_t modified = *reinterpret_cast<const int64_t*>(&decompressedData[pos]); pos += 8;
+		uint32_t unknown32, index;
+		int64_t created, accessed, modified;
+		if (reader.skip(2) != S_OK ||   // Skip unknown
+			reader.read(&fileInfo.offset) != S_OK ||
+			reader.read(&fileInfo.compressedSize) != S_OK ||
+			reader.read(&unknown32) != S_OK ||
+			reader.read(&fileInfo.uncompressedSize) != S_OK ||
+			reader.skip(18) != S_OK ||  // Skip unknown
+			reader.read(&index) != S_OK ||
+			reader.read(&created) != S_OK ||
+			reader.read(&accessed) != S_OK ||
+			reader.read(&modified) != S_OK) {
+			break;
+		}
 
 		fileInfo.SetFileTimes(created, accessed, modified);
 
-		// Read null-terminated path
-		std::string filePath;
-		while (pos < nodeEnd && decompressedData[pos] != '\0') {
-			filePath += decompressedData[pos];
-			pos++;
-		}
-		if (pos < nodeEnd && decompressedData[pos] == '\0') pos++;
+		// Null-terminated path, referenced in place
+		size_t pathStart = std::min(reader.pos, nodeEnd);
+		const char* name = decompressedData.data() + pathStart;
+		const void* end = memchr(name, '\0', nodeEnd - pathStart);
+		size_t length = end ? static_cast<const char*>(end) - name : nodeEnd - pathStart;
+		filterInvalidChars(decompressedData.data() + pathStart, length);
 
-		fileInfo.path = filePath;
-		pos = nodeEnd;
+		fileInfo.pathOffset = static_cast<uint32_t>(pathStart);
+		fileInfo.pathLength = static_cast<uint32_t>(length);
+		reader.pos = nodeEnd;
 
-		if (!filePath.empty()) {
-			this->items.push_back(fileInfo);
+		if (length != 0) {
+			items.push_back(fileInfo);
 		}
 	}
 
-	logDebug(L"Successfully parsed " + std::to_wstring(this->items.size()) + L" file entries");
+	logDebug(L"Successfully parsed " + std::to_wstring(items.size()) + L" file entries");
 	return S_OK;
 }
 
@@ -669,8 +770,13 @@ HRESULT ClickTeamInstallerHandler::Open(IInStream* stream, const UInt64* fileSiz
 	RINOK(stream->Seek(0, STREAM_SEEK_END, &streamLength));
 	RINOK(stream->Seek(0, STREAM_SEEK_SET, nullptr));
 
+	// Version probing works on one buffered window instead of per-field reads
+	std::vector<uint8_t> probe(static_cast<size_t>(std::min<UInt64>(streamLength, kVersionProbeSize)));
+	size_t probeSize = probe.size();
+	RINOK(ReadStream(stream, probe.data(), &probeSize));
+
 	uint16_t fileNumber = 0;
-	int installerVersion = GetInstallerVersion(stream, fileNumber, streamLength);
+	installerVersion = GetInstallerVersion(probe.data(), probeSize, fileNumber, streamLength);
 	if (installerVersion == -1) {
 		logDebug("Error: Failed to detect installer version!");
 		return E_FAIL;
@@ -705,14 +811,23 @@ HRESULT ClickTeamInstallerHandler::Open(IInStream* stream, const UInt64* fileSiz
 			RINOK(callback->SetTotal(nullptr, &totalSize));
 
 			std::vector<char> fileListData;
-			std::vector<FileInfo> fileInfos;
 
-			RINOK(unpackStream(stream, blockSize, fileListData, fileInfos, installerVersion));
-			RINOK(ParseArchive(stream, fileListData));
+			RINOK(unpackStream(stream, blockSize, fileListData, installerVersion));
+
+			// The first FILE_LIST becomes the arena as is; any further one is appended
+			size_t start = decompressedData.size();
+			if (start == 0) {
+				decompressedData.swap(fileListData);
+			}
+			else {
+				decompressedData.insert(decompressedData.end(), fileListData.begin(), fileListData.end());
+			}
+			RINOK(ParseArchive(stream, start));
 
 		}
 		else if (blockType == FILE_DATA) {
-			RINOK(ExtractFilesFromBlock(stream, position, installerVersion));
+			// Payloads are inflated on demand by DecompressItem
+			fileDataStart = position;
 		}
 
 		position = nextBlockPos;
@@ -720,79 +835,64 @@ HRESULT ClickTeamInstallerHandler::Open(IInStream* stream, const UInt64* fileSiz
 	}
 
 	logDebug("Archive parsed. Total items: " + std::to_string(items.size()));
-	for (const auto& item : items) {
-		logDebug("  " + item.path + ": " + std::to_string(item.decompressedData.size()) + " bytes");
-	}
 
 	return S_OK;
 }
 
-HRESULT ClickTeamInstallerHandler::ExtractFilesFromBlock(IInStream* stream, UInt64 fileDataStart, int installerVersion) {
-	if (items.empty()) {
-		return S_OK;
+// Inflates a single item from the FILE_DATA block into a buffer of at least
+// item.uncompressedSize bytes. Returns S_FALSE when the data is damaged (with
+// whatever could be decoded in *written) and E_NOTIMPL for methods other than
+// DEFLATE.
+HRESULT ClickTeamInstallerHandler::DecompressItem(IInStream* stream, const FileInfo& item,
+	Byte* output, size_t outputSize, size_t* written) {
+	*written = 0;
+	if (fileDataStart == 0 || item.compressedSize < 5) {
+		return S_FALSE;
 	}
 
-	for (auto& item : items) {
-		UInt64 absoluteOffset = fileDataStart + item.offset;
-
-		logDebug("Extracting: " + item.path);
-		logDebug("  Offset: " + std::to_string(absoluteOffset));
-		logDebug("  Compressed: " + std::to_string(item.compressedSize));
-		logDebug("  Uncompressed: " + std::to_string(item.uncompressedSize));
-
-		// Seek to file data (skip 4-byte header, read compression method)
-		RINOK(stream->Seek(absoluteOffset + 4, STREAM_SEEK_SET, nullptr));
+	UInt64 absoluteOffset = fileDataStart + item.offset;
+	logDebug("Extracting: " + std::string(GetPath(item)));
+	logDebug("  Offset: " + std::to_string(absoluteOffset));
+	logDebug("  Compressed: " + std::to_string(item.compressedSize));
+	logDebug("  Uncompressed: " + std::to_string(item.uncompressedSize));
 
-		uint8_t compressionMethod;
-		RINOK(stream->Read(&compressionMethod, 1, nullptr));
+	// Seek to file data (skip 4-byte header, read compression method)
+	RINOK(stream->Seek(absoluteOffset + 4, STREAM_SEEK_SET, nullptr));
 
-		// Currently only DEFLATE is supported
-		if (compressionMethod != DEFLATE) {
-			logDebug("  Unsupported compression method: " + std::to_string(compressionMethod));
-			continue;
-		}
-
-		// Read compressed data (after 4-byte header + 1-byte compression method)
-		uint32_t compressedDataSize = item.compressedSize - 5;
-		std::vector<uint8_t> compressedData(compressedDataSize);
-
-		UInt32 bytesRead = 0;
-		HRESULT hr = stream->Read(compressedData.data(), compressedDataSize, &bytesRead);
-		if (FAILED(hr) || bytesRead != compressedDataSize) {
-			logDebug("  Failed to read compressed data");
-			continue;
-		}
-
-		// Verify zlib header
-		if (compressedData.size() < 2 || compressedData[0] != 0x78) {
-			logDebug("  Missing zlib header");
-			continue;
-		}
+	uint8_t compressionMethod;
+	RINOK(stream->Read(&compressionMethod, 1, nullptr));
 
-		// Decompress
-		ByteVector* output = bytevector_create(item.uncompressedSize * 2);
-		if (!output) {
-			logDebug("  Failed to allocate buffer");
-			continue;
-		}
+	// Currently only DEFLATE is supported
+	if (compressionMethod != DEFLATE) {
+		logDebug("  Unsupported compression method: " + std::to_string(compressionMethod));
+		return E_NOTIMPL;
+	}
 
-		size_t bytes_consumed = 0;
-		int result = zlib_decompress_no_checksum(compressedData.data(), compressedData.size(),
-			output, &bytes_consumed);
+	// Read compressed data (after 4-byte header + 1-byte compression method)
+	uint32_t compressedDataSize = item.compressedSize - 5;
+	std::vector<uint8_t> compressedData(compressedDataSize);
 
-		if (output->length > 0) {
-			item.decompressedData.assign(output->data, output->data + output->length);
-			item.uncompressedSize = output->length;
+	UInt32 bytesRead = 0;
+	RINOK(stream->Read(compressedData.data(), compressedDataSize, &bytesRead));
+	if (bytesRead != compressedDataSize) {
+		logDebug("  Failed to read compressed data");
+		return S_FALSE;
+	}
 
-			logDebug("  SUCCESS: Decompressed " + std::to_string(output->length) + " bytes" +
-				(result < 0 ? " (with warnings)" : ""));
-		}
-		else {
-			logDebug("  FAILED: Decompression produced no output");
-		}
+	// Verify zlib header
+	if (compressedData.size() < 2 || compressedData[0] != 0x78) {
+		logDebug("  Missing zlib header");
+		return S_FALSE;
+	}
 
-		bytevector_free(output);
+	int result = zlib_decompress_into(compressedData.data(), compressedData.size(),
+		output, outputSize, written, nullptr, 0);
+	if (result < 0 || *written != item.uncompressedSize) {
+		logDebug("  FAILED: Decompressed " + std::to_string(*written) + " of " +
+			std::to_string(item.uncompressedSize) + " bytes");
+		return S_FALSE;
 	}
 
+	logDebug("  SUCCESS: Decompressed " + std::to_string(*written) + " bytes");
 	return S_OK;
 }
\ No newline at end of file
@@ -7,35 +7,58 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "7zCrc.h"
+
 #define BZ2_MAX_SELECTORS 18002
 #define BZ2_MAX_GROUPS 6
 #define BZ2_MAX_ALPHA_SIZE 258
-#define BZ2_MAX_CODE_LEN 23
+#define BZ2_MAX_CODE_LEN 20
+#define BZ2_GROUP_SIZE 50
+#define BZ2_RUNA 0
+#define BZ2_RUNB 1
+
+#define BZ2_BLOCK_MAGIC 0x314159265359ULL
+#define BZ2_END_MAGIC 0x177245385090ULL
 
 typedef struct {
   uint8_t* data;
   size_t length;
   size_t capacity;
+  // Optional: resizes the owner's buffer to new_cap bytes and returns it (NULL
+  // on failure). Lets the decoder write into a caller's buffer; data is then
+  // not malloc'd and must not be freed.
+  uint8_t* (*grow)(void* owner, size_t new_cap);
+  void* owner;
 } BZ2ByteVector;
 
-static bool bz2_bytevector_push(BZ2ByteVector* vec, uint8_t byte) {
-  if (vec->length >= vec->capacity) {
-    size_t new_cap = vec->capacity == 0 ? 4096 : vec->capacity * 2;
-    uint8_t* new_data = (uint8_t*)realloc(vec->data, new_cap);
-    if (!new_data) return false;
-    vec->data = new_data;
-    vec->capacity = new_cap;
+// Makes sure at least `extra` bytes can be written past vec->length.
+static bool bz2_bytevector_reserve(BZ2ByteVector* vec, size_t extra) {
+  if (vec->capacity - vec->length >= extra) return true;
+  size_t new_cap = vec->capacity == 0 ? 4096 : vec->capacity;
+  while (new_cap - vec->length < extra) {
+    if (new_cap > SIZE_MAX / 2) return false;
+    new_cap *= 2;
   }
-  vec->data[vec->length++] = byte;
+  uint8_t* new_data = vec->grow ? vec->grow(vec->owner, new_cap) : (uint8_t*)realloc(vec->data, new_cap);
+  if (!new_data) return false;
+  vec->data = new_data;
+  vec->capacity = new_cap;
   return true;
 }
 
+/*
+ * MSB-first bit reader. The next unread bit is the top bit of a 64-bit buffer
+ * holding up to 63 bits, refilled with one big-endian 8-byte load while enough
+ * input remains. Past the end of input zero bytes are shifted in and counted
+ * in `overrun`, so running off the end is caught on the next refill.
+ */
 typedef struct {
   const uint8_t* data;
   size_t size;
   size_t byte_pos;
-  uint32_t bit_buffer;
-  int bits_in_buffer;
+  uint64_t bit_buffer;
+  unsigned bits_in_buffer;
+  size_t overrun;
 } BZ2BitStream;
 
 static void bz2_bitstream_init(BZ2BitStream* bs, const uint8_t* data, size_t size) {
@@ -44,339 +67,372 @@ static void bz2_bitstream_init(BZ2BitStream* bs, const uint8_t* data, size_t siz
   bs->byte_pos = 0;
   bs->bit_buffer = 0;
   bs->bits_in_buffer = 0;
+  bs->overrun = 0;
+}
+
+static uint64_t bz2_load_be64(const uint8_t* p) {
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+    ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
 }
 
-static int bz2_read_bits(BZ2BitStream* bs, int n) {
-  while (bs->bits_in_buffer < n) {
-    if (bs->byte_pos >= bs->size) return -1;
-    bs->bit_buffer = (bs->bit_buffer << 8) | bs->data[bs->byte_pos++];
+// Tops the buffer up to at least 56 bits. Returns false once padding was consumed.
+static bool bz2_refill(BZ2BitStream* bs) {
+  if (bs->size - bs->byte_pos >= 8) {
+    bs->bit_buffer |= bz2_load_be64(bs->data + bs->byte_pos) >> bs->bits_in_buffer;
+    bs->byte_pos += (63 - bs->bits_in_buffer) >> 3;
+    bs->bits_in_buffer |= 56;
+    return true;
+  }
+  if (bs->bits_in_buffer < bs->overrun * 8) return false;
+  while (bs->bits_in_buffer <= 56) {
+    if (bs->byte_pos < bs->size)
+      bs->bit_buffer |= (uint64_t)bs->data[bs->byte_pos++] << (56 - bs->bits_in_buffer);
+    else
+      bs->overrun++;
     bs->bits_in_buffer += 8;
   }
-  int result = (bs->bit_buffer >> (bs->bits_in_buffer - n)) & ((1 << n) - 1);
-  bs->bits_in_buffer -= n;
-  return result;
+  return true;
 }
 
-static int bz2_read_bit(BZ2BitStream* bs) {
-  return bz2_read_bits(bs, 1);
+static uint32_t bz2_peek(const BZ2BitStream* bs, unsigned n) {
+  return (uint32_t)(bs->bit_buffer >> (64 - n));
 }
 
-// Count trailing zeros (portable version - replaces __builtin_ctz)
-static int bz2_count_trailing_zeros(int value) {
-  if (value == 0) return 32;
-  int count = 0;
-  while ((value & 1) == 0) {
-    value >>= 1;
-    count++;
-  }
-  return count;
+static void bz2_consume(BZ2BitStream* bs, unsigned n) {
+  bs->bit_buffer <<= n;
+  bs->bits_in_buffer -= n;
 }
 
-// Burrows-Wheeler Transform inverse
-static void bz2_inverse_bwt(uint8_t* data, int* tt, int origPtr, int blockSize) {
-  int counts[256] = { 0 };
-
-  // Count occurrences
-  for (int i = 0; i < blockSize; i++) {
-    counts[data[i]]++;
-  }
-
-  // Calculate cumulative counts
-  int cumul[256];
-  cumul[0] = 0;
-  for (int i = 1; i < 256; i++) {
-    cumul[i] = cumul[i - 1] + counts[i - 1];
-  }
-
-  // Build transformation vector
-  for (int i = 0; i < blockSize; i++) {
-    tt[cumul[data[i]]++] = i;
-  }
-
-  // Inverse transform
-  uint8_t* temp = (uint8_t*)malloc(blockSize);
-  if (!temp) return;
-
-  int idx = origPtr;
-  for (int i = 0; i < blockSize; i++) {
-    temp[i] = data[idx];
-    idx = tt[idx];
-  }
-
-  memcpy(data, temp, blockSize);
-  free(temp);
+// Reads up to 32 bits; returns -1 once the input is exhausted.
+static int64_t bz2_read_bits(BZ2BitStream* bs, unsigned n) {
+  if (bs->bits_in_buffer < n && !bz2_refill(bs)) return -1;
+  if (bs->bits_in_buffer - n < bs->overrun * 8) return -1;
+  uint32_t result = bz2_peek(bs, n);
+  bz2_consume(bs, n);
+  return result;
 }
 
-// Inverse Move-to-Front transform
-static void bz2_inverse_mtf(uint8_t* data, int blockSize) {
-  uint8_t mtf[256];
-  for (int i = 0; i < 256; i++) {
-    mtf[i] = (uint8_t)i;
-  }
+static int bz2_read_bit(BZ2BitStream* bs) {
+  return (int)bz2_read_bits(bs, 1);
+}
 
-  for (int i = 0; i < blockSize; i++) {
-    uint8_t idx = data[i];
-    uint8_t val = mtf[idx];
-    data[i] = val;
+/*
+ * Huffman decode table for one coding group. Codes up to BZ2_TABLE_BITS long
+ * resolve in a single lookup of (symbol << 5 | length); longer ones (rare in
+ * practice) are found by comparing against the per-length canonical limits.
+ */
+#define BZ2_TABLE_BITS 10
 
-    // Move to front
-    for (int j = idx; j > 0; j--) {
-      mtf[j] = mtf[j - 1];
-    }
-    mtf[0] = val;
+typedef struct {
+  uint16_t fast[1u << BZ2_TABLE_BITS];
+  int32_t limit[BZ2_MAX_CODE_LEN + 1];   // largest code of each length, -1 if none
+  int32_t base[BZ2_MAX_CODE_LEN + 1];    // perm index minus first code of each length
+  uint16_t perm[BZ2_MAX_ALPHA_SIZE];
+  unsigned max_len;
+} BZ2HuffmanTable;
+
+static int bz2_build_table(BZ2HuffmanTable* t, const uint8_t* length, int alphaSize) {
+  unsigned count[BZ2_MAX_CODE_LEN + 1] = { 0 };
+  t->max_len = 0;
+  for (int i = 0; i < alphaSize; i++) {
+    count[length[i]]++;
+    if (length[i] > t->max_len) t->max_len = length[i];
   }
-}
 
-// Create Huffman decode tables
-static int bz2_create_decode_tables(int* limit, int* base, int* perm,
-  uint8_t* length, int minLen, int maxLen, int alphaSize) {
+  memset(t->fast, 0, sizeof(t->fast));
   int pp = 0;
-  for (int i = minLen; i <= maxLen; i++) {
-    for (int j = 0; j < alphaSize; j++) {
-      if (length[j] == i) {
-        perm[pp++] = j;
+  uint32_t code = 0;
+  for (unsigned len = 1; len <= BZ2_MAX_CODE_LEN; len++) {
+    t->base[len] = pp - (int32_t)code;
+    t->limit[len] = count[len] ? (int32_t)(code + count[len] - 1) : -1;
+    if (count[len] && code + count[len] > (1u << len)) return -1;
+
+    for (int sym = 0; sym < alphaSize; sym++) {
+      if (length[sym] != len) continue;
+      t->perm[pp++] = (uint16_t)sym;
+      if (len <= BZ2_TABLE_BITS) {
+        unsigned shift = BZ2_TABLE_BITS - len;
+        uint16_t entry = (uint16_t)((sym << 5) | len);
+        for (uint32_t k = 0; k < (1u << shift); k++) t->fast[(code << shift) + k] = entry;
       }
+      code++;
     }
+    code <<= 1;
   }
+  return 0;
+}
 
-  for (int i = 0; i < BZ2_MAX_CODE_LEN; i++) {
-    base[i] = 0;
-    limit[i] = 0;
+// Decodes one symbol; the caller guarantees at least BZ2_MAX_CODE_LEN buffered bits.
+static int bz2_decode_symbol(const BZ2HuffmanTable* t, BZ2BitStream* bs) {
+  uint16_t entry = t->fast[bz2_peek(bs, BZ2_TABLE_BITS)];
+  if (entry) {
+    bz2_consume(bs, entry & 0x1F);
+    return entry >> 5;
   }
-
-  int vec = 0;
-  for (int i = minLen; i <= maxLen; i++) {
-    int count = 0;
-    for (int j = 0; j < alphaSize; j++) {
-      if (length[j] == i) count++;
+  for (unsigned len = BZ2_TABLE_BITS + 1; len <= t->max_len; len++) {
+    int32_t code = (int32_t)bz2_peek(bs, len);
+    if (code <= t->limit[len]) {
+      int32_t idx = code + t->base[len];
+      if (idx < 0) return -1;   // gap left by an incomplete code
+      bz2_consume(bs, len);
+      return t->perm[idx];
     }
-    base[i] = vec;
-    vec += count;
-    limit[i] = vec - 1;
-    vec <<= 1;
   }
+  return -1;
+}
+
+/*
+ * Move-to-front list split into 16-entry sublists as in libbzip2. Moving an
+ * entry to the front shifts only inside its own sublist and then rotates one
+ * entry across each lower sublist, so a deep index costs ~index/16 moves.
+ */
+#define BZ2_MTFA_SIZE 4096
+#define BZ2_MTFL_SIZE 16
 
-  for (int i = minLen + 1; i <= maxLen; i++) {
-    base[i] = ((limit[i - 1] + 1) << 1) - base[i];
+typedef struct {
+  uint8_t mtfa[BZ2_MTFA_SIZE];
+  int mtfbase[256 / BZ2_MTFL_SIZE];
+} BZ2Mtf;
+
+static void bz2_mtf_init(BZ2Mtf* m) {
+  int kk = BZ2_MTFA_SIZE - 1;
+  for (int ii = 256 / BZ2_MTFL_SIZE - 1; ii >= 0; ii--) {
+    for (int jj = BZ2_MTFL_SIZE - 1; jj >= 0; jj--) {
+      m->mtfa[kk] = (uint8_t)(ii * BZ2_MTFL_SIZE + jj);
+      kk--;
+    }
+    m->mtfbase[ii] = kk + 1;
   }
+}
 
-  return 0;
+static uint8_t bz2_mtf_front(const BZ2Mtf* m) {
+  return m->mtfa[m->mtfbase[0]];
 }
 
-// Decode a block
-static int bz2_decompress_block(BZ2BitStream* bs, BZ2ByteVector* output) {
-  // Read block header
-  int blockMagic1 = bz2_read_bits(bs, 24);
-  int blockMagic2 = bz2_read_bits(bs, 24);
-  if (blockMagic1 != 0x314159 || blockMagic2 != 0x265359) {
-    return -1; // End of blocks or error
+static uint8_t bz2_mtf_move(BZ2Mtf* m, int nn) {
+  uint8_t uc;
+  if (nn < BZ2_MTFL_SIZE) {
+    int pp = m->mtfbase[0];
+    uc = m->mtfa[pp + nn];
+    while (nn > 3) {
+      int z = pp + nn;
+      m->mtfa[z] = m->mtfa[z - 1];
+      m->mtfa[z - 1] = m->mtfa[z - 2];
+      m->mtfa[z - 2] = m->mtfa[z - 3];
+      m->mtfa[z - 3] = m->mtfa[z - 4];
+      nn -= 4;
+    }
+    while (nn > 0) {
+      m->mtfa[pp + nn] = m->mtfa[pp + nn - 1];
+      nn--;
+    }
+    m->mtfa[pp] = uc;
+    return uc;
   }
 
-  // Read CRC
-  bz2_read_bits(bs, 32);
-
-  // Read randomized flag
-  int randomized = bz2_read_bit(bs);
-  if (randomized) return -1; // Not supported
-
-  // Read origPtr
-  int origPtr = bz2_read_bits(bs, 24);
-
-  // Read used bitmap
-  int inUse16[16] = { 0 };
-  for (int i = 0; i < 16; i++) {
-    inUse16[i] = bz2_read_bit(bs);
+  int lno = nn / BZ2_MTFL_SIZE;
+  int pp = m->mtfbase[lno] + nn % BZ2_MTFL_SIZE;
+  uc = m->mtfa[pp];
+  while (pp > m->mtfbase[lno]) {
+    m->mtfa[pp] = m->mtfa[pp - 1];
+    pp--;
   }
-
-  bool inUse[256] = { false };
-  int symTotal = 0;
-  for (int i = 0; i < 16; i++) {
-    if (inUse16[i]) {
-      for (int j = 0; j < 16; j++) {
-        if (bz2_read_bit(bs)) {
-          inUse[i * 16 + j] = true;
-          symTotal++;
-        }
+  m->mtfbase[lno]++;
+  while (lno > 0) {
+    m->mtfbase[lno]--;
+    m->mtfa[m->mtfbase[lno]] = m->mtfa[m->mtfbase[lno - 1] + BZ2_MTFL_SIZE - 1];
+    lno--;
+  }
+  m->mtfbase[0]--;
+  m->mtfa[m->mtfbase[0]] = uc;
+
+  // Front sublist ran into the start of the array: repack everything.
+  if (m->mtfbase[0] == 0) {
+    int kk = BZ2_MTFA_SIZE - 1;
+    for (int ii = 256 / BZ2_MTFL_SIZE - 1; ii >= 0; ii--) {
+      for (int jj = BZ2_MTFL_SIZE - 1; jj >= 0; jj--) {
+        m->mtfa[kk] = m->mtfa[m->mtfbase[ii] + jj];
+        kk--;
       }
+      m->mtfbase[ii] = kk + 1;
     }
   }
+  return uc;
+}
 
-  if (symTotal == 0) return -1;
-
-  // Create symbol map
+/*
+ * Decodes one block into `tt`, then runs the inverse BWT and the final
+ * run-length stage straight into `output`. Each tt word packs the byte in its
+ * low 8 bits and the successor index above it, so walking the BWT chain costs
+ * one cache miss per output byte. Returns the block's stored CRC check result:
+ * 0 on success, -1 on corrupt data or a CRC mismatch.
+ */
+static int bz2_decompress_block(BZ2BitStream* bs, uint32_t* tt, uint32_t max_block, BZ2ByteVector* output,
+  uint32_t* block_crc) {
+  int64_t v = bz2_read_bits(bs, 32);
+  if (v < 0) return -1;
+  uint32_t stored_crc = (uint32_t)v;
+
+  if (bz2_read_bit(bs) != 0) return -1;   // randomised blocks are obsolete and unsupported
+
+  v = bz2_read_bits(bs, 24);
+  if (v < 0) return -1;
+  uint32_t origPtr = (uint32_t)v;
+  if (origPtr >= max_block) return -1;
+
+  // Symbol map
+  v = bz2_read_bits(bs, 16);
+  if (v < 0) return -1;
+  uint32_t inUse16 = (uint32_t)v;
   uint8_t seqToUnseq[256];
-  int idx = 0;
-  for (int i = 0; i < 256; i++) {
-    if (inUse[i]) {
-      seqToUnseq[idx++] = (uint8_t)i;
+  int nInUse = 0;
+  for (int i = 0; i < 16; i++) {
+    if (!(inUse16 & (0x8000u >> i))) continue;
+    v = bz2_read_bits(bs, 16);
+    if (v < 0) return -1;
+    for (int j = 0; j < 16; j++) {
+      if ((uint32_t)v & (0x8000u >> j)) seqToUnseq[nInUse++] = (uint8_t)(i * 16 + j);
     }
   }
-  int alphaSize = symTotal + 2; // EOB + RUNA + RUNB
-
-  // Read number of Huffman groups
-  int nGroups = bz2_read_bits(bs, 3);
-  if (nGroups < 2 || nGroups > 6) return -1;
+  if (nInUse == 0) return -1;
+  int alphaSize = nInUse + 2;   // RUNA, RUNB, symbols 1..nInUse-1, EOB
 
-  // Read number of selectors
-  int nSelectors = bz2_read_bits(bs, 15);
-  if (nSelectors < 1) return -1;
+  // Coding groups and selectors
+  int nGroups = (int)bz2_read_bits(bs, 3);
+  if (nGroups < 2 || nGroups > BZ2_MAX_GROUPS) return -1;
+  v = bz2_read_bits(bs, 15);
+  if (v < 1) return -1;
+  int nSelectors = (int)v;
 
-  // Read selector MTF values
-  uint8_t selectorMtf[BZ2_MAX_SELECTORS];
-  for (int i = 0; i < nSelectors; i++) {
-    int j = 0;
-    while (bz2_read_bit(bs)) {
-      j++;
-      if (j >= nGroups) return -1;
-    }
-    selectorMtf[i] = (uint8_t)j;
-  }
-
-  // Undo MTF on selectors
   uint8_t pos[BZ2_MAX_GROUPS];
   for (int i = 0; i < nGroups; i++) pos[i] = (uint8_t)i;
-
   uint8_t selector[BZ2_MAX_SELECTORS];
   for (int i = 0; i < nSelectors; i++) {
-    uint8_t v = selectorMtf[i];
-    uint8_t tmp = pos[v];
-    while (v > 0) {
-      pos[v] = pos[v - 1];
-      v--;
+    int j = 0;
+    for (;;) {
+      int bit = bz2_read_bit(bs);
+      if (bit < 0) return -1;
+      if (!bit) break;
+      if (++j >= nGroups) return -1;
     }
+    // Undo the selector MTF on the fly; selectors past the limit are ignored
+    // as libbzip2 does.
+    uint8_t tmp = pos[j];
+    for (; j > 0; j--) pos[j] = pos[j - 1];
     pos[0] = tmp;
-    selector[i] = tmp;
+    if (i < BZ2_MAX_SELECTORS) selector[i] = tmp;
   }
+  if (nSelectors > BZ2_MAX_SELECTORS) nSelectors = BZ2_MAX_SELECTORS;
 
-  // Read Huffman code lengths
-  uint8_t len[BZ2_MAX_GROUPS][BZ2_MAX_ALPHA_SIZE];
+  BZ2HuffmanTable tables[BZ2_MAX_GROUPS];
   for (int t = 0; t < nGroups; t++) {
-    int curr = bz2_read_bits(bs, 5);
+    uint8_t len[BZ2_MAX_ALPHA_SIZE];
+    int curr = (int)bz2_read_bits(bs, 5);
     for (int i = 0; i < alphaSize; i++) {
-      while (1) {
-        if (curr < 1 || curr > 20) return -1;
-        if (!bz2_read_bit(bs)) break;
-        if (bz2_read_bit(bs)) curr--;
-        else curr++;
+      for (;;) {
+        if (curr < 1 || curr > BZ2_MAX_CODE_LEN) return -1;
+        int bit = bz2_read_bit(bs);
+        if (bit < 0) return -1;
+        if (!bit) break;
+        bit = bz2_read_bit(bs);
+        if (bit < 0) return -1;
+        curr += bit ? -1 : 1;
       }
-      len[t][i] = (uint8_t)curr;
+      len[i] = (uint8_t)curr;
     }
+    if (bz2_build_table(&tables[t], len, alphaSize) < 0) return -1;
   }
 
-  // Create decode tables
-  int limit[BZ2_MAX_GROUPS][BZ2_MAX_CODE_LEN];
-  int base[BZ2_MAX_GROUPS][BZ2_MAX_CODE_LEN];
-  int perm[BZ2_MAX_GROUPS][BZ2_MAX_ALPHA_SIZE];
-  int minLens[BZ2_MAX_GROUPS];
-
-  for (int t = 0; t < nGroups; t++) {
-    int minLen = 32, maxLen = 0;
-    for (int i = 0; i < alphaSize; i++) {
-      if (len[t][i] > maxLen) maxLen = len[t][i];
-      if (len[t][i] < minLen) minLen = len[t][i];
-    }
-    minLens[t] = minLen;
-    bz2_create_decode_tables(limit[t], base[t], perm[t], len[t], minLen, maxLen, alphaSize);
-  }
-
-  // Decode block data
-  uint8_t* blockData = (uint8_t*)malloc(900000);
-  if (!blockData) return -1;
-  int blockSize = 0;
-
-  int groupNo = 0;
-  int groupPos = 0;
-  int nextSym = 0;
-  int runLength = 0;
-
-  while (1) {
+  // Huffman + RUNA/RUNB + MTF into tt, counting byte frequencies for the BWT
+  uint32_t unzftab[256] = { 0 };
+  BZ2Mtf mtf;
+  bz2_mtf_init(&mtf);
+  const int eob = nInUse + 1;
+  uint32_t nblock = 0;
+  int groupPos = 0, groupNo = -1;
+  const BZ2HuffmanTable* table = NULL;
+  uint32_t runLength = 0, runWeight = 1;
+
+  for (;;) {
     if (groupPos == 0) {
-      groupNo = selector[nextSym];
-      nextSym++;
-      groupPos = 50;
+      if (++groupNo >= nSelectors) return -1;
+      table = &tables[selector[groupNo]];
+      groupPos = BZ2_GROUP_SIZE;
     }
     groupPos--;
 
-    int gSel = groupNo;
-    int zn = minLens[gSel];
-    int zvec = bz2_read_bits(bs, zn);
+    if (bs->bits_in_buffer < BZ2_MAX_CODE_LEN && !bz2_refill(bs)) return -1;
+    int sym = bz2_decode_symbol(table, bs);
+    if (sym < 0) return -1;
 
-    while (zvec > limit[gSel][zn]) {
-      if (zn > 20) {
-        free(blockData);
-        return -1;
-      }
-      zn++;
-      int bit = bz2_read_bit(bs);
-      if (bit < 0) {
-        free(blockData);
-        return -1;
-      }
-      zvec = (zvec << 1) | bit;
+    if (sym <= BZ2_RUNB) {
+      if (runWeight >= 2 * 1024 * 1024) return -1;
+      runLength += (uint32_t)(sym + 1) * runWeight;
+      runWeight <<= 1;
+      continue;
     }
 
-    int sym = perm[gSel][zvec - base[gSel][zn]];
-
-    if (sym == alphaSize - 1) break; // EOB
-
-    if (sym == 0 || sym == 1) { // RUNA or RUNB
-      if (runLength == 0) runLength = 1;
-      runLength += (sym + 1) << (runLength == 1 ? 0 : bz2_count_trailing_zeros(runLength));
+    if (runWeight > 1) {
+      uint8_t uc = seqToUnseq[bz2_mtf_front(&mtf)];
+      if (runLength > max_block - nblock) return -1;
+      unzftab[uc] += runLength;
+      for (uint32_t end = nblock + runLength; nblock < end; nblock++) tt[nblock] = uc;
+      runLength = 0;
+      runWeight = 1;
     }
-    else {
-      if (runLength > 0) {
-        uint8_t ch = seqToUnseq[0];
-        for (int i = 0; i < runLength; i++) {
-          if (blockSize >= 900000) {
-            free(blockData);
-            return -1;
-          }
-          blockData[blockSize++] = ch;
-        }
-        runLength = 0;
-      }
 
-      if (blockSize >= 900000) {
-        free(blockData);
-        return -1;
-      }
-      blockData[blockSize++] = seqToUnseq[sym - 1];
-    }
-  }
+    if (sym == eob) break;
 
-  // Handle final run
-  if (runLength > 0) {
-    uint8_t ch = seqToUnseq[0];
-    for (int i = 0; i < runLength; i++) {
-      if (blockSize >= 900000) {
-        free(blockData);
-        return -1;
-      }
-      blockData[blockSize++] = ch;
-    }
+    if (nblock >= max_block) return -1;
+    uint8_t uc = seqToUnseq[bz2_mtf_move(&mtf, sym - 1)];
+    unzftab[uc]++;
+    tt[nblock++] = uc;
   }
 
-  // Inverse MTF
-  bz2_inverse_mtf(blockData, blockSize);
+  if (origPtr >= nblock) return -1;
 
-  // Inverse BWT
-  int* tt = (int*)malloc(blockSize * sizeof(int));
-  if (!tt) {
-    free(blockData);
-    return -1;
+  // Inverse BWT: link each position to its successor in the high 24 bits.
+  uint32_t cftab[256];
+  uint32_t sum = 0;
+  for (int i = 0; i < 256; i++) {
+    cftab[i] = sum;
+    sum += unzftab[i];
+  }
+  for (uint32_t i = 0; i < nblock; i++) {
+    uint8_t uc = (uint8_t)(tt[i] & 0xFF);
+    tt[cftab[uc]++] |= i << 8;
   }
-  bz2_inverse_bwt(blockData, tt, origPtr, blockSize);
-  free(tt);
 
-  // Add to output
-  for (int i = 0; i < blockSize; i++) {
-    if (!bz2_bytevector_push(output, blockData[i])) {
-      free(blockData);
-      return -1;
+  // Walk the chain and undo the initial run-length stage: after four equal
+  // bytes the next byte is a repeat count for that byte.
+  if (!bz2_bytevector_reserve(output, nblock)) return -1;
+  const size_t block_start = output->length;
+  uint32_t tPos = tt[origPtr] >> 8;
+  int last = -1, run = 0;
+  for (uint32_t i = 0; i < nblock; i++) {
+    uint32_t e = tt[tPos];
+    uint8_t b = (uint8_t)(e & 0xFF);
+    tPos = e >> 8;
+    if (run == 4) {
+      if (b) {
+        if (!bz2_bytevector_reserve(output, (size_t)b + (nblock - i))) return -1;
+        memset(output->data + output->length, last, b);
+        output->length += b;
+      }
+      run = 0;
+      continue;
+    }
+    if (b == last) run++;
+    else {
+      last = b;
+      run = 1;
     }
+    output->data[output->length++] = b;
   }
 
-  free(blockData);
+  uint32_t crc = CRC_GET_DIGEST(Bz2CrcUpdate(CRC_INIT_VAL, output->data + block_start, output->length - block_start));
+  if (crc != stored_crc) return -1;
+  *block_crc = crc;
   return 0;
 }
 
@@ -391,25 +447,206 @@ static int bzip2_decompress(const uint8_t* input, size_t input_size, BZ2ByteVect
   int blockSize100k = input[3] - '0';
   if (blockSize100k < 1 || blockSize100k > 9) return -1;
 
+  const uint32_t max_block = (uint32_t)blockSize100k * 100000;
+  uint32_t* tt = (uint32_t*)malloc(max_block * sizeof(uint32_t));
+  if (!tt) return -1;
+
   BZ2BitStream bs;
   bz2_bitstream_init(&bs, input + 4, input_size - 4);
+  uint32_t combined_crc = 0;
+  int result = -1;
 
-  // Decompress all blocks
   while (1) {
-    int result = bz2_decompress_block(&bs, output);
-    if (result < 0) {
-      // Check for stream end marker
-      int magic1 = bz2_read_bits(&bs, 24);
-      int magic2 = bz2_read_bits(&bs, 24);
-      if (magic1 == 0x177245 && magic2 == 0x385090) {
-        // Stream end marker found
-        return 0;
+    int64_t hi = bz2_read_bits(&bs, 24);
+    int64_t lo = bz2_read_bits(&bs, 24);
+    if (hi < 0 || lo < 0) break;
+    uint64_t magic = ((uint64_t)hi << 24) | (uint64_t)lo;
+
+    if (magic == BZ2_BLOCK_MAGIC) {
+      uint32_t block_crc = 0;
+      if (bz2_decompress_block(&bs, tt, max_block, output, &block_crc) < 0) break;
+      combined_crc = BZ2_CRC_COMBINE(combined_crc, block_crc);
+      continue;
+    }
+    if (magic == BZ2_END_MAGIC) {
+      int64_t stored = bz2_read_bits(&bs, 32);
+      if (stored >= 0 && (uint32_t)stored == combined_crc) result = 0;
+    }
+    break;
+  }
+
+  free(tt);
+  return result;
+}
+
+// Bits consumed from the start of the stream so far.
+static uint64_t bz2_bit_position(const BZ2BitStream* bs) {
+  return ((uint64_t)bs->byte_pos + bs->overrun) * 8 - bs->bits_in_buffer;
+}
+
+// Positions the reader `bit_pos` bits into `data`.
+static bool bz2_bitstream_seek(BZ2BitStream* bs, const uint8_t* data, size_t size, uint64_t bit_pos) {
+  if ((bit_pos >> 3) > size) return false;
+  bz2_bitstream_init(bs, data, size);
+  bs->byte_pos = (size_t)(bit_pos >> 3);
+  return (bit_pos & 7) == 0 || bz2_read_bits(bs, (unsigned)(bit_pos & 7)) >= 0;
+}
+
+#ifdef __cplusplus
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+ * Parallel decoding for multi-block streams. Blocks start at bit-aligned
+ * 48-bit magics, so a scan over every bit offset finds the candidates; each
+ * block is then decoded independently on a worker. A candidate is only
+ * trusted if the block before it ends exactly there, which rejects magics
+ * that happen to occur inside compressed data. Any doubt (no blocks, a
+ * mismatched boundary, a failed block) falls back to the serial decoder,
+ * which then reports the real error.
+ */
+struct BZ2BlockSpan {
+  uint64_t start;   // bit offset of the block magic, relative to input + 4
+  uint64_t end;     // bit offset just past the block, filled in by the decode
+  uint32_t crc;
+  BZ2ByteVector output;
+};
+
+// Collects block magics up to the first end-of-stream magic; returns its offset or -1.
+static int64_t bz2_scan_blocks(const uint8_t* data, size_t size, std::vector<BZ2BlockSpan>& blocks) {
+  // For every alignment the byte before the current one lies fully inside
+  // the magic, so it rules out almost all positions with one lookup.
+  bool inner_byte[256] = { false };
+  for (int shift = 0; shift < 8; shift++) {
+    inner_byte[(BZ2_BLOCK_MAGIC >> (8 - shift)) & 0xFF] = true;
+    inner_byte[(BZ2_END_MAGIC >> (8 - shift)) & 0xFF] = true;
+  }
+
+  uint64_t window = 0;
+  const uint64_t mask = (1ULL << 48) - 1;
+  for (size_t i = 0; i < size; i++) {
+    window = (window << 8) | data[i];
+    if (i == 0 || !inner_byte[data[i - 1]]) continue;
+    // Each shift is a 48-bit candidate ending `shift` bits before the end of
+    // the current byte.
+    for (int shift = 7; shift >= 0; shift--) {
+      if ((uint64_t)(i + 1) * 8 < (uint64_t)shift + 48) continue;
+      uint64_t candidate = (window >> shift) & mask;
+      if (candidate != BZ2_BLOCK_MAGIC && candidate != BZ2_END_MAGIC) continue;
+      uint64_t start = (uint64_t)(i + 1) * 8 - shift - 48;
+      if (candidate == BZ2_END_MAGIC) return (int64_t)start;
+      BZ2BlockSpan span = { start, 0, 0, { NULL, 0, 0, NULL, NULL } };
+      blocks.push_back(span);
+    }
+  }
+  return -1;
+}
+
+static int bzip2_decompress_parallel(const uint8_t* input, size_t input_size, BZ2ByteVector* output,
+  unsigned max_threads = 0) {
+  if (input_size < 10) return -1;
+  if (input[0] != 'B' || input[1] != 'Z' || input[2] != 'h') return -1;
+  int blockSize100k = input[3] - '0';
+  if (blockSize100k < 1 || blockSize100k > 9) return -1;
+  const uint32_t max_block = (uint32_t)blockSize100k * 100000;
+
+  const uint8_t* data = input + 4;
+  const size_t size = input_size - 4;
+  std::vector<BZ2BlockSpan> blocks;
+  int64_t end_pos = bz2_scan_blocks(data, size, blocks);
+
+  if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (end_pos < 0 || blocks.size() < 2 || blocks[0].start != 0 || max_threads < 2)
+    return bzip2_decompress(input, input_size, output);
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    uint32_t* tt = (uint32_t*)malloc(max_block * sizeof(uint32_t));
+    if (!tt) {
+      failed = true;
+      return;
+    }
+    for (size_t i = next++; i < blocks.size() && !failed; i = next++) {
+      BZ2BlockSpan& span = blocks[i];
+      BZ2BitStream bs;
+      if (!bz2_bitstream_seek(&bs, data, size, span.start + 48) ||
+        bz2_decompress_block(&bs, tt, max_block, &span.output, &span.crc) < 0) {
+        failed = true;
+        break;
       }
-      return -1;
+      span.end = bz2_bit_position(&bs);
     }
+    free(tt);
+  };
+
+  unsigned thread_count = (unsigned)std::min<size_t>(max_threads, blocks.size());
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  try {
+    for (unsigned t = 1; t < thread_count; t++) threads.emplace_back(worker);
+  }
+  catch (...) {
+    // Could not start more threads; the ones we have still drain the queue.
+  }
+  worker();
+  for (auto& t : threads) t.join();
+
+  uint32_t combined_crc = 0;
+  size_t total = 0;
+  bool ok = !failed;
+  for (size_t i = 0; ok && i < blocks.size(); i++) {
+    uint64_t expected_end = i + 1 < blocks.size() ? blocks[i + 1].start : (uint64_t)end_pos;
+    if (blocks[i].end != expected_end) ok = false;
+    combined_crc = BZ2_CRC_COMBINE(combined_crc, blocks[i].crc);
+    total += blocks[i].output.length;
   }
 
-  return 0;
+  BZ2BitStream bs;
+  if (ok) {
+    int64_t stored = -1;
+    if (bz2_bitstream_seek(&bs, data, size, (uint64_t)end_pos + 48)) stored = bz2_read_bits(&bs, 32);
+    ok = stored >= 0 && (uint32_t)stored == combined_crc && bz2_bytevector_reserve(output, total);
+  }
+  if (ok) {
+    for (auto& span : blocks) {
+      if (span.output.length) memcpy(output->data + output->length, span.output.data, span.output.length);
+      output->length += span.output.length;
+    }
+  }
+  for (auto& span : blocks) free(span.output.data);
+
+  return ok ? 0 : bzip2_decompress(input, input_size, output);
 }
 
-#endif /* BZIP2_DECODER_H */
\ No newline at end of file
+/*
+ * Decodes straight into a std::vector of char or uint8_t, which the decoder
+ * grows as it goes, so the result needs no copy out of a malloc'd buffer.
+ * The container is left empty on failure.
+ */
+template <class Container>
+static int bzip2_decompress_into(const uint8_t* input, size_t input_size, Container& out,
+  unsigned max_threads = 0) {
+  out.clear();
+  BZ2ByteVector output = { NULL, 0, 0, NULL, &out };
+  output.grow = [](void* owner, size_t new_cap) -> uint8_t* {
+    Container& buffer = *static_cast<Container*>(owner);
+    try {
+      buffer.resize(new_cap);
+    }
+    catch (...) {
+      return NULL;
+    }
+    return reinterpret_cast<uint8_t*>(buffer.data());
+  };
+  int result = bzip2_decompress_parallel(input, input_size, &output, max_threads);
+  out.resize(result < 0 ? 0 : output.length);
+  return result;
+}
+
+#endif
+
+#endif /* BZIP2_DECODER_H */
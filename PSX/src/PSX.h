@@ -286,6 +286,17 @@ HRESULT PSXHandler::Open(IInStream* stream, const uint64_t* fileSize, IArchiveOp
     swprintf_s(debugMsg, L"PS4 PKG: ParseFileTable returned %zu items", ps4Items.size());
     logDebug(debugMsg);
 
+    // Files inside pfs_image.dat; a PFS image that cannot be walked still
+    // leaves the table entries above
+    hr = ps4Handler.ParsePFS(stream, ps4Items);
+    if (FAILED(hr)) {
+      swprintf_s(debugMsg, L"PS4 PKG: ParsePFS failed with error 0x%08X", hr);
+      logDebug(debugMsg);
+    }
+    else if (hr == S_FALSE) {
+      logDebug(L"PS4 PKG: PFS image is not browsable, listing table entries only");
+    }
+
     items.reserve(ps4Items.size());
 
     for (const auto& src : ps4Items) {
@@ -462,9 +473,8 @@ HRESULT PSXHandler::ExtractFile(size_t index, ISequentialOutStream* outStream, I
     ps4Item.fileTime1 = item.fileTime1;
     ps4Item.fileTime2 = item.fileTime2;
     ps4Item.fileTime3 = item.fileTime3;
-	
 
-    hr = ps4Handler.ExtractFileData(m_stream, ps4Item);
+    hr = ps4Handler.ExtractFileToStream(m_stream, ps4Item, outStream);
     break;
   }
 
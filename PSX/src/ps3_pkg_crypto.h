@@ -2,9 +2,14 @@
 #include <cstdint>
 #include <cstring>
 #include <vector>
+#include <thread>
+#include <algorithm>
 #include <windows.h>
 #include <wincrypt.h>
 
+#include "Aes128.h"
+#include "sha.h"
+
 // PS3 PKG Cryptography - WITH TYPE 0x0001 AUTO-DETECTION AND CMAC
 
 namespace PS3Crypto {
@@ -25,96 +30,191 @@ namespace PS3Crypto {
 			 0x6C, 0xC6, 0x08, 0xD4, 0x6C, 0x84, 0xCE, 0x96,
 			 0x7C, 0xDD, 0x83, 0xC1, 0xA6, 0xBB, 0x43, 0x69
 	};
-	// AES S-box
-	static const uint8_t AES_SBOX[256] = {
-		0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
-		0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
-		0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
-		0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
-		0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
-		0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
-		0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
-		0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
-		0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
-		0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
-		0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
-		0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
-		0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
-		0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
-		0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
-		0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
-	};
+	// AES-128 encryption over the shared kernel, which uses AES-NI when the
+	// CPU has it and T-tables otherwise
+	class AES128 {
+	private:
+		CAes128 ctx;
+
+	public:
+		AES128(const uint8_t* key) { Aes128_SetKey(&ctx, key); }
+
+		void EncryptBlock(uint8_t* block) const { Aes128_Encrypt(&ctx, block, 1); }
+
+		// Encrypts `count` consecutive 16-byte blocks in place
+		void EncryptBlocks(uint8_t* blocks, size_t count) const { Aes128_Encrypt(&ctx, blocks, count); }
 
-	static const uint8_t AES_RCON[11] = {
-		0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+		// XORs the CTR keystream of counters iv + blockIndex onwards into
+		// `count` 16-byte blocks
+		void CtrBlocks(const uint8_t* iv, uint64_t blockIndex, uint8_t* blocks, size_t count) const {
+			Aes128_Ctr(&ctx, iv, blockIndex, blocks, count);
+		}
 	};
 
-	static uint8_t gmul(uint8_t a, uint8_t b) {
-		uint8_t p = 0;
-		for (int i = 0; i < 8; i++) {
-			if (b & 1) p ^= a;
-			bool hi_bit_set = (a & 0x80);
-			a <<= 1;
-			if (hi_bit_set) a ^= 0x1B;
-			b >>= 1;
+	// Runs range(data, size, offset) over a counter-mode buffer, split across
+	// hardware threads when each gets at least minBytesPerThread. Slices end
+	// on 16-byte block boundaries of the stream.
+	template <typename RangeFn>
+	inline void ProcessInSlices(uint8_t* data, size_t size, uint64_t offset, size_t minBytesPerThread, RangeFn range) {
+		size_t workers = std::min<size_t>(std::thread::hardware_concurrency(), size / minBytesPerThread);
+		if (workers < 2) {
+			range(data, size, offset);
+			return;
 		}
-		return p;
+
+		size_t slice = (size / workers + 15) & ~static_cast<size_t>(15);
+		std::vector<std::thread> threads;
+		size_t start = 0;
+		while (size - start > slice) {
+			size_t end = static_cast<size_t>(((offset + start + slice) & ~static_cast<uint64_t>(15)) - offset);
+			try {
+				threads.emplace_back(range, data + start, end - start, offset + start);
+			}
+			catch (...) {
+				// Could not start another thread; the rest runs here
+				break;
+			}
+			start = end;
+		}
+		range(data + start, size - start, offset + start);
+		for (auto& t : threads) t.join();
 	}
 
-	class AES128 {
+	// AES-128 in CTR mode over a 128-bit big-endian counter. The counter of
+	// block n is IV + n, computed directly, so decrypting deep inside a
+	// package costs the same as at its start. Large buffers are split across
+	// threads since CTR blocks are independent.
+	class AES128CTR {
+	public:
+		AES128CTR(const uint8_t* key, const uint8_t* iv) : aes(key) {
+			memcpy(this->iv, iv, 16);
+		}
+
+		// XORs the keystream into data, which starts `offset` bytes into the
+		// encrypted stream (any alignment)
+		void Process(uint8_t* data, size_t size, uint64_t offset) const {
+			ProcessInSlices(data, size, offset, MIN_BYTES_PER_THREAD,
+				[this](uint8_t* d, size_t n, uint64_t o) { ProcessRange(d, n, o); });
+		}
+
 	private:
-		uint8_t roundKeys[11][16];
+		static const size_t MIN_BYTES_PER_THREAD = 512 * 1024;
+
+		AES128 aes;
+		uint8_t iv[16];
+
+		// Whole blocks are decrypted in place; a partial block at either end
+		// goes through a scratch block of keystream
+		void ProcessRange(uint8_t* data, size_t size, uint64_t offset) const {
+			uint64_t block = offset / 16;
+			size_t skip = static_cast<size_t>(offset % 16);
+
+			if (skip != 0) {
+				size_t n = std::min<size_t>(16 - skip, size);
+				XorPartialBlock(data, n, block, skip);
+				data += n;
+				size -= n;
+				block++;
+			}
+
+			size_t blocks = size / 16;
+			aes.CtrBlocks(iv, block, data, blocks);
 
-		void SubBytes(uint8_t* state) {
-			for (int i = 0; i < 16; i++) state[i] = AES_SBOX[state[i]];
+			if (size % 16 != 0)
+				XorPartialBlock(data + blocks * 16, size % 16, block + blocks, 0);
 		}
 
-		void ShiftRows(uint8_t* state) {
-			uint8_t temp;
-			temp = state[1]; state[1] = state[5]; state[5] = state[9]; state[9] = state[13]; state[13] = temp;
-			temp = state[2]; state[2] = state[10]; state[10] = temp;
-			temp = state[6]; state[6] = state[14]; state[14] = temp;
-			temp = state[3]; state[3] = state[15]; state[15] = state[11]; state[11] = state[7]; state[7] = temp;
+		void XorPartialBlock(uint8_t* data, size_t size, uint64_t block, size_t skip) const {
+			uint8_t keystream[16] = { 0 };
+			aes.CtrBlocks(iv, block, keystream, 1);
+			for (size_t i = 0; i < size; i++) data[i] ^= keystream[skip + i];
 		}
+	};
 
-		void MixColumns(uint8_t* state) {
-			for (int i = 0; i < 4; i++) {
-				uint8_t* col = state + (i * 4);
-				uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
-				col[0] = gmul(a0, 2) ^ gmul(a1, 3) ^ a2 ^ a3;
-				col[1] = a0 ^ gmul(a1, 2) ^ gmul(a2, 3) ^ a3;
-				col[2] = a0 ^ a1 ^ gmul(a2, 2) ^ gmul(a3, 3);
-				col[3] = gmul(a0, 3) ^ a1 ^ a2 ^ gmul(a3, 2);
-			}
+	// Keystream of type 1 (homebrew/debug) packages. Block n is the first 16
+	// bytes of SHA-1 over a 64-byte key built from the QA digest, with n added
+	// to its big-endian value, so the key for any block is computed directly.
+	// The key is one SHA-1 block plus a fixed padding block; SHA1::LANES
+	// counters are hashed per call.
+	class SHA1CTR {
+	public:
+		SHA1CTR(const uint8_t* qa_digest) {
+			memset(key, 0, 64);
+			memcpy(key + 0, qa_digest + 0, 8);
+			memcpy(key + 8, qa_digest + 0, 8);
+			memcpy(key + 16, qa_digest + 8, 8);
+			memcpy(key + 24, qa_digest + 8, 8);
 		}
 
-		void AddRoundKey(uint8_t* state, int round) {
-			for (int i = 0; i < 16; i++) state[i] ^= roundKeys[round][i];
+		// XORs the keystream into data, which starts `offset` bytes into the
+		// encrypted stream (any alignment)
+		void Process(uint8_t* data, size_t size, uint64_t offset) const {
+			ProcessInSlices(data, size, offset, MIN_BYTES_PER_THREAD,
+				[this](uint8_t* d, size_t n, uint64_t o) { ProcessRange(d, n, o); });
 		}
 
-		void KeyExpansion(const uint8_t* key) {
-			memcpy(roundKeys[0], key, 16);
-			for (int i = 1; i <= 10; i++) {
-				uint8_t temp[4];
-				memcpy(temp, &roundKeys[i - 1][12], 4);
-				uint8_t k = temp[0];
-				temp[0] = temp[1]; temp[1] = temp[2]; temp[2] = temp[3]; temp[3] = k;
-				for (int j = 0; j < 4; j++) temp[j] = AES_SBOX[temp[j]];
-				temp[0] ^= AES_RCON[i];
-				for (int j = 0; j < 4; j++) roundKeys[i][j] = roundKeys[i - 1][j] ^ temp[j];
-				for (int j = 4; j < 16; j++) roundKeys[i][j] = roundKeys[i - 1][j] ^ roundKeys[i][j - 4];
+	private:
+		static const size_t KEYSTREAM_BYTES = SHA1::LANES * 16;
+		static const size_t MIN_BYTES_PER_THREAD = 128 * 1024;
+
+		uint8_t key[64];
+
+		// key + n as 64-byte big-endian numbers
+		void CounterKey(uint64_t n, uint8_t* out) const {
+			memcpy(out, key, 64);
+			for (int i = 63; i >= 0 && n != 0; i--) {
+				uint64_t v = out[i] + (n & 0xFF);
+				out[i] = static_cast<uint8_t>(v);
+				n = (n >> 8) + (v >> 8);
 			}
 		}
 
-	public:
-		AES128(const uint8_t* key) { KeyExpansion(key); }
+		// Keystream of blocks [block, block + SHA1::LANES)
+		void KeystreamBlocks(uint64_t block, uint8_t* out) const {
+			uint8_t keys[SHA1::LANES][64];
+			const uint8_t* blocks[SHA1::LANES];
+			uint32_t lanes[5][SHA1::LANES];
+			uint32_t init[5];
+			SHA1::initState(init);
+			for (size_t lane = 0; lane < SHA1::LANES; lane++) {
+				CounterKey(block + lane, keys[lane]);
+				blocks[lane] = keys[lane];
+				for (int i = 0; i < 5; i++) lanes[i][lane] = init[i];
+			}
+			SHA1::compressLanes(lanes, blocks);
+
+			// Every message is exactly 64 bytes long, so they share the padding block
+			uint8_t padding[64] = { 0x80 };
+			padding[62] = 0x02;
+			for (size_t lane = 0; lane < SHA1::LANES; lane++) blocks[lane] = padding;
+			SHA1::compressLanes(lanes, blocks);
+
+			for (size_t lane = 0; lane < SHA1::LANES; lane++) {
+				for (int i = 0; i < 4; i++) {
+					uint32_t v = lanes[i][lane];
+					uint8_t* p = out + lane * 16 + i * 4;
+					p[0] = static_cast<uint8_t>(v >> 24);
+					p[1] = static_cast<uint8_t>(v >> 16);
+					p[2] = static_cast<uint8_t>(v >> 8);
+					p[3] = static_cast<uint8_t>(v);
+				}
+			}
+		}
 
-		void EncryptBlock(uint8_t* block) {
-			AddRoundKey(block, 0);
-			for (int round = 1; round < 10; round++) {
-				SubBytes(block); ShiftRows(block); MixColumns(block); AddRoundKey(block, round);
+		void ProcessRange(uint8_t* data, size_t size, uint64_t offset) const {
+			uint8_t keystream[KEYSTREAM_BYTES];
+			uint64_t block = offset / 16;
+			size_t skip = static_cast<size_t>(offset % 16);
+
+			size_t done = 0;
+			while (done < size) {
+				KeystreamBlocks(block, keystream);
+				size_t n = std::min<size_t>(KEYSTREAM_BYTES - skip, size - done);
+				for (size_t j = 0; j < n; j++) data[done + j] ^= keystream[skip + j];
+				done += n;
+				block += SHA1::LANES;
+				skip = 0;
 			}
-			SubBytes(block); ShiftRows(block); AddRoundKey(block, 10);
 		}
 	};
 
@@ -287,24 +387,6 @@ namespace PS3Crypto {
 		cmac.ComputeMAC(data, length, output);
 	}
 
-	// Increment key array
-	inline bool IncrementArray(uint8_t* key, int keySize, int position = -1) {
-		if (position < 0) position = keySize - 1;
-
-		if (key[position] == 0xFF) {
-			if (position != 0) {
-				if (IncrementArray(key, keySize, position - 1)) {
-					key[position] = 0x00;
-					return true;
-				}
-				return false;
-			}
-			return false;
-		}
-		key[position] += 0x01;
-		return true;
-	}
-
 	// Test if data decrypts correctly with AES
 	inline bool TestAESDecryption(const uint8_t* data, size_t size, const uint8_t* pkg_data_riv, const uint8_t* aesKey) {
 		if (size < 32) return false;
@@ -312,22 +394,8 @@ namespace PS3Crypto {
 		// Make a copy to test
 		std::vector<uint8_t> testBuf(data, data + 32);
 
-		AES128 aes(aesKey);
-		uint8_t pkgKey[16];
-		memcpy(pkgKey, pkg_data_riv, 16);
-
 		// Decrypt first two blocks
-		for (size_t offset = 0; offset < 32; offset += 16) {
-			uint8_t xorKey[16];
-			memcpy(xorKey, pkgKey, 16);
-			aes.EncryptBlock(xorKey);
-
-			for (size_t j = 0; j < 16; j++) {
-				testBuf[offset + j] ^= xorKey[j];
-			}
-
-			IncrementArray(pkgKey, 16);
-		}
+		AES128CTR(aesKey, pkg_data_riv).Process(testBuf.data(), 32, 0);
 
 		// Check if result looks valid
 		uint64_t tableSize1 = ((uint64_t)testBuf[8] << 56) | ((uint64_t)testBuf[9] << 48) |
@@ -391,54 +459,12 @@ namespace PS3Crypto {
 		}
 
 		if (useSHA1) {
-			uint8_t key[64];
-			memset(key, 0, 64);
-			memcpy(key + 0, keySource + 0, 8);
-			memcpy(key + 8, keySource + 0, 8);
-			memcpy(key + 16, keySource + 8, 8);
-			memcpy(key + 24, keySource + 8, 8);
-
-			uint64_t startBlock = relativeOffset / 16;
-			for (uint64_t i = 0; i < startBlock; i++) {
-				IncrementArray(key, 64);
-			}
-
-			FastSHA1 sha;
-			for (size_t offset = 0; offset < size; offset += 16) {
-				uint8_t hash[20];
-				sha.Hash(key, 64, hash);
-
-				size_t blockSize = (size - offset < 16) ? (size - offset) : 16;
-				for (size_t j = 0; j < blockSize; j++) {
-					data[offset + j] ^= hash[j];
-				}
-
-				IncrementArray(key, 64);
-			}
+			SHA1CTR ctr(keySource);
+			ctr.Process(data, size, relativeOffset);
 		}
 		else if (useAES) {
-			AES128 aes(aesKey);
-
-			uint8_t pkgKey[16];
-			memcpy(pkgKey, keySource, 16);
-
-			uint64_t startBlock = relativeOffset / 16;
-			for (uint64_t i = 0; i < startBlock; i++) {
-				IncrementArray(pkgKey, 16);
-			}
-
-			for (size_t offset = 0; offset < size; offset += 16) {
-				uint8_t xorKey[16];
-				memcpy(xorKey, pkgKey, 16);
-				aes.EncryptBlock(xorKey);
-
-				size_t blockSize = (size - offset < 16) ? (size - offset) : 16;
-				for (size_t j = 0; j < blockSize; j++) {
-					data[offset + j] ^= xorKey[j];
-				}
-
-				IncrementArray(pkgKey, 16);
-			}
+			AES128CTR ctr(aesKey, keySource);
+			ctr.Process(data, size, relativeOffset);
 		}
 	}
 
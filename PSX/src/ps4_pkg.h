@@ -5,6 +5,10 @@
 #include <algorithm>
 #include <string>
 
+#include "Alloc.h"
+#include "StreamUtils.h"
+#include "log.h"
+
 // ---------------------------------------------------------------------
 // PS4 PKG constants
 // ---------------------------------------------------------------------
@@ -22,6 +26,31 @@ enum PS4_PKG_ENTRY_TYPES {
   PS4_PKG_ENTRY_TYPE_FILE2 = 0x1200
 };
 
+// ---------------------------------------------------------------------
+// PFS image (pfs_image.dat) constants
+// ---------------------------------------------------------------------
+#define PFS_MAGIC_PS4 20130315
+
+#define PFS_MODE_SIGNED    0x0001
+#define PFS_MODE_64BIT     0x0002
+#define PFS_MODE_ENCRYPTED 0x0004
+
+#define PFS_INODE_SIZE_D32 0xA8     // 12 direct + 5 indirect 32-bit block numbers
+#define PFS_INODE_SIZE_S32 0x2C8    // same, each preceded by a 32-byte signature
+#define PFS_INODE_BLOCKS_OFFSET 0x64
+#define PFS_INODE_FLAG_COMPRESSED 0x0001
+#define PFS_INODE_MODE_DIR 0x4000
+
+#define PFS_MAX_TABLE_SIZE (64u << 20)
+#define PFS_MAX_DIR_SIZE (16u << 20)
+
+enum PFS_DIRENT_TYPES {
+  PFS_DIRENT_FILE = 2,
+  PFS_DIRENT_DIR = 3,
+  PFS_DIRENT_DOT = 4,
+  PFS_DIRENT_DOTDOT = 5
+};
+
 // ---------------------------------------------------------------------
 // PS4 PKG header (packed)
 // ---------------------------------------------------------------------
@@ -89,8 +118,86 @@ struct PKG_TABLE_ENTRY_PS4 {
   uint32_t unk2;
   uint32_t unk3;
 };
+
+// PFS structures are little-endian, unlike the PKG container
+struct PFS_HEADER_PS4 {
+  int64_t  version;                        // 0x00
+  int64_t  magic;                          // 0x08
+  int64_t  id;                             // 0x10
+  uint8_t  fmode;                          // 0x18
+  uint8_t  clean;                          // 0x19
+  uint8_t  read_only;                      // 0x1A
+  uint8_t  rsv;                            // 0x1B
+  uint16_t mode;                           // 0x1C
+  uint16_t unk_0x1E;                       // 0x1E
+  uint32_t block_size;                     // 0x20
+  uint32_t n_backup;                       // 0x24
+  int64_t  n_block;                        // 0x28
+  int64_t  dinode_count;                   // 0x30
+  int64_t  nd_block;                       // 0x38
+  int64_t  dinode_block_count;             // 0x40
+  int64_t  superroot_ino;                  // 0x48
+};
+
+// Common head of the D32 and S32 inodes; block pointers follow at 0x64
+struct PFS_INODE_PS4 {
+  uint16_t mode;                           // 0x00
+  uint16_t nlink;                          // 0x02
+  uint32_t flags;                          // 0x04
+  int64_t  size;                           // 0x08
+  int64_t  size_compressed;                // 0x10
+  int64_t  atime;                          // 0x18
+  int64_t  mtime;                          // 0x20
+  int64_t  ctime;                          // 0x28
+  int64_t  birthtime;                      // 0x30
+  uint32_t time_nsec[4];                   // 0x38
+  uint32_t uid;                            // 0x48
+  uint32_t gid;                            // 0x4C
+  uint64_t unk_0x50;                       // 0x50
+  uint64_t unk_0x58;                       // 0x58
+  uint32_t blocks;                         // 0x60
+};
+
+struct PFS_DIRENT_PS4 {
+  uint32_t ino;
+  uint32_t type;
+  uint32_t namelen;
+  uint32_t entsize;                        // name follows, padded to entsize
+};
 #pragma pack(pop)
 
+// ---------------------------------------------------------------------
+// Page-aligned copy buffer. It is allocated on first use and kept until
+// the handler goes away, so extracting any number of entries of any size
+// costs one allocation.
+// ---------------------------------------------------------------------
+class PS4CopyBuffer {
+public:
+  static const size_t kSize = (size_t)4 << 20;
+
+  PS4CopyBuffer() = default;
+  PS4CopyBuffer(const PS4CopyBuffer&) = delete;
+  PS4CopyBuffer& operator=(const PS4CopyBuffer&) = delete;
+  PS4CopyBuffer(PS4CopyBuffer&& other) noexcept : data(other.data) { other.data = nullptr; }
+  PS4CopyBuffer& operator=(PS4CopyBuffer&& other) noexcept {
+    if (this != &other) {
+      MidFree(data);
+      data = other.data;
+      other.data = nullptr;
+    }
+    return *this;
+  }
+  ~PS4CopyBuffer() { MidFree(data); }
+
+  Byte* Get() {
+    if (!data) data = (Byte*)MidAlloc(kSize);
+    return data;
+  }
+
+private:
+  Byte* data = nullptr;
+};
+
 // ---------------------------------------------------------------------
 // PS4 PKG Handler Class
 // ---------------------------------------------------------------------
@@ -98,6 +205,7 @@ class PS4PKGHandler {
 private:
   PKG_HEADER_PS4 header = {};
   PKG_CONTENT_HEADER_PS4 contentHeader = {};
+  PS4CopyBuffer copyBuffer;
 
   uint32_t SwapEndian32(uint32_t v) { return _byteswap_ulong(v); }
   uint64_t SwapEndian64(uint64_t v) { return _byteswap_uint64(v); }
@@ -129,6 +237,79 @@ private:
     }
   }
 
+  // Geometry of a plain PFS image, and its inode table read whole
+  struct PfsImage {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint32_t blockSize = 0;
+    uint32_t inodeSize = 0;
+    uint32_t inodesPerBlock = 0;
+    uint32_t firstBlockOffset = 0;           // of db[0] within an inode
+    uint64_t inodeCount = 0;
+    std::vector<uint8_t> inodeTable;
+  };
+
+  static HRESULT ReadAt(IInStream* stream, uint64_t offset, void* data, size_t size) {
+    RINOK(stream->Seek(offset, STREAM_SEEK_SET, nullptr));
+    size_t processed = size;
+    RINOK(ReadStream(stream, data, &processed));
+    return processed == size ? S_OK : E_FAIL;
+  }
+
+  static bool GetInode(const PfsImage& pfs, uint64_t ino, PFS_INODE_PS4& inode, uint32_t& firstBlock) {
+    if (ino >= pfs.inodeCount) return false;
+    const uint8_t* p = pfs.inodeTable.data() +
+      (ino / pfs.inodesPerBlock) * pfs.blockSize + (ino % pfs.inodesPerBlock) * pfs.inodeSize;
+    memcpy(&inode, p, sizeof(inode));
+    memcpy(&firstBlock, p + pfs.firstBlockOffset, 4);
+    return true;
+  }
+
+  // Image-relative extent of an inode's data. Package images are laid out
+  // with every file in consecutive blocks starting at db[0], so the extent
+  // is all that is needed to read a file.
+  static bool GetExtent(const PfsImage& pfs, const PFS_INODE_PS4& inode, uint32_t firstBlock, uint64_t& offset) {
+    if (inode.size < 0) return false;
+    offset = (uint64_t)firstBlock * pfs.blockSize;
+    return offset <= pfs.size && (uint64_t)inode.size <= pfs.size - offset;
+  }
+
+  // Calls onEntry(name, ino, isDir) for each dirent of a directory inode
+  template <typename OnEntry>
+  static HRESULT ReadDirectory(IInStream* stream, const PfsImage& pfs, uint64_t ino, OnEntry onEntry) {
+    PFS_INODE_PS4 inode;
+    uint32_t firstBlock = 0;
+    uint64_t offset = 0;
+    if (!GetInode(pfs, ino, inode, firstBlock) || !GetExtent(pfs, inode, firstBlock, offset) ||
+      (uint64_t)inode.size > PFS_MAX_DIR_SIZE) {
+      return S_FALSE;
+    }
+
+    std::vector<uint8_t> data((size_t)inode.size);
+    if (!data.empty()) {
+      RINOK(ReadAt(stream, pfs.offset + offset, data.data(), data.size()));
+    }
+
+    // Dirents do not cross block boundaries; a zero entsize ends a block
+    for (size_t blockStart = 0; blockStart < data.size(); blockStart += pfs.blockSize) {
+      size_t blockEnd = std::min(data.size(), blockStart + pfs.blockSize);
+      size_t pos = blockStart;
+      while (pos + sizeof(PFS_DIRENT_PS4) <= blockEnd) {
+        PFS_DIRENT_PS4 dirent;
+        memcpy(&dirent, data.data() + pos, sizeof(dirent));
+        if (dirent.entsize == 0) break;
+        if (dirent.entsize < sizeof(dirent) + dirent.namelen || dirent.entsize > blockEnd - pos) return S_FALSE;
+
+        if (dirent.type == PFS_DIRENT_FILE || dirent.type == PFS_DIRENT_DIR) {
+          std::string name(reinterpret_cast<const char*>(data.data() + pos + sizeof(dirent)), dirent.namelen);
+          onEntry(name, dirent.ino, dirent.type == PFS_DIRENT_DIR);
+        }
+        pos += dirent.entsize;
+      }
+    }
+    return S_OK;
+  }
+
 public:
   struct FileInfo {
     uint64_t  offset = 0;
@@ -136,7 +317,6 @@ public:
     uint32_t  flags = 0;
     uint32_t  type = 0;
     std::string path;
-    std::vector<uint8_t> fileData;
     bool      isFolder = false;
     int64_t   fileTime1 = 0;
     int64_t   fileTime2 = 0;
@@ -357,14 +537,130 @@ public:
     return S_OK;
   }
 
-  HRESULT ExtractFileData(IInStream* stream, FileInfo& fi) {
+  // Lists the files inside the PFS image as items under "pfs_image/", with
+  // absolute offsets so they extract like table entries. Only plain images
+  // (fake packages without PFS encryption) can be walked; for anything else
+  // this returns S_FALSE and leaves items alone.
+  HRESULT ParsePFS(IInStream* stream, std::vector<FileInfo>& items) {
+    PfsImage pfs;
+    pfs.offset = ((uint64_t)contentHeader.unk_0x410 << 32) | contentHeader.content_offset;
+    pfs.size = ((uint64_t)contentHeader.unk_0x418 << 32) | contentHeader.content_size;
+    if (pfs.offset == 0 || pfs.size < sizeof(PFS_HEADER_PS4)) return S_FALSE;
+
+    PFS_HEADER_PS4 ph = {};
+    RINOK(ReadAt(stream, pfs.offset, &ph, sizeof(ph)));
+    if (ph.version != 1 || ph.magic != PFS_MAGIC_PS4) return S_FALSE;
+    if (ph.mode & (PFS_MODE_ENCRYPTED | PFS_MODE_64BIT)) {
+      logDebug(L"PS4 PKG: PFS image mode 0x%04X is not browsable", ph.mode);
+      return S_FALSE;
+    }
+
+    pfs.blockSize = ph.block_size;
+    pfs.inodeSize = (ph.mode & PFS_MODE_SIGNED) ? PFS_INODE_SIZE_S32 : PFS_INODE_SIZE_D32;
+    pfs.firstBlockOffset = PFS_INODE_BLOCKS_OFFSET + ((ph.mode & PFS_MODE_SIGNED) ? 32 : 0);
+    if (pfs.blockSize < 0x1000 || pfs.blockSize > 0x100000 || (pfs.blockSize & (pfs.blockSize - 1)) != 0)
+      return S_FALSE;
+    pfs.inodesPerBlock = pfs.blockSize / pfs.inodeSize;
+
+    // The inode table starts at block 1
+    uint64_t tableSize = (uint64_t)ph.dinode_block_count * pfs.blockSize;
+    if (ph.dinode_count <= 0 || ph.dinode_block_count <= 0 || tableSize > PFS_MAX_TABLE_SIZE ||
+      (uint64_t)ph.dinode_count > (uint64_t)ph.dinode_block_count * pfs.inodesPerBlock ||
+      pfs.blockSize + tableSize > pfs.size) {
+      return S_FALSE;
+    }
+    pfs.inodeCount = (uint64_t)ph.dinode_count;
+    pfs.inodeTable.resize((size_t)tableSize);
+    RINOK(ReadAt(stream, pfs.offset + pfs.blockSize, pfs.inodeTable.data(), pfs.inodeTable.size()));
+
+    // The superroot holds flat_path_table and uroot, the package's root
+    uint64_t rootIno = (uint64_t)ph.superroot_ino;
+    bool haveUroot = false;
+    HRESULT hr = ReadDirectory(stream, pfs, (uint64_t)ph.superroot_ino,
+      [&](const std::string& name, uint64_t ino, bool isDir) {
+        if (isDir && name == "uroot") {
+          rootIno = ino;
+          haveUroot = true;
+        }
+      });
+    if (hr != S_OK) return hr;
+
+    std::vector<FileInfo> found;
+    std::vector<bool> visited((size_t)pfs.inodeCount, false);
+    std::vector<std::pair<uint64_t, std::string>> pending;
+    pending.emplace_back(rootIno, "pfs_image");
+    size_t skippedCompressed = 0;
+
+    while (!pending.empty()) {
+      uint64_t dirIno = pending.back().first;
+      std::string dirPath = std::move(pending.back().second);
+      pending.pop_back();
+      if (dirIno >= pfs.inodeCount || visited[(size_t)dirIno]) continue;
+      visited[(size_t)dirIno] = true;
+
+      FileInfo dir;
+      dir.path = dirPath;
+      dir.isFolder = true;
+      found.push_back(dir);
+
+      hr = ReadDirectory(stream, pfs, dirIno,
+        [&](const std::string& name, uint64_t ino, bool isDir) {
+          if (name.empty() || name.find('/') != std::string::npos) return;
+          if (!haveUroot && dirIno == rootIno && name == "flat_path_table") return;
+          std::string path = dirPath + "/" + name;
+          if (isDir) {
+            pending.emplace_back(ino, path);
+            return;
+          }
+
+          PFS_INODE_PS4 inode;
+          uint32_t firstBlock = 0;
+          uint64_t offset = 0;
+          if (!GetInode(pfs, ino, inode, firstBlock) || (inode.mode & PFS_INODE_MODE_DIR)) return;
+          if (inode.flags & PFS_INODE_FLAG_COMPRESSED) {
+            skippedCompressed++;
+            return;
+          }
+          if (!GetExtent(pfs, inode, firstBlock, offset)) return;
+
+          FileInfo fi;
+          fi.offset = pfs.offset + offset;
+          fi.size = (uint64_t)inode.size;
+          fi.path = std::move(path);
+          fi.fileTime1 = inode.ctime;
+          fi.fileTime2 = inode.atime;
+          fi.fileTime3 = inode.mtime;
+          found.push_back(std::move(fi));
+        });
+      if (FAILED(hr)) return hr;
+    }
+
+    if (skippedCompressed > 0)
+      logDebug(L"PS4 PKG: Skipped %zu PFSC-compressed files in the PFS image", skippedCompressed);
+
+    items.insert(items.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+    return S_OK;
+  }
+
+  // Copies the entry to outStream through the shared copy buffer, so memory
+  // use does not depend on the entry size (pfs_image.dat runs to many GB)
+  HRESULT ExtractFileToStream(IInStream* stream, const FileInfo& fi, ISequentialOutStream* outStream) {
     if (fi.isFolder || fi.size == 0) return S_OK;
 
-    fi.fileData.resize(fi.size);
-    UInt32 read = 0;
+    Byte* buf = copyBuffer.Get();
+    if (!buf) return E_OUTOFMEMORY;
+
     RINOK(stream->Seek(fi.offset, STREAM_SEEK_SET, nullptr));
-    RINOK(stream->Read(fi.fileData.data(), static_cast<UInt32>(fi.size), &read));
-    if (read != fi.size) return E_FAIL;
+
+    uint64_t remaining = fi.size;
+    while (remaining > 0) {
+      size_t toRead = (size_t)std::min((uint64_t)PS4CopyBuffer::kSize, remaining);
+      size_t read = toRead;
+      RINOK(ReadStream(stream, buf, &read));
+      if (read != toRead) return E_FAIL;
+      RINOK(WriteStream(outStream, buf, read));
+      remaining -= read;
+    }
 
     return S_OK;
   }
@@ -4,7 +4,11 @@
 #include <cstdint>
 #include <algorithm>
 #include <string>
+#include <memory>
+#include <thread>
 #include <bcrypt.h>
+#include "Aes128.h"
+#include "StreamUtils.h"
 #pragma comment(lib, "bcrypt.lib") 
 
 class SHA3_256 {
@@ -314,6 +318,65 @@ struct PKG_TABLE_ENTRY_PS5 {
 };
 #pragma pack(pop)
 
+// ---------------------------------------------------------------------
+// Streaming AES-128-CBC decryption. Ciphertext is fed in chunks of whole
+// blocks and the IV carried between chunks is the last ciphertext block
+// seen. Each block needs only the ciphertext block before it, so a large
+// chunk is split across threads, each slice starting from the block that
+// precedes it.
+// ---------------------------------------------------------------------
+class PS5CbcDecryptor {
+public:
+  PS5CbcDecryptor(const uint8_t* key, const uint8_t* iv) {
+    Aes128_SetKeyDecrypt(&aes, key);
+    memcpy(this->iv, iv, AES_BLOCK_SIZE);
+  }
+
+  // Decrypts size bytes in place; size must be a multiple of 16
+  void Decrypt(uint8_t* data, size_t size) {
+    size_t blocks = size / AES_BLOCK_SIZE;
+    size_t workers = std::min<size_t>(std::thread::hardware_concurrency(), size / MIN_BYTES_PER_THREAD);
+    if (workers < 2) {
+      Aes128_CbcDecrypt(&aes, iv, data, blocks);
+      return;
+    }
+
+    // Slice IVs must be taken before any slice overwrites its ciphertext
+    size_t sliceBlocks = (blocks + workers - 1) / workers;
+    std::vector<uint8_t> sliceIvs(workers * AES_BLOCK_SIZE);
+    memcpy(sliceIvs.data(), iv, AES_BLOCK_SIZE);
+    for (size_t i = 1; i < workers; i++)
+      memcpy(&sliceIvs[i * AES_BLOCK_SIZE], data + (i * sliceBlocks - 1) * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+    memcpy(iv, data + size - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+
+    std::vector<std::thread> threads;
+    size_t started = 1;
+    try {
+      for (; started < workers; started++) {
+        size_t start = started * sliceBlocks;
+        size_t count = std::min(sliceBlocks, blocks - start);
+        threads.emplace_back(Aes128_CbcDecrypt, &aes, &sliceIvs[started * AES_BLOCK_SIZE],
+          data + start * AES_BLOCK_SIZE, count);
+      }
+    }
+    catch (...) {
+      // Could not start another thread; the slices from here on run below
+    }
+    Aes128_CbcDecrypt(&aes, sliceIvs.data(), data, sliceBlocks);
+    if (started < workers) {
+      size_t start = started * sliceBlocks;
+      Aes128_CbcDecrypt(&aes, &sliceIvs[started * AES_BLOCK_SIZE], data + start * AES_BLOCK_SIZE, blocks - start);
+    }
+    for (auto& t : threads) t.join();
+  }
+
+private:
+  static const size_t MIN_BYTES_PER_THREAD = 1 << 20;
+
+  CAes128 aes;
+  Byte iv[AES_BLOCK_SIZE];
+};
+
 // ---------------------------------------------------------------------
 // PS5 PKG Handler Class
 // ---------------------------------------------------------------------
@@ -321,6 +384,9 @@ class PS5PKGHandler {
 private:
   PKG_HEADER_PS5 header = {};
   RSAKeyset keyset;
+  std::vector<uint8_t> chunkBuffer;
+
+  static const size_t CHUNK_SIZE = (size_t)4 << 20;
 
   uint32_t SwapEndian32(uint32_t v) { return _byteswap_ulong(v); }
   uint16_t SwapEndian16(uint16_t v) { return _byteswap_ushort(v); }
@@ -437,46 +503,6 @@ private:
 
     return result;
   }
-  // AES CBC Decrypt
-  bool AesCbcDecrypt(uint8_t* output, const uint8_t* input, uint32_t size,
-    const uint8_t* key, const uint8_t* iv) {
-    BCRYPT_ALG_HANDLE hAlg = NULL;
-    BCRYPT_KEY_HANDLE hKey = NULL;
-
-    if (BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_AES_ALGORITHM, NULL, 0) != 0)
-      return false;
-
-    if (BCryptSetProperty(hAlg, BCRYPT_CHAINING_MODE,
-      (PUCHAR)BCRYPT_CHAIN_MODE_CBC,
-      sizeof(BCRYPT_CHAIN_MODE_CBC), 0) != 0) {
-      BCryptCloseAlgorithmProvider(hAlg, 0);
-      return false;
-    }
-
-    ULONG keyObjSize = 0, dataSize = 0;
-    BCryptGetProperty(hAlg, BCRYPT_OBJECT_LENGTH, (PUCHAR)&keyObjSize,
-      sizeof(keyObjSize), &dataSize, 0);
-
-    std::vector<uint8_t> keyObj(keyObjSize);
-
-    if (BCryptGenerateSymmetricKey(hAlg, &hKey, keyObj.data(), keyObjSize,
-      (PUCHAR)key, 16, 0) != 0) {
-      BCryptCloseAlgorithmProvider(hAlg, 0);
-      return false;
-    }
-
-    std::vector<uint8_t> ivCopy(iv, iv + 16);
-    ULONG bytesDecrypted = 0;
-
-    NTSTATUS status = BCryptDecrypt(hKey, (PUCHAR)input, size, NULL,
-      ivCopy.data(), 16, output, size,
-      &bytesDecrypted, 0);
-
-    BCryptDestroyKey(hKey);
-    BCryptCloseAlgorithmProvider(hAlg, 0);
-
-    return (status == 0);
-  }
 public:
   struct FileInfo {
     uint64_t  offset = 0;
@@ -880,22 +906,18 @@ public:
     return S_OK;
   }
 
+  // Reads, decrypts and writes the entry CHUNK_SIZE bytes at a time. The
+  // entry is stored padded to 16 bytes; the padding is decrypted but not
+  // written out.
   HRESULT ExtractFileToStream(IInStream* inStream, const FileInfo& fi,
     ISequentialOutStream* outStream,
     const std::vector<uint8_t>& rsaDecryptedData) {
     if (fi.size == 0) return S_OK;
 
-    uint32_t alignedSize = fi.size;
-    if (alignedSize % 0x10 != 0) {
-      alignedSize = alignedSize + 0x10 - (alignedSize % 0x10);
-    }
-
-    std::vector<uint8_t> fileData(alignedSize);
-    UInt32 read = 0;
-
-    RINOK(inStream->Seek(fi.offset, STREAM_SEEK_SET, nullptr));
-    RINOK(inStream->Read(fileData.data(), alignedSize, &read));
+    // Encrypted data is stored in whole AES blocks; plain entries are read as is
+    uint64_t readSize = fi.isEncrypted ? (fi.size + 0xF) & ~(uint64_t)0xF : fi.size;
 
+    std::unique_ptr<PS5CbcDecryptor> decryptor;
     if (fi.isEncrypted) {
       std::vector<uint8_t> entryData(0x40);
 
@@ -914,19 +936,29 @@ public:
       uint8_t iv[16], key[16];
       memcpy(iv, hash.data(), 0x10);
       memcpy(key, hash.data() + 0x10, 0x10);
+      decryptor = std::make_unique<PS5CbcDecryptor>(key, iv);
+    }
 
-      std::vector<uint8_t> decryptedData(alignedSize);
-      if (!AesCbcDecrypt(decryptedData.data(), fileData.data(),
-        alignedSize, key, iv)) {
-        return E_FAIL;
-      }
+    if (chunkBuffer.empty())
+      chunkBuffer.resize(CHUNK_SIZE);
 
-      UInt32 written = 0;
-      RINOK(outStream->Write(decryptedData.data(), fi.size, &written));
-    }
-    else {
-      UInt32 written = 0;
-      RINOK(outStream->Write(fileData.data(), fi.size, &written));
+    RINOK(inStream->Seek(fi.offset, STREAM_SEEK_SET, nullptr));
+
+    uint64_t remaining = readSize;
+    uint64_t toWrite = fi.size;
+    while (remaining > 0) {
+      size_t toRead = (size_t)std::min((uint64_t)CHUNK_SIZE, remaining);
+      size_t read = toRead;
+      RINOK(ReadStream(inStream, chunkBuffer.data(), &read));
+      if (read != toRead) return E_FAIL;
+
+      if (decryptor)
+        decryptor->Decrypt(chunkBuffer.data(), read);
+
+      size_t n = (size_t)std::min((uint64_t)read, toWrite);
+      RINOK(WriteStream(outStream, chunkBuffer.data(), n));
+      toWrite -= n;
+      remaining -= read;
     }
 
     return S_OK;
@@ -7,8 +7,11 @@
 #include <sstream>
 #include <iomanip>
 #include <map>
+#include <atomic>
+#include <thread>
 
 #include "log.h"
+#include "StreamUtils.h"
 #include "zlib_decoder.h"
 
 // ---------------------------------------------------------------------
@@ -78,6 +81,164 @@ struct PSX_BLOCK_INFO {
 };
 #pragma pack(pop)
 
+// ---------------------------------------------------------------------
+// One window of a blocked PUP file. Blocks that lie close together in the
+// file are fetched with a single read, then decoded by worker threads
+// straight into their place in the output. Blocks are independent zlib
+// streams, so workers simply take the next one off a shared counter.
+// ---------------------------------------------------------------------
+class PUPBlockBatch {
+public:
+  // Blocks separated by at most this much are read together
+  static const size_t MAX_READ_GAP = 64 * 1024;
+
+  PUPBlockBatch() = default;
+  PUPBlockBatch(const PUPBlockBatch&) = delete;
+  PUPBlockBatch& operator=(const PUPBlockBatch&) = delete;
+  ~PUPBlockBatch() { Join(); }
+
+  void Clear() {
+    blocks.clear();
+    runs.clear();
+    inputSize = 0;
+    outputSize = 0;
+  }
+
+  bool Empty() const { return blocks.empty(); }
+  size_t OutputSize() const { return outputSize; }
+  const uint8_t* Output() const { return output.data(); }
+
+  // Input buffer size once a block of readSize bytes at `offset` is added,
+  // counting the gap that is read along when it joins the last run
+  size_t InputSizeWith(uint64_t offset, size_t readSize) const {
+    if (readSize == 0) return inputSize;
+    if (JoinsLastRun(offset)) return inputSize + (size_t)(offset - LastRunEnd()) + readSize;
+    return inputSize + readSize;
+  }
+
+  // Appends a block of decodedSize bytes stored as readSize bytes at file
+  // offset `offset`. A readSize of 0 is a missing block and decodes to zeros.
+  void Add(uint64_t offset, size_t readSize, size_t decodedSize, bool compressed) {
+    Block b;
+    b.inputSize = readSize;
+    b.outputPos = outputSize;
+    b.outputSize = decodedSize;
+    b.compressed = compressed;
+
+    if (readSize != 0) {
+      Run* run = runs.empty() ? nullptr : &runs.back();
+      if (JoinsLastRun(offset)) {
+        b.inputPos = run->inputPos + (size_t)(offset - run->offset);
+        run->size = (size_t)(offset - run->offset) + readSize;
+      }
+      else {
+        b.inputPos = inputSize;
+        runs.push_back({ offset, inputSize, readSize });
+        run = &runs.back();
+      }
+      inputSize = run->inputPos + run->size;
+    }
+
+    blocks.push_back(b);
+    outputSize += decodedSize;
+  }
+
+  HRESULT Read(IInStream* stream) {
+    if (input.size() < inputSize) input.resize(inputSize);
+    for (const Run& run : runs) {
+      size_t read = run.size;
+      RINOK(stream->Seek((Int64)run.offset, STREAM_SEEK_SET, nullptr));
+      RINOK(ReadStream(stream, input.data() + run.inputPos, &read));
+      if (read != run.size) return E_FAIL;
+    }
+    return S_OK;
+  }
+
+  // Decodes on background threads; the caller may read the next batch
+  // meanwhile and must call Join before touching the output
+  void StartDecode() {
+    if (output.size() < outputSize) output.resize(outputSize);
+    nextBlock = 0;
+    failed = false;
+
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), blocks.size());
+    try {
+      for (size_t i = 0; i < workers; i++)
+        threads.emplace_back(&PUPBlockBatch::DecodeBlocks, this);
+    }
+    catch (...) {
+      // Started threads take every remaining block; with none, decode here
+      if (threads.empty()) DecodeBlocks();
+    }
+  }
+
+  // Returns false if any block failed to decode
+  bool Join() {
+    for (auto& t : threads) t.join();
+    threads.clear();
+    return !failed;
+  }
+
+private:
+  struct Block {
+    size_t inputPos = 0;
+    size_t inputSize = 0;
+    size_t outputPos = 0;
+    size_t outputSize = 0;
+    bool compressed = false;
+  };
+
+  // One coalesced read
+  struct Run {
+    uint64_t offset;
+    size_t inputPos;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  std::vector<Run> runs;
+  std::vector<uint8_t> input;
+  std::vector<uint8_t> output;
+  size_t inputSize = 0;
+  size_t outputSize = 0;
+
+  std::vector<std::thread> threads;
+  std::atomic<size_t> nextBlock{ 0 };
+  std::atomic<bool> failed{ false };
+
+  uint64_t LastRunEnd() const { return runs.back().offset + runs.back().size; }
+
+  bool JoinsLastRun(uint64_t offset) const {
+    return !runs.empty() && offset >= LastRunEnd() && offset - LastRunEnd() <= MAX_READ_GAP;
+  }
+
+  void DecodeBlocks() {
+    for (;;) {
+      size_t i = nextBlock++;
+      if (i >= blocks.size() || failed) return;
+      if (!DecodeBlock(blocks[i])) failed = true;
+    }
+  }
+
+  bool DecodeBlock(const Block& b) {
+    uint8_t* out = output.data() + b.outputPos;
+    if (b.inputSize == 0) {
+      memset(out, 0, b.outputSize);
+      return true;
+    }
+
+    const uint8_t* in = input.data() + b.inputPos;
+    if (!b.compressed) {
+      memcpy(out, in, b.outputSize);
+      return true;
+    }
+
+    size_t written = 0;
+    int result = zlib_decompress_into(in, b.inputSize, out, b.outputSize, &written, nullptr, 0);
+    return result == 0 && written == b.outputSize;
+  }
+};
+
 
 class PUPHandler {
 private:
@@ -420,22 +581,9 @@ private:
   }
 
   bool ZlibDecode(const uint8_t* compressedData, size_t compressedSize, uint8_t* outputData, size_t outputSize) {
-    ByteVector* output = bytevector_create(outputSize);
-    if (!output) {
-      return false;
-    }
-
-    size_t consumed = 0;
-    int result = zlib_decompress_no_checksum(compressedData, compressedSize, output, &consumed);
-
-    if (result < 0 || output->length != outputSize) {
-      bytevector_free(output);
-      return false;
-    }
-
-    memcpy(outputData, output->data, output->length);
-    bytevector_free(output);
-    return true;
+    size_t written = 0;
+    int result = zlib_decompress_into(compressedData, compressedSize, outputData, outputSize, &written, nullptr, 0);
+    return result == 0 && written == outputSize;
   }
 
 public:
@@ -892,11 +1040,15 @@ public:
   }
 
   HRESULT ExtractSimpleFile(IInStream* inStream, const FileInfo& fi, ISequentialOutStream* outStream) {
+    return CopyRange(inStream, fi.offset, fi.size, outStream);
+  }
+
+  HRESULT CopyRange(IInStream* inStream, uint64_t offset, uint64_t size, ISequentialOutStream* outStream) {
     const size_t CHUNK_SIZE = 2 * 1024 * 1024;
     std::vector<uint8_t> buffer(CHUNK_SIZE);
 
-    uint64_t remaining = fi.size;
-    RINOK(inStream->Seek(fi.offset, STREAM_SEEK_SET, nullptr));
+    uint64_t remaining = size;
+    RINOK(inStream->Seek(offset, STREAM_SEEK_SET, nullptr));
 
     while (remaining > 0) {
       size_t toRead = (size_t)std::min((uint64_t)CHUNK_SIZE, remaining);
@@ -915,155 +1067,128 @@ public:
     return S_OK;
   }
 
+  // Decoded bytes held per batch; two batches are in flight, one being
+  // decoded while the previous is written and the next is read
+  static const size_t BLOCK_BATCH_SIZE = 16 * 1024 * 1024;
+
   HRESULT ExtractBlockedFile(IInStream* inStream, const FileInfo& fi, ISequentialOutStream* outStream) {
     if (fi.tableIndex < 0) {
       return E_FAIL;
     }
 
+    // Without a block table the blocks are stored raw and back to back
+    if (!fi.isCompressed) {
+      return CopyRange(inStream, fi.offset, fi.uncompressed_size, outStream);
+    }
+
     PSX_PUP_ENTRY& tableEntry = psxEntries[fi.tableIndex];
 
     // Calculate block parameters
     int blockSizeShift = (int)(((fi.flags & 0xF000) >> 12) + 12);
-    int blockSize = 1 << blockSizeShift;
-    int blockCount = (int)((fi.uncompressed_size + blockSize - 1) / blockSize);
-    int tailSize = (int)(fi.uncompressed_size % blockSize);
+    size_t blockSize = (size_t)1 << blockSizeShift;
+    size_t blockCount = (size_t)((fi.uncompressed_size + blockSize - 1) / blockSize);
+    size_t tailSize = (size_t)(fi.uncompressed_size % blockSize);
     if (tailSize == 0) tailSize = blockSize;
 
 
     // Read block info table
     std::vector<PSX_BLOCK_INFO> blockInfos(blockCount);
 
-    if (fi.isCompressed) {
+    RINOK(inStream->Seek(tableEntry.offset, STREAM_SEEK_SET, nullptr));
 
-      RINOK(inStream->Seek(tableEntry.offset, STREAM_SEEK_SET, nullptr));
-
-      std::vector<uint8_t> tableData;
-
-      if (tableEntry.flags & 8) {
-        std::vector<uint8_t> compressedTable(tableEntry.compressed_size);
-        UInt32 read = 0;
-        RINOK(inStream->Read(compressedTable.data(), (UInt32)tableEntry.compressed_size, &read));
-        if (read != tableEntry.compressed_size) {
-          return E_FAIL;
-        }
+    std::vector<uint8_t> tableData;
 
-        tableData.resize(tableEntry.uncompressed_size);
-        if (!ZlibDecode(compressedTable.data(), tableEntry.compressed_size,
-          tableData.data(), tableEntry.uncompressed_size)) {
-          return E_FAIL;
-        }
-      }
-      else {
-        tableData.resize(tableEntry.compressed_size);
-        UInt32 read = 0;
-        RINOK(inStream->Read(tableData.data(), (UInt32)tableEntry.compressed_size, &read));
-        if (read != tableEntry.compressed_size) return E_FAIL;
+    if (tableEntry.flags & 8) {
+      std::vector<uint8_t> compressedTable(tableEntry.compressed_size);
+      UInt32 read = 0;
+      RINOK(inStream->Read(compressedTable.data(), (UInt32)tableEntry.compressed_size, &read));
+      if (read != tableEntry.compressed_size) {
+        return E_FAIL;
       }
 
-      // Parse block info
-      size_t blockInfoOffset = 32 * blockCount;
-
-      for (int j = 0; j < blockCount; j++) {
-        size_t idx = blockInfoOffset + (j * 8);
-        if (idx + 8 > tableData.size()) {
-          return E_FAIL;
-        }
-
-        blockInfos[j].offset = tableData[idx] | (tableData[idx + 1] << 8) |
-          (tableData[idx + 2] << 16) | (tableData[idx + 3] << 24);
-        blockInfos[j].size = tableData[idx + 4] | (tableData[idx + 5] << 8) |
-          (tableData[idx + 6] << 16) | (tableData[idx + 7] << 24);
-
-        if (j < 5 || j >= blockCount - 2) {
-        }
+      tableData.resize(tableEntry.uncompressed_size);
+      if (!ZlibDecode(compressedTable.data(), tableEntry.compressed_size,
+        tableData.data(), tableEntry.uncompressed_size)) {
+        return E_FAIL;
       }
     }
+    else {
+      tableData.resize(tableEntry.compressed_size);
+      UInt32 read = 0;
+      RINOK(inStream->Read(tableData.data(), (UInt32)tableEntry.compressed_size, &read));
+      if (read != tableEntry.compressed_size) return E_FAIL;
+    }
 
-    // Allocate output buffer
-    std::vector<uint8_t> outputBuffer(fi.uncompressed_size, 0);
-
-    int lastIndex = blockCount - 1;
-
-    // Process blocks
-    for (int i = 0; i < blockCount; i++) {
-      size_t outputPosition = (size_t)i * blockSize;
+    // Parse block info
+    size_t blockInfoOffset = 32 * blockCount;
 
-      // Calculate expected uncompressed size for THIS block
-      int expectedUncompressedSize = (i == lastIndex) ? tailSize : blockSize;
+    for (size_t j = 0; j < blockCount; j++) {
+      size_t idx = blockInfoOffset + (j * 8);
+      if (idx + 8 > tableData.size()) {
+        return E_FAIL;
+      }
 
-      bool blockIsCompressed = false;
-      int compressedReadSize = 0;
+      blockInfos[j].offset = tableData[idx] | (tableData[idx + 1] << 8) |
+        (tableData[idx + 2] << 16) | (tableData[idx + 3] << 24);
+      blockInfos[j].size = tableData[idx + 4] | (tableData[idx + 5] << 8) |
+        (tableData[idx + 6] << 16) | (tableData[idx + 7] << 24);
+    }
 
-      if (fi.isCompressed) {
-        PSX_BLOCK_INFO& blockInfo = blockInfos[i];
+    // Blocks go out in order through two alternating batches: while one is
+    // decoded, the previous one is written and the next one is read
+    PUPBlockBatch batches[2];
+    size_t nextBlock = 0;
+    int current = 0;
 
-        if (blockInfo.size == 0) {
-          if (i < 5 || i >= blockCount - 2) {
-          }
-          continue;
-        }
+    auto fillBatch = [&](PUPBlockBatch& batch) -> HRESULT {
+      batch.Clear();
+      while (nextBlock < blockCount) {
+        const PSX_BLOCK_INFO& blockInfo = blockInfos[nextBlock];
+        size_t expectedSize = (nextBlock == blockCount - 1) ? tailSize : blockSize;
 
         // Determine compression
-        int unpaddedSize = (blockInfo.size & ~0xFu) - (blockInfo.size & 0xFu);
-
-        if (unpaddedSize != blockSize) {
-          blockIsCompressed = true;
-          compressedReadSize = blockInfo.size & ~0xFu;
+        bool blockIsCompressed = false;
+        size_t readSize = 0;
+        if (blockInfo.size != 0) {
+          size_t unpaddedSize = (blockInfo.size & ~0xFu) - (blockInfo.size & 0xFu);
+          blockIsCompressed = unpaddedSize != blockSize;
+          readSize = blockIsCompressed ? (blockInfo.size & ~0xFu) : expectedSize;
         }
-        else {
-          // Uncompressed block
-          compressedReadSize = expectedUncompressedSize;
+        if (blockIsCompressed && readSize == 0) return E_FAIL;
+
+        if (!batch.Empty() &&
+          (batch.OutputSize() + expectedSize > BLOCK_BATCH_SIZE ||
+            batch.InputSizeWith(fi.offset + blockInfo.offset, readSize) > BLOCK_BATCH_SIZE)) {
+          break;
         }
 
-        int64_t blockOffset = fi.offset + blockInfo.offset;
-        RINOK(inStream->Seek(blockOffset, STREAM_SEEK_SET, nullptr));
+        uint64_t blockOffset = fi.offset + blockInfo.offset;
+        if (blockOffset + readSize > archiveSize) return E_FAIL;
 
-        if (i < 5 || i >= blockCount - 2) {
-        }
-      }
-      else {
-        compressedReadSize = expectedUncompressedSize;
-        int64_t blockOffset = fi.offset + outputPosition;
-        RINOK(inStream->Seek(blockOffset, STREAM_SEEK_SET, nullptr));
+        batch.Add(blockOffset, readSize, expectedSize, blockIsCompressed);
+        nextBlock++;
       }
+      return batch.Read(inStream);
+    };
 
-      if (blockIsCompressed) {
-        // Read and decompress
-        std::vector<uint8_t> compressedBlock(compressedReadSize);
-        UInt32 read = 0;
-        RINOK(inStream->Read(compressedBlock.data(), (UInt32)compressedReadSize, &read));
-        if (read != compressedReadSize) {
-          return E_FAIL;
-        }
+    RINOK(fillBatch(batches[0]));
+    batches[0].StartDecode();
 
-        if (!ZlibDecode(compressedBlock.data(), compressedReadSize,
-          &outputBuffer[outputPosition], expectedUncompressedSize)) {
-          return E_FAIL;
-        }
+    for (;;) {
+      PUPBlockBatch& batch = batches[current];
+      PUPBlockBatch& next = batches[current ^ 1];
+      bool more = nextBlock < blockCount;
 
-        if (i < 5 || i >= blockCount - 2) {
-        }
-      }
-      else {
-        // Read uncompressed
-        UInt32 read = 0;
-        RINOK(inStream->Read(&outputBuffer[outputPosition],
-          (UInt32)compressedReadSize, &read));
-        if (read != compressedReadSize) {
-          return E_FAIL;
-        }
+      HRESULT hr = more ? fillBatch(next) : S_OK;
+      if (!batch.Join()) return E_FAIL;
+      RINOK(hr);
 
-        if (i < 5 || i >= blockCount - 2) {
-        }
-      }
+      if (more) next.StartDecode();
+      RINOK(WriteStream(outStream, batch.Output(), batch.OutputSize()));
+      if (!more) break;
+      current ^= 1;
     }
 
-    // Write output
-    UInt32 written = 0;
-    RINOK(outStream->Write(outputBuffer.data(), (UInt32)fi.uncompressed_size, &written));
-    if (written != fi.uncompressed_size) {
-      return E_FAIL;
-    }
     return S_OK;
   }
 
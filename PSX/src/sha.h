@@ -1,3 +1,11 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SHA1_SSE2_LANES
+#endif
 
 class SHA1
 {
@@ -10,7 +18,63 @@ private:
     return (value << bits) | (value >> (32 - bits));
   }
 
+  static int loadBE32(const uint8_t* p) {
+    return (int)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+  }
+
+#ifdef SHA1_SSE2_LANES
+  static __m128i rolLanes(__m128i value, int bits) {
+    return _mm_or_si128(_mm_slli_epi32(value, bits), _mm_srli_epi32(value, 32 - bits));
+  }
+
+  static __m128i choose(__m128i b, __m128i c, __m128i d) {
+    return _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)));
+  }
+
+  static __m128i parity(__m128i b, __m128i c, __m128i d) {
+    return _mm_xor_si128(_mm_xor_si128(b, c), d);
+  }
+
+  static __m128i majority(__m128i b, __m128i c, __m128i d) {
+    return _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)));
+  }
+
+  // Word i of the message schedule, kept in a 16-entry ring
+  static __m128i scheduleLanes(__m128i w[16], int i) {
+    if (i < 16) return w[i];
+    __m128i x = _mm_xor_si128(_mm_xor_si128(w[(i - 3) & 15], w[(i - 8) & 15]),
+      _mm_xor_si128(w[(i - 14) & 15], w[i & 15]));
+    return w[i & 15] = rolLanes(x, 1);
+  }
+
+  // One round; a and c are read, b is rotated and e takes the new value
+  // that becomes a after the renaming in compressLanes()
+  template <typename F>
+  static void roundLanes(__m128i a, __m128i& b, __m128i c, __m128i d, __m128i& e, F f, __m128i k, __m128i wi) {
+    e = _mm_add_epi32(_mm_add_epi32(e, rolLanes(a, 5)),
+      _mm_add_epi32(f(b, c, d), _mm_add_epi32(k, wi)));
+    b = rolLanes(b, 30);
+  }
+#endif
+
   void transform(const uint8_t block[64]) {
+    compress(state, block);
+  }
+
+public:
+  static const size_t LANES = 4;
+
+  static void initState(uint32_t st[5]) {
+    st[0] = 0x67452301;
+    st[1] = 0xEFCDAB89;
+    st[2] = 0x98BADCFE;
+    st[3] = 0x10325476;
+    st[4] = 0xC3D2E1F0;
+  }
+
+  // Block function on an explicit state, for callers hashing fixed-size
+  // messages that do not need the buffering in update()
+  static void compress(uint32_t st[5], const uint8_t block[64]) {
     uint32_t a, b, c, d, e;
     uint32_t w[80];
 
@@ -24,11 +88,11 @@ private:
     }
 
     // Initialize working variables
-    a = state[0];
-    b = state[1];
-    c = state[2];
-    d = state[3];
-    e = state[4];
+    a = st[0];
+    b = st[1];
+    c = st[2];
+    d = st[3];
+    e = st[4];
 
     // Main loop
     for (int i = 0; i < 80; i++) {
@@ -58,24 +122,70 @@ private:
       a = temp;
     }
 
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
-    state[4] += e;
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+  }
+
+  // Runs the block function over LANES independent messages at once.
+  // States are interleaved by word, lanes[word][lane], so the SSE2 path
+  // loads them directly.
+  static void compressLanes(uint32_t lanes[5][LANES], const uint8_t* const blocks[LANES]) {
+#ifdef SHA1_SSE2_LANES
+    __m128i w[16];
+    for (int i = 0; i < 16; i++) {
+      w[i] = _mm_setr_epi32(loadBE32(blocks[0] + i * 4), loadBE32(blocks[1] + i * 4),
+        loadBE32(blocks[2] + i * 4), loadBE32(blocks[3] + i * 4));
+    }
+
+    __m128i a = _mm_loadu_si128((const __m128i*)lanes[0]);
+    __m128i b = _mm_loadu_si128((const __m128i*)lanes[1]);
+    __m128i c = _mm_loadu_si128((const __m128i*)lanes[2]);
+    __m128i d = _mm_loadu_si128((const __m128i*)lanes[3]);
+    __m128i e = _mm_loadu_si128((const __m128i*)lanes[4]);
+    const __m128i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+    // Five rounds per step with the variables renamed instead of shifted
+#define SHA1_LANES_STEP(F, K, i) \
+    roundLanes(a, b, c, d, e, F, K, scheduleLanes(w, i)); \
+    roundLanes(e, a, b, c, d, F, K, scheduleLanes(w, i + 1)); \
+    roundLanes(d, e, a, b, c, F, K, scheduleLanes(w, i + 2)); \
+    roundLanes(c, d, e, a, b, F, K, scheduleLanes(w, i + 3)); \
+    roundLanes(b, c, d, e, a, F, K, scheduleLanes(w, i + 4));
+
+    const __m128i k0 = _mm_set1_epi32(0x5A827999);
+    const __m128i k1 = _mm_set1_epi32(0x6ED9EBA1);
+    const __m128i k2 = _mm_set1_epi32((int)0x8F1BBCDC);
+    const __m128i k3 = _mm_set1_epi32((int)0xCA62C1D6);
+    for (int i = 0; i < 20; i += 5) { SHA1_LANES_STEP(choose, k0, i) }
+    for (int i = 20; i < 40; i += 5) { SHA1_LANES_STEP(parity, k1, i) }
+    for (int i = 40; i < 60; i += 5) { SHA1_LANES_STEP(majority, k2, i) }
+    for (int i = 60; i < 80; i += 5) { SHA1_LANES_STEP(parity, k3, i) }
+#undef SHA1_LANES_STEP
+
+    _mm_storeu_si128((__m128i*)lanes[0], _mm_add_epi32(a, a0));
+    _mm_storeu_si128((__m128i*)lanes[1], _mm_add_epi32(b, b0));
+    _mm_storeu_si128((__m128i*)lanes[2], _mm_add_epi32(c, c0));
+    _mm_storeu_si128((__m128i*)lanes[3], _mm_add_epi32(d, d0));
+    _mm_storeu_si128((__m128i*)lanes[4], _mm_add_epi32(e, e0));
+#else
+    for (size_t lane = 0; lane < LANES; lane++) {
+      uint32_t st[5];
+      for (int i = 0; i < 5; i++) st[i] = lanes[i][lane];
+      compress(st, blocks[lane]);
+      for (int i = 0; i < 5; i++) lanes[i][lane] = st[i];
+    }
+#endif
   }
 
-public:
   SHA1() {
     reset();
   }
 
   void reset() {
-    state[0] = 0x67452301;
-    state[1] = 0xEFCDAB89;
-    state[2] = 0x98BADCFE;
-    state[3] = 0x10325476;
-    state[4] = 0xC3D2E1F0;
+    initState(state);
     count[0] = 0;
     count[1] = 0;
   }
@@ -25,6 +25,7 @@ static void logDebug(const std::wstringstream& wss);
 #endif
 
 #include "zlib_decoder.h"
+#include "StreamUtils.h"
 #include <chrono>
 #include <codecvt>
 
@@ -35,7 +36,6 @@ public:
   HRESULT Open(IInStream* stream, const UInt64*, IArchiveOpenCallback* callback);
   CMyComPtr<IArchiveOpenVolumeCallback> volCallback;
   HRESULT ParseArchive(IInStream* stream, UInt64 fileSize);
-  HRESULT ReadData(IInStream* stream);
   uint32_t ByteSwap(uint32_t x) {
     return ((x >> 24) & 0x000000FF) |
       ((x >> 8) & 0x0000FF00) |
@@ -50,8 +50,6 @@ public:
     uint8_t compressionFlag;
     std::string compressionType;
     std::string name;
-    std::vector<uint8_t> data;
-    std::vector<uint8_t> decompressedData;
 
     ArchiveEntry(uint32_t entryPos, uint32_t compressedSize, uint32_t uncompressedSize,
       uint8_t compressionFlag, const std::string& compressionType,
@@ -60,9 +58,18 @@ public:
       compressionFlag(compressionFlag), compressionType(compressionType), name(name) {
     }
 
-
+    // PYZ archives and entries without the compression flag are stored as is
+    bool isStored() const { return compressionType == "z" || compressionFlag == 0; }
   };
 
+  // Decodes one entry from the archive stream and hands it to
+  // sink(const uint8_t* data, size_t size), which returns an HRESULT.
+  // Compressed entries are inflated a chunk at a time, so memory stays
+  // constant whatever the entry size. Returns S_FALSE on corrupt or truncated
+  // data; errors from the stream or the sink are passed through as is.
+  template <class Sink>
+  HRESULT DecodeEntry(IInStream* stream, const ArchiveEntry& item, Sink sink);
+
   // Additional members for handling the PyInstaller archive
   UInt32 lengthofPackage = 0;            // Length of the package
   UInt32 toc = 0;                        // Table of contents
@@ -255,9 +262,6 @@ HRESULT PyInstallerHandler::Open(IInStream* stream, const UInt64*, IArchiveOpenC
   HRESULT parseResult = ParseArchive(stream, fileSize);
   RINOK(parseResult);
 
-  HRESULT readDataResult = ReadData(stream);
-  RINOK(readDataResult);
-
   archiveSize = tableOfContentsSize + lengthofPackage;
 
   logDebug(L"[+] Successfully opened PyInstaller archive, TOC size: " + std::to_wstring(tableOfContentsSize));
@@ -351,6 +355,10 @@ HRESULT PyInstallerHandler::ParseArchive(IInStream* stream, UInt64 fileSize) {
     if (compressionType == 's' || compressionType == 'M' || compressionType == 'm') name += L".pyc";
 
     UInt64 actualOffset = overlayPos + entryPos;
+    if (actualOffset > fileSize || compressedSize > fileSize - actualOffset) {
+      logDebug(L"[!] Error: Entry data lies outside the file");
+      return S_FALSE;
+    }
 
     // Debugging: log entry metadata
     std::wstringstream entryMsg;
@@ -381,162 +389,111 @@ HRESULT PyInstallerHandler::ParseArchive(IInStream* stream, UInt64 fileSize) {
   return S_OK;
 }
 
-HRESULT PyInstallerHandler::ReadData(IInStream* stream) {
-  if (items.empty()) {
-    HandleError(L"[!] Error: No metadata available. ParseArchive must be called first.");
-    return S_FALSE;
-  }
+static const size_t kDecodeChunkSize = 1 << 16;
 
-  logDebug("Starting ReadData for " + std::to_string(items.size()) + " items");
-
-  for (auto& item : items) {
-    if (item.compressedSize == 0) {
-      logDebug("Skipping item with zero compressed size");
-      continue;  // Skip if there's no compressed data
-    }
+template <class Sink>
+HRESULT PyInstallerHandler::DecodeEntry(IInStream* stream, const ArchiveEntry& item, Sink sink) {
+  // Directory markers ('o') carry no data
+  if (item.compressedSize == 0 || item.compressionType == "o") {
+    return S_OK;
+  }
 
-    // Handle PYZ files - they're special uncompressed archive files
-    if (item.compressionType == "z") {
-      logDebug("Processing PYZ archive file (uncompressed): " + item.name);
+  RINOK(stream->Seek(overlayPos + item.entryPos, STREAM_SEEK_SET, nullptr));
 
-      // PYZ files are stored uncompressed, just read the raw data
-      uint64_t actualOffset = overlayPos + item.entryPos;
-      HRESULT result = stream->Seek(actualOffset, STREAM_SEEK_SET, nullptr);
-      if (result != S_OK) {
-        logDebug("Failed to seek to PYZ offset: " + std::to_string(actualOffset));
-        HandleError(L"[!] Error: Failed to seek to actual offset");
-        return S_FALSE;
-      }
+  std::vector<uint8_t> input(kDecodeChunkSize);
+  uint32_t left = item.compressedSize;
 
-      item.data.resize(item.compressedSize);
-      UInt32 bytesRead = 0;
-      result = SafeRead(stream, item.data.data(), item.compressedSize, &bytesRead);
-      if (result != S_OK || bytesRead != item.compressedSize) {
-        logDebug("Failed to read PYZ data - Expected: " + std::to_string(item.compressedSize) +
-          ", Got: " + std::to_string(bytesRead));
-        HandleError(L"[!] Error: Failed to read PYZ file data");
+  if (item.isStored()) {
+    while (left > 0) {
+      size_t chunk = std::min<size_t>(left, input.size());
+      size_t got = chunk;
+      RINOK(ReadStream(stream, input.data(), &got));
+      if (got != chunk) {
+        logDebug("Stored entry is truncated: " + item.name);
         return S_FALSE;
       }
-
-      logDebug("Successfully read PYZ file: " + std::to_string(bytesRead) + " bytes");
-
-      // For PYZ files, the data IS the decompressed data (it's stored uncompressed)
-      item.decompressedData = item.data;
-
-      logDebug("PYZ file processed successfully");
-
-      continue;
-    }
-
-    // Skip uncompressed files (type 'o' for directory markers)
-    if (item.compressionFlag == 0 || item.compressionType == "o") {
-      logDebug("Skipping uncompressed/directory entry: " + item.name);
-      continue;
-    }
-
-    logDebug("Processing item - Compressed size: " + std::to_string(item.compressedSize) +
-      ", Uncompressed size: " + std::to_string(item.uncompressedSize));
-
-    uint64_t actualOffset = overlayPos + item.entryPos;
-    HRESULT result = stream->Seek(actualOffset, STREAM_SEEK_SET, nullptr);
-    if (result != S_OK) {
-      logDebug("Failed to seek to offset: " + std::to_string(actualOffset));
-      HandleError(L"[!] Error: Failed to seek to actual offset");
-      return S_FALSE;
-    }
-
-    item.data.resize(item.compressedSize);
-    UInt32 bytesRead = 0;
-    result = SafeRead(stream, item.data.data(), item.compressedSize, &bytesRead);
-    if (result != S_OK || bytesRead != item.compressedSize) {
-      logDebug("Failed to read data - Expected: " + std::to_string(item.compressedSize) +
-        ", Got: " + std::to_string(bytesRead));
-      HandleError(L"[!] Error: Failed to read file data");
-      return S_FALSE;
+      RINOK(sink(input.data(), got));
+      left -= static_cast<uint32_t>(got);
     }
+    return S_OK;
+  }
 
-    logDebug("Successfully read " + std::to_string(bytesRead) + " bytes");
+  InflateStream* inflater = inflate_stream_create(INFLATE_STREAM_ZLIB | INFLATE_STREAM_ADLER);
+  if (!inflater) {
+    return E_OUTOFMEMORY;
+  }
 
-    bool zlibFound = false;
-    size_t zlibHeaderIndex = 0;
-    for (; zlibHeaderIndex < item.data.size() - 1; ++zlibHeaderIndex) {
-      if (item.data[zlibHeaderIndex] == 0x78) {  // 0x78 is typical for zlib headers
-        zlibFound = true;
+  std::vector<uint8_t> output(kDecodeChunkSize);
+  size_t inPos = 0;
+  size_t inSize = 0;
+  uint64_t total = 0;
+  bool headerFound = false;
+  bool needInput = true;
+  HRESULT hr = S_OK;
+
+  for (;;) {
+    if (needInput) {
+      if (left == 0) {
+        logDebug("Compressed data ends before the zlib stream does: " + item.name);
+        hr = S_FALSE;
         break;
       }
+      // Keep the bytes the inflater handed back and top up behind them
+      size_t keep = inSize - inPos;
+      memmove(input.data(), input.data() + inPos, keep);
+      size_t chunk = std::min<size_t>(left, input.size() - keep);
+      size_t got = chunk;
+      hr = ReadStream(stream, input.data() + keep, &got);
+      if (hr == S_OK && got != chunk) hr = S_FALSE;
+      if (hr != S_OK) break;
+      left -= static_cast<uint32_t>(chunk);
+      inPos = 0;
+      inSize = keep + chunk;
+      needInput = false;
     }
 
-    if (zlibFound) {
-      logDebug("Found zlib header at index: " + std::to_string(zlibHeaderIndex));
-
-      std::vector<uint8_t> actualCompressedData(item.data.begin() + zlibHeaderIndex, item.data.end());
-
-      logDebug("Actual compressed data size: " + std::to_string(actualCompressedData.size()));
-      // Log first few bytes for debugging
-      std::stringstream ss;
-      ss << "First bytes: ";
-      for (size_t i = 0; i < std::min(size_t(16), actualCompressedData.size()); ++i) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)actualCompressedData[i] << " ";
-      }
-      logDebug(ss.str());
-
-      // Create output ByteVector for decompression
-      ByteVector* output = bytevector_create(item.uncompressedSize);
-      if (!output) {
-        logDebug("Failed to allocate ByteVector");
-        HandleError(L"[!] Error: Failed to allocate memory for decompression");
-        return S_FALSE;
+    if (!headerFound) {
+      // The zlib stream may be preceded by padding; it starts at the first 0x78
+      const void* header = memchr(input.data() + inPos, 0x78, inSize - inPos);
+      if (!header) {
+        inPos = inSize;
+        needInput = true;
+        continue;
       }
+      inPos = static_cast<const uint8_t*>(header) - input.data();
+      headerFound = true;
+    }
 
-      logDebug("Starting decompression with custom zlib decoder");
-
-      int decompressResult = zlib_decompress(
-        actualCompressedData.data(),
-        actualCompressedData.size(),
-        output
-      );
-
-      if (decompressResult < 0) {
-        logDebug("Decompression failed with error code: " + std::to_string(decompressResult));
-        bytevector_free(output);
-        HandleError(L"[!] Error: Failed to decompress data");
-        return S_FALSE;
-      }
-
-      logDebug("Decompression successful - Output size: " + std::to_string(output->length));
-
-      // Copy decompressed data to item
-      item.decompressedData.resize(output->length);
-      memcpy(item.decompressedData.data(), output->data, output->length);
+    size_t used = 0;
+    size_t written = 0;
+    int status = inflate_stream_run(inflater, input.data() + inPos, inSize - inPos, &used,
+      output.data(), output.size(), &written);
+    inPos += used;
 
-      // Clean up
-      bytevector_free(output);
+    if (status == INFLATE_STREAM_ERROR || written > item.uncompressedSize - total) {
+      logDebug("Failed to inflate entry: " + item.name);
+      hr = S_FALSE;
+      break;
+    }
+    total += written;
+    if (written > 0) {
+      hr = sink(output.data(), written);
+      if (hr != S_OK) break;
+    }
 
-      // Verify size matches expected
-      if (item.decompressedData.size() != item.uncompressedSize) {
+    if (status == INFLATE_STREAM_END) {
+      if (total != item.uncompressedSize) {
         logDebug("Size mismatch - Expected: " + std::to_string(item.uncompressedSize) +
-          ", Got: " + std::to_string(item.decompressedData.size()));
-        HandleError(L"[!] Warning: Decompressed size does not match expected uncompressed size");
-        return S_FALSE;
+          ", Got: " + std::to_string(total));
+        hr = S_FALSE;
       }
-
-      logDebug("Item processed successfully");
-    }
-    else {
-      logDebug("No zlib header (0x78) found in data");
-      // Log first few bytes to help debug
-      std::stringstream ss;
-      ss << "First bytes of data: ";
-      for (size_t i = 0; i < std::min(size_t(16), item.data.size()); ++i) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)item.data[i] << " ";
-      }
-      logDebug(ss.str());
-      HandleError(L"[!] Error: No zlib header found in data");
-      return S_FALSE;
+      break;
     }
+    // All buffered input was offered, so stopping short of a full output
+    // chunk means the inflater is waiting for more input
+    needInput = written < output.size();
   }
 
-  logDebug("ReadData completed successfully for all items");
-
-  return S_OK;
-}
\ No newline at end of file
+  inflate_stream_free(inflater);
+  return hr;
+}
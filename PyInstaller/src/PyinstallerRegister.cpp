@@ -221,15 +221,17 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 
 		Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
 
-		// Write decompressed data
-		HRESULT writeResult = realOutStream->Write(
-			item.decompressedData.data(),
-			static_cast<UInt32>(item.decompressedData.size()),
-			nullptr
-		);
-
-		if (writeResult != S_OK)
+		// Decode straight from the archive into the output stream
+		HRESULT decodeResult = pyHandler.DecodeEntry(mainStream, item,
+			[&](const uint8_t* data, size_t size) -> HRESULT {
+				return realOutStream ? WriteStream(realOutStream, data, size) : S_OK;
+			});
+
+		// S_FALSE is corrupt entry data; write errors and E_ABORT stop the extraction
+		if (decodeResult == S_FALSE)
 			opRes = NArchive::NExtract::NOperationResult::kDataError;
+		else
+			RINOK(decodeResult);
 
 		realOutStream.Release();
 		RINOK(extractCallback->SetOperationResult(opRes));
@@ -247,8 +249,9 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream) MY_
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 
 	const auto& item = items[index];
+	const size_t dataSize = item.isStored() ? item.compressedSize : item.uncompressedSize;
 
-	if (!item.decompressedData.size())
+	if (dataSize == 0 || item.compressionType == "o")
 	{
 		*stream = new CEmptyInStream();
 		(*stream)->AddRef();
@@ -260,13 +263,23 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream) MY_
 	// Set the main stream
 	limitedStream->SetStream(mainStream, 0);
 
-	// Put all data in the cache
+	// Decode the entry into the cache
 	auto& preload = limitedStream->Buffer;
-	preload.Alloc(item.decompressedData.size());
-	memcpy(preload, item.decompressedData.data(), item.decompressedData.size());
-
-	limitedStream->SetCache(item.decompressedData.size(), 0);
-	RINOK(limitedStream->InitAndSeek(0, item.decompressedData.size()));
+	preload.Alloc(dataSize);
+	size_t filled = 0;
+	HRESULT decodeResult = pyHandler.DecodeEntry(mainStream, item,
+		[&](const uint8_t* data, size_t size) -> HRESULT {
+			if (size > dataSize - filled)
+				return S_FALSE;
+			memcpy(preload + filled, data, size);
+			filled += size;
+			return S_OK;
+		});
+	if (decodeResult != S_OK)
+		return decodeResult == S_FALSE ? E_FAIL : decodeResult;
+
+	limitedStream->SetCache(filled, 0);
+	RINOK(limitedStream->InitAndSeek(0, filled));
 
 	*stream = limitedStream.Detach();
 	return S_OK;
@@ -10,85 +10,61 @@
 #include "ProgressUtils.h"
 #include "RegisterArc.h"
 #include "StringConvert.h"
+#include "StreamUtils.h"
 #include "RPAHandler.h"
 #include <cwchar>
 
 class CHandler :
 	public IInArchive,
 	public IInArchiveGetStream,
+	public IOutArchive,
+	public ISetProperties,
 	public CMyUnknownImp
 {
 public:
-	CHandler() : batchLoadEnabled(false), hasArchiveCache(false) {}
+	CHandler() {}
 
-	~CHandler()
-	{
-		if (batchLoadEnabled)
-			rpaHandler.CloseBatchLoad();
-		archiveDataCache.clear();
-	}
-
-	MY_UNKNOWN_IMP2(IInArchive, IInArchiveGetStream)
+	MY_UNKNOWN_IMP4(IInArchive, IInArchiveGetStream, IOutArchive, ISetProperties)
 		INTERFACE_IInArchive(override)
+		INTERFACE_IOutArchive(override)
 
 		STDMETHOD(GetStream)(UInt32 index, ISequentialInStream** stream) override;
+	STDMETHOD(SetProperties)(const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps) override;
 
 private:
+	HRESULT UpdateItemsInPlace(IOutStream* archiveFile, UInt32 numItems, IArchiveUpdateCallback* updateCallback);
+
 	RPAArchiveHandler rpaHandler;
-	std::vector<std::pair<std::string, RPAArchiveHandler::ArchiveIndex>> itemsList;
 	CMyComPtr<IInStream> mainStream;
 	UInt64 totalSize = 0;
 	double archiveVersion = 0.0;
-	bool batchLoadEnabled;
-	bool hasArchiveCache;
-	std::vector<uint8_t> archiveDataCache;
-
-	bool CreateMemoryCache(IInStream* stream, UInt64 maxSize);
+	double writeVersion = 0.0;
 };
 
-bool CHandler::CreateMemoryCache(IInStream* stream, UInt64 maxSize)
+// The index cache is opt-in: with RPA_INDEX_CACHE set (to anything but 0)
+// the decoded index of each archive is kept under
+// %LOCALAPPDATA%\RPAHandler\IndexCache, named by the archive's size,
+// modification time and index CRC
+static bool IsIndexCacheEnabled()
 {
-	UInt64 streamSize = 0;
-	if (FAILED(stream->Seek(0, STREAM_SEEK_END, &streamSize)))
-		return false;
-
-	if (streamSize > maxSize || streamSize == 0)
-		return false;
-
-	try
-	{
-		archiveDataCache.resize(static_cast<size_t>(streamSize));
-	}
-	catch (...)
-	{
-		return false;
-	}
-
-	if (FAILED(stream->Seek(0, STREAM_SEEK_SET, nullptr)))
-	{
-		archiveDataCache.clear();
-		return false;
-	}
-
-	UInt32 bytesRead = 0;
-	UInt64 totalRead = 0;
-	const UInt32 chunkSize = 16 * 1024 * 1024;
-
-	while (totalRead < streamSize)
-	{
-		UInt32 toRead = static_cast<UInt32>(std::min<UInt64>(chunkSize, streamSize - totalRead));
-		HRESULT hr = stream->Read(&archiveDataCache[static_cast<size_t>(totalRead)], toRead, &bytesRead);
-
-		if (FAILED(hr) || bytesRead == 0)
-		{
-			archiveDataCache.clear();
-			return false;
-		}
-		totalRead += bytesRead;
-	}
+	wchar_t value[8];
+	DWORD len = GetEnvironmentVariableW(L"RPA_INDEX_CACHE", value, ARRAYSIZE(value));
+	return len > 0 && len < ARRAYSIZE(value) && wcscmp(value, L"0") != 0;
+}
 
-	hasArchiveCache = true;
-	return true;
+// Creates the cache directory on first use; returns an empty path (cache
+// off) when there is no local application data folder
+static std::wstring GetIndexCacheDir()
+{
+	wchar_t path[MAX_PATH];
+	if (!SUCCEEDED(SHGetFolderPathW(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, path)))
+		return std::wstring();
+
+	std::wstring dir = std::wstring(path) + L"\\RPAHandler";
+	CreateDirectoryW(dir.c_str(), nullptr);
+	dir += L"\\IndexCache";
+	CreateDirectoryW(dir.c_str(), nullptr);
+	return dir;
 }
 
 STDMETHODIMP CHandler::Open(IInStream* inStream, const UInt64* maxCheckStartPosition, IArchiveOpenCallback* callback) MY_NO_THROW_DECL_ONLY
@@ -127,32 +103,35 @@ STDMETHODIMP CHandler::Open(IInStream* inStream, const UInt64* maxCheckStartPosi
 		// Reset stream
 		RINOK(inStream->Seek(0, STREAM_SEEK_SET, nullptr));
 
-		// Try to create memory cache for faster access
-		CreateMemoryCache(inStream, 500 * 1024 * 1024);
-
-		if (hasArchiveCache)
-			batchLoadEnabled = true;
+		// Map the archive when the callback names it by absolute path, so
+		// extraction reads straight from the mapping. 7-Zip's own open
+		// callback reports only the bare file name, so under 7-Zip nothing
+		// is mapped and entries stream from inStream through CopyRange.
+		CMyComPtr<IArchiveOpenVolumeCallback> volumeCallback;
+		if (callback)
+			callback->QueryInterface(IID_IArchiveOpenVolumeCallback, (void**)&volumeCallback);
+		if (volumeCallback)
+		{
+			NWindows::NCOM::CPropVariant prop;
+			if (volumeCallback->GetProperty(kpidName, &prop) == S_OK && prop.vt == VT_BSTR)
+			{
+				rpaHandler.MapArchive(prop.bstrVal, inStream);
+			}
+		}
+		rpaHandler.SetIndexCacheDir(IsIndexCacheEnabled() ? GetIndexCacheDir() : std::wstring());
 
 		// Open with RPA handler
 		RINOK(rpaHandler.Open(inStream, nullptr, callback));
 
 		mainStream = inStream;
 
-		// Copy items list
-		itemsList.clear();
-		itemsList.reserve(rpaHandler.items.size());
-		for (const auto& item : rpaHandler.items)
-		{
-			itemsList.push_back(item);
-		}
-
 		archiveVersion = rpaHandler.GetArchiveVersion();
 
 		// Calculate total size
 		UInt64 s = 0;
-		for (size_t i = 0; i < itemsList.size(); i++)
+		for (size_t i = 0; i < rpaHandler.GetFileCount(); i++)
 		{
-			s += itemsList[i].second.length;
+			s += rpaHandler.GetEntry(i).length;
 		}
 		totalSize = s;
 
@@ -168,17 +147,8 @@ STDMETHODIMP CHandler::Open(IInStream* inStream, const UInt64* maxCheckStartPosi
 STDMETHODIMP CHandler::Close() MY_NO_THROW_DECL_ONLY
 {
 	mainStream.Release();
-	itemsList.clear();
-	rpaHandler.items.clear();
-	archiveDataCache.clear();
-	archiveDataCache.shrink_to_fit();
-	hasArchiveCache = false;
-
-	if (batchLoadEnabled)
-	{
-		rpaHandler.CloseBatchLoad();
-		batchLoadEnabled = false;
-	}
+	rpaHandler.Clear();
+	rpaHandler.CloseBatchLoad();
 
 	totalSize = 0;
 	archiveVersion = 0.0;
@@ -187,7 +157,7 @@ STDMETHODIMP CHandler::Close() MY_NO_THROW_DECL_ONLY
 
 STDMETHODIMP CHandler::GetNumberOfItems(UInt32* numItems) MY_NO_THROW_DECL_ONLY
 {
-	*numItems = static_cast<UInt32>(itemsList.size());
+	*numItems = static_cast<UInt32>(rpaHandler.GetFileCount());
 	return S_OK;
 }
 
@@ -243,26 +213,25 @@ STDMETHODIMP CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value) MY_
 STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value) MY_NO_THROW_DECL_ONLY
 {
 	COM_TRY_BEGIN
-		if (index >= itemsList.size())
+		if (index >= rpaHandler.GetFileCount())
 			return E_INVALIDARG;
 
-	const auto& item = itemsList[index];
-	const std::string& fileName = item.first;
-	const auto& fileInfo = item.second;
+	const auto& fileInfo = rpaHandler.GetEntry(index);
 	NWindows::NCOM::CPropVariant prop;
 
 	switch (propID)
 	{
 	case kpidPath:
 	{
-		if (fileName.empty())
+		if (fileInfo.pathSize == 0)
 		{
 			prop = L"unnamed.bin";
 		}
 		else
 		{
+			const char* fileName = rpaHandler.GetPath(fileInfo);
 			UString widePath;
-			for (size_t i = 0; i < fileName.length(); i++)
+			for (size_t i = 0; i < fileInfo.pathSize; i++)
 			{
 				widePath += (wchar_t)(unsigned char)fileName[i];
 			}
@@ -278,9 +247,10 @@ STDMETHODIMP CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* val
 	case kpidPackSize:
 	{
 		UInt64 packedSize = 0;
-		for (const auto& tuple : fileInfo.tuples)
+		const auto* tuples = rpaHandler.GetTuples(fileInfo);
+		for (UInt32 i = 0; i < fileInfo.tupleCount; i++)
 		{
-			packedSize += tuple.second.length;
+			packedSize += tuples[i].length;
 		}
 		prop = packedSize;
 	}
@@ -300,7 +270,7 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 	COM_TRY_BEGIN
 		const bool allFilesMode = numItems == (UInt32)(Int32)-1;
 	if (allFilesMode)
-		numItems = static_cast<UInt32>(itemsList.size());
+		numItems = static_cast<UInt32>(rpaHandler.GetFileCount());
 
 	if (numItems == 0)
 		return S_OK;
@@ -310,8 +280,8 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 	for (UInt32 i = 0; i < numItems; i++)
 	{
 		UInt32 index = allFilesMode ? i : indices[i];
-		if (index < itemsList.size())
-			totalExtractSize += itemsList[index].second.length;
+		if (index < rpaHandler.GetFileCount())
+			totalExtractSize += rpaHandler.GetEntry(index).length;
 	}
 
 	RINOK(extractCallback->SetTotal(totalExtractSize));
@@ -321,76 +291,14 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 
 	const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest : NArchive::NExtract::NAskMode::kExtract;
 
-	// Use batch extraction for multiple files with cache
-	if (hasArchiveCache && numItems > 5)
-	{
-		UInt64 currentSize = 0;
-		for (UInt32 i = 0; i < numItems; i++)
-		{
-			UInt32 index = allFilesMode ? i : indices[i];
-			if (index >= itemsList.size())
-				continue;
-
-			const auto& item = itemsList[index];
-			const auto& fileInfo = item.second;
-
-			progress->InSize = progress->OutSize = currentSize;
-			RINOK(progress->SetCur());
-
-			CMyComPtr<ISequentialOutStream> realOutStream;
-			RINOK(extractCallback->GetStream(index, &realOutStream, askMode));
-
-			currentSize += fileInfo.length;
-
-			if (!testMode && !realOutStream)
-				continue;
-
-			RINOK(extractCallback->PrepareOperation(askMode));
-
-			// Extract from cache
-			std::vector<uint8_t> fileData;
-			fileData.reserve(fileInfo.length);
-
-			for (const auto& tuplePair : fileInfo.tuples)
-			{
-				const auto& tuple = tuplePair.second;
-				fileData.insert(fileData.end(), tuple.prefix.begin(), tuple.prefix.end());
-
-				size_t dataLength = tuple.length - tuple.prefix.size();
-				if (dataLength > 0 && tuple.offset + dataLength <= archiveDataCache.size())
-				{
-					const uint8_t* srcData = &archiveDataCache[static_cast<size_t>(tuple.offset)];
-					fileData.insert(fileData.end(), srcData, srcData + dataLength);
-				}
-			}
-
-			Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
-
-			if (!testMode && realOutStream)
-			{
-				UInt32 written = 0;
-				HRESULT writeResult = realOutStream->Write(fileData.data(), static_cast<UInt32>(fileData.size()), &written);
-				if (FAILED(writeResult) || written != fileData.size())
-					opRes = NArchive::NExtract::NOperationResult::kDataError;
-			}
-
-			realOutStream.Release();
-			RINOK(extractCallback->SetOperationResult(opRes));
-		}
-		return S_OK;
-	}
-
-	// Standard sequential extraction
 	UInt64 currentTotalSize = 0;
 	for (UInt32 i = 0; i < numItems; i++)
 	{
 		UInt32 index = allFilesMode ? i : indices[i];
-		if (index >= itemsList.size())
+		if (index >= rpaHandler.GetFileCount())
 			continue;
 
-		const auto& item = itemsList[index];
-		const std::string& fileName = item.first;
-		const auto& fileInfo = item.second;
+		const auto& fileInfo = rpaHandler.GetEntry(index);
 
 		progress->InSize = progress->OutSize = currentTotalSize;
 		RINOK(progress->SetCur());
@@ -405,44 +313,13 @@ STDMETHODIMP CHandler::Extract(const UInt32* indices, UInt32 numItems, Int32 tes
 
 		RINOK(extractCallback->PrepareOperation(askMode));
 
+		// Tuple ranges go straight from the mapping (or stream) to the output
 		Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
-		std::vector<uint8_t> fileData;
-
-		// Extract file data
-		HRESULT extractResult;
-		if (hasArchiveCache)
-		{
-			fileData.reserve(fileInfo.length);
-			for (const auto& tuplePair : fileInfo.tuples)
-			{
-				const auto& tuple = tuplePair.second;
-				fileData.insert(fileData.end(), tuple.prefix.begin(), tuple.prefix.end());
-
-				size_t dataLength = tuple.length - tuple.prefix.size();
-				if (dataLength > 0 && tuple.offset + dataLength <= archiveDataCache.size())
-				{
-					const uint8_t* srcData = &archiveDataCache[static_cast<size_t>(tuple.offset)];
-					fileData.insert(fileData.end(), srcData, srcData + dataLength);
-				}
-			}
-			extractResult = S_OK;
-		}
-		else
-		{
-			extractResult = rpaHandler.ExtractFile(mainStream, fileName, fileData);
-		}
-
-		if (FAILED(extractResult))
-		{
+		HRESULT extractResult = rpaHandler.ExtractToStream(mainStream, fileInfo, testMode ? nullptr : (ISequentialOutStream*)realOutStream);
+		if (extractResult == S_FALSE)
 			opRes = NArchive::NExtract::NOperationResult::kDataError;
-		}
-		else if (!testMode && realOutStream)
-		{
-			UInt32 written = 0;
-			HRESULT writeResult = realOutStream->Write(fileData.data(), static_cast<UInt32>(fileData.size()), &written);
-			if (FAILED(writeResult) || written != fileData.size())
-				opRes = NArchive::NExtract::NOperationResult::kDataError;
-		}
+		else
+			RINOK(extractResult);
 
 		realOutStream.Release();
 		RINOK(extractCallback->SetOperationResult(opRes));
@@ -456,12 +333,10 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream) MY_
 {
 	*stream = nullptr;
 
-	if (index >= itemsList.size())
+	if (index >= rpaHandler.GetFileCount())
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 
-	const auto& item = itemsList[index];
-	const std::string& fileName = item.first;
-	const auto& fileInfo = item.second;
+	const auto& fileInfo = rpaHandler.GetEntry(index);
 
 	if (fileInfo.length == 0)
 	{
@@ -470,48 +345,266 @@ STDMETHODIMP CHandler::GetStream(UInt32 index, ISequentialInStream** stream) MY_
 		return S_OK;
 	}
 
-	std::vector<uint8_t> fileData;
-	HRESULT result = S_OK;
+	if (!mainStream)
+		return E_FAIL;
+
+	// The entry is read in place, from the mapping or mainStream
+	HRESULT result = rpaHandler.CreateEntryStream(mainStream, fileInfo, stream);
+	if (result != S_OK)
+		return E_FAIL;
+
+	return S_OK;
+}
+
+STDMETHODIMP CHandler::GetFileTimeType(UInt32* type) MY_NO_THROW_DECL_ONLY
+{
+	if (!type)
+		return E_POINTER;
+	*type = NFileTimeType::kUnix;
+	return S_OK;
+}
+
+// COM identity: both interfaces belong to one object
+static bool IsSameObject(IUnknown* a, IUnknown* b)
+{
+	CMyComPtr<IUnknown> unknownA, unknownB;
+	a->QueryInterface(IID_IUnknown, (void**)&unknownA);
+	b->QueryInterface(IID_IUnknown, (void**)&unknownB);
+	return unknownA && unknownA == unknownB;
+}
+
+// Writes a complete RPA-3.x archive to outStream. Items kept from the open
+// archive are byte-copied from their tuple ranges (prefixes included), so
+// nothing is re-read through the entry streams; new items stream straight
+// from the callback, and the index is pickled and written last.
+STDMETHODIMP CHandler::UpdateItems(ISequentialOutStream* outStream, UInt32 numItems, IArchiveUpdateCallback* updateCallback) MY_NO_THROW_DECL_ONLY
+{
+	COM_TRY_BEGIN
+		if (!updateCallback)
+			return E_FAIL;
+
+	// The header points at the index, which is only placed once every
+	// payload is written
+	CMyComPtr<IOutStream> outSeekStream;
+	outStream->QueryInterface(IID_IOutStream, (void**)&outSeekStream);
+	if (!outSeekStream)
+		return E_NOTIMPL;
+
+	// 7-Zip always writes to a temporary file and swaps it in, but a host
+	// that passes back the read/write stream the archive was opened from
+	// gets an append instead of a rewrite
+	if (mainStream && IsSameObject(outSeekStream, mainStream))
+		return UpdateItemsInPlace(outSeekStream, numItems, updateCallback);
+
+	double version = writeVersion;
+	if (version == 0.0)
+		version = archiveVersion >= RPA::VERSION_RPA_3 ? archiveVersion : RPA::VERSION_RPA_3;
+	int64_t key = archiveVersion >= RPA::VERSION_RPA_3 ? rpaHandler.GetObfuscationKey() : RPA::DEFAULT_OBFUSCATION_KEY;
+
+	UInt64 total = 0;
+	for (UInt32 i = 0; i < numItems; i++)
+	{
+		Int32 newData = 0;
+		Int32 newProps = 0;
+		UInt32 indexInArchive = (UInt32)-1;
+		RINOK(updateCallback->GetUpdateItemInfo(i, &newData, &newProps, &indexInArchive));
+
+		if (newData)
+		{
+			NWindows::NCOM::CPropVariant prop;
+			RINOK(updateCallback->GetProperty(i, kpidSize, &prop));
+			if (prop.vt == VT_UI8)
+				total += prop.uhVal.QuadPart;
+		}
+		else if (indexInArchive < rpaHandler.GetFileCount())
+		{
+			total += rpaHandler.GetEntry(indexInArchive).length;
+		}
+	}
+	RINOK(updateCallback->SetTotal(total));
+
+	RPAArchiveWriter writer;
+	RINOK(writer.Create(outSeekStream, version, key));
+
+	CMyComPtr<CLocalProgress> progress = new CLocalProgress;
+	progress->Init(updateCallback, true);
 
-	// Extract file data
-	if (hasArchiveCache)
+	UInt64 completed = 0;
+	for (UInt32 i = 0; i < numItems; i++)
 	{
-		fileData.reserve(fileInfo.length);
-		for (const auto& tuplePair : fileInfo.tuples)
+		progress->InSize = progress->OutSize = completed;
+
+		Int32 newData = 0;
+		Int32 newProps = 0;
+		UInt32 indexInArchive = (UInt32)-1;
+		RINOK(updateCallback->GetUpdateItemInfo(i, &newData, &newProps, &indexInArchive));
+
+		const bool fromArchive = indexInArchive < rpaHandler.GetFileCount();
+		if (!newData && !fromArchive)
+			return E_INVALIDARG;
+
+		std::string path;
+		if (newProps || !fromArchive)
 		{
-			const auto& tuple = tuplePair.second;
-			fileData.insert(fileData.end(), tuple.prefix.begin(), tuple.prefix.end());
+			NWindows::NCOM::CPropVariant prop;
+			RINOK(updateCallback->GetProperty(i, kpidIsDir, &prop));
+			if (prop.vt == VT_BOOL && prop.boolVal != VARIANT_FALSE)
+				continue;  // RPA has no directory entries
+
+			prop.Clear();
+			RINOK(updateCallback->GetProperty(i, kpidPath, &prop));
+			if (prop.vt != VT_BSTR)
+				return E_INVALIDARG;
+			path = wideToUtf8(prop.bstrVal);
+			std::replace(path.begin(), path.end(), '\\', '/');
+		}
+		else
+		{
+			const auto& fileInfo = rpaHandler.GetEntry(indexInArchive);
+			path.assign(rpaHandler.GetPath(fileInfo), fileInfo.pathSize);
+		}
 
-			size_t dataLength = tuple.length - tuple.prefix.size();
-			if (dataLength > 0 && tuple.offset + dataLength <= archiveDataCache.size())
+		if (newData)
+		{
+			CMyComPtr<ISequentialInStream> fileInStream;
+			HRESULT res = updateCallback->GetStream(i, &fileInStream);
+			if (res == S_FALSE)
+				continue;  // The file could not be opened and is skipped
+			RINOK(res);
+
+			UInt64 size = 0;
+			RINOK(writer.AddStream(path.data(), path.size(), fileInStream, &size, progress));
+			RINOK(updateCallback->SetOperationResult(NArchive::NUpdate::NOperationResult::kOK));
+			completed += size;
+		}
+		else
+		{
+			const auto& fileInfo = rpaHandler.GetEntry(indexInArchive);
+			HRESULT res = writer.AddCopy(path.data(), path.size(), rpaHandler, mainStream, fileInfo, progress);
+			if (res == S_FALSE)
+				return E_FAIL;
+			RINOK(res);
+			completed += fileInfo.length;
+		}
+
+		RINOK(updateCallback->SetCompleted(&completed));
+	}
+
+	return writer.Finish();
+	COM_TRY_END
+}
+
+// Kept entries stay where they are, new data and the index are appended and
+// everything the update no longer lists is dropped from the index. Payloads
+// cannot be renamed without copying them through the same stream, so a
+// rename without new data is refused.
+HRESULT CHandler::UpdateItemsInPlace(IOutStream* archiveFile, UInt32 numItems, IArchiveUpdateCallback* updateCallback)
+{
+	std::vector<bool> kept(rpaHandler.GetFileCount(), false);
+	std::vector<RPAArchiveWriter::Change> changes;
+	std::vector<CMyComPtr<ISequentialInStream>> newStreams;  // Owns the Change::data pointers
+
+	UInt64 total = 0;
+	for (UInt32 i = 0; i < numItems; i++)
+	{
+		Int32 newData = 0;
+		Int32 newProps = 0;
+		UInt32 indexInArchive = (UInt32)-1;
+		RINOK(updateCallback->GetUpdateItemInfo(i, &newData, &newProps, &indexInArchive));
+
+		const bool fromArchive = indexInArchive < rpaHandler.GetFileCount();
+		if (!newData && !fromArchive)
+			return E_INVALIDARG;
+
+		std::string path;
+		if (newProps || !fromArchive)
+		{
+			NWindows::NCOM::CPropVariant prop;
+			RINOK(updateCallback->GetProperty(i, kpidIsDir, &prop));
+			if (prop.vt == VT_BOOL && prop.boolVal != VARIANT_FALSE)
+				continue;  // RPA has no directory entries
+
+			prop.Clear();
+			RINOK(updateCallback->GetProperty(i, kpidPath, &prop));
+			if (prop.vt != VT_BSTR)
+				return E_INVALIDARG;
+			path = wideToUtf8(prop.bstrVal);
+			std::replace(path.begin(), path.end(), '\\', '/');
+		}
+		else
+		{
+			const auto& fileInfo = rpaHandler.GetEntry(indexInArchive);
+			path.assign(rpaHandler.GetPath(fileInfo), fileInfo.pathSize);
+		}
+
+		if (!newData)
+		{
+			const auto& fileInfo = rpaHandler.GetEntry(indexInArchive);
+			if (path != std::string(rpaHandler.GetPath(fileInfo), fileInfo.pathSize))
 			{
-				const uint8_t* srcData = &archiveDataCache[static_cast<size_t>(tuple.offset)];
-				fileData.insert(fileData.end(), srcData, srcData + dataLength);
+				logDebug("In-place update cannot rename " + path);
+				return E_NOTIMPL;
 			}
+			kept[indexInArchive] = true;
+			continue;
 		}
+
+		NWindows::NCOM::CPropVariant sizeProp;
+		RINOK(updateCallback->GetProperty(i, kpidSize, &sizeProp));
+		if (sizeProp.vt == VT_UI8)
+			total += sizeProp.uhVal.QuadPart;
+
+		CMyComPtr<ISequentialInStream> fileInStream;
+		HRESULT res = updateCallback->GetStream(i, &fileInStream);
+		if (res == S_FALSE)
+			continue;  // The file could not be opened and is skipped
+		RINOK(res);
+
+		changes.push_back({ path, fileInStream });
+		newStreams.push_back(fileInStream);
 	}
-	else
+
+	for (size_t i = 0; i < kept.size(); i++)
 	{
-		if (!mainStream)
-			return E_FAIL;
-		result = rpaHandler.ExtractFile(mainStream, fileName, fileData);
+		if (!kept[i])
+		{
+			const auto& fileInfo = rpaHandler.GetEntry(i);
+			changes.push_back({ std::string(rpaHandler.GetPath(fileInfo), fileInfo.pathSize), nullptr });
+		}
 	}
 
-	if (FAILED(result))
-		return E_FAIL;
+	RINOK(updateCallback->SetTotal(total));
 
-	CMyComPtr<CLimitedCachedInStream> limitedStream = new CLimitedCachedInStream;
-
-	limitedStream->SetStream(mainStream, 0);
+	CMyComPtr<CLocalProgress> progress = new CLocalProgress;
+	progress->Init(updateCallback, true);
+	RINOK(RPAArchiveWriter::UpdateInPlace(archiveFile, rpaHandler, changes, progress));
 
-	auto& preload = limitedStream->Buffer;
-	preload.Alloc(fileData.size());
-	memcpy(preload, fileData.data(), fileData.size());
+	for (size_t i = 0; i < newStreams.size(); i++)
+		RINOK(updateCallback->SetOperationResult(NArchive::NUpdate::NOperationResult::kOK));
+	return updateCallback->SetCompleted(&total);
+}
 
-	limitedStream->SetCache(fileData.size(), 0);
-	RINOK(limitedStream->InitAndSeek(0, fileData.size()));
+// "v" selects the header written by UpdateItems: 3.0 (default) or 3.2.
+// The compression level is accepted and ignored, as payloads are stored.
+STDMETHODIMP CHandler::SetProperties(const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps) MY_NO_THROW_DECL_ONLY
+{
+	writeVersion = 0.0;
+	for (UInt32 i = 0; i < numProps; i++)
+	{
+		if (wcscmp(names[i], L"x") == 0)
+			continue;
+		if (wcscmp(names[i], L"v") != 0)
+			return E_INVALIDARG;
+		if (values[i].vt != VT_BSTR)
+			return E_INVALIDARG;
 
-	*stream = limitedStream.Detach();
+		if (wcscmp(values[i].bstrVal, L"3.0") == 0)
+			writeVersion = RPA::VERSION_RPA_3;
+		else if (wcscmp(values[i].bstrVal, L"3.2") == 0)
+			writeVersion = RPA::VERSION_RPA_3_2;
+		else
+			return E_INVALIDARG;
+	}
 	return S_OK;
 }
 
@@ -535,7 +628,7 @@ API_FUNC_IsArc IsArc_RPA(const Byte* p, size_t size)
 	return k_IsArc_Res_NO;
 }
 
-REGISTER_ARC_I(
+REGISTER_ARC_IO(
 	"RPA",
 	"rpa rpi",
 	0,
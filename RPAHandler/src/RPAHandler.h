@@ -8,6 +8,8 @@
 #include <sstream>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <ctime>
@@ -16,7 +18,14 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
 #include "zlib_decoder.h"
+#include "zlib_encoder.h"
+#include "robin_hood.h"
+#include "7zCrc.h"
 
 // Forward declarations for COM interfaces
 interface IInStream;
@@ -130,124 +139,424 @@ namespace Pickle {
 	const uint8_t READONLY_BUFFER = '\x98';
 }
 
-class PickleParser {
+// Streaming reader for the RPA index pickle. Instead of building a tree of
+// every object it keeps a stack of small values: strings and bytes are copied
+// into an arena, and only lists and tuples are materialised, in pooled
+// containers that are recycled once the entry owning them has been reported.
+// Items stored into the first (root) dict are handed to the callback as they
+// are set, in the {path: [(offset, length, prefix)]} shape, so the index is
+// never held as a whole.
+//
+// Input arrives in chunks of any size: an opcode cut off at the end of a
+// chunk is kept back and parsed once the next chunk completes it. Nothing
+// points into the chunks afterwards, so the caller can reuse their buffers.
+class PickleIndexReader {
 public:
-	enum ValueType {
+	struct IndexTuple {
+		int64_t offset;
+		int64_t length;
+		const uint8_t* prefix;    // valid during the callback, may be null
+		uint32_t prefixSize;
+	};
+
+	typedef std::function<void(const char* path, size_t pathSize,
+		const IndexTuple* tuples, size_t count)> EntryCallback;
+
+	PickleIndexReader() : data(nullptr), size(0), pos(0), endOfInput(false), stopped(false),
+		fedSize(0), rootDict(NO_CONTAINER), memoCount(0) {}
+
+	// Parses the opcodes completed by this chunk. Returns S_OK once STOP has
+	// been read and S_FALSE while more input is expected; throws on
+	// malformed data
+	HRESULT feed(const uint8_t* chunk, size_t chunkSize, const EntryCallback& onEntry);
+
+	// Ends the input. Returns S_OK if the root dict is complete
+	HRESULT finish(const EntryCallback& onEntry);
+
+private:
+	enum ValueType : uint8_t {
 		TYPE_NONE,
 		TYPE_INT,
-		TYPE_LONG,
 		TYPE_STRING,
 		TYPE_UNICODE,
+		TYPE_BYTES,
 		TYPE_LIST,
 		TYPE_TUPLE,
 		TYPE_DICT,
-		TYPE_BYTES
+		TYPE_MARK
 	};
 
 	struct Value {
 		ValueType type;
+		uint32_t size;            // string length, or container generation
 		union {
 			int64_t intValue;
-			double floatValue;
+			const uint8_t* str;
+			uint32_t container;
 		};
-		std::string strValue;
-		std::vector<uint8_t> bytesValue;
-		std::vector<std::shared_ptr<Value>> listValue;
-		std::map<std::string, std::shared_ptr<Value>> dictValue;
+	};
 
-		Value(ValueType t = TYPE_NONE) : type(t), intValue(0) {}
+	struct Container {
+		std::vector<Value> items;
+		uint32_t generation;
 	};
 
-	PickleParser(const uint8_t* d, size_t s) : data(d), size(s), pos(0) {}
+	// Bump allocator for string bytes. Blocks never move, so copies stay put
+	// until the arena is reset.
+	class StringArena {
+	public:
+		StringArena() : blockUsed(kBlockSize), total(0) {}
 
-	std::shared_ptr<Value> parse();
+		const uint8_t* copy(const uint8_t* p, size_t len);
+		void reset();
+		size_t used() const { return total; }
+
+	private:
+		static const size_t kBlockSize = 64 * 1024;
+
+		std::vector<std::unique_ptr<uint8_t[]>> blocks;
+		std::vector<std::unique_ptr<uint8_t[]>> largeBlocks;
+		size_t blockUsed;
+		size_t total;
+	};
+
+	// Thrown when an opcode runs past the end of a chunk that is not the last
+	struct NeedMoreData {};
+
+	static const uint32_t NO_CONTAINER = 0xFFFFFFFF;
+
+	// Strings of a finished batch of root items are dropped once this much
+	// has built up
+	static const size_t kTransientResetSize = 1 << 20;
 
-private:
 	const uint8_t* data;
 	size_t size;
 	size_t pos;
-	std::vector<std::shared_ptr<void>> stack;
-	std::map<int, std::shared_ptr<void>> memo;
+	bool endOfInput;
+	bool stopped;
+	uint64_t fedSize;
+	std::vector<uint8_t> pending;
+	std::vector<Value> stack;
+	std::vector<size_t> marks;
+	std::vector<Value> memo;
+	std::vector<Container> containers;
+	std::vector<uint32_t> freeContainers;
+	std::vector<IndexTuple> scratch;
+	StringArena transientStrings;
+	StringArena memoStrings;
+	uint32_t rootDict;
+	size_t memoCount;
+
+	void require(size_t len) {
+		if (size - pos < len) {
+			if (endOfInput) throw std::runtime_error("Unexpected end of pickle data");
+			throw NeedMoreData();
+		}
+	}
 
 	uint8_t readByte() {
-		if (pos >= size) throw std::runtime_error("Unexpected end of pickle data");
+		require(1);
 		return data[pos++];
 	}
 
-	int32_t readInt32() {
-		if (pos + 4 > size) throw std::runtime_error("Unexpected end of pickle data");
-		int32_t value = *reinterpret_cast<const int32_t*>(&data[pos]);
-		pos += 4;
+	template <typename T>
+	T readScalar() {
+		require(sizeof(T));
+		T value;
+		memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
 		return value;
 	}
 
-	uint32_t readUInt32() {
-		if (pos + 4 > size) throw std::runtime_error("Unexpected end of pickle data");
-		uint32_t value = *reinterpret_cast<const uint32_t*>(&data[pos]);
-		pos += 4;
-		return value;
+	const uint8_t* readBytes(size_t len) {
+		require(len);
+		const uint8_t* p = data + pos;
+		pos += len;
+		return p;
 	}
 
-	int16_t readInt16() {
-		if (pos + 2 > size) throw std::runtime_error("Unexpected end of pickle data");
-		int16_t value = *reinterpret_cast<const int16_t*>(&data[pos]);
-		pos += 2;
-		return value;
+	// Returns the line as a view and steps past its terminator
+	const uint8_t* readLine(size_t* len) {
+		const uint8_t* start = data + pos;
+		while (pos < size && data[pos] != '\n' && data[pos] != '\r') pos++;
+		// A chunk ending in or just after the line may not hold its whole terminator
+		if (!endOfInput && size - pos < 2) throw NeedMoreData();
+		*len = (data + pos) - start;
+		if (pos < size && data[pos++] == '\r' && pos < size && data[pos] == '\n') pos++;
+		return start;
 	}
 
-	uint64_t readUInt64() {
-		if (pos + 8 > size) throw std::runtime_error("Unexpected end of pickle data");
-		uint64_t value = *reinterpret_cast<const uint64_t*>(&data[pos]);
-		pos += 8;
-		return value;
+	std::string readLineString() {
+		size_t len;
+		const uint8_t* line = readLine(&len);
+		return std::string(reinterpret_cast<const char*>(line), len);
 	}
 
-	std::string readLine() {
-		std::string line;
-		while (pos < size) {
-			char ch = static_cast<char>(data[pos++]);
-			if (ch == '\n') break;
-			if (ch == '\r') {
-				if (pos < size && data[pos] == '\n') pos++;
-				break;
-			}
-			line += ch;
+	static Value makeValue(ValueType type) {
+		Value v;
+		v.type = type;
+		v.size = 0;
+		v.intValue = 0;
+		return v;
+	}
+
+	static Value makeInt(int64_t value) {
+		Value v = makeValue(TYPE_INT);
+		v.intValue = value;
+		return v;
+	}
+
+	// Copies the string out of the input, which does not outlive the chunk
+	Value makeString(ValueType type, const uint8_t* str, size_t len) {
+		Value v = makeValue(type);
+		v.str = transientStrings.copy(str, len);
+		v.size = static_cast<uint32_t>(len);
+		return v;
+	}
+
+	Value newContainer(ValueType type) {
+		uint32_t id;
+		if (!freeContainers.empty()) {
+			id = freeContainers.back();
+			freeContainers.pop_back();
+		}
+		else {
+			id = static_cast<uint32_t>(containers.size());
+			containers.push_back(Container());
+			containers.back().generation = 0;
 		}
-		return line;
+		Value v = makeValue(type);
+		v.container = id;
+		v.size = containers[id].generation;
+		return v;
 	}
 
-	std::string readString(size_t len) {
-		if (pos + len > size) throw std::runtime_error("Unexpected end of pickle data");
-		std::string str(reinterpret_cast<const char*>(&data[pos]), len);
-		pos += len;
-		return str;
+	static bool isContainer(const Value& v) {
+		return v.type == TYPE_LIST || v.type == TYPE_TUPLE || v.type == TYPE_DICT;
+	}
+
+	// Null for non-containers and for containers that have since been recycled
+	Container* resolve(const Value& v) {
+		if (!isContainer(v)) return nullptr;
+		Container& c = containers[v.container];
+		return c.generation == v.size ? &c : nullptr;
+	}
+
+	// Hands a container and everything below it back to the pool
+	void release(const Value& v) {
+		std::vector<Value> pending(1, v);
+		while (!pending.empty()) {
+			Value cur = pending.back();
+			pending.pop_back();
+			Container* c = resolve(cur);
+			if (!c || cur.container == rootDict) continue;
+			for (const Value& child : c->items) {
+				if (isContainer(child)) pending.push_back(child);
+			}
+			c->items.clear();
+			c->generation++;
+			freeContainers.push_back(cur.container);
+		}
 	}
 
-	std::shared_ptr<Value> popStack() {
+	Value popStack() {
 		if (stack.empty()) throw std::runtime_error("Stack underflow");
-		auto val = std::static_pointer_cast<Value>(stack.back());
+		Value v = stack.back();
 		stack.pop_back();
-		return val;
+		if (v.type == TYPE_MARK && !marks.empty()) marks.pop_back();
+		return v;
+	}
+
+	void pushStack(const Value& v) {
+		stack.push_back(v);
+	}
+
+	// Index of the first item above the topmost mark (the whole stack if none)
+	size_t markStart() const {
+		return marks.empty() ? 0 : marks.back() + 1;
+	}
+
+	// Drops the items above the topmost mark together with the mark itself
+	void dropMark(size_t start) {
+		if (!marks.empty()) {
+			marks.pop_back();
+			start--;
+		}
+		stack.resize(start);
+	}
+
+	Value containerFromMark(ValueType type) {
+		size_t start = markStart();
+		Value v = newContainer(type);
+		containers[v.container].items.assign(stack.begin() + start, stack.end());
+		dropMark(start);
+		return v;
 	}
 
-	void pushStack(std::shared_ptr<Value> val) {
-		stack.push_back(val);
+	// Memoized strings can be fetched at any later point, so they move to
+	// an arena that lives as long as the reader
+	void setMemo(size_t idx) {
+		if (stack.empty() || stack.back().type == TYPE_MARK) return;
+		if (idx > fedSize) throw std::runtime_error("Memo index out of range");
+		if (idx >= memo.size()) memo.resize(idx + 1, makeValue(TYPE_MARK));
+		if (memo[idx].type == TYPE_MARK) memoCount++;
+		Value& top = stack.back();
+		if (top.type == TYPE_STRING || top.type == TYPE_UNICODE || top.type == TYPE_BYTES) {
+			top.str = memoStrings.copy(top.str, top.size);
+		}
+		memo[idx] = top;
 	}
 
-	std::vector<std::shared_ptr<Value>> popMark() {
-		std::vector<std::shared_ptr<Value>> items;
-		while (!stack.empty()) {
-			auto item = stack.back();
-			stack.pop_back();
-			if (!item) break; // Found mark
-			items.insert(items.begin(), std::static_pointer_cast<Value>(item));
+	void getMemo(size_t idx) {
+		if (idx < memo.size() && memo[idx].type != TYPE_MARK) {
+			pushStack(memo[idx]);
 		}
-		return items;
 	}
+
+	void setItems(const Value& dict, const Value* items, size_t count, const EntryCallback& onEntry);
+	void reportEntry(const Value& key, const Value& value, const EntryCallback& onEntry);
+	void recycleTransient();
+	HRESULT run(const EntryCallback& onEntry);
 };
 
-std::shared_ptr<PickleParser::Value> PickleParser::parse() {
+const uint8_t* PickleIndexReader::StringArena::copy(const uint8_t* p, size_t len) {
+	static const uint8_t kEmpty = 0;
+	if (len == 0) return &kEmpty;
+
+	total += len;
+	if (len > kBlockSize / 4) {
+		largeBlocks.emplace_back(new uint8_t[len]);
+		memcpy(largeBlocks.back().get(), p, len);
+		return largeBlocks.back().get();
+	}
+
+	if (kBlockSize - blockUsed < len) {
+		blocks.emplace_back(new uint8_t[kBlockSize]);
+		blockUsed = 0;
+	}
+	uint8_t* dst = blocks.back().get() + blockUsed;
+	memcpy(dst, p, len);
+	blockUsed += len;
+	return dst;
+}
+
+// Keeps one block for reuse
+void PickleIndexReader::StringArena::reset() {
+	if (blocks.size() > 1) blocks.erase(blocks.begin() + 1, blocks.end());
+	largeBlocks.clear();
+	blockUsed = 0;
+	total = 0;
+	if (blocks.empty()) blockUsed = kBlockSize;
+}
+
+// Called with nothing but the root dict on the stack: every string and
+// container left over from the previous items is unreachable, so the
+// transient strings go, and containers that were never released (and could
+// still be reached through the memo) are invalidated along with them
+void PickleIndexReader::recycleTransient() {
+	freeContainers.clear();
+	for (uint32_t id = 0; id < containers.size(); id++) {
+		if (id == rootDict) continue;
+		containers[id].items.clear();
+		containers[id].generation++;
+		freeContainers.push_back(id);
+	}
+	transientStrings.reset();
+}
+
+void PickleIndexReader::reportEntry(const Value& key, const Value& value, const EntryCallback& onEntry) {
+	Container* list = (value.type == TYPE_LIST || value.type == TYPE_TUPLE) ? resolve(value) : nullptr;
+	if (!list) return;
+
+	scratch.clear();
+	for (const Value& item : list->items) {
+		Container* tuple = (item.type == TYPE_TUPLE || item.type == TYPE_LIST) ? resolve(item) : nullptr;
+		if (!tuple || tuple->items.size() < 2) continue;
+
+		const Value& offsetVal = tuple->items[0];
+		const Value& lengthVal = tuple->items[1];
+		if (offsetVal.type != TYPE_INT || lengthVal.type != TYPE_INT) continue;
+
+		IndexTuple t;
+		t.offset = offsetVal.intValue;
+		t.length = lengthVal.intValue;
+		t.prefix = nullptr;
+		t.prefixSize = 0;
+
+		if (tuple->items.size() >= 3) {
+			const Value& prefixVal = tuple->items[2];
+			if ((prefixVal.type == TYPE_STRING || prefixVal.type == TYPE_BYTES) && prefixVal.size != 0) {
+				t.prefix = prefixVal.str;
+				t.prefixSize = prefixVal.size;
+			}
+		}
+		scratch.push_back(t);
+	}
+
+	// Non-string keys all collapse to the empty path, as a dict keyed by str would
+	bool named = key.type == TYPE_STRING || key.type == TYPE_UNICODE;
+	onEntry(named ? reinterpret_cast<const char*>(key.str) : "", named ? key.size : 0,
+		scratch.data(), scratch.size());
+}
+
+void PickleIndexReader::setItems(const Value& dict, const Value* items, size_t count, const EntryCallback& onEntry) {
+	bool isRoot = dict.type == TYPE_DICT && dict.container == rootDict && resolve(dict);
+	for (size_t i = 0; i + 1 < count; i += 2) {
+		if (isRoot) {
+			reportEntry(items[i], items[i + 1], onEntry);
+		}
+		release(items[i + 1]);
+	}
+}
+
+HRESULT PickleIndexReader::feed(const uint8_t* chunk, size_t chunkSize, const EntryCallback& onEntry) {
+	if (stopped) return S_OK;
+	fedSize += chunkSize;
+
+	if (pending.empty()) {
+		data = chunk;
+		size = chunkSize;
+		pos = 0;
+		HRESULT hr = run(onEntry);
+		if (hr == S_FALSE) pending.assign(chunk + pos, chunk + size);
+		return hr;
+	}
+
+	// Finish the opcode held back from the previous chunk
+	pending.insert(pending.end(), chunk, chunk + chunkSize);
+	data = pending.data();
+	size = pending.size();
+	pos = 0;
+	HRESULT hr = run(onEntry);
+	pending.erase(pending.begin(), pending.begin() + pos);
+	return hr;
+}
+
+HRESULT PickleIndexReader::finish(const EntryCallback& onEntry) {
+	if (stopped) return S_OK;
+
+	endOfInput = true;
+	data = pending.data();
+	size = pending.size();
+	pos = 0;
+	HRESULT hr = run(onEntry);
+	pending.clear();
+	if (hr == S_OK) return S_OK;
+
+	return (!stack.empty() && stack.back().type == TYPE_DICT &&
+		stack.back().container == rootDict) ? S_OK : E_FAIL;
+}
+
+// Parses whole opcodes from data[pos, size). Returns S_FALSE with pos at
+// the start of the first incomplete one.
+HRESULT PickleIndexReader::run(const EntryCallback& onEntry) {
 	while (pos < size) {
+		if (stack.size() == 1 && marks.empty() && stack[0].type == TYPE_DICT &&
+			stack[0].container == rootDict && transientStrings.used() >= kTransientResetSize) {
+			recycleTransient();
+		}
+
+		size_t start = pos;
 		uint8_t opcode = readByte();
 
 		try {
@@ -259,444 +568,286 @@ std::shared_ptr<PickleParser::Value> PickleParser::parse() {
 			}
 
 			case Pickle::MARK:
-				stack.push_back(nullptr); // Mark
+				marks.push_back(stack.size());
+				pushStack(makeValue(TYPE_MARK));
 				break;
 
 			case Pickle::STOP:
-				if (!stack.empty()) {
-					return std::static_pointer_cast<Value>(stack.back());
-				}
-				return std::make_shared<Value>(TYPE_NONE);
-
-			case Pickle::INT: {
-				std::string line = readLine();
-				int64_t val = std::stoll(line);
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = val;
-				pushStack(value);
+				stopped = true;
+				return (!stack.empty() && stack.back().type == TYPE_DICT &&
+					stack.back().container == rootDict) ? S_OK : E_FAIL;
+
+			case Pickle::INT:
+				pushStack(makeInt(std::stoll(readLineString())));
 				break;
-			}
 
-			case Pickle::BININT: {
-				int32_t val = readInt32();
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = val;
-				pushStack(value);
+			case Pickle::BININT:
+				pushStack(makeInt(readScalar<int32_t>()));
 				break;
-			}
 
-			case Pickle::BININT1: {
-				uint8_t val = readByte();
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = val;
-				pushStack(value);
+			case Pickle::BININT1:
+				pushStack(makeInt(readByte()));
 				break;
-			}
 
-			case Pickle::BININT2: {
-				uint16_t val = readInt16();
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = val;
-				pushStack(value);
+			case Pickle::BININT2:
+				pushStack(makeInt(readScalar<uint16_t>()));
 				break;
-			}
 
 			case Pickle::LONG: {
-				std::string line = readLine();
+				std::string line = readLineString();
 				if (!line.empty() && line.back() == 'L') {
 					line.pop_back();
 				}
-				int64_t val = std::stoll(line);
-				auto value = std::make_shared<Value>(TYPE_LONG);
-				value->intValue = val;
-				pushStack(value);
-				break;
-			}
-
-			case Pickle::LONG1: {
-				uint8_t len = readByte();
-				int64_t val = 0;
-				for (int i = 0; i < len && i < 8; i++) {
-					val |= static_cast<int64_t>(readByte()) << (i * 8);
-				}
-				auto value = std::make_shared<Value>(TYPE_LONG);
-				value->intValue = val;
-				pushStack(value);
+				pushStack(makeInt(std::stoll(line)));
 				break;
 			}
 
+			case Pickle::LONG1:
 			case Pickle::LONG4: {
-				uint32_t len = readUInt32();
+				uint32_t len = (opcode == Pickle::LONG1) ? readByte() : readScalar<uint32_t>();
+				const uint8_t* bytes = readBytes(len);
 				int64_t val = 0;
 				for (uint32_t i = 0; i < len && i < 8; i++) {
-					val |= static_cast<int64_t>(readByte()) << (i * 8);
+					val |= static_cast<int64_t>(bytes[i]) << (i * 8);
 				}
-				auto value = std::make_shared<Value>(TYPE_LONG);
-				value->intValue = val;
-				pushStack(value);
+				pushStack(makeInt(val));
 				break;
 			}
 
 			case Pickle::STRING: {
-				std::string line = readLine();
+				size_t len;
+				const uint8_t* line = readLine(&len);
 				// Remove quotes
-				if (line.size() >= 2 && line.front() == '\'' && line.back() == '\'') {
-					line = line.substr(1, line.size() - 2);
+				if (len >= 2 && line[0] == '\'' && line[len - 1] == '\'') {
+					line++;
+					len -= 2;
 				}
-				auto value = std::make_shared<Value>(TYPE_STRING);
-				value->strValue = line;
-				pushStack(value);
+				pushStack(makeString(TYPE_STRING, line, len));
 				break;
 			}
 
 			case Pickle::BINSTRING:
 			case Pickle::BINBYTES: {
-				uint32_t len = readUInt32();
-				auto str = readString(len);
-				if (opcode == Pickle::BINBYTES) {
-					auto value = std::make_shared<Value>(TYPE_BYTES);
-					value->bytesValue.assign(str.begin(), str.end());
-					pushStack(value);
-				}
-				else {
-					auto value = std::make_shared<Value>(TYPE_STRING);
-					value->strValue = str;
-					pushStack(value);
-				}
+				uint32_t len = readScalar<uint32_t>();
+				pushStack(makeString(opcode == Pickle::BINBYTES ? TYPE_BYTES : TYPE_STRING, readBytes(len), len));
 				break;
 			}
 
 			case Pickle::SHORT_BINSTRING:
 			case Pickle::SHORT_BINBYTES: {
 				uint8_t len = readByte();
-				auto str = readString(len);
-				if (opcode == Pickle::SHORT_BINBYTES) {
-					auto value = std::make_shared<Value>(TYPE_BYTES);
-					value->bytesValue.assign(str.begin(), str.end());
-					pushStack(value);
-				}
-				else {
-					auto value = std::make_shared<Value>(TYPE_STRING);
-					value->strValue = str;
-					pushStack(value);
-				}
+				pushStack(makeString(opcode == Pickle::SHORT_BINBYTES ? TYPE_BYTES : TYPE_STRING, readBytes(len), len));
+				break;
+			}
+
+			case Pickle::PYUNICODE: {
+				size_t len;
+				const uint8_t* line = readLine(&len);
+				pushStack(makeString(TYPE_UNICODE, line, len));
 				break;
 			}
 
-			case Pickle::PYUNICODE:
 			case Pickle::BINUNICODE: {
-				uint32_t len = (opcode == Pickle::BINUNICODE) ? readUInt32() : 0;
-				std::string str = (opcode == Pickle::BINUNICODE) ?
-					readString(len) : readLine();
-				auto value = std::make_shared<Value>(TYPE_UNICODE);
-				value->strValue = str;
-				pushStack(value);
+				uint32_t len = readScalar<uint32_t>();
+				pushStack(makeString(TYPE_UNICODE, readBytes(len), len));
 				break;
 			}
 
 			case Pickle::SHORT_BINUNICODE: {
 				uint8_t len = readByte();
-				std::string str = readString(len);
-				auto value = std::make_shared<Value>(TYPE_UNICODE);
-				value->strValue = str;
-				pushStack(value);
+				pushStack(makeString(TYPE_UNICODE, readBytes(len), len));
 				break;
 			}
 
-			case Pickle::BINUNICODE8: {
-				uint64_t len = readUInt64();
+			case Pickle::BINUNICODE8:
+			case Pickle::BINBYTES8:
+			case Pickle::BYTEARRAY8: {
+				uint64_t len = readScalar<uint64_t>();
 				if (len > 0x7FFFFFFF) {
 					throw std::runtime_error("String too large");
 				}
-				std::string str = readString(static_cast<size_t>(len));
-				auto value = std::make_shared<Value>(TYPE_UNICODE);
-				value->strValue = str;
-				pushStack(value);
-				break;
-			}
-
-			case Pickle::BINBYTES8: {
-				uint64_t len = readUInt64();
-				if (len > 0x7FFFFFFF) {
-					throw std::runtime_error("Bytes too large");
-				}
-				std::string str = readString(static_cast<size_t>(len));
-				auto value = std::make_shared<Value>(TYPE_BYTES);
-				value->bytesValue.assign(str.begin(), str.end());
-				pushStack(value);
+				ValueType type = (opcode == Pickle::BINUNICODE8) ? TYPE_UNICODE : TYPE_BYTES;
+				pushStack(makeString(type, readBytes(static_cast<size_t>(len)), static_cast<size_t>(len)));
 				break;
 			}
 
 			case Pickle::FRAME: {
-				uint64_t frameSize = readUInt64();
+				uint64_t frameSize = readScalar<uint64_t>();
 #ifdef _DEBUG
 				logDebug("Frame size: " + std::to_string(frameSize));
 #endif
 				break;
 			}
 
-			case Pickle::MEMOIZE: {
-				if (!stack.empty()) {
-					int idx = static_cast<int>(memo.size());
-					memo[idx] = stack.back();
-				}
+			case Pickle::MEMOIZE:
+				setMemo(memoCount);
 				break;
-			}
 
-			case Pickle::STACK_GLOBAL: {
+			case Pickle::STACK_GLOBAL:
 				if (stack.size() >= 2) {
 					popStack(); // name
 					popStack(); // module
 				}
-				auto value = std::make_shared<Value>(TYPE_NONE);
-				pushStack(value);
+				pushStack(makeValue(TYPE_NONE));
 				break;
-			}
 
-			case Pickle::EMPTY_SET: {
-				auto value = std::make_shared<Value>(TYPE_LIST);
-				pushStack(value);
+			case Pickle::EMPTY_SET:
+				pushStack(newContainer(TYPE_LIST));
 				break;
-			}
 
 			case Pickle::ADDITEMS: {
-				auto items = popMark();
-				auto set = popStack();
-				pushStack(set);
+				size_t start = markStart();
+				for (size_t i = start; i < stack.size(); i++) release(stack[i]);
+				dropMark(start);
 				break;
 			}
 
-			case Pickle::FROZENSET: {
-				auto items = popMark();
-				auto value = std::make_shared<Value>(TYPE_LIST);
-				value->listValue = items;
-				pushStack(value);
+			case Pickle::FROZENSET:
+				pushStack(containerFromMark(TYPE_LIST));
 				break;
-			}
 
-			case Pickle::NEWOBJ_EX: {
+			case Pickle::NEWOBJ_EX:
 				if (stack.size() >= 3) {
-					popStack(); // kwargs
-					popStack(); // args
+					release(popStack()); // kwargs
+					release(popStack()); // args
 					popStack(); // cls
 				}
-				auto value = std::make_shared<Value>(TYPE_NONE);
-				pushStack(value);
+				pushStack(makeValue(TYPE_NONE));
 				break;
-			}
 
 			case Pickle::NEXT_BUFFER:
 			case Pickle::READONLY_BUFFER:
-			case Pickle::BYTEARRAY8: {
-				auto value = std::make_shared<Value>(TYPE_NONE);
-				pushStack(value);
+			case Pickle::NONE:
+				pushStack(makeValue(TYPE_NONE));
 				break;
-			}
-
-			case Pickle::NONE: {
-				auto value = std::make_shared<Value>(TYPE_NONE);
-				pushStack(value);
-				break;
-			}
 
-			case Pickle::NEWTRUE: {
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = 1;
-				pushStack(value);
+			case Pickle::NEWTRUE:
+				pushStack(makeInt(1));
 				break;
-			}
 
-			case Pickle::NEWFALSE: {
-				auto value = std::make_shared<Value>(TYPE_INT);
-				value->intValue = 0;
-				pushStack(value);
+			case Pickle::NEWFALSE:
+				pushStack(makeInt(0));
 				break;
-			}
 
-			case Pickle::EMPTY_LIST: {
-				auto value = std::make_shared<Value>(TYPE_LIST);
-				pushStack(value);
+			case Pickle::EMPTY_LIST:
+				pushStack(newContainer(TYPE_LIST));
 				break;
-			}
 
 			case Pickle::APPEND: {
-				auto item = popStack();
-				auto list = popStack();
-				if (list->type == TYPE_LIST) {
-					list->listValue.push_back(item);
+				Value item = popStack();
+				Value list = popStack();
+				Container* c = list.type == TYPE_LIST ? resolve(list) : nullptr;
+				if (c) {
+					c->items.push_back(item);
+				}
+				else {
+					release(item);
 				}
 				pushStack(list);
 				break;
 			}
 
 			case Pickle::APPENDS: {
-				auto items = popMark();
-				auto list = popStack();
-				if (list->type == TYPE_LIST) {
-					list->listValue.insert(list->listValue.end(), items.begin(), items.end());
+				size_t start = markStart();
+				if (start < 2) throw std::runtime_error("Stack underflow");
+				const Value& list = stack[start - 2];
+				Container* c = list.type == TYPE_LIST ? resolve(list) : nullptr;
+				for (size_t i = start; i < stack.size(); i++) {
+					if (c) c->items.push_back(stack[i]);
+					else release(stack[i]);
 				}
-				pushStack(list);
-				break;
-			}
-
-			case Pickle::LIST: {
-				auto items = popMark();
-				auto value = std::make_shared<Value>(TYPE_LIST);
-				value->listValue = items;
-				pushStack(value);
-				break;
-			}
-
-			case Pickle::EMPTY_TUPLE: {
-				auto value = std::make_shared<Value>(TYPE_TUPLE);
-				pushStack(value);
+				dropMark(start);
 				break;
 			}
 
-			case Pickle::TUPLE: {
-				auto items = popMark();
-				auto value = std::make_shared<Value>(TYPE_TUPLE);
-				value->listValue = items;
-				pushStack(value);
+			case Pickle::LIST:
+				pushStack(containerFromMark(TYPE_LIST));
 				break;
-			}
 
-			case Pickle::TUPLE1: {
-				auto item = popStack();
-				auto value = std::make_shared<Value>(TYPE_TUPLE);
-				value->listValue.push_back(item);
-				pushStack(value);
+			case Pickle::EMPTY_TUPLE:
+				pushStack(newContainer(TYPE_TUPLE));
 				break;
-			}
 
-			case Pickle::TUPLE2: {
-				auto item2 = popStack();
-				auto item1 = popStack();
-				auto value = std::make_shared<Value>(TYPE_TUPLE);
-				value->listValue.push_back(item1);
-				value->listValue.push_back(item2);
-				pushStack(value);
+			case Pickle::TUPLE:
+				pushStack(containerFromMark(TYPE_TUPLE));
 				break;
-			}
 
+			case Pickle::TUPLE1:
+			case Pickle::TUPLE2:
 			case Pickle::TUPLE3: {
-				auto item3 = popStack();
-				auto item2 = popStack();
-				auto item1 = popStack();
-				auto value = std::make_shared<Value>(TYPE_TUPLE);
-				value->listValue.push_back(item1);
-				value->listValue.push_back(item2);
-				value->listValue.push_back(item3);
-				pushStack(value);
+				size_t count = opcode - Pickle::TUPLE1 + 1;
+				if (stack.size() < count) throw std::runtime_error("Stack underflow");
+				Value tuple = newContainer(TYPE_TUPLE);
+				containers[tuple.container].items.assign(stack.end() - count, stack.end());
+				for (size_t i = 0; i < count; i++) popStack();
+				pushStack(tuple);
 				break;
 			}
 
 			case Pickle::EMPTY_DICT: {
-				auto value = std::make_shared<Value>(TYPE_DICT);
-				pushStack(value);
+				Value dict = newContainer(TYPE_DICT);
+				if (rootDict == NO_CONTAINER) rootDict = dict.container;
+				pushStack(dict);
 				break;
 			}
 
 			case Pickle::DICT: {
-				auto items = popMark();
-				auto value = std::make_shared<Value>(TYPE_DICT);
-				for (size_t i = 0; i + 1 < items.size(); i += 2) {
-					std::string key;
-					if (items[i]->type == TYPE_STRING || items[i]->type == TYPE_UNICODE) {
-						key = items[i]->strValue;
-					}
-					value->dictValue[key] = items[i + 1];
-				}
-				pushStack(value);
+				size_t start = markStart();
+				Value dict = newContainer(TYPE_DICT);
+				if (rootDict == NO_CONTAINER) rootDict = dict.container;
+				setItems(dict, stack.data() + start, stack.size() - start, onEntry);
+				dropMark(start);
+				pushStack(dict);
 				break;
 			}
 
 			case Pickle::SETITEM: {
-				auto val = popStack();
-				auto key = popStack();
-				auto dict = popStack();
-				if (dict->type == TYPE_DICT) {
-					std::string keyStr;
-					if (key->type == TYPE_STRING || key->type == TYPE_UNICODE) {
-						keyStr = key->strValue;
-					}
-					dict->dictValue[keyStr] = val;
-				}
+				Value items[2];
+				items[1] = popStack();
+				items[0] = popStack();
+				Value dict = popStack();
+				setItems(dict, items, 2, onEntry);
 				pushStack(dict);
 				break;
 			}
 
 			case Pickle::SETITEMS: {
-				auto items = popMark();
-				auto dict = popStack();
-				if (dict->type == TYPE_DICT) {
-					for (size_t i = 0; i + 1 < items.size(); i += 2) {
-						std::string key;
-						if (items[i]->type == TYPE_STRING || items[i]->type == TYPE_UNICODE) {
-							key = items[i]->strValue;
-						}
-						dict->dictValue[key] = items[i + 1];
-					}
-				}
-				pushStack(dict);
+				size_t start = markStart();
+				if (start < 2) throw std::runtime_error("Stack underflow");
+				setItems(stack[start - 2], stack.data() + start, stack.size() - start, onEntry);
+				dropMark(start);
 				break;
 			}
 
-			case Pickle::PUT: {
-				std::string line = readLine();
-				int idx = std::stoi(line);
-				if (!stack.empty()) {
-					memo[idx] = stack.back();
-				}
+			case Pickle::PUT:
+				setMemo(static_cast<size_t>(std::stoul(readLineString())));
 				break;
-			}
 
-			case Pickle::BINPUT: {
-				uint8_t idx = readByte();
-				if (!stack.empty()) {
-					memo[idx] = stack.back();
-				}
+			case Pickle::BINPUT:
+				setMemo(readByte());
 				break;
-			}
 
-			case Pickle::LONG_BINPUT: {
-				uint32_t idx = readUInt32();
-				if (!stack.empty()) {
-					memo[idx] = stack.back();
-				}
+			case Pickle::LONG_BINPUT:
+				setMemo(readScalar<uint32_t>());
 				break;
-			}
 
-			case Pickle::GET: {
-				std::string line = readLine();
-				int idx = std::stoi(line);
-				if (memo.find(idx) != memo.end()) {
-					stack.push_back(memo[idx]);
-				}
+			case Pickle::GET:
+				getMemo(static_cast<size_t>(std::stoul(readLineString())));
 				break;
-			}
 
-			case Pickle::BINGET: {
-				uint8_t idx = readByte();
-				if (memo.find(idx) != memo.end()) {
-					stack.push_back(memo[idx]);
-				}
+			case Pickle::BINGET:
+				getMemo(readByte());
 				break;
-			}
 
-			case Pickle::LONG_BINGET: {
-				uint32_t idx = readUInt32();
-				if (memo.find(idx) != memo.end()) {
-					stack.push_back(memo[idx]);
-				}
+			case Pickle::LONG_BINGET:
+				getMemo(readScalar<uint32_t>());
 				break;
-			}
 
 			case Pickle::GLOBAL: {
-				std::string module = readLine();
-				std::string name = readLine();
-				auto value = std::make_shared<Value>(TYPE_NONE);
-				pushStack(value);
+				size_t len;
+				readLine(&len); // module
+				readLine(&len); // name
+				pushStack(makeValue(TYPE_NONE));
 				break;
 			}
 
@@ -714,6 +865,10 @@ std::shared_ptr<PickleParser::Value> PickleParser::parse() {
 				break;
 			}
 		}
+		catch (const NeedMoreData&) {
+			pos = start;
+			return S_FALSE;
+		}
 		catch (const std::exception& e) {
 			logDebug("Error processing opcode 0x" +
 				std::to_string(static_cast<int>(opcode)) + ": " + e.what());
@@ -721,10 +876,7 @@ std::shared_ptr<PickleParser::Value> PickleParser::parse() {
 		}
 	}
 
-	if (!stack.empty()) {
-		return std::static_pointer_cast<Value>(stack.back());
-	}
-	return std::make_shared<Value>(TYPE_NONE);
+	return S_FALSE;
 }
 
 class MemoryMappedFile {
@@ -797,6 +949,10 @@ public:
 	uint64_t GetSize() const { return fileSize; }
 	bool IsOpen() const { return pData != nullptr; }
 
+	bool GetLastWriteTime(FILETIME* time) const {
+		return hFile != INVALID_HANDLE_VALUE && GetFileTime(hFile, nullptr, nullptr, time) != 0;
+	}
+
 private:
 	HANDLE hFile;
 	HANDLE hMapping;
@@ -804,47 +960,192 @@ private:
 	uint64_t fileSize;
 };
 
+// Reads one entry as a seekable stream without assembling it. The entry is
+// a run of segments, each either index prefix bytes (copied into the stream)
+// or a range of the archive, read from the shared mapping when there is one
+// and from the archive stream otherwise.
+class RPAEntryInStream :
+	public IInStream,
+	public CMyUnknownImp
+{
+public:
+	struct Segment {
+		UInt64 virtStart;
+		UInt64 size;
+		UInt64 source;      // archive offset, or offset into prefixData
+		bool isPrefix;
+	};
+
+	RPAEntryInStream() : _virtPos(0), _size(0), _segment(0) {}
+
+	void Init(IInStream* stream, std::shared_ptr<MemoryMappedFile> mapping) {
+		_stream = stream;
+		_mapping = mapping;
+		_segments.clear();
+		_prefixData.clear();
+		_virtPos = 0;
+		_size = 0;
+		_segment = 0;
+	}
+
+	void AddPrefix(const uint8_t* data, size_t size) {
+		if (size == 0) return;
+		addSegment(_prefixData.size(), size, true);
+		_prefixData.insert(_prefixData.end(), data, data + size);
+	}
+
+	void AddRange(UInt64 offset, UInt64 size) {
+		if (size == 0) return;
+		addSegment(offset, size, false);
+	}
+
+	MY_UNKNOWN_IMP2(ISequentialInStream, IInStream)
+
+	STDMETHOD(Read)(void* data, UInt32 size, UInt32* processedSize) {
+		if (processedSize)
+			*processedSize = 0;
+
+		Byte* dest = static_cast<Byte*>(data);
+		while (size > 0 && _virtPos < _size) {
+			const Segment& seg = findSegment();
+			UInt64 delta = _virtPos - seg.virtStart;
+			UInt32 cur = static_cast<UInt32>(std::min<UInt64>(size, seg.size - delta));
+
+			if (seg.isPrefix) {
+				memcpy(dest, _prefixData.data() + seg.source + delta, cur);
+			}
+			else if (_mapping) {
+				memcpy(dest, _mapping->GetData() + seg.source + delta, cur);
+			}
+			else {
+				// The archive stream is shared with other readers, so its
+				// position is never assumed
+				RINOK(_stream->Seek(static_cast<Int64>(seg.source + delta), STREAM_SEEK_SET, nullptr));
+				UInt32 got = 0;
+				HRESULT res = _stream->Read(dest, cur, &got);
+				_virtPos += got;
+				if (processedSize)
+					*processedSize += got;
+				if (res != S_OK || got == 0)
+					return res;
+				dest += got;
+				size -= got;
+				continue;
+			}
+
+			_virtPos += cur;
+			dest += cur;
+			size -= cur;
+			if (processedSize)
+				*processedSize += cur;
+		}
+		return S_OK;
+	}
+
+	STDMETHOD(Seek)(Int64 offset, UInt32 seekOrigin, UInt64* newPosition) {
+		switch (seekOrigin) {
+		case STREAM_SEEK_SET: break;
+		case STREAM_SEEK_CUR: offset += _virtPos; break;
+		case STREAM_SEEK_END: offset += _size; break;
+		default: return STG_E_INVALIDFUNCTION;
+		}
+		if (offset < 0)
+			return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+		_virtPos = offset;
+		if (newPosition)
+			*newPosition = _virtPos;
+		return S_OK;
+	}
+
+private:
+	CMyComPtr<IInStream> _stream;
+	std::shared_ptr<MemoryMappedFile> _mapping;
+	std::vector<Segment> _segments;
+	std::vector<uint8_t> _prefixData;
+	UInt64 _virtPos;
+	UInt64 _size;
+	size_t _segment;
+
+	void addSegment(UInt64 source, UInt64 size, bool isPrefix) {
+		Segment seg = { _size, size, source, isPrefix };
+		_segments.push_back(seg);
+		_size += size;
+	}
+
+	// Sequential reads stay in the current or next segment; anything else
+	// is a binary search over the segment starts
+	const Segment& findSegment() {
+		if (_segment < _segments.size()) {
+			const Segment& cur = _segments[_segment];
+			if (_virtPos >= cur.virtStart && _virtPos - cur.virtStart < cur.size)
+				return cur;
+			if (_segment + 1 < _segments.size() && _virtPos == cur.virtStart + cur.size)
+				return _segments[++_segment];
+		}
+
+		auto it = std::upper_bound(_segments.begin(), _segments.end(), _virtPos,
+			[](UInt64 pos, const Segment& seg) { return pos < seg.virtStart; });
+		_segment = static_cast<size_t>(it - _segments.begin()) - 1;
+		return _segments[_segment];
+	}
+};
+
 class RPAArchiveHandler {
 public:
+	// A stored range of an entry. The prefix (bytes Ren'Py keeps in the index
+	// instead of the archive) lives in the handler's prefix arena.
 	struct Tuple {
 		int64_t offset;
 		int64_t length;
-		std::vector<uint8_t> prefix;
-
-		Tuple() : offset(0), length(0) {}
+		uint32_t prefixOffset;
+		uint32_t prefixSize;
 	};
 
+	// One file of the archive. Nearly every entry has a single tuple, kept
+	// inline; entries with more keep all of them in overflowTuples.
 	struct ArchiveIndex {
-		std::map<int, Tuple> tuples;
-		std::string fullPath;
-		std::string treePath;
-		std::string parentPath;
-		bool inArchive;
+		Tuple inlineTuple;
+		uint32_t firstTuple;
+		uint32_t tupleCount;
+		uint32_t pathOffset;
+		uint32_t pathSize;
+		uint32_t nextSameHash;
 		int64_t length;
-
-		ArchiveIndex() : inArchive(false), length(0) {}
 	};
 
-	struct BatchLoadRequest {
-		std::string fileName;
-		std::vector<uint8_t>* output;
-		bool success;
-
-		BatchLoadRequest() : output(nullptr), success(false) {}
-		BatchLoadRequest(const std::string& name, std::vector<uint8_t>* out)
-			: fileName(name), output(out), success(false) {
-		}
+	// Receives the data of batch-extracted files. Write gets consecutive pieces
+	// of one file from a single worker; different files arrive concurrently.
+	// Done follows the last piece with S_OK, S_FALSE when the entry is missing
+	// or points outside the archive, or the error Write returned. Returning
+	// E_ABORT from Write stops the whole batch.
+	struct IBatchSink {
+		virtual ~IBatchSink() {}
+		virtual HRESULT Write(size_t fileIndex, const uint8_t* data, size_t size) = 0;
+		virtual void Done(size_t fileIndex, HRESULT result) = 0;
 	};
 
 	RPAArchiveHandler();
 	~RPAArchiveHandler();
 
-	std::map<std::string, ArchiveIndex> items;
-
 	HRESULT Open(IInStream* stream, const UInt64* fileSize, IArchiveOpenCallback* callback);
-	HRESULT ExtractFile(IInStream* stream, const std::string& fileName, std::vector<uint8_t>& output);
+	HRESULT ExtractToStream(IInStream* stream, const ArchiveIndex& fileInfo, ISequentialOutStream* outStream);
+	HRESULT CreateEntryStream(IInStream* stream, const ArchiveIndex& fileInfo, ISequentialInStream** result);
+	HRESULT CopyRange(IInStream* stream, UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+		std::vector<uint8_t>& buffer) const;
+
+	bool MapArchive(const std::wstring& path, IInStream* stream);
+	bool IsMapped() const { return mmapFile != nullptr; }
+
+	// Keeps decoded indexes in the directory `dir` (empty disables it), one
+	// file per archive named after its cache key, so a hit does not depend
+	// on where the archive lives or how the host names it.
+	// Set before Open or OpenForBatchLoad.
+	void SetIndexCacheDir(const std::wstring& dir) { indexCacheDir = dir; }
 
 	HRESULT OpenForBatchLoad(const std::wstring& archivePath);
+	HRESULT BatchExtractFiles(const std::vector<std::string>& fileNames,
+		IBatchSink* sink,
+		int numThreads = 0);
 	HRESULT BatchExtractFiles(const std::vector<std::string>& fileNames,
 		std::vector<std::vector<uint8_t>>& outputs,
 		int numThreads = 0);
@@ -852,7 +1153,17 @@ public:
 
 	double GetArchiveVersion() const { return archiveVersion; }
 	int64_t GetObfuscationKey() const { return obfuscationKey; }
-	size_t GetFileCount() const { return items.size(); }
+	size_t GetHeaderSize() const { return firstLine.size() + 1; }
+	size_t GetFileCount() const { return entries.size(); }
+
+	const ArchiveIndex& GetEntry(size_t i) const { return entries[i]; }
+	const char* GetPath(const ArchiveIndex& entry) const { return names.data() + entry.pathOffset; }
+	const Tuple* GetTuples(const ArchiveIndex& entry) const {
+		return entry.tupleCount == 1 ? &entry.inlineTuple : overflowTuples.data() + entry.firstTuple;
+	}
+	const uint8_t* GetPrefix(const Tuple& tuple) const { return prefixes.data() + tuple.prefixOffset; }
+	const ArchiveIndex* FindEntry(const char* path, size_t pathSize) const;
+	void Clear();
 
 private:
 	std::string archivePath;
@@ -866,12 +1177,54 @@ private:
 	int padding;
 	bool optionsConfirmed;
 
-	std::map<std::string, ArchiveIndex> index;
+	// Entries in index order. Paths and prefixes are packed into arenas and
+	// looked up by path hash; entries sharing a hash are chained.
+	static const uint32_t kNoEntry = 0xFFFFFFFF;
+	std::vector<ArchiveIndex> entries;
+	std::vector<Tuple> overflowTuples;
+	std::vector<char> names;
+	std::vector<uint8_t> prefixes;
+	robin_hood::unordered_flat_map<size_t, uint32_t> pathLookup;
+
 	IArchiveOpenVolumeCallback* volCallback;
 
-	MemoryMappedFile mmapFile;
+	// Set only while the archive is mapped. Entry streams share it, so the
+	// view stays valid for them after the handler closes or remaps.
+	std::shared_ptr<MemoryMappedFile> mmapFile;
 	std::mutex extractMutex;
 
+	// Index cache. The file is a header followed by the entries, overflow
+	// tuples, names and prefixes exactly as they are held in memory, so a
+	// hit is a validated copy out of the mapping. It is keyed by archive
+	// size, modification time and the CRC of the header line and the
+	// compressed index, which also name the file, and is rebuilt whenever
+	// any of them changes.
+	struct IndexCacheKey {
+		uint64_t archiveSize;
+		uint64_t archiveTime;
+		uint32_t indexCrc;
+	};
+
+	struct IndexCacheHeader {
+		char magic[8];
+		uint32_t layout;
+		uint32_t indexCrc;
+		uint64_t archiveSize;
+		uint64_t archiveTime;
+		uint32_t entryCount;
+		uint32_t overflowCount;
+		uint64_t namesSize;
+		uint64_t prefixesSize;
+		uint32_t payloadCrc;
+		uint32_t reserved;
+	};
+
+	friend class RPAArchiveWriter;
+
+	std::wstring indexCacheDir;
+
+	static const size_t kCopyBufferSize = 1 << 20;
+
 	HRESULT readFirstLine(IInStream* stream);
 	HRESULT readFirstLineFromMemory(const uint8_t* data, size_t size);
 	double detectVersion(IInStream* stream);
@@ -880,15 +1233,114 @@ private:
 	int64_t calculateObfuscationKey();
 	HRESULT parseIndex(IInStream* stream);
 	HRESULT parseIndexFromMemory(const uint8_t* data, size_t size);
+	HRESULT loadIndex(const uint8_t* compressed, size_t size, uint64_t archiveSize, const FILETIME* archiveTime);
+	HRESULT decodeIndex(const uint8_t* compressed, size_t size);
+	HRESULT decodeIndexInline(InflateStream* inflater, const uint8_t* compressed, size_t size,
+		PickleIndexReader& reader, const PickleIndexReader::EntryCallback& onEntry);
+	HRESULT decodeIndexPipelined(InflateStream* inflater, const uint8_t* compressed, size_t size,
+		PickleIndexReader& reader, const PickleIndexReader::EntryCallback& onEntry);
+	std::wstring indexCacheFile(const IndexCacheKey& key) const;
+	bool readIndexCache(const IndexCacheKey& key);
+	bool writeIndexCache(const IndexCacheKey& key) const;
+	bool validateIndex() const;
 	HRESULT deobfuscateIndexData();
 	bool checkVersion(double version, double check);
 
 	// Pickle parsing
-	HRESULT parsePickleData(const std::vector<uint8_t>& data);
+	void addEntry(const char* path, size_t pathSize,
+		const PickleIndexReader::IndexTuple* tuples, size_t count);
+	uint32_t appendPrefix(const uint8_t* data, size_t size);
+
+	// Batch extraction. Each worker owns a queue of jobs sorted largest first
+	// and steals from the back of the others' queues once its own is empty.
+	struct BatchJob {
+		size_t fileIndex;
+		const ArchiveIndex* entry;
+	};
+
+	struct BatchQueue {
+		std::mutex lock;
+		std::deque<uint32_t> jobs;
+	};
+
+	// True when the tuple is well formed and its payload lies inside an
+	// archive of archiveSize bytes
+	static bool tupleInArchive(const Tuple& tuple, uint64_t archiveSize) {
+		if (tuple.offset < 0 || tuple.length < static_cast<int64_t>(tuple.prefixSize)) {
+			return false;
+		}
+		uint64_t dataLength = tuple.length - tuple.prefixSize;
+		return static_cast<uint64_t>(tuple.offset) <= archiveSize && dataLength <= archiveSize - tuple.offset;
+	}
+
+	HRESULT batchExtractEntry(const ArchiveIndex& entry, size_t fileIndex, IBatchSink* sink);
+	void batchExtractWorker(size_t self, std::vector<BatchQueue>& queues,
+		const std::vector<BatchJob>& jobs, IBatchSink* sink,
+		std::atomic<bool>& aborted, std::atomic<int>& progress);
+};
+
+// Writes RPA-3.0 and RPA-3.2 archives. Payloads are written as they are
+// added; the pickled index goes last, and the header line that points at it
+// is rewritten once its offset is known, so the output must be seekable.
+// Appending reopens an existing archive in place: its payloads stay where
+// they are, new data and the new index go after the end of the file, and
+// the header is rewritten last, so an interrupted append leaves the old
+// index in effect.
+class RPAArchiveWriter {
+public:
+	// New contents for a path in UpdateInPlace, or its removal when data is null
+	struct Change {
+		std::string path;
+		ISequentialInStream* data;
+	};
+
+	RPAArchiveWriter();
 
-	// Batch extraction worker
-	void batchExtractWorker(const std::vector<BatchLoadRequest*>& requests,
-		std::atomic<int>& progress);
+	HRESULT Create(IOutStream* out, double version, int64_t key);
+	HRESULT Append(IOutStream* out, const RPAArchiveHandler& archive);
+
+	// Both report the bytes of the current file written so far to progress
+	// (may be null) after every chunk, so large files do not stall the bar
+	HRESULT AddStream(const char* path, size_t pathSize, ISequentialInStream* data, UInt64* size,
+		ICompressProgressInfo* progress);
+	HRESULT AddCopy(const char* path, size_t pathSize, const RPAArchiveHandler& source,
+		IInStream* sourceStream, const RPAArchiveHandler::ArchiveIndex& entry,
+		ICompressProgressInfo* progress);
+	void AddInPlace(const RPAArchiveHandler& source, const RPAArchiveHandler::ArchiveIndex& entry);
+
+	HRESULT Finish();
+
+	// Rewrites the index of an archive opened with `archive`, whose file is
+	// also open for writing as `archiveFile`. Costs the changed data plus
+	// the index; replaced payloads and the old index are left as dead space.
+	// progress (may be null) is advanced by the bytes of new data written.
+	static HRESULT UpdateInPlace(IOutStream* archiveFile, const RPAArchiveHandler& archive,
+		const std::vector<Change>& changes, CLocalProgress* progress);
+
+private:
+	struct Entry {
+		uint32_t pathOffset;
+		uint32_t pathSize;
+		uint32_t firstTuple;
+		uint32_t tupleCount;
+	};
+
+	CMyComPtr<IOutStream> outStream;
+	double version;
+	int64_t key;
+	UInt64 position;
+	size_t headerSize;
+
+	std::vector<Entry> entries;
+	std::vector<RPAArchiveHandler::Tuple> tuples;
+	std::vector<char> names;
+	std::vector<uint8_t> prefixes;
+	std::vector<uint8_t> buffer;
+
+	std::string formatHeader(UInt64 indexOffset) const;
+	void addEntry(const char* path, size_t pathSize);
+	void addTuple(int64_t offset, int64_t length, const uint8_t* prefix, uint32_t prefixSize);
+	void writePickle(std::vector<uint8_t>& out) const;
 };
 
 // Utility functions
@@ -1069,100 +1521,97 @@ int64_t RPAArchiveHandler::calculateObfuscationKey() {
 	return key;
 }
 
-HRESULT RPAArchiveHandler::parsePickleData(const std::vector<uint8_t>& data) {
-#ifdef _DEBUG
-	logDebug("Parsing pickle data, size: " + std::to_string(data.size()));
-#endif
+uint32_t RPAArchiveHandler::appendPrefix(const uint8_t* data, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+	if (prefixes.size() + size > UINT32_MAX) {
+		throw std::runtime_error("Prefix data too large");
+	}
+	uint32_t pos = static_cast<uint32_t>(prefixes.size());
+	prefixes.insert(prefixes.end(), data, data + size);
+	return pos;
+}
 
-	try {
-		PickleParser parser(data.data(), data.size());
-		auto root = parser.parse();
+// Adds one index entry. A key set twice keeps its last value, as in the
+// source dict; the replaced entry's arena bytes are simply left unused.
+void RPAArchiveHandler::addEntry(const char* path, size_t pathSize,
+	const PickleIndexReader::IndexTuple* tuples, size_t count) {
+	if (count == 0) return;
+	if (names.size() + pathSize > UINT32_MAX || overflowTuples.size() + count > UINT32_MAX) {
+		throw std::runtime_error("Index too large");
+	}
 
-		if (!root || root->type != PickleParser::TYPE_DICT) {
-			return E_FAIL;
+	ArchiveIndex entry = {};
+	entry.tupleCount = static_cast<uint32_t>(count);
+	entry.pathOffset = static_cast<uint32_t>(names.size());
+	entry.pathSize = static_cast<uint32_t>(pathSize);
+	entry.nextSameHash = kNoEntry;
+	names.insert(names.end(), path, path + pathSize);
+
+	if (count > 1) {
+		entry.firstTuple = static_cast<uint32_t>(overflowTuples.size());
+	}
+	for (size_t i = 0; i < count; ++i) {
+		Tuple tuple;
+		tuple.offset = tuples[i].offset;
+		tuple.length = tuples[i].length;
+		tuple.prefixOffset = appendPrefix(tuples[i].prefix, tuples[i].prefixSize);
+		tuple.prefixSize = tuples[i].prefixSize;
+		entry.length += tuple.length;
+
+		if (count == 1) {
+			entry.inlineTuple = tuple;
 		}
+		else {
+			overflowTuples.push_back(tuple);
+		}
+	}
 
-		for (const auto& entry : root->dictValue) {
-			const std::string& fileName = entry.first;
-			auto& fileData = entry.second;
+	size_t hash = robin_hood::hash_bytes(path, pathSize);
+	auto found = pathLookup.find(hash);
+	if (found == pathLookup.end()) {
+		pathLookup.emplace(hash, static_cast<uint32_t>(entries.size()));
+		entries.push_back(entry);
+		return;
+	}
 
-			if (!fileData || (fileData->type != PickleParser::TYPE_LIST &&
-				fileData->type != PickleParser::TYPE_TUPLE)) {
-				continue;
-			}
+	for (uint32_t id = found->second;; id = entries[id].nextSameHash) {
+		ArchiveIndex& existing = entries[id];
+		if (existing.pathSize == pathSize && memcmp(names.data() + existing.pathOffset, path, pathSize) == 0) {
+			entry.nextSameHash = existing.nextSameHash;
+			existing = entry;
+			return;
+		}
+		if (existing.nextSameHash == kNoEntry) {
+			existing.nextSameHash = static_cast<uint32_t>(entries.size());
+			entries.push_back(entry);
+			return;
+		}
+	}
+}
 
-			ArchiveIndex archIndex;
-			archIndex.treePath = fileName;
-			archIndex.inArchive = true;
-			archIndex.length = 0;
+const RPAArchiveHandler::ArchiveIndex* RPAArchiveHandler::FindEntry(const char* path, size_t pathSize) const {
+	auto found = pathLookup.find(robin_hood::hash_bytes(path, pathSize));
+	if (found == pathLookup.end()) {
+		return nullptr;
+	}
 
-			size_t lastSlash = fileName.find_last_of("/\\");
-			if (lastSlash != std::string::npos) {
-				archIndex.parentPath = fileName.substr(0, lastSlash);
-			}
+	for (uint32_t id = found->second; id != kNoEntry; id = entries[id].nextSameHash) {
+		const ArchiveIndex& entry = entries[id];
+		if (entry.pathSize == pathSize && memcmp(names.data() + entry.pathOffset, path, pathSize) == 0) {
+			return &entry;
+		}
+	}
+	return nullptr;
+}
 
-			int tupleIndex = 0;
-			const size_t numTuples = fileData->listValue.size();
-
-			for (size_t i = 0; i < numTuples; ++i) {
-				auto& tupleData = fileData->listValue[i];
-
-				if (!tupleData || (tupleData->type != PickleParser::TYPE_TUPLE &&
-					tupleData->type != PickleParser::TYPE_LIST)) {
-					continue;
-				}
-
-				if (tupleData->listValue.size() < 2) continue;
-
-				Tuple tuple;
-
-				auto& offsetVal = tupleData->listValue[0];
-				if (offsetVal->type == PickleParser::TYPE_INT ||
-					offsetVal->type == PickleParser::TYPE_LONG) {
-					tuple.offset = offsetVal->intValue;
-				}
-				else {
-					continue;
-				}
-
-				auto& lengthVal = tupleData->listValue[1];
-				if (lengthVal->type == PickleParser::TYPE_INT ||
-					lengthVal->type == PickleParser::TYPE_LONG) {
-					tuple.length = lengthVal->intValue;
-				}
-				else {
-					continue;
-				}
-
-				if (tupleData->listValue.size() >= 3) {
-					auto& prefixData = tupleData->listValue[2];
-					if (prefixData->type == PickleParser::TYPE_STRING &&
-						!prefixData->strValue.empty()) {
-						tuple.prefix.assign(prefixData->strValue.begin(),
-							prefixData->strValue.end());
-					}
-					else if (prefixData->type == PickleParser::TYPE_BYTES &&
-						!prefixData->bytesValue.empty()) {
-						tuple.prefix = std::move(prefixData->bytesValue);
-					}
-				}
-
-				archIndex.tuples[tupleIndex++] = std::move(tuple);
-				archIndex.length += tuple.length;
-			}
-
-			if (!archIndex.tuples.empty()) {
-				items.emplace(fileName, std::move(archIndex));
-			}
-		}
-
-		logDebug("Successfully parsed " + std::to_string(items.size()) + " files");
-		return S_OK;
-	}
-	catch (const std::exception& e) {
-		logDebug("Error parsing pickle: " + std::string(e.what()));
-		return E_FAIL;
-	}
+void RPAArchiveHandler::Clear() {
+	entries.clear();
+	overflowTuples.clear();
+	names.clear();
+	prefixes.clear();
+	pathLookup.clear();
 }
 
 HRESULT RPAArchiveHandler::parseIndex(IInStream* stream) {
@@ -1194,37 +1643,17 @@ HRESULT RPAArchiveHandler::parseIndex(IInStream* stream) {
 		return E_FAIL;
 	}
 
-	ByteVector* output = bytevector_create(indexSize * 4);
-	if (!output) {
-		logDebug("Failed to allocate buffer for index decompression");
-		return E_FAIL;
-	}
-
-	size_t bytes_consumed = 0;
-	int result = zlib_decompress_no_checksum(compressedIndex.data(), compressedIndex.size(),
-		output, &bytes_consumed);
-
-	compressedIndex.clear();
-	compressedIndex.shrink_to_fit();
-
-	if (result < 0 || output->length == 0) {
-		logDebug("Failed to decompress index");
-		bytevector_free(output);
-		return E_FAIL;
+	// File streams report their modification time; without one the cache
+	// is keyed on size and content alone
+	FILETIME mtime = {};
+	bool hasTime = false;
+	CMyComPtr<IStreamGetProps> getProps;
+	stream->QueryInterface(IID_IStreamGetProps, (void**)&getProps);
+	if (getProps) {
+		hasTime = getProps->GetProps(nullptr, nullptr, nullptr, &mtime, nullptr) == S_OK;
 	}
 
-#ifdef _DEBUG
-	logDebug("Decompressed index: " + std::to_string(output->length) + " bytes");
-#endif
-
-	std::vector<uint8_t> decompressed;
-	decompressed.reserve(output->length);
-	decompressed.assign(output->data, output->data + output->length);
-	bytevector_free(output);
-
-	HRESULT hr = parsePickleData(decompressed);
-
-	return hr;
+	return loadIndex(compressedIndex.data(), compressedIndex.size(), streamLength, hasTime ? &mtime : nullptr);
 }
 
 HRESULT RPAArchiveHandler::parseIndexFromMemory(const uint8_t* data, size_t size) {
@@ -1242,36 +1671,382 @@ HRESULT RPAArchiveHandler::parseIndexFromMemory(const uint8_t* data, size_t size
 		return E_FAIL;
 	}
 
-	const uint8_t* compressedData = data + offset;
+	FILETIME mtime = {};
+	bool hasTime = mmapFile->GetLastWriteTime(&mtime);
 
-	ByteVector* output = bytevector_create(indexSize * 4);
-	if (!output) {
-		logDebug("Failed to allocate buffer for index decompression");
-		return E_FAIL;
+	return loadIndex(data + offset, indexSize, size, hasTime ? &mtime : nullptr);
+}
+
+// Fills the index from the cache when it matches the archive, otherwise
+// decodes the compressed index and refreshes the cache
+HRESULT RPAArchiveHandler::loadIndex(const uint8_t* compressed, size_t size, uint64_t archiveSize,
+	const FILETIME* archiveTime) {
+	IndexCacheKey key = {};
+	if (!indexCacheDir.empty()) {
+		key.archiveSize = archiveSize;
+		if (archiveTime) {
+			key.archiveTime = (static_cast<uint64_t>(archiveTime->dwHighDateTime) << 32) | archiveTime->dwLowDateTime;
+		}
+		UInt32 crc = CrcUpdate(CRC_INIT_VAL, firstLine.data(), firstLine.size());
+		key.indexCrc = CRC_GET_DIGEST(CrcUpdate(crc, compressed, size));
+
+		if (readIndexCache(key)) {
+			logDebug("Index loaded from cache: " + wideToUtf8(indexCacheFile(key)));
+			return S_OK;
+		}
+	}
+
+	RINOK(decodeIndex(compressed, size));
+	RINOK(deobfuscateIndexData());
+
+	if (!indexCacheDir.empty() && !writeIndexCache(key)) {
+		logDebug("Failed to write index cache: " + wideToUtf8(indexCacheFile(key)));
 	}
 
-	size_t bytes_consumed = 0;
-	int result = zlib_decompress_no_checksum(compressedData, indexSize,
-		output, &bytes_consumed);
+	return S_OK;
+}
+
+// The index is inflated a chunk at a time and each chunk is parsed as soon
+// as it is produced, so the decompressed pickle is never held as a whole.
+// Large indexes inflate on a second thread while this one parses.
+static const size_t kIndexChunkSize = 256 * 1024;
+static const size_t kIndexChunkCount = 4;
+static const size_t kPipelinedIndexSize = 1 << 20;
+
+// Inflates the next chunk of the index. Returns the inflate_stream_run
+// status, with running out of input before the end counted as an error.
+// All remaining input is offered on every call, so a call that stops short
+// of filling the chunk without reaching the end has starved: the index is
+// truncated. The inflater hands back read-ahead bytes, so *inPos alone
+// never reaches size in that case.
+static int inflateIndexChunk(InflateStream* inflater, const uint8_t* compressed, size_t size, size_t* inPos,
+	uint8_t* out, size_t outSize, size_t* written) {
+	size_t used = 0;
+	int status = inflate_stream_run(inflater, compressed + *inPos, size - *inPos, &used, out, outSize, written);
+	*inPos += used;
+	if (status == INFLATE_STREAM_OK && (*written < outSize || (used == 0 && *written == 0))) {
+		return INFLATE_STREAM_ERROR;
+	}
+	return status;
+}
 
-	if (result < 0 || output->length == 0) {
-		logDebug("Failed to decompress index");
-		bytevector_free(output);
+HRESULT RPAArchiveHandler::decodeIndex(const uint8_t* compressed, size_t size) {
+	InflateStream* inflater = inflate_stream_create(INFLATE_STREAM_ZLIB | INFLATE_STREAM_ADLER);
+	if (!inflater) {
+		logDebug("Failed to allocate index decompressor");
 		return E_FAIL;
 	}
 
+	Clear();
+	PickleIndexReader reader;
+	PickleIndexReader::EntryCallback onEntry = [this](const char* path, size_t pathSize,
+		const PickleIndexReader::IndexTuple* tuples, size_t count) {
+		addEntry(path, pathSize, tuples, count);
+	};
+
+	HRESULT hr;
+	try {
+		hr = size < kPipelinedIndexSize
+			? decodeIndexInline(inflater, compressed, size, reader, onEntry)
+			: decodeIndexPipelined(inflater, compressed, size, reader, onEntry);
+		if (hr == S_OK) {
+			hr = reader.finish(onEntry);
+		}
+	}
+	catch (const std::exception& e) {
+		logDebug("Error parsing pickle: " + std::string(e.what()));
+		hr = E_FAIL;
+	}
+
 #ifdef _DEBUG
-	logDebug("Decompressed index: " + std::to_string(output->length) + " bytes");
+	logDebug("Decompressed index: " + std::to_string(inflater->total_out) + " bytes");
 #endif
+	inflate_stream_free(inflater);
+
+	if (hr != S_OK) {
+		Clear();
+		return E_FAIL;
+	}
 
-	std::vector<uint8_t> decompressed;
-	decompressed.reserve(output->length);
-	decompressed.assign(output->data, output->data + output->length);
-	bytevector_free(output);
+	logDebug("Successfully parsed " + std::to_string(entries.size()) + " files");
+	return S_OK;
+}
 
-	HRESULT hr = parsePickleData(decompressed);
+HRESULT RPAArchiveHandler::decodeIndexInline(InflateStream* inflater, const uint8_t* compressed, size_t size,
+	PickleIndexReader& reader, const PickleIndexReader::EntryCallback& onEntry) {
+	std::vector<uint8_t> chunk(kIndexChunkSize);
+	size_t inPos = 0;
 
-	return hr;
+	for (;;) {
+		size_t written = 0;
+		int status = inflateIndexChunk(inflater, compressed, size, &inPos, chunk.data(), chunk.size(), &written);
+		if (status == INFLATE_STREAM_ERROR) {
+			logDebug("Failed to decompress index");
+			return E_FAIL;
+		}
+
+		HRESULT hr = reader.feed(chunk.data(), written, onEntry);
+		if (hr != S_FALSE || status == INFLATE_STREAM_END) {
+			return FAILED(hr) ? hr : S_OK;
+		}
+	}
+}
+
+HRESULT RPAArchiveHandler::decodeIndexPipelined(InflateStream* inflater, const uint8_t* compressed, size_t size,
+	PickleIndexReader& reader, const PickleIndexReader::EntryCallback& onEntry) {
+	struct Chunk {
+		std::vector<uint8_t> data;
+		size_t length;
+		bool last;
+	};
+
+	std::vector<Chunk> chunks(kIndexChunkCount);
+	for (Chunk& chunk : chunks) {
+		chunk.data.resize(kIndexChunkSize);
+	}
+
+	// Chunks cycle in order: the inflater fills `produced` ones ahead of the
+	// parser, blocking while all of them are waiting to be parsed
+	std::mutex mutex;
+	std::condition_variable changed;
+	size_t produced = 0;
+	size_t consumed = 0;
+	bool inflateFailed = false;
+	bool parseDone = false;
+
+	auto inflateChunks = [&]() {
+		size_t inPos = 0;
+		for (size_t n = 0;; n++) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return parseDone || n - consumed < kIndexChunkCount; });
+				if (parseDone) return;
+			}
+
+			Chunk& chunk = chunks[n % kIndexChunkCount];
+			int status = inflateIndexChunk(inflater, compressed, size, &inPos,
+				chunk.data.data(), chunk.data.size(), &chunk.length);
+			chunk.last = status != INFLATE_STREAM_OK;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			inflateFailed = status == INFLATE_STREAM_ERROR;
+			produced = n + 1;
+			changed.notify_all();
+			if (chunk.last) return;
+		}
+	};
+
+	std::thread inflaterThread;
+	try {
+		inflaterThread = std::thread(inflateChunks);
+	}
+	catch (const std::system_error&) {
+		// Nothing has been inflated yet, so the index can still be decoded here
+		logDebug("Could not start the index inflater thread; decoding inline");
+		return decodeIndexInline(inflater, compressed, size, reader, onEntry);
+	}
+
+	HRESULT hr = S_FALSE;
+	try {
+		for (size_t n = 0; hr == S_FALSE; n++) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return produced > n; });
+				if (inflateFailed && produced == n + 1) {
+					logDebug("Failed to decompress index");
+					hr = E_FAIL;
+					break;
+				}
+			}
+
+			const Chunk& chunk = chunks[n % kIndexChunkCount];
+			hr = reader.feed(chunk.data.data(), chunk.length, onEntry);
+			if (hr == S_FALSE && chunk.last) {
+				hr = S_OK;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			consumed = n + 1;
+			changed.notify_all();
+		}
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			parseDone = true;
+			changed.notify_all();
+		}
+		inflaterThread.join();
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		parseDone = true;
+		changed.notify_all();
+	}
+	inflaterThread.join();
+
+	return FAILED(hr) ? hr : S_OK;
+}
+
+static const char kIndexCacheMagic[8] = { 'R', 'P', 'A', 'I', 'D', 'X', '0', '1' };
+
+// <size>-<mtime>-<crc>.rpaidx in the cache directory
+std::wstring RPAArchiveHandler::indexCacheFile(const IndexCacheKey& key) const {
+	wchar_t name[64];
+	swprintf(name, ARRAYSIZE(name), L"%016llx-%016llx-%08x.rpaidx",
+		static_cast<unsigned long long>(key.archiveSize),
+		static_cast<unsigned long long>(key.archiveTime), key.indexCrc);
+	return indexCacheDir + L"\\" + name;
+}
+
+bool RPAArchiveHandler::readIndexCache(const IndexCacheKey& key) {
+	MemoryMappedFile cache;
+	if (!cache.Open(indexCacheFile(key)) || cache.GetSize() < sizeof(IndexCacheHeader)) {
+		return false;
+	}
+
+	IndexCacheHeader header;
+	memcpy(&header, cache.GetData(), sizeof(header));
+
+	if (memcmp(header.magic, kIndexCacheMagic, sizeof(header.magic)) != 0 ||
+		header.layout != ((sizeof(ArchiveIndex) << 16) | sizeof(Tuple)) ||
+		header.archiveSize != key.archiveSize ||
+		header.archiveTime != key.archiveTime ||
+		header.indexCrc != key.indexCrc) {
+		logDebug("Index cache is stale");
+		return false;
+	}
+
+	// Section sizes are checked against the file before anything is copied
+	uint64_t entriesBytes = static_cast<uint64_t>(header.entryCount) * sizeof(ArchiveIndex);
+	uint64_t overflowBytes = static_cast<uint64_t>(header.overflowCount) * sizeof(Tuple);
+	uint64_t payloadSize = cache.GetSize() - sizeof(IndexCacheHeader);
+	if (header.namesSize > UINT32_MAX || header.prefixesSize > UINT32_MAX ||
+		entriesBytes + overflowBytes + header.namesSize + header.prefixesSize != payloadSize) {
+		return false;
+	}
+
+	const uint8_t* payload = cache.GetData() + sizeof(IndexCacheHeader);
+	if (CrcCalc(payload, static_cast<size_t>(payloadSize)) != header.payloadCrc) {
+		logDebug("Index cache is damaged");
+		return false;
+	}
+
+	Clear();
+	entries.resize(header.entryCount);
+	overflowTuples.resize(header.overflowCount);
+	names.resize(static_cast<size_t>(header.namesSize));
+	prefixes.resize(static_cast<size_t>(header.prefixesSize));
+
+	const uint8_t* p = payload;
+	memcpy(entries.data(), p, static_cast<size_t>(entriesBytes));
+	p += entriesBytes;
+	memcpy(overflowTuples.data(), p, static_cast<size_t>(overflowBytes));
+	p += overflowBytes;
+	memcpy(names.data(), p, names.size());
+	p += names.size();
+	memcpy(prefixes.data(), p, prefixes.size());
+
+	if (!validateIndex()) {
+		Clear();
+		return false;
+	}
+
+	// Paths are unique in a written index, so each one just joins the
+	// front of its hash chain
+	for (uint32_t id = 0; id < entries.size(); id++) {
+		ArchiveIndex& entry = entries[id];
+		entry.nextSameHash = kNoEntry;
+		auto inserted = pathLookup.emplace(robin_hood::hash_bytes(names.data() + entry.pathOffset, entry.pathSize), id);
+		if (!inserted.second) {
+			entry.nextSameHash = inserted.first->second;
+			inserted.first->second = id;
+		}
+	}
+
+	return true;
+}
+
+// Checks that every entry's path, tuples and prefixes lie inside the arenas
+bool RPAArchiveHandler::validateIndex() const {
+	for (const ArchiveIndex& entry : entries) {
+		if (entry.tupleCount == 0 ||
+			static_cast<uint64_t>(entry.pathOffset) + entry.pathSize > names.size()) {
+			return false;
+		}
+		if (entry.tupleCount > 1 &&
+			static_cast<uint64_t>(entry.firstTuple) + entry.tupleCount > overflowTuples.size()) {
+			return false;
+		}
+
+		const Tuple* tuples = GetTuples(entry);
+		for (uint32_t i = 0; i < entry.tupleCount; i++) {
+			if (static_cast<uint64_t>(tuples[i].prefixOffset) + tuples[i].prefixSize > prefixes.size()) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool writeAll(HANDLE file, const void* data, size_t size) {
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	while (size > 0) {
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1 << 30));
+		DWORD written = 0;
+		if (!WriteFile(file, p, chunk, &written, nullptr) || written != chunk) {
+			return false;
+		}
+		p += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+// Writes the cache next to its final name and moves it into place, so a
+// reader never sees a partial file. Another process writing the same cache
+// holds the temporary file open, and this write is then skipped.
+bool RPAArchiveHandler::writeIndexCache(const IndexCacheKey& key) const {
+	IndexCacheHeader header = {};
+	memcpy(header.magic, kIndexCacheMagic, sizeof(header.magic));
+	header.layout = (sizeof(ArchiveIndex) << 16) | sizeof(Tuple);
+	header.indexCrc = key.indexCrc;
+	header.archiveSize = key.archiveSize;
+	header.archiveTime = key.archiveTime;
+	header.entryCount = static_cast<uint32_t>(entries.size());
+	header.overflowCount = static_cast<uint32_t>(overflowTuples.size());
+	header.namesSize = names.size();
+	header.prefixesSize = prefixes.size();
+
+	UInt32 crc = CRC_INIT_VAL;
+	crc = CrcUpdate(crc, entries.data(), entries.size() * sizeof(ArchiveIndex));
+	crc = CrcUpdate(crc, overflowTuples.data(), overflowTuples.size() * sizeof(Tuple));
+	crc = CrcUpdate(crc, names.data(), names.size());
+	crc = CrcUpdate(crc, prefixes.data(), prefixes.size());
+	header.payloadCrc = CRC_GET_DIGEST(crc);
+
+	std::wstring cachePath = indexCacheFile(key);
+	std::wstring tempPath = cachePath + L".tmp";
+	HANDLE file = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	bool ok = writeAll(file, &header, sizeof(header)) &&
+		writeAll(file, entries.data(), entries.size() * sizeof(ArchiveIndex)) &&
+		writeAll(file, overflowTuples.data(), overflowTuples.size() * sizeof(Tuple)) &&
+		writeAll(file, names.data(), names.size()) &&
+		writeAll(file, prefixes.data(), prefixes.size());
+	CloseHandle(file);
+
+	if (!ok || !MoveFileExW(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileW(tempPath.c_str());
+		return false;
+	}
+	return true;
 }
 
 HRESULT RPAArchiveHandler::deobfuscateIndexData() {
@@ -1282,10 +2057,13 @@ HRESULT RPAArchiveHandler::deobfuscateIndexData() {
 	logDebug("Deobfuscating index data with key: 0x" +
 		std::to_string(obfuscationKey));
 
-	for (auto& item : items) {
-		for (auto& tuple : item.second.tuples) {
-			tuple.second.offset ^= obfuscationKey;
-			tuple.second.length ^= obfuscationKey;
+	for (auto& entry : entries) {
+		entry.length = 0;
+		Tuple* tuples = entry.tupleCount == 1 ? &entry.inlineTuple : &overflowTuples[entry.firstTuple];
+		for (uint32_t i = 0; i < entry.tupleCount; ++i) {
+			tuples[i].offset ^= obfuscationKey;
+			tuples[i].length ^= obfuscationKey;
+			entry.length += tuples[i].length;
 		}
 	}
 
@@ -1330,76 +2108,197 @@ HRESULT RPAArchiveHandler::Open(IInStream* stream, const UInt64* fileSize,
 	}
 
 	RINOK(parseIndex(stream));
-	RINOK(deobfuscateIndexData());
 
-	logDebug("Archive opened successfully. Files: " + std::to_string(items.size()));
+	logDebug("Archive opened successfully. Files: " + std::to_string(entries.size()));
 
 	return S_OK;
 }
 
-// Extract file implementation
-HRESULT RPAArchiveHandler::ExtractFile(IInStream* stream, const std::string& fileName,
-	std::vector<uint8_t>& output) {
+// Writes an entry to outStream (null when testing). Prefixes come from the
+// index; payloads are written straight from the mapping when there is one,
+// otherwise they are copied from the stream through a bounded buffer.
+// Returns S_FALSE when a tuple points outside the archive.
+HRESULT RPAArchiveHandler::ExtractToStream(IInStream* stream, const ArchiveIndex& fileInfo,
+	ISequentialOutStream* outStream) {
+	HRESULT result = S_OK;
+	std::vector<uint8_t> buffer;
 
-	auto it = items.find(fileName);
-	if (it == items.end()) {
-		logDebug("File not found: " + fileName);
-		return E_FAIL;
+	const Tuple* tuples = GetTuples(fileInfo);
+
+	for (uint32_t i = 0; i < fileInfo.tupleCount; ++i) {
+		const Tuple& tuple = tuples[i];
+
+		if (outStream && tuple.prefixSize != 0) {
+			RINOK(WriteStream(outStream, GetPrefix(tuple), tuple.prefixSize));
+		}
+
+		if (tuple.offset < 0 || tuple.length < static_cast<int64_t>(tuple.prefixSize)) {
+			result = S_FALSE;
+			continue;
+		}
+
+		HRESULT copied = CopyRange(stream, tuple.offset, tuple.length - tuple.prefixSize, outStream, buffer);
+		if (copied == S_FALSE) {
+			result = S_FALSE;
+			continue;
+		}
+		RINOK(copied);
 	}
 
-	const ArchiveIndex& fileInfo = it->second;
-	output.clear();
+	return result;
+}
+
+// Copies `size` bytes at `offset` of the archive to outStream (null to only
+// read them), from the mapping when there is one and otherwise through
+// `buffer`. Returns S_FALSE when the range runs past the end of the archive.
+HRESULT RPAArchiveHandler::CopyRange(IInStream* stream, UInt64 offset, UInt64 size,
+	ISequentialOutStream* outStream, std::vector<uint8_t>& buffer) const {
+	if (size == 0) return S_OK;
 
-	logDebug("Extracting: " + fileName);
+	if (IsMapped()) {
+		if (offset > mmapFile->GetSize() || size > mmapFile->GetSize() - offset) {
+			return S_FALSE;
+		}
+		if (outStream) {
+			RINOK(WriteStream(outStream, mmapFile->GetData() + offset, static_cast<size_t>(size)));
+		}
+		return S_OK;
+	}
 
-	for (const auto& tuplePair : fileInfo.tuples) {
-		const Tuple& tuple = tuplePair.second;
+	RINOK(stream->Seek(offset, STREAM_SEEK_SET, nullptr));
+	if (buffer.size() < size && buffer.size() < kCopyBufferSize) {
+		buffer.resize(static_cast<size_t>(std::min<UInt64>(size, static_cast<UInt64>(kCopyBufferSize))));
+	}
 
-		logDebug("  Tuple " + std::to_string(tuplePair.first) +
-			": offset=" + std::to_string(tuple.offset) +
-			", length=" + std::to_string(tuple.length) +
-			", prefix=" + std::to_string(tuple.prefix.size()));
+	while (size > 0) {
+		size_t chunk = static_cast<size_t>(std::min<UInt64>(size, buffer.size()));
+		size_t got = chunk;
+		RINOK(ReadStream(stream, buffer.data(), &got));
+		if (outStream && got > 0) {
+			RINOK(WriteStream(outStream, buffer.data(), got));
+		}
+		if (got != chunk) {
+			return S_FALSE;
+		}
+		size -= got;
+	}
 
-		RINOK(stream->Seek(tuple.offset, STREAM_SEEK_SET, nullptr));
+	return S_OK;
+}
 
-		output.insert(output.end(), tuple.prefix.begin(), tuple.prefix.end());
+// Builds a seekable stream over an entry. Tuples are checked against the
+// archive size up front, so reads never run past the mapping.
+HRESULT RPAArchiveHandler::CreateEntryStream(IInStream* stream, const ArchiveIndex& fileInfo,
+	ISequentialInStream** result) {
+	*result = nullptr;
 
-		size_t dataLength = tuple.length - tuple.prefix.size();
-		if (dataLength > 0) {
-			size_t oldSize = output.size();
-			output.resize(oldSize + dataLength);
+	UInt64 archiveSize = 0;
+	if (IsMapped()) {
+		archiveSize = mmapFile->GetSize();
+	}
+	else {
+		RINOK(stream->Seek(0, STREAM_SEEK_END, &archiveSize));
+	}
 
-			UInt32 bytesRead;
-			RINOK(stream->Read(&output[oldSize], static_cast<UInt32>(dataLength), &bytesRead));
+	RPAEntryInStream* streamSpec = new RPAEntryInStream;
+	CMyComPtr<ISequentialInStream> streamTemp = streamSpec;
+	streamSpec->Init(stream, mmapFile);
 
-			if (bytesRead != dataLength) {
-				logDebug("  Warning: Read " + std::to_string(bytesRead) +
-					" bytes, expected " + std::to_string(dataLength));
-			}
+	const Tuple* tuples = GetTuples(fileInfo);
+	for (uint32_t i = 0; i < fileInfo.tupleCount; ++i) {
+		const Tuple& tuple = tuples[i];
+		if (!tupleInArchive(tuple, archiveSize)) {
+			return S_FALSE;
 		}
+
+		streamSpec->AddPrefix(GetPrefix(tuple), tuple.prefixSize);
+		streamSpec->AddRange(tuple.offset, tuple.length - tuple.prefixSize);
 	}
 
-	logDebug("  Extracted: " + std::to_string(output.size()) + " bytes");
+	*result = streamTemp.Detach();
 	return S_OK;
 }
 
+// Drive-rooted (C:\dir) or UNC (\\server\share); anything else would
+// resolve against the process's current directory
+static bool isAbsolutePath(const std::wstring& path) {
+	auto isSlash = [](wchar_t c) { return c == L'\\' || c == L'/'; };
+	if (path.size() >= 3 && path[1] == L':' && isSlash(path[2])) {
+		return true;
+	}
+	return path.size() >= 2 && isSlash(path[0]) && isSlash(path[1]);
+}
+
+// Maps the file behind `stream` so entries can be served without copies.
+// The path comes from the open callback and need not name the same file, so
+// the mapping is only kept for an absolute path whose modification time,
+// size and both ends match what the stream reports. When the stream has no
+// time to compare against, entries stream from it instead.
+bool RPAArchiveHandler::MapArchive(const std::wstring& path, IInStream* stream) {
+	mmapFile.reset();
+	if (!isAbsolutePath(path)) {
+		logDebug("Archive path is not absolute, not mapping: " + wideToUtf8(path));
+		return false;
+	}
+
+	FILETIME streamTime = {};
+	CMyComPtr<IStreamGetProps> getProps;
+	stream->QueryInterface(IID_IStreamGetProps, (void**)&getProps);
+	if (!getProps || getProps->GetProps(nullptr, nullptr, nullptr, &streamTime, nullptr) != S_OK) {
+		logDebug("Archive stream reports no modification time, not mapping");
+		return false;
+	}
+
+	std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>();
+	if (!file->Open(path)) {
+		return false;
+	}
+
+	FILETIME fileTime = {};
+	UInt64 streamSize = 0;
+	bool same = file->GetLastWriteTime(&fileTime) && CompareFileTime(&fileTime, &streamTime) == 0 &&
+		stream->Seek(0, STREAM_SEEK_END, &streamSize) == S_OK && streamSize == file->GetSize();
+
+	const size_t probeSize = 4096;
+	std::vector<uint8_t> probe(probeSize);
+	UInt64 probeOffsets[2] = { 0, streamSize > probeSize ? streamSize - probeSize : 0 };
+	for (int i = 0; i < 2 && same; i++) {
+		size_t size = static_cast<size_t>(std::min<UInt64>(probeSize, streamSize));
+		same = stream->Seek(probeOffsets[i], STREAM_SEEK_SET, nullptr) == S_OK &&
+			ReadStream(stream, probe.data(), &size) == S_OK &&
+			memcmp(probe.data(), file->GetData() + probeOffsets[i], size) == 0;
+	}
+
+	stream->Seek(0, STREAM_SEEK_SET, nullptr);
+	if (!same) {
+		logDebug("Mapped file does not match the archive stream: " + wideToUtf8(path));
+		return false;
+	}
+
+	mmapFile = file;
+	logDebug("Archive mapped: " + wideToUtf8(path));
+	return true;
+}
+
 HRESULT RPAArchiveHandler::OpenForBatchLoad(const std::wstring& archivePath) {
 	logDebug("Opening archive for batch load: " + wideToUtf8(archivePath));
 
-	if (!mmapFile.Open(archivePath)) {
+	mmapFile = std::make_shared<MemoryMappedFile>();
+	if (!mmapFile->Open(archivePath)) {
 		logDebug("Failed to memory-map archive file");
+		mmapFile.reset();
 		return E_FAIL;
 	}
 
-	const uint8_t* data = mmapFile.GetData();
-	uint64_t size = mmapFile.GetSize();
+	const uint8_t* data = mmapFile->GetData();
+	uint64_t size = mmapFile->GetSize();
 
 	RINOK(readFirstLineFromMemory(data, static_cast<size_t>(size)));
 
 	archiveVersion = detectVersion(nullptr);
 	if (archiveVersion == RPA::VERSION_UNKNOWN) {
 		logDebug("Error: Unknown RPA archive version");
-		mmapFile.Close();
+		mmapFile.reset();
 		return E_FAIL;
 	}
 
@@ -1415,59 +2314,97 @@ HRESULT RPAArchiveHandler::OpenForBatchLoad(const std::wstring& archivePath) {
 	}
 
 	RINOK(parseIndexFromMemory(data, static_cast<size_t>(size)));
-	RINOK(deobfuscateIndexData());
 
-	logDebug("Archive opened for batch load. Files: " + std::to_string(items.size()));
+	logDebug("Archive opened for batch load. Files: " + std::to_string(entries.size()));
 
 	return S_OK;
 }
 
-void RPAArchiveHandler::batchExtractWorker(const std::vector<BatchLoadRequest*>& requests,
-	std::atomic<int>& progress) {
-	const uint8_t* data = mmapFile.GetData();
+// Streams one entry from the mapping to the sink in bounded pieces, so a
+// sink writing to disk never holds more than kCopyBufferSize of it. Every
+// tuple is checked before anything is written, so a bad entry leaves the
+// sink untouched.
+HRESULT RPAArchiveHandler::batchExtractEntry(const ArchiveIndex& entry, size_t fileIndex,
+	IBatchSink* sink) {
+	const uint8_t* data = mmapFile->GetData();
+	uint64_t size = mmapFile->GetSize();
+	const Tuple* tuples = GetTuples(entry);
+
+	for (uint32_t i = 0; i < entry.tupleCount; ++i) {
+		if (!tupleInArchive(tuples[i], size)) {
+			return S_FALSE;
+		}
+	}
 
-	for (auto* request : requests) {
-		auto it = items.find(request->fileName);
-		if (it == items.end()) {
-			request->success = false;
-			progress++;
-			continue;
+	for (uint32_t i = 0; i < entry.tupleCount; ++i) {
+		const Tuple& tuple = tuples[i];
+
+		if (tuple.prefixSize != 0) {
+			RINOK(sink->Write(fileIndex, GetPrefix(tuple), tuple.prefixSize));
 		}
 
-		const ArchiveIndex& fileInfo = it->second;
-		request->output->clear();
+		uint64_t dataLength = tuple.length - tuple.prefixSize;
+		const uint8_t* fileData = data + tuple.offset;
+		while (dataLength > 0) {
+			size_t chunk = static_cast<size_t>(std::min<uint64_t>(dataLength, static_cast<uint64_t>(kCopyBufferSize)));
+			RINOK(sink->Write(fileIndex, fileData, chunk));
+			fileData += chunk;
+			dataLength -= chunk;
+		}
+	}
 
-		try {
-			for (const auto& tuplePair : fileInfo.tuples) {
-				const Tuple& tuple = tuplePair.second;
-
-				// Add prefix
-				request->output->insert(request->output->end(),
-					tuple.prefix.begin(), tuple.prefix.end());
-
-				// Copy file data directly from memory-mapped file
-				size_t dataLength = tuple.length - tuple.prefix.size();
-				if (dataLength > 0 && tuple.offset + dataLength <= mmapFile.GetSize()) {
-					const uint8_t* fileData = data + tuple.offset;
-					request->output->insert(request->output->end(),
-						fileData, fileData + dataLength);
-				}
+	return S_OK;
+}
+
+void RPAArchiveHandler::batchExtractWorker(size_t self, std::vector<BatchQueue>& queues,
+	const std::vector<BatchJob>& jobs, IBatchSink* sink,
+	std::atomic<bool>& aborted, std::atomic<int>& progress) {
+	const uint32_t kNoJob = 0xFFFFFFFF;
+
+	while (!aborted) {
+		uint32_t job = kNoJob;
+		{
+			BatchQueue& own = queues[self];
+			std::lock_guard<std::mutex> guard(own.lock);
+			if (!own.jobs.empty()) {
+				job = own.jobs.front();
+				own.jobs.pop_front();
 			}
+		}
 
-			request->success = true;
+		// Nothing is queued after the workers start, so once every queue
+		// is empty the worker is done
+		for (size_t i = 1; job == kNoJob && i < queues.size(); i++) {
+			BatchQueue& victim = queues[(self + i) % queues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.jobs.empty()) {
+				job = victim.jobs.back();
+				victim.jobs.pop_back();
+			}
+		}
+
+		if (job == kNoJob) break;
+
+		HRESULT result;
+		try {
+			result = batchExtractEntry(*jobs[job].entry, jobs[job].fileIndex, sink);
 		}
 		catch (...) {
-			request->success = false;
+			result = E_OUTOFMEMORY;
 		}
 
+		if (result == E_ABORT) {
+			aborted = true;
+		}
+		sink->Done(jobs[job].fileIndex, result);
 		progress++;
 	}
 }
 
 HRESULT RPAArchiveHandler::BatchExtractFiles(const std::vector<std::string>& fileNames,
-	std::vector<std::vector<uint8_t>>& outputs,
+	IBatchSink* sink,
 	int numThreads) {
-	if (!mmapFile.IsOpen()) {
+	if (!IsMapped()) {
 		logDebug("Archive not opened for batch load");
 		return E_FAIL;
 	}
@@ -1481,37 +2418,53 @@ HRESULT RPAArchiveHandler::BatchExtractFiles(const std::vector<std::string>& fil
 
 	auto startTime = std::chrono::high_resolution_clock::now();
 
-	outputs.resize(fileNames.size());
-	std::vector<BatchLoadRequest> requests(fileNames.size());
+	std::vector<BatchJob> jobs;
+	jobs.reserve(fileNames.size());
+	int failedCount = 0;
 
 	for (size_t i = 0; i < fileNames.size(); i++) {
-		requests[i].fileName = fileNames[i];
-		requests[i].output = &outputs[i];
+		const ArchiveIndex* entry = FindEntry(fileNames[i].data(), fileNames[i].size());
+		if (!entry) {
+			sink->Done(i, S_FALSE);
+			failedCount++;
+			continue;
+		}
+		BatchJob job = { i, entry };
+		jobs.push_back(job);
 	}
 
-	// Distribute work across threads
-	std::vector<std::thread> threads;
-	std::atomic<int> progress(0);
-
-	size_t filesPerThread = (fileNames.size() + numThreads - 1) / numThreads;
+	// Largest first, dealt round-robin so every queue starts with a similar
+	// share of the big files
+	std::sort(jobs.begin(), jobs.end(), [](const BatchJob& a, const BatchJob& b) {
+		return a.entry->length > b.entry->length;
+	});
 
-	for (int t = 0; t < numThreads; t++) {
-		size_t startIdx = t * filesPerThread;
-		size_t endIdx = std::min(startIdx + filesPerThread, fileNames.size());
+	size_t workerCount = std::min<size_t>(numThreads, jobs.size());
+	std::vector<BatchQueue> queues(std::max<size_t>(workerCount, 1));
+	for (size_t i = 0; i < jobs.size(); i++) {
+		queues[i % queues.size()].jobs.push_back(static_cast<uint32_t>(i));
+	}
 
-		if (startIdx >= fileNames.size()) break;
+	std::atomic<bool> aborted(false);
+	std::atomic<int> progress(0);
+	std::vector<std::thread> threads;
 
-		std::vector<BatchLoadRequest*> threadRequests;
-		for (size_t i = startIdx; i < endIdx; i++) {
-			threadRequests.push_back(&requests[i]);
+	try {
+		for (size_t t = 1; t < workerCount; t++) {
+			threads.emplace_back([this, t, &queues, &jobs, sink, &aborted, &progress]() {
+				this->batchExtractWorker(t, queues, jobs, sink, aborted, progress);
+				});
 		}
+	}
+	catch (...) {
+		// Could not start more threads; the running workers, this one
+		// included, steal the queues that have no worker of their own
+	}
 
-		threads.emplace_back([this, threadRequests, &progress]() {
-			this->batchExtractWorker(threadRequests, progress);
-			});
+	if (workerCount > 0) {
+		batchExtractWorker(0, queues, jobs, sink, aborted, progress);
 	}
 
-	// Wait for all threads
 	for (auto& thread : threads) {
 		thread.join();
 	}
@@ -1519,20 +2472,343 @@ HRESULT RPAArchiveHandler::BatchExtractFiles(const std::vector<std::string>& fil
 	auto endTime = std::chrono::high_resolution_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
 
-	logDebug("Batch extraction completed in " + std::to_string(duration.count()) + " ms");
+	logDebug("Batch extraction completed in " + std::to_string(duration.count()) + " ms, " +
+		std::to_string(progress.load()) + "/" + std::to_string(fileNames.size()) + " files processed, " +
+		std::to_string(failedCount) + " not found");
+
+	if (aborted) {
+		return E_ABORT;
+	}
+	return failedCount == 0 ? S_OK : S_FALSE;
+}
+
+// Collects each file into its own vector; a file that fails is left empty
+class RPAVectorBatchSink : public RPAArchiveHandler::IBatchSink {
+public:
+	explicit RPAVectorBatchSink(std::vector<std::vector<uint8_t>>& outputs) : outputs(outputs) {}
+
+	HRESULT Write(size_t fileIndex, const uint8_t* data, size_t size) override {
+		std::vector<uint8_t>& output = outputs[fileIndex];
+		output.insert(output.end(), data, data + size);
+		return S_OK;
+	}
 
-	// Check results
-	int successCount = 0;
-	for (const auto& req : requests) {
-		if (req.success) successCount++;
+	void Done(size_t fileIndex, HRESULT result) override {
+		if (result != S_OK) {
+			std::vector<uint8_t>().swap(outputs[fileIndex]);
+		}
 	}
 
-	logDebug("Successfully extracted " + std::to_string(successCount) + "/" +
-		std::to_string(fileNames.size()) + " files");
+private:
+	std::vector<std::vector<uint8_t>>& outputs;
+};
 
-	return S_OK;
+HRESULT RPAArchiveHandler::BatchExtractFiles(const std::vector<std::string>& fileNames,
+	std::vector<std::vector<uint8_t>>& outputs,
+	int numThreads) {
+	outputs.clear();
+	outputs.resize(fileNames.size());
+	for (size_t i = 0; i < fileNames.size(); i++) {
+		const ArchiveIndex* entry = FindEntry(fileNames[i].data(), fileNames[i].size());
+		if (entry && IsMapped() && entry->length > 0 && static_cast<uint64_t>(entry->length) <= mmapFile->GetSize()) {
+			outputs[i].reserve(static_cast<size_t>(entry->length));
+		}
+	}
+
+	RPAVectorBatchSink sink(outputs);
+	return BatchExtractFiles(fileNames, &sink, numThreads);
 }
 
 void RPAArchiveHandler::CloseBatchLoad() {
-	mmapFile.Close();
+	mmapFile.reset();
+}
+
+// Archive writer
+RPAArchiveWriter::RPAArchiveWriter()
+	: version(RPA::VERSION_RPA_3)
+	, key(RPA::DEFAULT_OBFUSCATION_KEY)
+	, position(0)
+	, headerSize(0)
+{
+}
+
+std::string RPAArchiveWriter::formatHeader(UInt64 indexOffset) const {
+	char line[64];
+	unsigned long long keyValue = static_cast<unsigned long long>(key);
+	if (std::abs(version - RPA::VERSION_RPA_3_2) < 0.01) {
+		// The 3.2 key starts at the fourth field; the third is not used
+		snprintf(line, sizeof(line), "RPA-3.2 %016llx %08x %08llx\n",
+			static_cast<unsigned long long>(indexOffset), 0u, keyValue);
+	}
+	else {
+		snprintf(line, sizeof(line), "RPA-3.0 %016llx %08llx\n",
+			static_cast<unsigned long long>(indexOffset), keyValue);
+	}
+	return line;
+}
+
+HRESULT RPAArchiveWriter::Create(IOutStream* out, double archiveVersion, int64_t archiveKey) {
+	outStream = out;
+	version = archiveVersion;
+	key = archiveKey;
+
+	// Placeholder with the final length; Finish fills in the index offset
+	std::string header = formatHeader(0);
+	headerSize = header.size();
+	RINOK(outStream->Seek(0, STREAM_SEEK_SET, nullptr));
+	RINOK(WriteStream(outStream, header.data(), header.size()));
+	position = headerSize;
+	return S_OK;
+}
+
+HRESULT RPAArchiveWriter::Append(IOutStream* out, const RPAArchiveHandler& archive) {
+	if (archive.GetArchiveVersion() < RPA::VERSION_RPA_3) {
+		logDebug("In-place update needs an RPA-3.0 or RPA-3.2 archive");
+		return E_NOTIMPL;
+	}
+
+	outStream = out;
+	version = archive.GetArchiveVersion();
+	key = archive.GetObfuscationKey();
+	headerSize = archive.GetHeaderSize();
+
+	// The new header has to fit where the old one was
+	if (formatHeader(0).size() > headerSize) {
+		logDebug("Archive header too short to rewrite in place");
+		return E_NOTIMPL;
+	}
+
+	return outStream->Seek(0, STREAM_SEEK_END, &position);
+}
+
+void RPAArchiveWriter::addEntry(const char* path, size_t pathSize) {
+	if (names.size() + pathSize > UINT32_MAX || tuples.size() >= UINT32_MAX) {
+		throw std::runtime_error("Index too large");
+	}
+	Entry entry;
+	entry.pathOffset = static_cast<uint32_t>(names.size());
+	entry.pathSize = static_cast<uint32_t>(pathSize);
+	entry.firstTuple = static_cast<uint32_t>(tuples.size());
+	entry.tupleCount = 0;
+	names.insert(names.end(), path, path + pathSize);
+	entries.push_back(entry);
+}
+
+void RPAArchiveWriter::addTuple(int64_t offset, int64_t length, const uint8_t* prefix, uint32_t prefixSize) {
+	if (prefixes.size() + prefixSize > UINT32_MAX) {
+		throw std::runtime_error("Prefix data too large");
+	}
+	RPAArchiveHandler::Tuple tuple;
+	tuple.offset = offset;
+	tuple.length = length;
+	tuple.prefixOffset = static_cast<uint32_t>(prefixes.size());
+	tuple.prefixSize = prefixSize;
+	prefixes.insert(prefixes.end(), prefix, prefix + prefixSize);
+	tuples.push_back(tuple);
+	entries.back().tupleCount++;
+}
+
+HRESULT RPAArchiveWriter::AddStream(const char* path, size_t pathSize, ISequentialInStream* data, UInt64* size,
+	ICompressProgressInfo* progress) {
+	if (buffer.size() < RPAArchiveHandler::kCopyBufferSize) {
+		buffer.resize(RPAArchiveHandler::kCopyBufferSize);
+	}
+
+	UInt64 start = position;
+	for (;;) {
+		size_t got = buffer.size();
+		RINOK(ReadStream(data, buffer.data(), &got));
+		if (got == 0) break;
+		RINOK(WriteStream(outStream, buffer.data(), got));
+		position += got;
+		if (progress) {
+			UInt64 done = position - start;
+			RINOK(progress->SetRatioInfo(&done, &done));
+		}
+	}
+
+	*size = position - start;
+	addEntry(path, pathSize);
+	addTuple(static_cast<int64_t>(start), static_cast<int64_t>(*size), nullptr, 0);
+	return S_OK;
+}
+
+HRESULT RPAArchiveWriter::AddCopy(const char* path, size_t pathSize, const RPAArchiveHandler& source,
+	IInStream* sourceStream, const RPAArchiveHandler::ArchiveIndex& entry,
+	ICompressProgressInfo* progress) {
+	addEntry(path, pathSize);
+
+	UInt64 done = 0;
+
+	const RPAArchiveHandler::Tuple* sourceTuples = source.GetTuples(entry);
+	for (uint32_t i = 0; i < entry.tupleCount; i++) {
+		const RPAArchiveHandler::Tuple& tuple = sourceTuples[i];
+		if (tuple.offset < 0 || tuple.length < static_cast<int64_t>(tuple.prefixSize)) {
+			return S_FALSE;
+		}
+
+		UInt64 dataLength = tuple.length - tuple.prefixSize;
+		addTuple(static_cast<int64_t>(position), tuple.length, source.GetPrefix(tuple), tuple.prefixSize);
+		done += tuple.prefixSize;
+
+		// Copied in buffer-sized pieces so progress moves within the payload
+		for (UInt64 copied = 0; copied < dataLength;) {
+			UInt64 chunk = std::min<UInt64>(dataLength - copied, RPAArchiveHandler::kCopyBufferSize);
+			HRESULT result = source.CopyRange(sourceStream, tuple.offset + copied, chunk, outStream, buffer);
+			if (result != S_OK) {
+				return result;
+			}
+			copied += chunk;
+			position += chunk;
+			done += chunk;
+			if (progress) {
+				RINOK(progress->SetRatioInfo(&done, &done));
+			}
+		}
+	}
+	return S_OK;
+}
+
+void RPAArchiveWriter::AddInPlace(const RPAArchiveHandler& source, const RPAArchiveHandler::ArchiveIndex& entry) {
+	addEntry(source.GetPath(entry), entry.pathSize);
+
+	const RPAArchiveHandler::Tuple* sourceTuples = source.GetTuples(entry);
+	for (uint32_t i = 0; i < entry.tupleCount; i++) {
+		const RPAArchiveHandler::Tuple& tuple = sourceTuples[i];
+		addTuple(tuple.offset, tuple.length, source.GetPrefix(tuple), tuple.prefixSize);
+	}
+}
+
+static void pickleWriteInt(std::vector<uint8_t>& out, int64_t value) {
+	if (value >= INT32_MIN && value <= INT32_MAX) {
+		uint32_t v = static_cast<uint32_t>(value);
+		out.push_back(Pickle::BININT);
+		for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+		return;
+	}
+
+	// Shortest little-endian two's complement that keeps the sign
+	uint8_t bytes[8];
+	uint64_t v = static_cast<uint64_t>(value);
+	for (int i = 0; i < 8; i++) bytes[i] = static_cast<uint8_t>(v >> (8 * i));
+	int n = 8;
+	while (n > 1 && ((bytes[n - 1] == 0x00 && !(bytes[n - 2] & 0x80)) ||
+		(bytes[n - 1] == 0xFF && (bytes[n - 2] & 0x80)))) {
+		n--;
+	}
+	out.push_back(Pickle::LONG1);
+	out.push_back(static_cast<uint8_t>(n));
+	out.insert(out.end(), bytes, bytes + n);
+}
+
+static void pickleWriteSized(std::vector<uint8_t>& out, uint8_t shortOp, uint8_t longOp,
+	const void* data, size_t size) {
+	if (shortOp && size < 256) {
+		out.push_back(shortOp);
+		out.push_back(static_cast<uint8_t>(size));
+	}
+	else {
+		out.push_back(longOp);
+		for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(size >> (8 * i)));
+	}
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	out.insert(out.end(), p, p + size);
+}
+
+// Protocol 3, as Python 3 writes it: {path: [(offset ^ key, length ^ key, prefix)]}
+// with items added in batches of 1000 like the pickle module does
+void RPAArchiveWriter::writePickle(std::vector<uint8_t>& out) const {
+	out.push_back(Pickle::PROTO);
+	out.push_back(3);
+	out.push_back(Pickle::EMPTY_DICT);
+
+	const size_t kBatchSize = 1000;
+	for (size_t first = 0; first < entries.size(); first += kBatchSize) {
+		size_t last = std::min(entries.size(), first + kBatchSize);
+		out.push_back(Pickle::MARK);
+		for (size_t i = first; i < last; i++) {
+			const Entry& entry = entries[i];
+			pickleWriteSized(out, 0, Pickle::BINUNICODE, names.data() + entry.pathOffset, entry.pathSize);
+
+			out.push_back(Pickle::EMPTY_LIST);
+			if (entry.tupleCount > 1) out.push_back(Pickle::MARK);
+			for (uint32_t t = 0; t < entry.tupleCount; t++) {
+				const RPAArchiveHandler::Tuple& tuple = tuples[entry.firstTuple + t];
+				pickleWriteInt(out, tuple.offset ^ key);
+				pickleWriteInt(out, tuple.length ^ key);
+				pickleWriteSized(out, Pickle::SHORT_BINBYTES, Pickle::BINBYTES,
+					prefixes.data() + tuple.prefixOffset, tuple.prefixSize);
+				out.push_back(Pickle::TUPLE3);
+			}
+			out.push_back(entry.tupleCount > 1 ? Pickle::APPENDS : Pickle::APPEND);
+		}
+		out.push_back(Pickle::SETITEMS);
+	}
+
+	out.push_back(Pickle::STOP);
+}
+
+HRESULT RPAArchiveWriter::Finish() {
+	std::vector<uint8_t> pickle;
+	writePickle(pickle);
+
+	ByteVector* compressed = bytevector_create(pickle.size() / 2 + 64);
+	if (!compressed) {
+		return E_OUTOFMEMORY;
+	}
+	if (zlib_compress(pickle.data(), pickle.size(), compressed) < 0) {
+		bytevector_free(compressed);
+		return E_OUTOFMEMORY;
+	}
+
+	UInt64 indexOffset = position;
+	HRESULT hr = outStream->Seek(static_cast<Int64>(indexOffset), STREAM_SEEK_SET, nullptr);
+	if (hr == S_OK) {
+		hr = WriteStream(outStream, compressed->data, compressed->length);
+	}
+	bytevector_free(compressed);
+	RINOK(hr);
+
+	// Spaces before the newline keep an appended archive's header its
+	// original length
+	std::string header = formatHeader(indexOffset);
+	header.insert(header.size() - 1, headerSize - header.size(), ' ');
+	RINOK(outStream->Seek(0, STREAM_SEEK_SET, nullptr));
+	RINOK(WriteStream(outStream, header.data(), header.size()));
+
+	logDebug("Archive written: " + std::to_string(entries.size()) + " files, index at " +
+		std::to_string(indexOffset));
+	return S_OK;
+}
+
+HRESULT RPAArchiveWriter::UpdateInPlace(IOutStream* archiveFile, const RPAArchiveHandler& archive,
+	const std::vector<Change>& changes, CLocalProgress* progress) {
+	RPAArchiveWriter writer;
+	RINOK(writer.Append(archiveFile, archive));
+
+	robin_hood::unordered_flat_set<std::string> changed;
+	for (const Change& change : changes) {
+		changed.insert(change.path);
+	}
+
+	for (size_t i = 0; i < archive.GetFileCount(); i++) {
+		const RPAArchiveHandler::ArchiveIndex& entry = archive.GetEntry(i);
+		if (changed.find(std::string(archive.GetPath(entry), entry.pathSize)) == changed.end()) {
+			writer.AddInPlace(archive, entry);
+		}
+	}
+
+	UInt64 completed = progress ? progress->InSize : 0;
+	for (const Change& change : changes) {
+		if (change.data) {
+			if (progress) {
+				progress->InSize = progress->OutSize = completed;
+			}
+			UInt64 size = 0;
+			RINOK(writer.AddStream(change.path.data(), change.path.size(), change.data, &size, progress));
+			completed += size;
+		}
+	}
+
+	return writer.Finish();
 }
\ No newline at end of file
@@ -4,15 +4,10 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
-typedef struct {
-  const uint8_t* data;
-  size_t size;
-  size_t byte_pos;
-  uint32_t bit_buffer;
-  int bits_in_buffer;
-} BitStream;
+#include "Adler32.h"
 
 typedef struct {
   uint8_t* data;
@@ -36,109 +31,136 @@ static void bytevector_free(ByteVector* bv) {
   free(bv);
 }
 
-static int bytevector_push(ByteVector* bv, uint8_t val) {
-  if (bv->length >= bv->size) {
-    size_t new_size = bv->size ? bv->size * 2 : 256;
-    uint8_t* tmp = (uint8_t*)realloc(bv->data, new_size);
-    if (!tmp) return 0;
-    bv->data = tmp;
-    bv->size = new_size;
+// Makes sure at least `extra` bytes can be written past bv->length.
+static int bytevector_reserve(ByteVector* bv, size_t extra) {
+  if (bv->size - bv->length >= extra) return 1;
+  size_t new_size = bv->size ? bv->size : 256;
+  while (new_size - bv->length < extra) {
+    if (new_size > SIZE_MAX / 2) return 0;
+    new_size *= 2;
   }
-  bv->data[bv->length++] = val;
+  uint8_t* tmp = (uint8_t*)realloc(bv->data, new_size);
+  if (!tmp) return 0;
+  bv->data = tmp;
+  bv->size = new_size;
   return 1;
 }
 
+/*
+ * Bit reader. Keeps up to 63 bits in a 64-bit buffer and refills it with one
+ * unaligned 8-byte load while enough input remains. Past the end of input it
+ * shifts in zero bytes and counts them in `overrun`, so a truncated stream is
+ * detected as soon as one of those padding bits is consumed.
+ */
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t byte_pos;
+  uint64_t bit_buffer;
+  unsigned bits_in_buffer;
+  size_t overrun;
+} BitStream;
+
 static void bitstream_init(BitStream* bs, const uint8_t* data, size_t size) {
   bs->data = data;
   bs->size = size;
   bs->byte_pos = 0;
   bs->bit_buffer = 0;
   bs->bits_in_buffer = 0;
+  bs->overrun = 0;
+}
+
+// All supported targets are little-endian.
+static uint64_t bitstream_load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
 }
 
-static int bitstream_read_bits(BitStream* bs, int n) {
-  while (bs->bits_in_buffer < n) {
-    if (bs->byte_pos >= bs->size) return -1;
-    bs->bit_buffer |= (uint32_t)bs->data[bs->byte_pos++] << bs->bits_in_buffer;
+// Tops the buffer up to at least 56 bits. Returns 0 once padding was consumed.
+static int bitstream_refill(BitStream* bs) {
+  if (bs->size - bs->byte_pos >= 8) {
+    bs->bit_buffer |= bitstream_load64(bs->data + bs->byte_pos) << bs->bits_in_buffer;
+    bs->byte_pos += (63 - bs->bits_in_buffer) >> 3;
+    bs->bits_in_buffer |= 56;
+    return 1;
+  }
+  if (bs->bits_in_buffer < bs->overrun * 8) return 0;
+  while (bs->bits_in_buffer <= 56) {
+    if (bs->byte_pos < bs->size)
+      bs->bit_buffer |= (uint64_t)bs->data[bs->byte_pos++] << bs->bits_in_buffer;
+    else
+      bs->overrun++;
     bs->bits_in_buffer += 8;
   }
-  int result = bs->bit_buffer & ((1 << n) - 1);
+  return 1;
+}
+
+static uint32_t bitstream_peek(const BitStream* bs, unsigned n) {
+  return (uint32_t)(bs->bit_buffer & (((uint64_t)1 << n) - 1));
+}
+
+static void bitstream_consume(BitStream* bs, unsigned n) {
   bs->bit_buffer >>= n;
   bs->bits_in_buffer -= n;
+}
+
+static int bitstream_read_bits(BitStream* bs, unsigned n) {
+  if (bs->bits_in_buffer < n && !bitstream_refill(bs)) return -1;
+  int result = (int)bitstream_peek(bs, n);
+  bitstream_consume(bs, n);
   return result;
 }
 
-static int bitstream_read_byte_aligned(BitStream* bs) {
-  bs->bit_buffer = 0;
-  bs->bits_in_buffer = 0;
-  if (bs->byte_pos >= bs->size) return -1;
-  return bs->data[bs->byte_pos++];
+// Number of input bytes touched so far, or (size_t)-1 if padding was consumed.
+static size_t bitstream_position(const BitStream* bs) {
+  size_t unused = bs->bits_in_buffer >> 3;
+  if (unused < bs->overrun) return (size_t)-1;
+  return bs->byte_pos - (unused - bs->overrun);
 }
 
-static void bitstream_align_to_byte(BitStream* bs) {
+// Drops the partial byte and hands buffered whole bytes back to the input.
+static int bitstream_align_to_byte(BitStream* bs) {
+  size_t pos = bitstream_position(bs);
+  if (pos == (size_t)-1) return 0;
+  bs->byte_pos = pos;
   bs->bit_buffer = 0;
   bs->bits_in_buffer = 0;
+  bs->overrun = 0;
+  return 1;
 }
 
-typedef struct {
-  int max_code[16];
-  int offset[16];
-  uint16_t symbols[288];
-} HuffmanTable;
-
-static void huffman_build(HuffmanTable* table, const uint8_t* lengths, int n) {
-  int bl_count[16] = { 0 };
-  for (int i = 0; i < n; i++) {
-    if (lengths[i] > 0 && lengths[i] < 16) bl_count[lengths[i]]++;
-  }
-
-  int code = 0;
-  bl_count[0] = 0;
-  int next_code[16] = { 0 };
-  for (int bits = 1; bits < 16; bits++) {
-    code = (code + bl_count[bits - 1]) << 1;
-    next_code[bits] = code;
-  }
-
-  for (int bits = 0; bits < 16; bits++) {
-    table->max_code[bits] = -1;
-    table->offset[bits] = 0;
-  }
+/*
+ * Huffman decode tables. A primary table is indexed by the next `root` input
+ * bits; codes longer than that go through a LINK entry into a subtable.
+ * Length and distance symbols whose extra bits fit in the same lookup are
+ * expanded to their final value, so most matches need no separate extra read.
+ */
+#define INFLATE_LITLEN_ROOT 10
+#define INFLATE_DIST_ROOT 8
+#define INFLATE_CODELEN_ROOT 7
+#define INFLATE_LITLEN_ENOUGH 2048
+#define INFLATE_DIST_ENOUGH 1024
+#define INFLATE_CODELEN_ENOUGH 128
+#define INFLATE_MAX_MATCH 258
 
-  int sym_idx = 0;
-  for (int bits = 1; bits < 16; bits++) {
-    table->offset[bits] = sym_idx - next_code[bits];
-    for (int i = 0; i < n; i++) {
-      if (lengths[i] == bits) {
-        table->symbols[sym_idx++] = i;
-        table->max_code[bits] = next_code[bits]++;
-      }
-    }
-  }
-}
+#define INFLATE_OP_LITERAL 0x00
+#define INFLATE_OP_BASE 0x10     // low nibble: extra bits still to read
+#define INFLATE_OP_EOB 0x20
+#define INFLATE_OP_LINK 0x40     // low nibble: subtable index bits
+#define INFLATE_OP_INVALID 0x80
 
-static int huffman_decode(const HuffmanTable* table, BitStream* bs) {
-  int code = 0;
-  for (int len = 1; len < 16; len++) {
-    int bit = bitstream_read_bits(bs, 1);
-    if (bit < 0) return -1;
-    code = (code << 1) | bit;
-    if (code <= table->max_code[len] && table->max_code[len] >= 0) {
-      return table->symbols[table->offset[len] + code];
-    }
-  }
-  return -1;
-}
+typedef struct {
+  uint16_t value;  // literal, length/distance base or subtable offset
+  uint8_t op;
+  uint8_t bits;    // bits consumed by this entry
+} InflateCode;
 
-static uint32_t adler32(const uint8_t* data, size_t len) {
-  uint32_t a = 1, b = 0;
-  const uint32_t MOD_ADLER = 65521;
-  for (size_t i = 0; i < len; i++) {
-    a = (a + data[i]) % MOD_ADLER;
-    b = (b + a) % MOD_ADLER;
-  }
-  return (b << 16) | a;
-}
+typedef enum {
+  HUFFMAN_CODELENS,
+  HUFFMAN_LITLEN,
+  HUFFMAN_DIST
+} HuffmanKind;
 
 static const uint16_t length_base[29] = {
     3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
@@ -157,6 +179,160 @@ static const uint8_t dist_extra[30] = {
     7,7,8,8,9,9,10,10,11,11,12,12,13,13
 };
 
+static unsigned huffman_reverse(unsigned code, unsigned len) {
+  unsigned rev = 0;
+  while (len--) {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  return rev;
+}
+
+// Writes every replica of one codeword into a (sub)table of 2^table_bits entries.
+static void huffman_fill(InflateCode* table, unsigned table_bits, unsigned first,
+  unsigned len, HuffmanKind kind, unsigned sym) {
+  unsigned base = 0, extra = 0;
+  InflateCode entry;
+  entry.bits = (uint8_t)len;
+  entry.value = (uint16_t)sym;
+  entry.op = INFLATE_OP_LITERAL;
+
+  if (kind == HUFFMAN_LITLEN && sym == 256) {
+    entry.op = INFLATE_OP_EOB;
+  }
+  else if (kind == HUFFMAN_LITLEN && sym > 256) {
+    if (sym - 257 >= 29) entry.op = INFLATE_OP_INVALID;
+    else { base = length_base[sym - 257]; extra = length_extra[sym - 257]; entry.op = INFLATE_OP_BASE; }
+  }
+  else if (kind == HUFFMAN_DIST) {
+    if (sym >= 30) entry.op = INFLATE_OP_INVALID;
+    else { base = dist_base[sym]; extra = dist_extra[sym]; entry.op = INFLATE_OP_BASE; }
+  }
+
+  for (unsigned idx = first; idx < (1u << table_bits); idx += 1u << len) {
+    if (entry.op == INFLATE_OP_BASE) {
+      if (len + extra <= table_bits) {
+        entry.value = (uint16_t)(base + ((idx >> len) & ((1u << extra) - 1)));
+        entry.bits = (uint8_t)(len + extra);
+        table[idx] = entry;
+        entry.bits = (uint8_t)len;
+        continue;
+      }
+      InflateCode pending = { (uint16_t)base, (uint8_t)(INFLATE_OP_BASE | extra), (uint8_t)len };
+      table[idx] = pending;
+      continue;
+    }
+    table[idx] = entry;
+  }
+}
+
+/*
+ * Builds a decode table from canonical code lengths. Over-subscribed and
+ * incomplete codes are rejected, except for the single one-bit code that
+ * deflate allows for distances. Returns 0 on success, -1 on a bad code.
+ */
+static int huffman_build(InflateCode* table, size_t table_size, unsigned root,
+  const uint8_t* lengths, unsigned n, HuffmanKind kind) {
+  uint16_t count[16] = { 0 };
+  uint16_t offs[16];
+  uint16_t sorted[288];
+  uint8_t sub_bits[1u << INFLATE_LITLEN_ROOT];
+  unsigned max_len = 0;
+
+  for (unsigned i = 0; i < n; i++) {
+    if (lengths[i] > 15) return -1;
+    count[lengths[i]]++;
+    if (lengths[i] > max_len) max_len = lengths[i];
+  }
+
+  // Invalid entries claim the full index width, so a streaming caller only
+  // reports them once those bits are really present.
+  const unsigned root_size = 1u << root;
+  InflateCode invalid = { 0, INFLATE_OP_INVALID, (uint8_t)root };
+  for (unsigned i = 0; i < root_size; i++) table[i] = invalid;
+  if (max_len == 0) return 0;
+
+  int left = 1;
+  for (unsigned len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= count[len];
+    if (left < 0) return -1;
+  }
+  if (left > 0 && (kind == HUFFMAN_CODELENS || max_len != 1)) return -1;
+
+  offs[1] = 0;
+  for (unsigned len = 1; len < 15; len++) offs[len + 1] = (uint16_t)(offs[len] + count[len]);
+  for (unsigned i = 0; i < n; i++) {
+    if (lengths[i]) sorted[offs[lengths[i]]++] = (uint16_t)i;
+  }
+  const unsigned num_codes = offs[15];
+
+  // Codes longer than root are grouped by their first root bits; each group
+  // gets one subtable wide enough for its longest code.
+  memset(sub_bits, 0, root_size);
+  unsigned code = 0, cur_len = 0;
+  for (unsigned k = 0; k < num_codes; k++) {
+    unsigned len = lengths[sorted[k]];
+    code <<= len - cur_len;
+    cur_len = len;
+    if (len > root) {
+      unsigned prefix = huffman_reverse(code, len) & (root_size - 1);
+      sub_bits[prefix] = (uint8_t)(len - root);
+    }
+    code++;
+  }
+
+  size_t next = root_size;
+  for (unsigned prefix = 0; prefix < root_size; prefix++) {
+    if (!sub_bits[prefix]) continue;
+    size_t sub_size = (size_t)1 << sub_bits[prefix];
+    if (next + sub_size > table_size) return -1;
+    InflateCode link = { (uint16_t)next, (uint8_t)(INFLATE_OP_LINK | sub_bits[prefix]), (uint8_t)root };
+    table[prefix] = link;
+    invalid.bits = sub_bits[prefix];
+    for (size_t i = 0; i < sub_size; i++) table[next + i] = invalid;
+    next += sub_size;
+  }
+
+  code = 0;
+  cur_len = 0;
+  for (unsigned k = 0; k < num_codes; k++) {
+    unsigned sym = sorted[k];
+    unsigned len = lengths[sym];
+    code <<= len - cur_len;
+    cur_len = len;
+    unsigned rev = huffman_reverse(code, len);
+    if (len <= root) {
+      huffman_fill(table, root, rev, len, kind, sym);
+    }
+    else {
+      const InflateCode link = table[rev & (root_size - 1)];
+      huffman_fill(table + link.value, link.op & 0x0F, rev >> root, len - root, kind, sym);
+    }
+    code++;
+  }
+  return 0;
+}
+
+// Looks up the next symbol; the caller guarantees at least 15 buffered bits.
+static InflateCode huffman_decode(const InflateCode* table, unsigned root, BitStream* bs) {
+  InflateCode here = table[bitstream_peek(bs, root)];
+  if (here.op & INFLATE_OP_LINK) {
+    bitstream_consume(bs, here.bits);
+    here = table[here.value + bitstream_peek(bs, here.op & 0x0F)];
+  }
+  bitstream_consume(bs, here.bits);
+  return here;
+}
+
+static uint32_t adler32_update(uint32_t adler, const uint8_t* data, size_t len) {
+  return Adler32_Update(adler, data, len);
+}
+
+static uint32_t adler32(const uint8_t* data, size_t len) {
+  return adler32_update(1, data, len);
+}
+
 static void init_fixed_tables(uint8_t* lit_lengths, uint8_t* dist_lengths) {
   for (int i = 0; i <= 143; i++) lit_lengths[i] = 8;
   for (int i = 144; i <= 255; i++) lit_lengths[i] = 9;
@@ -172,6 +348,7 @@ static int decode_dynamic_tables(BitStream* bs, uint8_t* lit_lengths, uint8_t* d
   if (hdist < 0) return -1; hdist += 1;
   int hclen = bitstream_read_bits(bs, 4);
   if (hclen < 0) return -1; hclen += 4;
+  if (hlit > 286 || hdist > 30) return -1;
 
   const uint8_t cl_order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
   uint8_t cl_lengths[19] = { 0 };
@@ -181,89 +358,134 @@ static int decode_dynamic_tables(BitStream* bs, uint8_t* lit_lengths, uint8_t* d
     cl_lengths[cl_order[i]] = (uint8_t)len;
   }
 
-  HuffmanTable cl_table;
-  huffman_build(&cl_table, cl_lengths, 19);
+  InflateCode cl_table[INFLATE_CODELEN_ENOUGH];
+  if (huffman_build(cl_table, INFLATE_CODELEN_ENOUGH, INFLATE_CODELEN_ROOT, cl_lengths, 19, HUFFMAN_CODELENS) < 0)
+    return -1;
 
   uint8_t all_lengths[320] = { 0 };
   int idx = 0, total = hlit + hdist;
 
   while (idx < total) {
-    int sym = huffman_decode(&cl_table, bs);
-    if (sym < 0) return -1;
-    if (sym < 16) all_lengths[idx++] = (uint8_t)sym;
+    if (!bitstream_refill(bs)) return -1;
+    InflateCode here = huffman_decode(cl_table, INFLATE_CODELEN_ROOT, bs);
+    if (here.op != INFLATE_OP_LITERAL) return -1;
+    int sym = here.value;
+    int repeat;
+    uint8_t val = 0;
+    if (sym < 16) {
+      all_lengths[idx++] = (uint8_t)sym;
+      continue;
+    }
     else if (sym == 16) {
       if (idx == 0) return -1;
-      int repeat = bitstream_read_bits(bs, 2);
-      if (repeat < 0) return -1;
-      repeat += 3;
-      uint8_t val = all_lengths[idx - 1];
-      while (repeat-- > 0 && idx < total) all_lengths[idx++] = val;
+      val = all_lengths[idx - 1];
+      repeat = 3 + (int)bitstream_peek(bs, 2);
+      bitstream_consume(bs, 2);
     }
     else if (sym == 17) {
-      int repeat = bitstream_read_bits(bs, 3);
-      if (repeat < 0) return -1;
-      repeat += 3;
-      while (repeat-- > 0 && idx < total) all_lengths[idx++] = 0;
+      repeat = 3 + (int)bitstream_peek(bs, 3);
+      bitstream_consume(bs, 3);
     }
-    else if (sym == 18) {
-      int repeat = bitstream_read_bits(bs, 7);
-      if (repeat < 0) return -1;
-      repeat += 11;
-      while (repeat-- > 0 && idx < total) all_lengths[idx++] = 0;
+    else {
+      repeat = 11 + (int)bitstream_peek(bs, 7);
+      bitstream_consume(bs, 7);
     }
-    else return -1;
+    if (idx + repeat > total) return -1;
+    while (repeat-- > 0) all_lengths[idx++] = val;
   }
 
+  if (all_lengths[256] == 0) return -1;
   for (int i = 0; i < hlit; i++) lit_lengths[i] = all_lengths[i];
   for (int i = 0; i < hdist; i++) dist_lengths[i] = all_lengths[hlit + i];
 
   return 0;
 }
 
+/*
+ * Decodes one Huffman block. The bit buffer is refilled once per symbol, which
+ * always covers a full length/distance pair (at most 48 bits), and output space
+ * for a whole match plus an 8-byte overrun is reserved up front so literals
+ * and matches are stored without per-byte capacity checks.
+ */
 static int decode_block(BitStream* bs, ByteVector* output, const uint8_t* lit_lengths, const uint8_t* dist_lengths) {
-  HuffmanTable lit_table, dist_table;
-  huffman_build(&lit_table, lit_lengths, 288);
-  huffman_build(&dist_table, dist_lengths, 32);
+  InflateCode lit_table[INFLATE_LITLEN_ENOUGH];
+  InflateCode dist_table[INFLATE_DIST_ENOUGH];
+  if (huffman_build(lit_table, INFLATE_LITLEN_ENOUGH, INFLATE_LITLEN_ROOT, lit_lengths, 288, HUFFMAN_LITLEN) < 0)
+    return -1;
+  if (huffman_build(dist_table, INFLATE_DIST_ENOUGH, INFLATE_DIST_ROOT, dist_lengths, 32, HUFFMAN_DIST) < 0)
+    return -1;
 
   while (1) {
-    int symbol = huffman_decode(&lit_table, bs);
-    if (symbol < 0) return -1;
-    if (symbol < 256) {
-      if (!bytevector_push(output, (uint8_t)symbol)) return -1;
-    }
-    else if (symbol == 256) return 0;
-    else if (symbol <= 285) {
-      int len_code = symbol - 257;
-      if (len_code >= 29) return -1;
-
-      int length = length_base[len_code];
-      int extra_bits = length_extra[len_code];
-      if (extra_bits > 0) {
-        int extra = bitstream_read_bits(bs, extra_bits);
-        if (extra < 0) return -1;
-        length += extra;
-      }
+    if (!bytevector_reserve(output, INFLATE_MAX_MATCH + 8)) return -1;
+    if (!bitstream_refill(bs)) return -1;
 
-      int dist_code = huffman_decode(&dist_table, bs);
-      if (dist_code < 0 || dist_code >= 30) return -1;
-      int distance = dist_base[dist_code];
-      extra_bits = dist_extra[dist_code];
-      if (extra_bits > 0) {
-        int extra = bitstream_read_bits(bs, extra_bits);
-        if (extra < 0) return -1;
-        distance += extra;
-      }
+    InflateCode here = huffman_decode(lit_table, INFLATE_LITLEN_ROOT, bs);
+    if (here.op == INFLATE_OP_LITERAL) {
+      output->data[output->length++] = (uint8_t)here.value;
+      continue;
+    }
+    if (!(here.op & INFLATE_OP_BASE)) {
+      return here.op == INFLATE_OP_EOB ? 0 : -1;
+    }
 
-      if (distance > (int)output->length || distance <= 0) return -1;
-      size_t copy_pos = output->length - distance;
-      for (int i = 0; i < length; i++) {
-        if (!bytevector_push(output, output->data[copy_pos + i])) return -1;
-      }
+    size_t length = here.value;
+    unsigned extra_bits = here.op & 0x0F;
+    if (extra_bits) {
+      length += bitstream_peek(bs, extra_bits);
+      bitstream_consume(bs, extra_bits);
+    }
+
+    here = huffman_decode(dist_table, INFLATE_DIST_ROOT, bs);
+    if (!(here.op & INFLATE_OP_BASE)) return -1;
+    size_t distance = here.value;
+    extra_bits = here.op & 0x0F;
+    if (extra_bits) {
+      distance += bitstream_peek(bs, extra_bits);
+      bitstream_consume(bs, extra_bits);
+    }
+
+    if (distance > output->length) return -1;
+    uint8_t* dst = output->data + output->length;
+    const uint8_t* src = dst - distance;
+    output->length += length;
+
+    if (distance >= 8) {
+      // Chunks may overlap the match source by design; the reserve above
+      // leaves room for the final chunk's overrun.
+      uint8_t* end = dst + length;
+      do {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+      } while (dst < end);
+    }
+    else if (distance == 1) {
+      memset(dst, *src, length);
+    }
+    else {
+      while (length--) *dst++ = *src++;
     }
-    else return -1;
   }
 }
 
+static int decode_stored_block(BitStream* bs, ByteVector* output) {
+  if (!bitstream_align_to_byte(bs)) return -1;
+  if (bs->size - bs->byte_pos < 4) return -1;
+  const uint8_t* hdr = bs->data + bs->byte_pos;
+  uint16_t len = (uint16_t)(hdr[0] | (hdr[1] << 8));
+  uint16_t nlen = (uint16_t)(hdr[2] | (hdr[3] << 8));
+  if (len != (uint16_t)~nlen) return -1;
+  bs->byte_pos += 4;
+
+  size_t avail = bs->size - bs->byte_pos;
+  size_t copy = len < avail ? len : avail;
+  if (!bytevector_reserve(output, copy)) return -1;
+  memcpy(output->data + output->length, bs->data + bs->byte_pos, copy);
+  output->length += copy;
+  bs->byte_pos += copy;
+  return copy == len ? 0 : -1;
+}
+
 static int zlib_decompress_deflate(const uint8_t* input, size_t size,
   ByteVector* output, size_t* bytes_consumed) {
   BitStream bs;
@@ -278,20 +500,7 @@ static int zlib_decompress_deflate(const uint8_t* input, size_t size,
     if (type < 0) return -1;
 
     if (type == 0) {
-      bitstream_align_to_byte(&bs);
-      int len_lo = bitstream_read_byte_aligned(&bs);
-      int len_hi = bitstream_read_byte_aligned(&bs);
-      int nlen_lo = bitstream_read_byte_aligned(&bs);
-      int nlen_hi = bitstream_read_byte_aligned(&bs);
-      if (len_lo < 0 || len_hi < 0 || nlen_lo < 0 || nlen_hi < 0) return -1;
-      uint16_t len = (uint16_t)(len_lo | (len_hi << 8));
-      uint16_t nlen = (uint16_t)(nlen_lo | (nlen_hi << 8));
-      if (len != (uint16_t)~nlen) return -1;
-      for (int i = 0; i < len; i++) {
-        int b = bitstream_read_byte_aligned(&bs);
-        if (b < 0) return -1;
-        if (!bytevector_push(output, (uint8_t)b)) return -1;
-      }
+      if (decode_stored_block(&bs, output) < 0) return -1;
     }
     else if (type == 1) {
       uint8_t lit[288], dist[32];
@@ -308,7 +517,9 @@ static int zlib_decompress_deflate(const uint8_t* input, size_t size,
     }
   }
 
-  if (bytes_consumed) *bytes_consumed = bs.byte_pos;
+  size_t consumed = bitstream_position(&bs);
+  if (consumed == (size_t)-1) return -1;
+  if (bytes_consumed) *bytes_consumed = consumed;
   return 0;
 }
 
@@ -359,4 +570,618 @@ static int zlib_decompress_no_checksum(const uint8_t* input, size_t input_size,
   return result;
 }
 
+/*
+ * Inflate into a caller-provided buffer of known size. The fast loop runs
+ * while a full match plus an 8-byte overrun still fits in the output and at
+ * least 8 input bytes remain, so it needs no per-symbol bounds checks and
+ * copies matches in wide chunks. Near either end the careful loop takes over
+ * and checks every literal and match against the space left.
+ */
+static void inflate_copy_match(uint8_t* dst, size_t distance, size_t length) {
+  const uint8_t* src = dst - distance;
+  if (distance == 1) {
+    memset(dst, *src, length);
+  }
+  else {
+    while (length--) *dst++ = *src++;
+  }
+}
+
+static int decode_block_into(BitStream* bs, uint8_t* out, size_t out_size, size_t* out_pos,
+  const uint8_t* lit_lengths, const uint8_t* dist_lengths) {
+  InflateCode lit_table[INFLATE_LITLEN_ENOUGH];
+  InflateCode dist_table[INFLATE_DIST_ENOUGH];
+  if (huffman_build(lit_table, INFLATE_LITLEN_ENOUGH, INFLATE_LITLEN_ROOT, lit_lengths, 288, HUFFMAN_LITLEN) < 0)
+    return -1;
+  if (huffman_build(dist_table, INFLATE_DIST_ENOUGH, INFLATE_DIST_ROOT, dist_lengths, 32, HUFFMAN_DIST) < 0)
+    return -1;
+
+  size_t pos = *out_pos;
+  int result = -1;
+
+  for (;;) {
+    while (out_size - pos >= INFLATE_MAX_MATCH + 8 && bs->size - bs->byte_pos >= 8) {
+      bitstream_refill(bs);
+
+      InflateCode here = huffman_decode(lit_table, INFLATE_LITLEN_ROOT, bs);
+      if (here.op == INFLATE_OP_LITERAL) {
+        out[pos++] = (uint8_t)here.value;
+        continue;
+      }
+      if (!(here.op & INFLATE_OP_BASE)) {
+        if (here.op == INFLATE_OP_EOB) result = 0;
+        goto done;
+      }
+
+      size_t length = here.value;
+      unsigned extra_bits = here.op & 0x0F;
+      if (extra_bits) {
+        length += bitstream_peek(bs, extra_bits);
+        bitstream_consume(bs, extra_bits);
+      }
+
+      here = huffman_decode(dist_table, INFLATE_DIST_ROOT, bs);
+      if (!(here.op & INFLATE_OP_BASE)) goto done;
+      size_t distance = here.value;
+      extra_bits = here.op & 0x0F;
+      if (extra_bits) {
+        distance += bitstream_peek(bs, extra_bits);
+        bitstream_consume(bs, extra_bits);
+      }
+      if (distance > pos) goto done;
+
+      uint8_t* dst = out + pos;
+      pos += length;
+      if (distance >= 8) {
+        const uint8_t* src = dst - distance;
+        uint8_t* end = dst + length;
+        do {
+          memcpy(dst, src, 8);
+          dst += 8;
+          src += 8;
+        } while (dst < end);
+      }
+      else {
+        inflate_copy_match(dst, distance, length);
+      }
+    }
+
+    if (!bitstream_refill(bs)) goto done;
+
+    InflateCode here = huffman_decode(lit_table, INFLATE_LITLEN_ROOT, bs);
+    if (here.op == INFLATE_OP_LITERAL) {
+      if (pos == out_size) goto done;
+      out[pos++] = (uint8_t)here.value;
+      continue;
+    }
+    if (!(here.op & INFLATE_OP_BASE)) {
+      if (here.op == INFLATE_OP_EOB) result = 0;
+      goto done;
+    }
+
+    size_t length = here.value;
+    unsigned extra_bits = here.op & 0x0F;
+    if (extra_bits) {
+      length += bitstream_peek(bs, extra_bits);
+      bitstream_consume(bs, extra_bits);
+    }
+
+    here = huffman_decode(dist_table, INFLATE_DIST_ROOT, bs);
+    if (!(here.op & INFLATE_OP_BASE)) goto done;
+    size_t distance = here.value;
+    extra_bits = here.op & 0x0F;
+    if (extra_bits) {
+      distance += bitstream_peek(bs, extra_bits);
+      bitstream_consume(bs, extra_bits);
+    }
+    if (distance > pos || length > out_size - pos) goto done;
+
+    if (distance >= length) {
+      memcpy(out + pos, out + pos - distance, length);
+    }
+    else {
+      inflate_copy_match(out + pos, distance, length);
+    }
+    pos += length;
+  }
+
+done:
+  *out_pos = pos;
+  return result;
+}
+
+static int decode_stored_block_into(BitStream* bs, uint8_t* out, size_t out_size, size_t* out_pos) {
+  if (!bitstream_align_to_byte(bs)) return -1;
+  if (bs->size - bs->byte_pos < 4) return -1;
+  const uint8_t* hdr = bs->data + bs->byte_pos;
+  uint16_t len = (uint16_t)(hdr[0] | (hdr[1] << 8));
+  uint16_t nlen = (uint16_t)(hdr[2] | (hdr[3] << 8));
+  if (len != (uint16_t)~nlen) return -1;
+  bs->byte_pos += 4;
+
+  size_t copy = len;
+  if (copy > bs->size - bs->byte_pos) copy = bs->size - bs->byte_pos;
+  if (copy > out_size - *out_pos) copy = out_size - *out_pos;
+  memcpy(out + *out_pos, bs->data + bs->byte_pos, copy);
+  *out_pos += copy;
+  bs->byte_pos += copy;
+  return copy == len ? 0 : -1;
+}
+
+/*
+ * Inflates a raw deflate stream into out[0, out_size). *out_len is set to the
+ * number of bytes written even on failure; running out of output space is an
+ * error. Returns 0 on success, -1 on error.
+ */
+static int zlib_decompress_deflate_into(const uint8_t* input, size_t size,
+  uint8_t* out, size_t out_size, size_t* out_len, size_t* bytes_consumed) {
+  BitStream bs;
+  bitstream_init(&bs, input, size);
+  size_t pos = 0;
+  int is_final = 0;
+  int result = 0;
+
+  while (!is_final && result == 0) {
+    is_final = bitstream_read_bits(&bs, 1);
+    int type = bitstream_read_bits(&bs, 2);
+    if (is_final < 0 || type < 0) {
+      result = -1;
+    }
+    else if (type == 0) {
+      result = decode_stored_block_into(&bs, out, out_size, &pos);
+    }
+    else if (type == 1) {
+      uint8_t lit[288], dist[32];
+      init_fixed_tables(lit, dist);
+      result = decode_block_into(&bs, out, out_size, &pos, lit, dist);
+    }
+    else if (type == 2) {
+      uint8_t lit[288] = { 0 }, dist[32] = { 0 };
+      result = decode_dynamic_tables(&bs, lit, dist);
+      if (result == 0) result = decode_block_into(&bs, out, out_size, &pos, lit, dist);
+    }
+    else {
+      result = -1;
+    }
+  }
+
+  if (out_len) *out_len = pos;
+  if (result < 0) return -1;
+  size_t consumed = bitstream_position(&bs);
+  if (consumed == (size_t)-1) return -1;
+  if (bytes_consumed) *bytes_consumed = consumed;
+  return 0;
+}
+
+/*
+ * zlib wrapper around zlib_decompress_deflate_into. With verify_checksum the
+ * four Adler-32 bytes must directly follow the deflate data and are checked;
+ * *bytes_consumed then includes them, otherwise it stops after the deflate
+ * data like zlib_decompress_no_checksum.
+ */
+static int zlib_decompress_into(const uint8_t* input, size_t input_size, uint8_t* out, size_t out_size,
+  size_t* out_len, size_t* bytes_consumed, int verify_checksum) {
+  if (out_len) *out_len = 0;
+  if (input_size < 2) return -1;
+  uint8_t cmf = input[0], flg = input[1];
+  if ((cmf & 0x0F) != 8) return -1;
+  if (((cmf << 8) + flg) % 31 != 0) return -1;
+  if (flg & 0x20) return -1;
+
+  size_t consumed = 0, written = 0;
+  int result = zlib_decompress_deflate_into(input + 2, input_size - 2, out, out_size, &written, &consumed);
+  if (out_len) *out_len = written;
+  if (result < 0) return -1;
+  consumed += 2;
+
+  if (verify_checksum) {
+    if (input_size - consumed < 4) return -1;
+    const uint8_t* p = input + consumed;
+    uint32_t stored_checksum = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    if (stored_checksum != adler32(out, written)) return -1;
+    consumed += 4;
+  }
+
+  if (bytes_consumed) *bytes_consumed = consumed;
+  return 0;
+}
+
+/*
+ * Streaming inflate. The decoder is a resumable state machine: input is fed in
+ * arbitrary chunks and output is produced in arbitrary chunks, so callers can
+ * decode straight from an IInStream into an ISequentialOutStream with constant
+ * memory. Decoded bytes go into an internal buffer holding the 32 KiB history
+ * window plus a decode area; whenever the decode area is drained it slides down,
+ * keeping only the window. Each step (a symbol, a length/distance pair, a
+ * header field) is committed only once all of its bits are buffered, so a
+ * chunk may end anywhere.
+ */
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_STREAM_BUFFER (4 * INFLATE_WINDOW_SIZE)
+#define INFLATE_STREAM_LIMIT (INFLATE_STREAM_BUFFER - INFLATE_MAX_MATCH - 8)
+
+// inflate_stream_create flags
+#define INFLATE_STREAM_ZLIB 0x01    // input starts with a two-byte zlib header
+#define INFLATE_STREAM_ADLER 0x02   // verify the trailing Adler-32 (needs ZLIB)
+
+// Return codes of inflate_stream_run
+#define INFLATE_STREAM_ERROR -1
+#define INFLATE_STREAM_OK 0         // needs more input or more output space
+#define INFLATE_STREAM_END 1        // stream finished and fully delivered
+#define INFLATE_STREAM_FULL 2       // internal: decode area full, drain it
+
+typedef enum {
+  INFLATE_MODE_ZLIB_HEADER,
+  INFLATE_MODE_BLOCK_HEADER,
+  INFLATE_MODE_STORED_HEADER,
+  INFLATE_MODE_STORED_COPY,
+  INFLATE_MODE_TABLE_COUNTS,
+  INFLATE_MODE_TABLE_LENLENS,
+  INFLATE_MODE_TABLE_CODELENS,
+  INFLATE_MODE_CODES,
+  INFLATE_MODE_DIST,
+  INFLATE_MODE_CHECK,
+  INFLATE_MODE_DONE
+} InflateMode;
+
+typedef struct {
+  InflateMode mode;
+  int flags;
+  int last_block;
+
+  uint64_t bit_buffer;
+  unsigned bits_in_buffer;
+
+  size_t stored_left;
+  unsigned hlit, hdist, hclen, have;
+  size_t match_length;
+  uint8_t lengths[320];
+  InflateCode cl_table[INFLATE_CODELEN_ENOUGH];
+  InflateCode lit_table[INFLATE_LITLEN_ENOUGH];
+  InflateCode dist_table[INFLATE_DIST_ENOUGH];
+
+  uint32_t adler;
+  uint64_t total_out;
+  size_t pos;         // next write position in buffer
+  size_t read_pos;    // first byte not yet handed to the caller
+  uint8_t buffer[INFLATE_STREAM_BUFFER + 8];
+} InflateStream;
+
+static void inflate_stream_reset(InflateStream* s, int flags) {
+  s->mode = (flags & INFLATE_STREAM_ZLIB) ? INFLATE_MODE_ZLIB_HEADER : INFLATE_MODE_BLOCK_HEADER;
+  s->flags = flags;
+  s->last_block = 0;
+  s->bit_buffer = 0;
+  s->bits_in_buffer = 0;
+  s->stored_left = 0;
+  s->hlit = s->hdist = s->hclen = s->have = 0;
+  s->match_length = 0;
+  s->adler = 1;
+  s->total_out = 0;
+  s->pos = 0;
+  s->read_pos = 0;
+}
+
+static InflateStream* inflate_stream_create(int flags) {
+  InflateStream* s = (InflateStream*)malloc(sizeof(InflateStream));
+  if (!s) return NULL;
+  inflate_stream_reset(s, flags);
+  return s;
+}
+
+static void inflate_stream_free(InflateStream* s) {
+  free(s);
+}
+
+static void inflate_stream_pull(InflateStream* s, const uint8_t* in, size_t in_size, size_t* in_pos) {
+  if (in_size - *in_pos >= 8) {
+    s->bit_buffer |= bitstream_load64(in + *in_pos) << s->bits_in_buffer;
+    *in_pos += (63 - s->bits_in_buffer) >> 3;
+    s->bits_in_buffer |= 56;
+    return;
+  }
+  while (s->bits_in_buffer <= 56 && *in_pos < in_size) {
+    s->bit_buffer |= (uint64_t)in[(*in_pos)++] << s->bits_in_buffer;
+    s->bits_in_buffer += 8;
+  }
+}
+
+static uint32_t inflate_stream_bits(InflateStream* s, unsigned n) {
+  uint32_t v = (uint32_t)(s->bit_buffer & (((uint64_t)1 << n) - 1));
+  s->bit_buffer >>= n;
+  s->bits_in_buffer -= n;
+  return v;
+}
+
+// Resolves the next code without consuming it; NULL if more bits are needed.
+static const InflateCode* inflate_stream_lookup(const InflateStream* s, const InflateCode* table,
+  unsigned root, unsigned* total_bits) {
+  const InflateCode* here = &table[s->bit_buffer & ((1u << root) - 1)];
+  unsigned bits = here->bits;
+  if (here->op & INFLATE_OP_LINK) {
+    if (s->bits_in_buffer < root) return NULL;
+    here = &table[here->value + ((s->bit_buffer >> root) & ((1u << (here->op & 0x0F)) - 1))];
+    bits += here->bits;
+  }
+  if (here->op & INFLATE_OP_BASE) bits += here->op & 0x0F;
+  if (s->bits_in_buffer < bits) return NULL;
+  *total_bits = bits;
+  return here;
+}
+
+// Consumes a code found by inflate_stream_lookup and returns its value.
+static size_t inflate_stream_take(InflateStream* s, const InflateCode* here, unsigned total_bits) {
+  unsigned extra = (here->op & INFLATE_OP_BASE) ? (here->op & 0x0F) : 0;
+  unsigned code_bits = total_bits - extra;
+  s->bit_buffer >>= code_bits;
+  s->bits_in_buffer -= code_bits;
+  return here->value + (extra ? inflate_stream_bits(s, extra) : 0);
+}
+
+static int inflate_stream_decode(InflateStream* s, const uint8_t* in, size_t in_size, size_t* in_pos) {
+  for (;;) {
+    if (s->mode == INFLATE_MODE_DONE) return INFLATE_STREAM_END;
+    inflate_stream_pull(s, in, in_size, in_pos);
+
+    switch (s->mode) {
+    case INFLATE_MODE_ZLIB_HEADER: {
+      if (s->bits_in_buffer < 16) return INFLATE_STREAM_OK;
+      uint32_t cmf = inflate_stream_bits(s, 8);
+      uint32_t flg = inflate_stream_bits(s, 8);
+      if ((cmf & 0x0F) != 8 || ((cmf << 8) + flg) % 31 != 0 || (flg & 0x20))
+        return INFLATE_STREAM_ERROR;
+      s->mode = INFLATE_MODE_BLOCK_HEADER;
+      break;
+    }
+
+    case INFLATE_MODE_BLOCK_HEADER: {
+      if (s->last_block) {
+        s->mode = (s->flags & INFLATE_STREAM_ADLER) ? INFLATE_MODE_CHECK : INFLATE_MODE_DONE;
+        break;
+      }
+      if (s->bits_in_buffer < 3) return INFLATE_STREAM_OK;
+      s->last_block = (int)inflate_stream_bits(s, 1);
+      uint32_t type = inflate_stream_bits(s, 2);
+      if (type == 0) {
+        inflate_stream_bits(s, s->bits_in_buffer & 7);
+        s->mode = INFLATE_MODE_STORED_HEADER;
+      }
+      else if (type == 1) {
+        uint8_t lit[288], dist[32];
+        init_fixed_tables(lit, dist);
+        huffman_build(s->lit_table, INFLATE_LITLEN_ENOUGH, INFLATE_LITLEN_ROOT, lit, 288, HUFFMAN_LITLEN);
+        huffman_build(s->dist_table, INFLATE_DIST_ENOUGH, INFLATE_DIST_ROOT, dist, 32, HUFFMAN_DIST);
+        s->mode = INFLATE_MODE_CODES;
+      }
+      else if (type == 2) {
+        s->mode = INFLATE_MODE_TABLE_COUNTS;
+      }
+      else {
+        return INFLATE_STREAM_ERROR;
+      }
+      break;
+    }
+
+    case INFLATE_MODE_STORED_HEADER: {
+      if (s->bits_in_buffer < 32) return INFLATE_STREAM_OK;
+      uint32_t len = inflate_stream_bits(s, 16);
+      uint32_t nlen = inflate_stream_bits(s, 16);
+      if (len != (~nlen & 0xFFFF)) return INFLATE_STREAM_ERROR;
+      s->stored_left = len;
+      s->mode = INFLATE_MODE_STORED_COPY;
+      break;
+    }
+
+    case INFLATE_MODE_STORED_COPY: {
+      while (s->stored_left && s->bits_in_buffer >= 8) {
+        if (s->pos >= INFLATE_STREAM_LIMIT) return INFLATE_STREAM_FULL;
+        s->buffer[s->pos++] = (uint8_t)inflate_stream_bits(s, 8);
+        s->stored_left--;
+      }
+      if (s->bits_in_buffer == 0) s->bit_buffer = 0;  // drop read-ahead before copying from `in`
+      while (s->stored_left) {
+        if (s->pos >= INFLATE_STREAM_LIMIT) return INFLATE_STREAM_FULL;
+        if (*in_pos == in_size) return INFLATE_STREAM_OK;
+        size_t n = s->stored_left;
+        if (n > INFLATE_STREAM_LIMIT - s->pos) n = INFLATE_STREAM_LIMIT - s->pos;
+        if (n > in_size - *in_pos) n = in_size - *in_pos;
+        memcpy(s->buffer + s->pos, in + *in_pos, n);
+        s->pos += n;
+        *in_pos += n;
+        s->stored_left -= n;
+      }
+      s->mode = INFLATE_MODE_BLOCK_HEADER;
+      break;
+    }
+
+    case INFLATE_MODE_TABLE_COUNTS: {
+      if (s->bits_in_buffer < 14) return INFLATE_STREAM_OK;
+      s->hlit = inflate_stream_bits(s, 5) + 257;
+      s->hdist = inflate_stream_bits(s, 5) + 1;
+      s->hclen = inflate_stream_bits(s, 4) + 4;
+      if (s->hlit > 286 || s->hdist > 30) return INFLATE_STREAM_ERROR;
+      memset(s->lengths, 0, sizeof(s->lengths));
+      s->have = 0;
+      s->mode = INFLATE_MODE_TABLE_LENLENS;
+      break;
+    }
+
+    case INFLATE_MODE_TABLE_LENLENS: {
+      static const uint8_t cl_order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+      while (s->have < s->hclen) {
+        if (s->bits_in_buffer < 3) return INFLATE_STREAM_OK;
+        s->lengths[cl_order[s->have++]] = (uint8_t)inflate_stream_bits(s, 3);
+      }
+      if (huffman_build(s->cl_table, INFLATE_CODELEN_ENOUGH, INFLATE_CODELEN_ROOT,
+        s->lengths, 19, HUFFMAN_CODELENS) < 0)
+        return INFLATE_STREAM_ERROR;
+      memset(s->lengths, 0, sizeof(s->lengths));
+      s->have = 0;
+      s->mode = INFLATE_MODE_TABLE_CODELENS;
+      break;
+    }
+
+    case INFLATE_MODE_TABLE_CODELENS: {
+      const unsigned total = s->hlit + s->hdist;
+      while (s->have < total) {
+        if (s->bits_in_buffer < 15) inflate_stream_pull(s, in, in_size, in_pos);
+        const InflateCode* here = &s->cl_table[s->bit_buffer & ((1u << INFLATE_CODELEN_ROOT) - 1)];
+        if (here->op != INFLATE_OP_LITERAL) return INFLATE_STREAM_ERROR;
+        unsigned sym = here->value;
+        if (sym < 16) {
+          if (s->bits_in_buffer < here->bits) return INFLATE_STREAM_OK;
+          inflate_stream_bits(s, here->bits);
+          s->lengths[s->have++] = (uint8_t)sym;
+          continue;
+        }
+        unsigned extra = sym == 16 ? 2 : sym == 17 ? 3 : 7;
+        if (s->bits_in_buffer < here->bits + extra) return INFLATE_STREAM_OK;
+        if (sym == 16 && s->have == 0) return INFLATE_STREAM_ERROR;
+        inflate_stream_bits(s, here->bits);
+        unsigned repeat = inflate_stream_bits(s, extra) + (sym == 18 ? 11 : 3);
+        uint8_t val = sym == 16 ? s->lengths[s->have - 1] : 0;
+        if (s->have + repeat > total) return INFLATE_STREAM_ERROR;
+        while (repeat--) s->lengths[s->have++] = val;
+      }
+
+      uint8_t dist[32] = { 0 };
+      memcpy(dist, s->lengths + s->hlit, s->hdist);
+      memset(s->lengths + s->hlit, 0, 288 - s->hlit);
+      if (s->lengths[256] == 0) return INFLATE_STREAM_ERROR;
+      if (huffman_build(s->lit_table, INFLATE_LITLEN_ENOUGH, INFLATE_LITLEN_ROOT, s->lengths, 288, HUFFMAN_LITLEN) < 0)
+        return INFLATE_STREAM_ERROR;
+      if (huffman_build(s->dist_table, INFLATE_DIST_ENOUGH, INFLATE_DIST_ROOT, dist, 32, HUFFMAN_DIST) < 0)
+        return INFLATE_STREAM_ERROR;
+      s->mode = INFLATE_MODE_CODES;
+      break;
+    }
+
+    case INFLATE_MODE_CODES: {
+      for (;;) {
+        if (s->pos >= INFLATE_STREAM_LIMIT) return INFLATE_STREAM_FULL;
+        if (s->bits_in_buffer < 48) inflate_stream_pull(s, in, in_size, in_pos);
+        unsigned bits;
+        const InflateCode* here = inflate_stream_lookup(s, s->lit_table, INFLATE_LITLEN_ROOT, &bits);
+        if (!here) return INFLATE_STREAM_OK;
+        if (here->op == INFLATE_OP_LITERAL) {
+          inflate_stream_take(s, here, bits);
+          s->buffer[s->pos++] = (uint8_t)here->value;
+          continue;
+        }
+        if (here->op & INFLATE_OP_BASE) {
+          s->match_length = inflate_stream_take(s, here, bits);
+          s->mode = INFLATE_MODE_DIST;
+          break;
+        }
+        if (here->op == INFLATE_OP_EOB) {
+          inflate_stream_take(s, here, bits);
+          s->mode = INFLATE_MODE_BLOCK_HEADER;
+          break;
+        }
+        return INFLATE_STREAM_ERROR;
+      }
+      break;
+    }
+
+    case INFLATE_MODE_DIST: {
+      unsigned bits;
+      const InflateCode* here = inflate_stream_lookup(s, s->dist_table, INFLATE_DIST_ROOT, &bits);
+      if (!here) return INFLATE_STREAM_OK;
+      if (!(here->op & INFLATE_OP_BASE)) return INFLATE_STREAM_ERROR;
+      size_t distance = inflate_stream_take(s, here, bits);
+      if (distance > s->pos) return INFLATE_STREAM_ERROR;
+
+      uint8_t* dst = s->buffer + s->pos;
+      const uint8_t* src = dst - distance;
+      size_t length = s->match_length;
+      s->pos += length;
+      if (distance >= 8) {
+        uint8_t* end = dst + length;
+        do {
+          memcpy(dst, src, 8);
+          dst += 8;
+          src += 8;
+        } while (dst < end);
+      }
+      else {
+        while (length--) *dst++ = *src++;
+      }
+      s->mode = INFLATE_MODE_CODES;
+      break;
+    }
+
+    case INFLATE_MODE_CHECK: {
+      // The checksum covers delivered output, so drain everything first.
+      if (s->read_pos != s->pos) return INFLATE_STREAM_FULL;
+      inflate_stream_bits(s, s->bits_in_buffer & 7);
+      if (s->bits_in_buffer < 32) return INFLATE_STREAM_OK;
+      uint32_t stored = 0;
+      for (int i = 0; i < 4; i++) stored = (stored << 8) | inflate_stream_bits(s, 8);
+      if (stored != s->adler) return INFLATE_STREAM_ERROR;
+      s->mode = INFLATE_MODE_DONE;
+      break;
+    }
+
+    case INFLATE_MODE_DONE:
+      return INFLATE_STREAM_END;
+    }
+  }
+}
+
+/*
+ * Feeds `in` to the decoder and writes decoded bytes to `out`. On return
+ * *in_used and *out_written say how much of each buffer was used; input past
+ * *in_used was not consumed and must be passed again, followed by more data.
+ * Returns INFLATE_STREAM_END once the stream is finished and all output has
+ * been delivered, INFLATE_STREAM_OK when more input or more output space is
+ * needed, or INFLATE_STREAM_ERROR on corrupt data. After INFLATE_STREAM_END,
+ * *in_used stops exactly after the deflate (or zlib) stream.
+ */
+static int inflate_stream_run(InflateStream* s, const uint8_t* in, size_t in_size, size_t* in_used,
+  uint8_t* out, size_t out_size, size_t* out_written) {
+  size_t in_pos = 0, out_pos = 0;
+  int status = INFLATE_STREAM_FULL;
+
+  for (;;) {
+    size_t n = s->pos - s->read_pos;
+    if (n > out_size - out_pos) n = out_size - out_pos;
+    if (n) {
+      memcpy(out + out_pos, s->buffer + s->read_pos, n);
+      if (s->flags & INFLATE_STREAM_ADLER)
+        s->adler = adler32_update(s->adler, s->buffer + s->read_pos, n);
+      s->read_pos += n;
+      out_pos += n;
+      s->total_out += n;
+    }
+    if (s->read_pos == s->pos && s->pos >= INFLATE_STREAM_LIMIT) {
+      memmove(s->buffer, s->buffer + s->pos - INFLATE_WINDOW_SIZE, INFLATE_WINDOW_SIZE);
+      s->pos = s->read_pos = INFLATE_WINDOW_SIZE;
+    }
+
+    if (status != INFLATE_STREAM_FULL) break;
+    if (out_pos == out_size && s->read_pos != s->pos) {
+      status = INFLATE_STREAM_OK;
+      break;
+    }
+    status = inflate_stream_decode(s, in, in_size, &in_pos);
+  }
+
+  if (status == INFLATE_STREAM_END && s->read_pos != s->pos)
+    status = INFLATE_STREAM_OK;
+  // Hand back whole bytes that were read ahead but not used; the bit buffer
+  // then never carries more than a partial byte between calls.
+  size_t unused = s->bits_in_buffer >> 3;
+  if (unused > in_pos) unused = in_pos;
+  in_pos -= unused;
+  s->bits_in_buffer -= (unsigned)unused * 8;
+  s->bit_buffer &= ((uint64_t)1 << s->bits_in_buffer) - 1;
+  if (s->mode == INFLATE_MODE_DONE) {
+    s->bit_buffer = 0;
+    s->bits_in_buffer = 0;
+  }
+  *in_used = in_pos;
+  *out_written = out_pos;
+  return status;
+}
+
 #endif /* ZLIB_DECODER_H */
@@ -0,0 +1,152 @@
+#ifndef ZLIB_ENCODER_H
+#define ZLIB_ENCODER_H
+
+#include "zlib_decoder.h"
+
+/*
+ * Small zlib encoder for archive indexes: greedy LZ77 over hash chains,
+ * emitted as a single fixed-Huffman DEFLATE block. Pickled indexes are mostly
+ * repeated path fragments, which this catches well enough that dynamic
+ * Huffman tables are not worth their code here.
+ */
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_CHAIN 64
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_NO_POS 0xFFFFFFFFu
+
+static int bytevector_push(ByteVector* bv, uint8_t val) {
+  if (bv->length >= bv->size && !bytevector_reserve(bv, 1)) return 0;
+  bv->data[bv->length++] = val;
+  return 1;
+}
+
+typedef struct {
+  ByteVector* out;
+  uint64_t bits;
+  unsigned count;
+  int ok;
+} BitWriter;
+
+static void bitwriter_put(BitWriter* bw, uint32_t value, unsigned n) {
+  bw->bits |= (uint64_t)value << bw->count;
+  bw->count += n;
+  while (bw->count >= 8) {
+    if (!bytevector_push(bw->out, (uint8_t)bw->bits)) bw->ok = 0;
+    bw->bits >>= 8;
+    bw->count -= 8;
+  }
+}
+
+static void bitwriter_flush(BitWriter* bw) {
+  if (bw->count > 0 && !bytevector_push(bw->out, (uint8_t)bw->bits)) bw->ok = 0;
+  bw->bits = 0;
+  bw->count = 0;
+}
+
+// Fixed literal/length code (RFC 1951 3.2.6), stored MSB-first.
+static void deflate_put_fixed(BitWriter* bw, unsigned sym) {
+  if (sym < 144) bitwriter_put(bw, huffman_reverse(0x30 + sym, 8), 8);
+  else if (sym < 256) bitwriter_put(bw, huffman_reverse(0x190 + sym - 144, 9), 9);
+  else if (sym < 280) bitwriter_put(bw, huffman_reverse(sym - 256, 7), 7);
+  else bitwriter_put(bw, huffman_reverse(0xC0 + sym - 280, 8), 8);
+}
+
+static void deflate_put_match(BitWriter* bw, unsigned length, unsigned distance) {
+  unsigned code = 28;
+  while (length_base[code] > length) code--;
+  deflate_put_fixed(bw, 257 + code);
+  if (length_extra[code]) bitwriter_put(bw, length - length_base[code], length_extra[code]);
+
+  code = 29;
+  while (dist_base[code] > distance) code--;
+  bitwriter_put(bw, huffman_reverse(code, 5), 5);
+  if (dist_extra[code]) bitwriter_put(bw, distance - dist_base[code], dist_extra[code]);
+}
+
+static uint32_t deflate_hash(const uint8_t* p) {
+  uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Appends a zlib stream holding `input` to `output`. Returns 0, or -1 when
+// memory runs out or the input is too large for 32-bit positions.
+static int zlib_compress(const uint8_t* input, size_t size, ByteVector* output) {
+  if (size >= DEFLATE_NO_POS) return -1;
+
+  uint32_t* head = (uint32_t*)malloc(sizeof(uint32_t) << DEFLATE_HASH_BITS);
+  uint32_t* prev = (uint32_t*)malloc(sizeof(uint32_t) * DEFLATE_WINDOW_SIZE);
+  // Fixed codes are at most 9 bits per literal
+  if (!head || !prev || !bytevector_reserve(output, size + size / 8 + 16)) {
+    free(head);
+    free(prev);
+    return -1;
+  }
+  memset(head, 0xFF, sizeof(uint32_t) << DEFLATE_HASH_BITS);
+
+  BitWriter bw = { output, 0, 0, 1 };
+  bitwriter_put(&bw, 0x78, 8);  // deflate, 32K window
+  bitwriter_put(&bw, 0x01, 8);  // no dictionary, check bits
+  bitwriter_put(&bw, 1, 1);     // final block
+  bitwriter_put(&bw, 1, 2);     // fixed Huffman
+
+  size_t pos = 0;
+  while (pos < size) {
+    unsigned best_len = 0;
+    size_t best_dist = 0;
+
+    if (pos + DEFLATE_MIN_MATCH <= size) {
+      uint32_t h = deflate_hash(input + pos);
+      size_t max_len = size - pos < DEFLATE_MAX_MATCH ? size - pos : DEFLATE_MAX_MATCH;
+      uint32_t cand = head[h];
+
+      for (int chain = DEFLATE_MAX_CHAIN; cand != DEFLATE_NO_POS && chain > 0; chain--) {
+        size_t dist = pos - cand;
+        if (cand >= pos || dist > DEFLATE_WINDOW_SIZE) break;
+        if (input[cand + best_len] == input[pos + best_len]) {
+          unsigned len = 0;
+          while (len < max_len && input[cand + len] == input[pos + len]) len++;
+          if (len > best_len) {
+            best_len = len;
+            best_dist = dist;
+            if (len == max_len) break;
+          }
+        }
+        cand = prev[cand & (DEFLATE_WINDOW_SIZE - 1)];
+      }
+
+      prev[pos & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+      head[h] = (uint32_t)pos;
+    }
+
+    if (best_len >= DEFLATE_MIN_MATCH) {
+      deflate_put_match(&bw, best_len, (unsigned)best_dist);
+      size_t end = pos + best_len;
+      for (pos++; pos < end; pos++) {
+        if (pos + DEFLATE_MIN_MATCH > size) continue;
+        uint32_t h = deflate_hash(input + pos);
+        prev[pos & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+        head[h] = (uint32_t)pos;
+      }
+    }
+    else {
+      deflate_put_fixed(&bw, input[pos]);
+      pos++;
+    }
+  }
+
+  deflate_put_fixed(&bw, 256);
+  bitwriter_flush(&bw);
+
+  uint32_t adler = adler32(input, size);
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    if (!bytevector_push(output, (uint8_t)(adler >> shift))) bw.ok = 0;
+  }
+
+  free(head);
+  free(prev);
+  return bw.ok ? 0 : -1;
+}
+
+#endif /* ZLIB_ENCODER_H */